@@ -0,0 +1,2 @@
+# Shared audio helpers (audibility culling)
+set(app_include_dirs ../../tools/audio)
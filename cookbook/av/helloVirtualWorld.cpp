@@ -17,6 +17,8 @@ stereographic rendering
 //#include "al/sound/al_Ambisonics.hpp"
 #include "al/scene/al_DynamicScene.hpp"
 
+#include "al_AudibilityCuller.hpp"
+
 #include <cmath>
 #include <iostream>
 
@@ -25,20 +27,41 @@ using namespace al;
 #define AUDIO_BLOCK_SIZE 256
 
 // Create an agent,
-struct Agent : PositionedVoice, Nav {
+struct Agent : CullableVoice, Nav {
 
   float oscPhase {0}, oscFreq {220.0}, speed;
 
   void onProcess(AudioIOData& io) override {
-    // Play a sine tone
+    // Agents too far away to be heard are skipped
+    if (!renderBlock(io)) return;
+    // Play a sine tone. Quiet agents compute the sine every decimation()
+    // samples and interpolate in between.
+    const unsigned int step = decimation();
+    const float increment = oscFreq / io.framesPerSecond();
+    float s = std::sin(oscPhase * M_2PI);
+    float slope = 0;
+    unsigned int counter = 0;
     while (io()) {
-      float s = std::sin(oscPhase * M_2PI);
-      oscPhase += oscFreq / io.framesPerSecond();
-      if (oscPhase >= 1) oscPhase -= 1;
+      if (counter == 0) {
+        float next = std::sin((oscPhase + step * increment) * M_2PI);
+        slope = (next - s) / step;
+        counter = step;
+      }
       io.out(0) = s * 0.1f;
+      s += slope;
+      counter--;
+      oscPhase += increment;
+      if (oscPhase >= 1) oscPhase -= 1;
     }
   }
 
+  float levelEstimate() override { return 0.1f; }
+
+  void onSkip(AudioIOData& io) override {
+    oscPhase += io.framesPerBuffer() * oscFreq / io.framesPerSecond();
+    oscPhase -= std::floor(oscPhase);
+  }
+
   void update(double dt) override
   {
     // Update internal smoothed nav
@@ -91,6 +114,8 @@ struct MyApp : App
 {
 
   DynamicScene scene;
+  AudibilityCuller culler;
+
   void onCreate() override {
     // Set initial pose
     nav() = {Vec3d(0,0,50), 0.95};
@@ -111,6 +136,9 @@ struct MyApp : App
 
     // Make distance changes more noticeable
     scene.distanceAttenuation().law(AttenuationLaw::ATTEN_INVERSE_SQUARE);
+    // With inverse square attenuation agents quickly fall below the noise
+    // floor. Don't render those.
+    culler.setThresholds(-80.0f, -50.0f);
   }
 
   void onAnimate(double dt) override {
@@ -139,6 +167,7 @@ struct MyApp : App
 //  }
 
   void onSound(AudioIOData& io) override {
+    culler.update(scene);
     scene.render(io);
   }
 
@@ -0,0 +1,9 @@
+# Shared state distribution helpers (codec, transport, shared memory), the
+# spring solver and the state mesh view
+set(app_include_dirs ../../tools/distributed ../../tools/simulation
+    ../../tools/graphics)
+
+# shm_open and shm_unlink are in librt before glibc 2.34
+if(CMAKE_SYSTEM_NAME STREQUAL "Linux")
+  set(app_link_libs rt)
+endif()
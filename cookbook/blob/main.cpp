@@ -3,12 +3,21 @@
 #include "al/math/al_Random.hpp"
 
 #include "al/app/al_GUIDomain.hpp"
+#include "al/io/al_Imgui.hpp"
 
 #include "al_ext/statedistribution/al_CuttleboneDomain.hpp"
 #include "al_ext/statedistribution/al_CuttleboneStateSimulationDomain.hpp"
 
 #include <Gamma/Noise.h>
 
+#include "al_IcoFile.hpp"
+#include "al_SharedState.hpp"
+#include "al_SpringSolver.hpp"
+#include "al_StateCodec.hpp"
+#include "al_StateInterpolator.hpp"
+#include "al_StateMeshView.hpp"
+#include "al_StateTransport.hpp"
+
 using namespace al;
 
 #include <iostream> // cout
@@ -27,6 +36,15 @@ using namespace al;
 //#define N 163842
 //#define N 655362
 
+// Cuttlebone broadcasts the whole State every frame. Define this to send it
+// encoded with StateCodec over StateTransport instead: multicast packets that
+// renderers reassemble, keeping the last complete frame if packets are lost.
+//#define BLOB_STATE_TRANSPORT
+
+// Define this to also publish the State in shared memory. Renderers on the
+// same host as the simulator read it from there instead of the network.
+//#define BLOB_SHARED_STATE
+
 struct State {
   Pose pose; // for navigation
 
@@ -34,6 +52,7 @@ struct State {
   double eyeSeparation;
   Color backgroundColor{0};
   bool wireFrame; // alternative is shaded
+  double time;    // simulator time, for renderers to interpolate states
 
   // all of the above data could be distributed using unicast OSC to each
   // renderering host, but this scheme could suffer
@@ -51,64 +70,6 @@ struct State {
   Vec3f p[N];
 };
 
-// Load file into mesh
-bool load(std::string fileName, Mesh &mesh, std::vector<std::vector<int>> &nn) {
-  std::ifstream file(fileName);
-  if (!file.is_open())
-    return false;
-
-  std::string line;
-  int state = 0;
-  while (getline(file, line)) {
-    if (line == "|") {
-      state++;
-      continue;
-    }
-    switch (state) {
-    case 0: {
-      std::vector<float> v;
-      std::stringstream ss(line);
-      float f;
-      while (ss >> f) {
-        v.push_back(f);
-        if (ss.peek() == ',')
-          ss.ignore();
-      }
-      mesh.vertex(v[0], v[1], v[2]);
-      // cout << v[0] << "|" << v[1] << "|" << v[2] << endl;
-    } break;
-
-    case 1: {
-      std::stringstream ss(line);
-      int i;
-      if (ss >> i)
-        mesh.index(i);
-      else
-        return false;
-      // cout << i << endl;
-    } break;
-
-    case 2: {
-      std::vector<int> v;
-      std::stringstream ss(line);
-      int i;
-      while (ss >> i) {
-        v.push_back(i);
-        if (ss.peek() == ',')
-          ss.ignore();
-      }
-      if ((v.size() != 5) && (v.size() != 6))
-        return false;
-      nn.push_back(v);
-      // cout << nn[nn.size() - 1].size() << endl;
-    } break;
-    }
-  }
-  file.close();
-
-  return true;
-}
-
 #ifdef AL_WINDOWS
 // Damn you Windows!
 #undef near
@@ -131,12 +92,39 @@ struct Blob : DistributedAppWithState<State> {
   ParameterColor bgColor{"BackgroundColor", "", Color(0)};
   ParameterBool wireFrame{"wireFrame", "", true};
 
+  // Measure what the state would cost encoded with StateCodec: vertices
+  // quantized to 16 bits in a box around the blob, and deltas against a
+  // keyframe sent every second
+  ParameterBool codecStats{"codecStats", "", false};
+  StateCodec encoder;
+  StateCodec decoder;
+  std::vector<uint8_t> packet;
+  std::unique_ptr<State> decoded;
+
+#ifdef BLOB_STATE_TRANSPORT
+  StateSender sender;
+  StateReceiver receiver;
+  double statsTime{0.0};
+  // Renderers interpolate, so the state can be sent below the frame rate
+  Parameter stateRate{"stateRate", "", 30.0f, 1.0f, 120.0f};
+  double sendTime{0.0};
+#endif
+
+  // Renderers draw the state interpolated between the last two received
+  StateInterpolator<State> interpolator;
+  std::unique_ptr<State> view;
+
+#ifdef BLOB_SHARED_STATE
+  SharedStateWriter<State> sharedWriter;
+  SharedStateReader<State> sharedReader;
+  std::unique_ptr<State> sharedState; // Copied whole, so a torn read is dropped
+#endif
+
   // Internal computation data
   // This data will not be shared to remote nodes, so you should only use it on
   // the simulator machine
-  vector<vector<int>> nn;
-  vector<Vec3f> velocity;
   vector<Vec3f> original;
+  SpringSolver solver;
 
   // a boolean value that is read and reset (false) by the simulation step and
   // written (true) by audio, keyboard and mouse callbacks.
@@ -144,8 +132,11 @@ struct Blob : DistributedAppWithState<State> {
   unsigned pokedVertex;
   Vec3f pokedVertexRest;
 
-  // a mesh we use to do graphics rendering in this app
+  // a mesh we use to do graphics rendering in this app. Its vertices are only
+  // the rest positions: meshView draws its indices with the positions in the
+  // state, copied straight to the GPU.
   Mesh mesh;
+  StateMeshView meshView;
 
   gam::NoisePink<> pinkNoise;
 
@@ -160,42 +151,121 @@ struct Blob : DistributedAppWithState<State> {
 
     std::string icoSphereFile = std::to_string(N) + ".ico";
 
-    if (!load(searchPaths.find(icoSphereFile).filepath(), mesh, nn)) {
+    // Parsed once, then loaded from a binary cache next to the .ico file
+    IcoFile ico;
+    if (!ico.load(searchPaths.find(icoSphereFile).filepath()) ||
+        ico.vertexCount() != N) {
       std::cout << "cannot find " << icoSphereFile << std::endl;
       quit();
+      return;
     }
+    mesh.vertices().assign(ico.vertices(), ico.vertices() + N);
+    mesh.indices().assign(ico.indices(), ico.indices() + ico.indexCount());
     if (isPrimary()) {
       shouldPoke = true; // start with a poke
 
       // Initialize simulation data
-      velocity.resize(mesh.vertices().size(), Vec3f(0, 0, 0));
       original.resize(mesh.vertices().size());
       for (int i = 0; i < mesh.vertices().size(); i++)
         original[i] = mesh.vertices()[i];
+      solver.setTopology(ico.offsets(), ico.neighbours(), N);
+      solver.setRest(original.data(), original.size());
+      solver.setThreads(0);
 
       for (int i = 0; i < N; i++)
         state().p[i] = original[i];
       state().eyeSeparation = 0.03;
       state().backgroundColor = Color(0.1f, 0.1f);
       state().wireFrame = true;
+      state().time = 0.0;
+    } else {
+      state().time = 0.0; // Nothing received yet
+      interpolator.addPose(state(), state().pose);
+      interpolator.addLinear(state(), state().p);
+      // Stay 1.5 measured state periods behind, whatever stateRate is
+      interpolator.setPlayoutPeriods(1.5);
+      view.reset(new State);
     }
 
-    // Enable cuttlebone for state distribution
-    auto cuttleboneDomain =
-        CuttleboneStateSimulationDomain<State>::enableCuttlebone(this);
-    if (!cuttleboneDomain) {
-      std::cerr << "ERROR: Could not start Cuttlebone. Quitting." << std::endl;
+    for (auto *codec : {&encoder, &decoder}) {
+      codec->addQuantized(state(), state().p, Vec3f(-2, -2, -2),
+                          Vec3f(2, 2, 2));
+      codec->addRaw(state(), state().pose);
+      codec->addRaw(state(), state().eyeSeparation);
+      codec->addRaw(state(), state().backgroundColor);
+      codec->addRaw(state(), state().wireFrame);
+      codec->addRaw(state(), state().time);
+      codec->setKeyframeInterval(60);
+    }
+
+    // A renderer on the simulator's host reads the state from shared memory
+    // only, without joining the network distribution
+    bool sharedSource = false;
+#ifdef BLOB_SHARED_STATE
+    if (isPrimary()) {
+      if (!sharedWriter.open("/al_blob_state")) {
+        std::cerr << "Could not create shared state" << std::endl;
+      }
+    } else if (sharedReader.open("/al_blob_state")) {
+      std::cout << "Reading state from shared memory" << std::endl;
+      sharedState.reset(new State);
+      sharedSource = true;
+    }
+#endif
+
+#ifdef BLOB_STATE_TRANSPORT
+    // Keep bursts (keyframes) under gigabit speed
+    bool opened = false;
+    if (isPrimary()) {
+      opened = sender.open();
+      sender.setRateLimit(100e6);
+    } else {
+      opened = sharedSource || receiver.open();
+    }
+    if (!opened) {
+      std::cerr << "ERROR: Could not open state transport. Quitting."
+                << std::endl;
       quit();
     }
+#else
+    // Enable cuttlebone for state distribution
+    if (!sharedSource) {
+      auto cuttleboneDomain =
+          CuttleboneStateSimulationDomain<State>::enableCuttlebone(this);
+      if (!cuttleboneDomain) {
+        std::cerr << "ERROR: Could not start Cuttlebone. Quitting."
+                  << std::endl;
+        quit();
+      }
+    }
+#endif
+
     // GUI
     if (isPrimary()) {
       auto guiDomain = GUIDomain::enableGUI(defaultWindowDomain());
       auto &gui = guiDomain->newGUI();
-      gui << SK << NK << D << wireFrame << bgColor;
+      gui << SK << NK << D << wireFrame << bgColor << codecStats;
+#ifdef BLOB_STATE_TRANSPORT
+      gui << stateRate;
+#endif
+      gui.drawFunction = [&]() {
+        if (!codecStats) {
+          return;
+        }
+        auto &encoded = encoder.stats();
+        ImGui::Text("State: %.2f MB  encoded: %.2f MB (%s)",
+                    encoded.stateBytes / 1e6, encoded.encodedBytes / 1e6,
+                    encoded.keyframe ? "keyframe" : "delta");
+        ImGui::Text("%.0f Mbit/s at 60 fps", encoded.bitsPerSecond(60) / 1e6);
+        ImGui::Text("Encode %.2f ms  decode %.2f ms",
+                    encoded.encodeMicros / 1000.0,
+                    decoder.stats().decodeMicros / 1000.0);
+      };
+      decoded.reset(new State);
     }
   }
 
-  //  void onCreate() override {}
+  void onCreate() override { meshView.create(mesh, N); }
 
   void onAnimate(double dt) override {
 
@@ -207,42 +277,94 @@ struct Blob : DistributedAppWithState<State> {
         pokedVertex = n;
         pokedVertexRest = original[n];
         Vec3f v = Vec3f(rnd::uniformS(), rnd::uniformS(), rnd::uniformS());
-        for (unsigned k = 0; k < nn[n].size(); k++)
-          state().p[nn[n][k]] += v * 0.5;
-        state().p[n] += v;
+        for (uint32_t k = solver.offsets()[n]; k < solver.offsets()[n + 1]; k++)
+          solver.displace(solver.neighbours()[k], v * 0.5);
+        solver.displace(n, v);
       }
 
-      // Compute new postions
-      for (int i = 0; i < N; i++) {
-        Vec3f &v = state().p[i];
-        Vec3f force = (v - original[i]) * -SK;
-
-        for (int k = 0; k < nn[i].size(); k++) {
-          Vec3f &n = state().p[nn[i][k]];
-          force += (v - n) * -NK;
-        }
-
-        force -= velocity[i] * D;
-        velocity[i] += force;
-      }
-
-      for (int i = 0; i < N; i++) {
-        state().p[i] += velocity[i];
-      }
+      // Compute new postions, across threads, and write them to the state
+      solver.step(SK, NK, D, state().p);
 
       // Update variables in state to send to nodes
       state().pose = nav();
       state().backgroundColor = bgColor;
       state().wireFrame = wireFrame;
-
+      state().time += dt;
+
+#ifdef BLOB_STATE_TRANSPORT
+      sendTime += dt;
+      if (sendTime >= 1.0 / stateRate) {
+        sendTime = std::min(sendTime - 1.0 / stateRate, 1.0 / stateRate);
+        encoder.encode(&state(), packet);
+        sender.send(packet.data(), packet.size(), encoder.stats().keyframe);
+        if (codecStats) {
+          decoder.decode(packet.data(), packet.size(), decoded.get());
+        }
+      }
+#else
+      if (codecStats) {
+        encoder.encode(&state(), packet);
+        decoder.decode(packet.data(), packet.size(), decoded.get());
+      }
+#endif
+#ifdef BLOB_SHARED_STATE
+      if (sharedWriter.isOpen()) {
+        sharedWriter.write(state());
+      }
+#endif
     } else {
-      // For remote nodes, update pose and color from state
-      pose() = state().pose;
+      const State *received = &state();
+#ifdef BLOB_SHARED_STATE
+      if (sharedReader.isOpen()) {
+        // Copy the state out of shared memory, retrying if the simulator got
+        // around to rewriting it meanwhile. If every attempt was torn nothing
+        // new is pushed, and the previous states stay.
+        if (sharedReader.read(*sharedState)) {
+          State &s = state();
+          s.eyeSeparation = sharedState->eyeSeparation;
+          s.backgroundColor = sharedState->backgroundColor;
+          s.wireFrame = sharedState->wireFrame;
+          received = sharedState.get();
+        }
+      }
+#endif
+#ifdef BLOB_STATE_TRANSPORT
+      // Decode the last complete frame, if a new one arrived, after a
+      // keyframe that completed before it
+      while (receiver.receive(packet)) {
+        decoder.decode(packet.data(), packet.size(), &state());
+      }
+      statsTime += dt;
+      if (statsTime > 5.0) {
+        statsTime = 0.0;
+        auto stats = receiver.stats();
+        std::cout << "State frames: " << stats.frames << " complete, "
+                  << stats.dropped + stats.missed << " lost ("
+                  << stats.lostPackets << " packets), latency "
+                  << stats.latencyMicros / 1000.0 << " ms, decode "
+                  << decoder.stats().decodeMicros / 1000.0 << " ms"
+                  << std::endl;
+      }
+#endif
+      // Interpolate between the last two states instead of showing whichever
+      // arrived last, which stutters with network jitter. States already
+      // pushed are ignored.
+      if (received->time > 0.0) {
+        interpolator.push(*received, received->time);
+      }
+      if (!interpolator.interpolate(*view)) {
+        return;
+      }
+
+      // For renderers, update pose and color from state
+      pose() = view->pose;
       bgColor = state().backgroundColor;
       wireFrame = state().wireFrame;
+      meshView.update(view->p);
+      return;
     }
-    // Copy vertex positions from state to mesh
-    memcpy(&mesh.vertices()[0], &state().p[0], sizeof(Vec3f) * N);
+    // Copy vertex positions from state to the GPU
+    meshView.update(state().p);
   }
 
   void onDraw(Graphics &g) override {
@@ -258,7 +380,7 @@ struct Blob : DistributedAppWithState<State> {
     } else {
       g.polygonFill();
     }
-    g.draw(mesh);
+    meshView.draw(g);
     g.popMatrix();
   }
 
@@ -0,0 +1,408 @@
+#ifndef AL_AMBISONICBUS_HPP
+#define AL_AMBISONICBUS_HPP
+
+// Higher order Ambisonics through a shared bus.
+//
+// AmbisonicBusSpatializer encodes every source into one B-format bus of up
+// to 3rd order (16 channels) and decodes the bus to the speakers once per
+// block. Encoding a source is a ramped SIMD multiply-accumulate per bus
+// channel, and the decode is a single (speakers x bus channels) matrix
+// multiply done by SpatialMixKernel, so the cost on the speaker side doesn't
+// depend on the number of sources.
+//
+// Rotating the sound field is folded into the decode matrix, so it costs
+// nothing while the rotation is constant and is crossfaded over one block
+// when it changes.
+//
+// Channels are in ACN order with N3D normalization. The decoder samples the
+// spherical harmonics at the speaker directions with max-rE weighting and is
+// normalized so a source has unit energy on average over all directions,
+// which works for irregular layouts like the AlloSphere.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "al/io/al_AudioIOData.hpp"
+#include "al/sound/al_Spatializer.hpp"
+#include "al/sound/al_Speaker.hpp"
+#include "al/spatial/al_Pose.hpp"
+
+#include "al_GainTableSpatializer.hpp"
+#include "al_SpatialMixKernel.hpp"
+
+namespace al {
+
+/// Number of bus channels for an Ambisonic order
+inline int ambisonicChannels(int order) { return (order + 1) * (order + 1); }
+
+/**
+ * @brief Real spherical harmonics up to order 3 (ACN, N3D)
+ * @param x front, y left and z up components of a unit vector
+ * @param coefficients receives ambisonicChannels(order) values
+ */
+inline void sphericalHarmonics(int order, double x, double y, double z,
+                               float *coefficients) {
+  coefficients[0] = 1.0f;
+  if (order < 1) {
+    return;
+  }
+  const double s3 = std::sqrt(3.0);
+  coefficients[1] = float(s3 * y);
+  coefficients[2] = float(s3 * z);
+  coefficients[3] = float(s3 * x);
+  if (order < 2) {
+    return;
+  }
+  const double s15 = std::sqrt(15.0);
+  coefficients[4] = float(s15 * x * y);
+  coefficients[5] = float(s15 * y * z);
+  coefficients[6] = float(std::sqrt(5.0) / 2.0 * (3.0 * z * z - 1.0));
+  coefficients[7] = float(s15 * x * z);
+  coefficients[8] = float(s15 / 2.0 * (x * x - y * y));
+  if (order < 3) {
+    return;
+  }
+  const double s35_8 = std::sqrt(35.0 / 8.0);
+  const double s21_8 = std::sqrt(21.0 / 8.0);
+  const double s105 = std::sqrt(105.0);
+  coefficients[9] = float(s35_8 * y * (3.0 * x * x - y * y));
+  coefficients[10] = float(s105 * x * y * z);
+  coefficients[11] = float(s21_8 * y * (5.0 * z * z - 1.0));
+  coefficients[12] = float(std::sqrt(7.0) / 2.0 * z * (5.0 * z * z - 3.0));
+  coefficients[13] = float(s21_8 * x * (5.0 * z * z - 1.0));
+  coefficients[14] = float(s105 / 2.0 * z * (x * x - y * y));
+  coefficients[15] = float(s35_8 * x * (x * x - 3.0 * y * y));
+}
+
+/**
+ * @brief Spatializer encoding all sources to one Ambisonic bus
+ *
+ * Usage: scene.setSpatializer<AmbisonicBusSpatializer>(speakers);
+ *
+ * Gains ramp from the previous block's gains of the source rendered at the
+ * same position in the block, as in GainTableSpatializer. Silent buffers
+ * are skipped.
+ */
+class AmbisonicBusSpatializer : public Spatializer {
+public:
+  static const int kMaxOrder = 3;
+
+  AmbisonicBusSpatializer(const Speakers &sl, int order = kMaxOrder,
+                          int maxSources = 256, unsigned maxFrames = 2048)
+      : Spatializer(sl), mOrder(std::max(0, std::min(order, int(kMaxOrder)))),
+        mBusChannels(ambisonicChannels(mOrder)), mMaxSources(maxSources),
+        mMaxFrames(maxFrames) {}
+
+  void compile() override {
+    mChannels = layoutChannels(mSpeakers);
+    mDecoder.configure(mBusChannels, mChannels, mMaxFrames);
+    computeDecodeMatrix();
+    mRotation.assign(size_t(mBusChannels) * mBusChannels, 0.0f);
+    for (int i = 0; i < mBusChannels; i++) {
+      mRotation[size_t(i) * mBusChannels + i] = 1.0f;
+    }
+    for (int k = 0; k < mBusChannels; k++) {
+      std::copy_n(mDecode.data() + size_t(k) * mChannels, mChannels,
+                  mDecoder.startGains(k));
+      std::copy_n(mDecode.data() + size_t(k) * mChannels, mChannels,
+                  mDecoder.endGains(k));
+    }
+    mRotationVersion = 0;
+    mAppliedRotationVersion = 0;
+    mSources.assign(size_t(mMaxSources) * kBusStride, 0.0f);
+    mSourceDirection.assign(mMaxSources, Vec3d());
+    mSourceActive.assign(mMaxSources, false);
+    mTarget.assign(kBusStride, 0.0f);
+    mSampleGains.assign(kBusStride, 0.0f);
+    mOutputs.assign(mChannels, nullptr);
+    mScratch.assign(mDecoder.maxFrames(), 0.0f);
+  }
+
+  /**
+   * @brief Rotate the sound field (degrees)
+   *
+   * Positive yaw turns the field to the left, positive pitch raises the
+   * front and positive roll raises the left side. Can be called from any
+   * thread. Takes effect in the next block, crossfaded over the block.
+   */
+  void setRotation(float yaw, float pitch, float roll) {
+    mYaw = yaw;
+    mPitch = pitch;
+    mRoll = roll;
+    mRotationVersion++;
+  }
+
+  void prepare(AudioIOData &io) override {
+    mFrames = std::min(unsigned(io.framesPerBuffer()), mDecoder.maxFrames());
+    for (int k = 0; k < mBusChannels; k++) {
+      std::fill_n(mDecoder.samples(k), mFrames, 0.0f);
+    }
+    for (int s = mCount; s < mLastCount; s++) {
+      mSourceActive[s] = false;
+    }
+    mLastCount = std::min(mCount, mMaxSources);
+    mCount = 0;
+    // Previous block's matrix is where this block starts from
+    for (int k = 0; k < mBusChannels; k++) {
+      std::copy_n(mDecoder.endGains(k), mChannels, mDecoder.startGains(k));
+    }
+    unsigned version = mRotationVersion;
+    if (version != mAppliedRotationVersion) {
+      mAppliedRotationVersion = version;
+      computeRotationMatrix(mYaw, mPitch, mRoll);
+      applyRotation();
+    }
+  }
+
+  void renderBuffer(AudioIOData &io, const Pose &reldir, const float *samples,
+                    const unsigned int &numFrames) override {
+    (void)io;
+    const unsigned frames = std::min(numFrames, mFrames);
+    const int s = mCount++;
+    if (isSilent(samples, frames)) {
+      if (s < mMaxSources) {
+        mSourceActive[s] = false;
+      }
+      return;
+    }
+    Vec3d dir = reldir.vec();
+    encodeGains(dir, mTarget.data());
+    float *previous = nullptr;
+    bool ramp = false;
+    if (s < mMaxSources) {
+      previous = mSources.data() + size_t(s) * kBusStride;
+      ramp = mSourceActive[s] && continuesSource(mSourceDirection[s], dir);
+      mSourceDirection[s] = dir;
+      mSourceActive[s] = true;
+    }
+    for (int k = 0; k < mBusChannels; k++) {
+      float start = ramp ? previous[k] : mTarget[k];
+      float end = mTarget[k];
+      if (start == 0.0f && end == 0.0f) {
+        continue;
+      }
+      accumulateGainRamp(mDecoder.samples(k), samples, start, end, frames);
+    }
+    if (previous) {
+      std::copy_n(mTarget.data(), mBusChannels, previous);
+    }
+  }
+
+  void renderSample(AudioIOData &io, const Pose &reldir, const float &sample,
+                    const unsigned int &frameIndex) override {
+    (void)io;
+    if (frameIndex >= mFrames) {
+      return;
+    }
+    if (frameIndex == 0) {
+      encodeGains(reldir.vec(), mSampleGains.data());
+    }
+    for (int k = 0; k < mBusChannels; k++) {
+      mDecoder.samples(k)[frameIndex] += mSampleGains[k] * sample;
+    }
+  }
+
+  void finalize(AudioIOData &io) override {
+    // Channels the device doesn't have are decoded into a scratch buffer
+    const int channels = std::min(mChannels, int(io.channelsOut()));
+    for (int c = 0; c < mChannels; c++) {
+      mOutputs[c] = c < channels ? io.outBuffer(c) : mScratch.data();
+    }
+    mDecoder.mix(mBusChannels, mFrames, mOutputs.data());
+  }
+
+  void print(std::ostream &stream = std::cout) override {
+    stream << "Ambisonic bus: order " << mOrder << ", " << mBusChannels
+           << " channels decoded to " << mSpeakers.size() << " speakers"
+           << std::endl;
+  }
+
+  int order() const { return mOrder; }
+
+  /// Bus channel k of the current block, valid after all sources rendered
+  const float *bus(int k) { return mDecoder.samples(k); }
+
+private:
+  static const int kBusStride = 16;
+
+  // Ambisonic x (front), y (left), z (up) from a listener relative direction
+  // (x right, y up, -z front)
+  void encodeGains(const Vec3d &dir, float *gains) const {
+    double length = dir.mag();
+    if (length == 0.0) {
+      std::fill_n(gains, mBusChannels, 0.0f);
+      gains[0] = 1.0f;
+      return;
+    }
+    sphericalHarmonics(mOrder, -dir.z / length, -dir.x / length,
+                       dir.y / length, gains);
+  }
+
+  static void speakerDirection(const Speaker &speaker, double &x, double &y,
+                               double &z) {
+    const double azimuth = speaker.azimuth * M_PI / 180.0;
+    const double elevation = speaker.elevation * M_PI / 180.0;
+    x = std::cos(azimuth) * std::cos(elevation);
+    y = std::sin(azimuth) * std::cos(elevation);
+    z = std::sin(elevation);
+  }
+
+  // Sampling decoder with max-rE weights. mDecode is bus channels x channels.
+  void computeDecodeMatrix() {
+    mDecode.assign(size_t(mBusChannels) * mChannels, 0.0f);
+    if (mSpeakers.empty()) {
+      return;
+    }
+    float weights[kMaxOrder + 1];
+    maxReWeights(weights);
+    float harmonics[kBusStride];
+    for (auto &speaker : mSpeakers) {
+      if (speaker.deviceChannel < 0 || speaker.deviceChannel >= mChannels) {
+        continue;
+      }
+      double x, y, z;
+      speakerDirection(speaker, x, y, z);
+      sphericalHarmonics(mOrder, x, y, z, harmonics);
+      for (int k = 0; k < mBusChannels; k++) {
+        int l = int(std::sqrt(float(k)));
+        mDecode[size_t(k) * mChannels + speaker.deviceChannel] =
+            weights[l] * harmonics[k];
+      }
+    }
+    // Normalize to unit average energy over the sphere. The quadrature is
+    // exact for the squared gains of an order 3 decoder.
+    double energy = 0.0;
+    std::vector<double> out(mChannels);
+    forQuadrature([&](double x, double y, double z, double weight) {
+      sphericalHarmonics(mOrder, x, y, z, harmonics);
+      std::fill(out.begin(), out.end(), 0.0);
+      for (int k = 0; k < mBusChannels; k++) {
+        for (int c = 0; c < mChannels; c++) {
+          out[c] += mDecode[size_t(k) * mChannels + c] * harmonics[k];
+        }
+      }
+      for (double v : out) {
+        energy += weight * v * v;
+      }
+    });
+    energy /= 4.0 * M_PI;
+    if (energy > 0.0) {
+      const float scale = float(1.0 / std::sqrt(energy));
+      for (auto &gain : mDecode) {
+        gain *= scale;
+      }
+    }
+  }
+
+  void maxReWeights(float *weights) const {
+    // Legendre polynomials at cos(137.9 degrees / (order + 1.51))
+    const double t = std::cos(137.9 * M_PI / 180.0 / (mOrder + 1.51));
+    const double p[kMaxOrder + 1] = {1.0, t, (3.0 * t * t - 1.0) / 2.0,
+                                     (5.0 * t * t * t - 3.0 * t) / 2.0};
+    for (int l = 0; l <= kMaxOrder; l++) {
+      weights[l] = float(p[l]);
+    }
+  }
+
+  // Gauss-Legendre in z times uniform azimuths. Exact for polynomials up to
+  // degree 7 on the sphere, which covers products of two order 3 harmonics.
+  template <class Function> static void forQuadrature(Function function) {
+    static const double nodes[4] = {-0.8611363115940526, -0.3399810435848563,
+                                    0.3399810435848563, 0.8611363115940526};
+    static const double weights[4] = {0.3478548451374538, 0.6521451548625461,
+                                      0.6521451548625461, 0.3478548451374538};
+    const int azimuths = 8;
+    for (int i = 0; i < 4; i++) {
+      const double z = nodes[i];
+      const double r = std::sqrt(1.0 - z * z);
+      for (int a = 0; a < azimuths; a++) {
+        const double angle = 2.0 * M_PI * a / azimuths;
+        function(r * std::cos(angle), r * std::sin(angle), z,
+                 weights[i] * 2.0 * M_PI / azimuths);
+      }
+    }
+  }
+
+  // mRotation[i][j] = 1/(4 pi) * integral of Y_i(R d) Y_j(d)
+  void computeRotationMatrix(float yaw, float pitch, float roll) {
+    const double cy = std::cos(yaw * M_PI / 180.0);
+    const double sy = std::sin(yaw * M_PI / 180.0);
+    const double cp = std::cos(pitch * M_PI / 180.0);
+    const double sp = std::sin(pitch * M_PI / 180.0);
+    const double cr = std::cos(roll * M_PI / 180.0);
+    const double sr = std::sin(roll * M_PI / 180.0);
+    std::fill(mRotation.begin(), mRotation.end(), 0.0f);
+    float original[kBusStride];
+    float rotated[kBusStride];
+    forQuadrature([&](double x, double y, double z, double weight) {
+      // Roll around x, then pitch around y (front up), then yaw around z
+      double y1 = cr * y - sr * z;
+      double z1 = sr * y + cr * z;
+      double x2 = cp * x - sp * z1;
+      double z2 = sp * x + cp * z1;
+      double x3 = cy * x2 - sy * y1;
+      double y3 = sy * x2 + cy * y1;
+      sphericalHarmonics(mOrder, x, y, z, original);
+      sphericalHarmonics(mOrder, x3, y3, z2, rotated);
+      const float w = float(weight / (4.0 * M_PI));
+      for (int i = 0; i < mBusChannels; i++) {
+        for (int j = 0; j < mBusChannels; j++) {
+          mRotation[size_t(i) * mBusChannels + j] +=
+              w * rotated[i] * original[j];
+        }
+      }
+    });
+  }
+
+  // Decode of the rotated bus: endGains(j) = sum over i of
+  // decode(i) * rotation[i][j]
+  void applyRotation() {
+    for (int j = 0; j < mBusChannels; j++) {
+      float *gains = mDecoder.endGains(j);
+      std::fill_n(gains, mChannels, 0.0f);
+      for (int i = 0; i < mBusChannels; i++) {
+        const float r = mRotation[size_t(i) * mBusChannels + j];
+        if (std::abs(r) < 1e-6f) {
+          continue;
+        }
+        const float *decode = mDecode.data() + size_t(i) * mChannels;
+        for (int c = 0; c < mChannels; c++) {
+          gains[c] += decode[c] * r;
+        }
+      }
+    }
+  }
+
+  int mOrder;
+  int mBusChannels;
+  int mMaxSources;
+  unsigned mMaxFrames;
+  int mChannels{0};
+
+  SpatialMixKernel mDecoder; // Bus channels are the kernel's sources
+  std::vector<float> mDecode;
+  std::vector<float> mRotation;
+  std::atomic<float> mYaw{0.0f};
+  std::atomic<float> mPitch{0.0f};
+  std::atomic<float> mRoll{0.0f};
+  std::atomic<unsigned> mRotationVersion{0};
+  unsigned mAppliedRotationVersion{0};
+
+  unsigned mFrames{0};
+  int mCount{0};
+  int mLastCount{0};
+  std::vector<float> mSources; // Last gains per source slot
+  std::vector<Vec3d> mSourceDirection;
+  std::vector<bool> mSourceActive;
+  std::vector<float> mTarget;
+  std::vector<float> mSampleGains;
+  std::vector<float *> mOutputs;
+  std::vector<float> mScratch;
+};
+
+} // namespace al
+
+#endif // AL_AMBISONICBUS_HPP
@@ -0,0 +1,240 @@
+#ifndef AL_AUDIBILITYCULLER_HPP
+#define AL_AUDIBILITYCULLER_HPP
+
+// Skipping the rendering of voices in a DynamicScene that can't be heard.
+//
+// Before each block AudibilityCuller estimates the output level of every
+// active CullableVoice from the scene's distance attenuation and the voice's
+// own cheap level estimate (e.g. amplitude times envelope value). Voices
+// above the decimation level render normally. Voices between the cull and
+// decimation levels are asked to render at a reduced control rate, and voices
+// below the cull level only advance their state with onSkip() and output
+// silence, which the spatializers in this directory skip. Moving back up
+// requires the level to exceed a threshold by the hysteresis, so voices near
+// a threshold don't toggle every block.
+//
+// With a budget only the loudest voices are rendered and the rest are culled
+// regardless of level.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "al/io/al_AudioIOData.hpp"
+#include "al/scene/al_DynamicScene.hpp"
+
+namespace al {
+
+/**
+ * @brief PositionedVoice that an AudibilityCuller can skip
+ *
+ * Call renderBlock() at the start of onProcess(AudioIOData &) and only
+ * synthesize if it returns true. Anything that must happen every block,
+ * like freeing the voice when its envelope is done, should be done either
+ * way.
+ */
+class CullableVoice : public PositionedVoice {
+public:
+  enum Audibility { AUDIBLE, DECIMATED, CULLED };
+
+  /// Level of the voice's output before distance attenuation. Called once
+  /// per block, so it should be cheap.
+  virtual float levelEstimate() { return 1.0f; }
+
+  /// Called instead of synthesis when culled, with the block that would have
+  /// been rendered. Advance envelopes and timers.
+  virtual void onSkip(AudioIOData &io) { (void)io; }
+
+  Audibility audibility() const { return mAudibility; }
+
+  /// Control rate decimation factor to use while rendering. 1 if audible.
+  unsigned int decimation() const {
+    return mAudibility == DECIMATED ? mDecimation : 1;
+  }
+
+  /// Estimated output level including distance attenuation
+  float estimatedLevel() const { return mLevel; }
+
+  bool renderBlock(AudioIOData &io) {
+    if (mAudibility != CULLED) {
+      return true;
+    }
+    onSkip(io);
+    return false;
+  }
+
+private:
+  friend class AudibilityCuller;
+  Audibility mAudibility{AUDIBLE};
+  unsigned int mDecimation{1};
+  float mLevel{1.0f};
+};
+
+struct AudibilityStats {
+  int voices{0};
+  int audible{0};
+  int decimated{0};
+  int culled{0};
+};
+
+class AudibilityCuller {
+public:
+  /// @param maxVoices voices that can be ranked for the budget without
+  /// allocating in the audio thread
+  AudibilityCuller(int maxVoices = 256) { mRanking.reserve(maxVoices); }
+
+  /**
+   * @brief Levels in dB relative to full scale
+   * @param cullLevel below this voices are not rendered
+   * @param decimateLevel below this voices render at a reduced control rate
+   * @param hysteresis extra level needed to move back up
+   */
+  void setThresholds(float cullLevel, float decimateLevel,
+                     float hysteresis = 6.0f) {
+    mCullLevel = cullLevel;
+    mDecimateLevel = std::max(cullLevel, decimateLevel);
+    mHysteresis = hysteresis;
+  }
+
+  /// Control rate decimation factor for decimated voices
+  void setDecimation(unsigned int factor) {
+    mDecimation = std::max(1u, factor);
+  }
+
+  /// Render at most maxVoices voices, the loudest ones. 0 for no limit.
+  void setBudget(int maxVoices) { mBudget = std::max(0, maxVoices); }
+
+  void enable(bool enable) { mEnabled = enable; }
+  bool enabled() const { return mEnabled; }
+
+  /**
+   * @brief Classify the active voices of scene
+   *
+   * Call in onSound() before scene.render(io). Settings can be changed from
+   * any thread and apply from the next update.
+   */
+  void update(DynamicScene &scene) {
+    AudibilityStats stats;
+    const bool enabled = mEnabled;
+    const int budget = mBudget;
+    const float hysteresis = mHysteresis;
+    const Pose &listener = scene.listenerPose();
+    mRanking.clear();
+    for (auto *voice = scene.getActiveVoices(); voice; voice = voice->next) {
+      stats.voices++;
+      auto *cullable = dynamic_cast<CullableVoice *>(voice);
+      if (!cullable) {
+        stats.audible++;
+        continue;
+      }
+      if (!enabled) {
+        cullable->mAudibility = CullableVoice::AUDIBLE;
+        stats.audible++;
+        continue;
+      }
+      float level = std::abs(cullable->levelEstimate());
+      if (cullable->useDistanceAttenuation()) {
+        double distance = (cullable->pose().pos() - listener.pos()).mag();
+        level *= scene.distanceAttenuation().attenuation(distance);
+      }
+      cullable->mLevel = level;
+      const float db = level > 0.0f ? 20.0f * std::log10(level) : -200.0f;
+      const bool rendered = cullable->mAudibility != CullableVoice::CULLED;
+      cullable->mAudibility = classify(cullable->mAudibility, db);
+      cullable->mDecimation = mDecimation;
+      if (budget > 0 && cullable->mAudibility != CullableVoice::CULLED &&
+          mRanking.size() < mRanking.capacity()) {
+        // Voices that were rendered in the last block get the hysteresis as
+        // a bonus so voices of similar level don't take turns
+        mRanking.push_back({db + (rendered ? hysteresis : 0.0f), cullable});
+      }
+    }
+    if (budget > 0 && int(mRanking.size()) > budget) {
+      std::nth_element(mRanking.begin(), mRanking.begin() + budget,
+                       mRanking.end(), [](const Ranked &a, const Ranked &b) {
+                         return a.score > b.score;
+                       });
+      for (size_t i = budget; i < mRanking.size(); i++) {
+        mRanking[i].voice->mAudibility = CullableVoice::CULLED;
+      }
+    }
+    if (enabled) {
+      for (auto *voice = scene.getActiveVoices(); voice; voice = voice->next) {
+        auto *cullable = dynamic_cast<CullableVoice *>(voice);
+        if (!cullable) {
+          continue;
+        }
+        switch (cullable->mAudibility) {
+        case CullableVoice::AUDIBLE:
+          stats.audible++;
+          break;
+        case CullableVoice::DECIMATED:
+          stats.decimated++;
+          break;
+        case CullableVoice::CULLED:
+          stats.culled++;
+          break;
+        }
+      }
+    }
+    mVoices = stats.voices;
+    mAudible = stats.audible;
+    mDecimated = stats.decimated;
+    mCulled = stats.culled;
+  }
+
+  /// Counts from the last update. Can be called from any thread.
+  AudibilityStats stats() const {
+    AudibilityStats stats;
+    stats.voices = mVoices;
+    stats.audible = mAudible;
+    stats.decimated = mDecimated;
+    stats.culled = mCulled;
+    return stats;
+  }
+
+private:
+  struct Ranked {
+    float score;
+    CullableVoice *voice;
+  };
+
+  CullableVoice::Audibility classify(CullableVoice::Audibility previous,
+                                     float db) const {
+    // Thresholds are raised by the hysteresis when moving up from the
+    // previous state
+    float decimate = mDecimateLevel;
+    float cull = mCullLevel;
+    if (previous != CullableVoice::AUDIBLE) {
+      decimate += mHysteresis;
+    }
+    if (previous == CullableVoice::CULLED) {
+      cull += mHysteresis;
+    }
+    if (db >= decimate) {
+      return CullableVoice::AUDIBLE;
+    }
+    if (db >= cull) {
+      return CullableVoice::DECIMATED;
+    }
+    return CullableVoice::CULLED;
+  }
+
+  std::atomic<float> mCullLevel{-80.0f};
+  std::atomic<float> mDecimateLevel{-60.0f};
+  std::atomic<float> mHysteresis{6.0f};
+  std::atomic<unsigned int> mDecimation{4};
+  std::atomic<int> mBudget{0};
+  std::atomic<bool> mEnabled{true};
+  std::vector<Ranked> mRanking;
+
+  std::atomic<int> mVoices{0};
+  std::atomic<int> mAudible{0};
+  std::atomic<int> mDecimated{0};
+  std::atomic<int> mCulled{0};
+};
+
+} // namespace al
+
+#endif // AL_AUDIBILITYCULLER_HPP
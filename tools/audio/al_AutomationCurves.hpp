@@ -0,0 +1,562 @@
+#ifndef AL_AUTOMATIONCURVES_HPP
+#define AL_AUTOMATIONCURVES_HPP
+
+// Precompiled automation for objects moved by preset sequence files.
+//
+// A sequence file has lines like
+//
+//   +1.0:/_pose:0,1,0:2.0
+//
+// meaning: 1 second after the previous line, start moving the pose to
+// (0, 1, 0) over 2 seconds. A new line interrupts a move still in progress,
+// starting from wherever the value got to. Instead of playing these lines
+// with a PresetSequencer and morphing with a PresetHandler, each with its own
+// thread per object, AutomationBank parses every file once into its events
+// before audio starts, and PoseCurve or ScalarCurve turn them into
+// breakpoints when an object starts, with the interruptions already resolved,
+// in memory reserved up front. Values between breakpoints are linear, and the
+// orientation of a pose is interpolated with slerp.
+//
+// Finding the value at any time is a binary search over the breakpoints, and
+// playing forward only advances a cursor. Poses of all playing objects are
+// evaluated together once per block by PoseAutomationBatch, four objects at a
+// time with SSE.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "al/io/al_File.hpp"
+#include "al/math/al_Quat.hpp"
+#include "al/spatial/al_Pose.hpp"
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#define AL_AUTOMATIONCURVES_SSE 1
+#include <xmmintrin.h>
+#endif
+
+namespace al {
+
+/// One line of a sequence file
+struct AutomationEvent {
+  double time;      // Seconds from the start of the sequence
+  float morphTime;  // Seconds to reach the values
+  std::vector<float> values;
+};
+
+/// Events of one sequence file, by parameter address ("/_pose" ...)
+struct AutomationEvents {
+  std::map<std::string, std::vector<AutomationEvent>> parameters;
+
+  const std::vector<AutomationEvent> *find(const std::string &address) const {
+    auto it = parameters.find(address);
+    return it == parameters.end() ? nullptr : &it->second;
+  }
+
+  /// Most events of any one parameter
+  size_t maxEvents() const {
+    size_t count = 0;
+    for (auto &parameter : parameters) {
+      count = std::max(count, parameter.second.size());
+    }
+    return count;
+  }
+
+  /**
+   * @brief Parse sequence text
+   * @return false if no line could be parsed
+   */
+  bool parse(std::istream &stream) {
+    parameters.clear();
+    double time = 0.0;
+    std::string line;
+    bool parsed = false;
+    while (std::getline(stream, line)) {
+      if (line.compare(0, 2, "::") == 0) {
+        break;
+      }
+      if (line.empty() || line[0] != '+') {
+        continue;
+      }
+      // +delta:address:values:morph
+      std::vector<std::string> fields;
+      std::stringstream fieldStream(line.substr(1));
+      std::string field;
+      while (std::getline(fieldStream, field, ':')) {
+        fields.push_back(field);
+      }
+      if (fields.size() < 3) {
+        continue;
+      }
+      AutomationEvent event;
+      time += std::atof(fields[0].c_str());
+      event.time = time;
+      event.morphTime =
+          fields.size() > 3 ? float(std::atof(fields[3].c_str())) : 0.0f;
+      std::stringstream valueStream(fields[2]);
+      std::string value;
+      while (std::getline(valueStream, value, ',')) {
+        event.values.push_back(float(std::atof(value.c_str())));
+      }
+      if (event.values.empty()) {
+        continue;
+      }
+      parameters[fields[1]].push_back(std::move(event));
+      parsed = true;
+    }
+    return parsed;
+  }
+};
+
+/// Curve of a single value
+class ScalarCurve {
+public:
+  struct Breakpoint {
+    double time;
+    float value;
+  };
+
+  /// Breakpoints built from up to events events don't allocate
+  void reserve(size_t events) { mPoints.reserve(2 * events); }
+
+  /// Resolve events into breakpoints, starting from initial
+  void build(const std::vector<AutomationEvent> &events, float initial) {
+    mPoints.clear();
+    float current = initial;
+    for (size_t i = 0; i < events.size(); i++) {
+      auto &event = events[i];
+      const double next =
+          i + 1 < events.size() ? events[i + 1].time : HUGE_VAL;
+      float target = event.values[0];
+      add({event.time, current});
+      if (event.morphTime > 0.0f) {
+        double end = std::min(event.time + event.morphTime, next);
+        float fraction = float((end - event.time) / event.morphTime);
+        current += (target - current) * fraction;
+        add({end, current});
+      } else {
+        current = target;
+        add({event.time, current});
+      }
+    }
+  }
+
+  void clear() { mPoints.clear(); }
+  bool empty() const { return mPoints.empty(); }
+
+  /**
+   * @brief Value at time
+   * @param cursor breakpoint to start searching from, updated for the next
+   * call. Playing forward only steps it; earlier times search from the start.
+   */
+  float value(double time, size_t &cursor) const {
+    if (mPoints.empty()) {
+      return 0.0f;
+    }
+    if (cursor >= mPoints.size() || mPoints[cursor].time > time) {
+      cursor = seekBreakpoints(mPoints, time);
+    }
+    while (cursor + 1 < mPoints.size() && mPoints[cursor + 1].time <= time) {
+      cursor++;
+    }
+    auto &a = mPoints[cursor];
+    if (cursor + 1 >= mPoints.size() || time <= a.time) {
+      return a.value;
+    }
+    auto &b = mPoints[cursor + 1];
+    float fraction = float((time - a.time) / (b.time - a.time));
+    return a.value + (b.value - a.value) * fraction;
+  }
+
+  /// Index of the last breakpoint at or before time, in O(log n)
+  template <class Points>
+  static size_t seekBreakpoints(const Points &points, double time) {
+    auto it = std::upper_bound(
+        points.begin(), points.end(), time,
+        [](double t, const typename Points::value_type &point) {
+          return t < point.time;
+        });
+    return it == points.begin() ? 0 : size_t(it - points.begin()) - 1;
+  }
+
+private:
+  void add(Breakpoint point) {
+    if (mPoints.empty() || mPoints.back().time != point.time ||
+        mPoints.back().value != point.value) {
+      mPoints.push_back(point);
+    }
+  }
+
+  std::vector<Breakpoint> mPoints;
+};
+
+/// Curve of a position and orientation
+class PoseCurve {
+public:
+  struct Breakpoint {
+    double time;
+    float value[7]; // x, y, z, qw, qx, qy, qz
+    // Slerp from this breakpoint's orientation to the next one
+    float angle;
+    float inverseSine;
+  };
+
+  /**
+   * @brief Resolve events into breakpoints, starting from initial
+   *
+   * Events can have 3 values for the position or 7 for position and
+   * orientation (w, x, y, z). Doesn't allocate after reserve(events.size()).
+   */
+  void build(const std::vector<AutomationEvent> &events, const Pose &initial) {
+    mPoints.clear();
+    Breakpoint current;
+    current.time = 0.0;
+    current.value[0] = float(initial.pos().x);
+    current.value[1] = float(initial.pos().y);
+    current.value[2] = float(initial.pos().z);
+    current.value[3] = float(initial.quat().w);
+    current.value[4] = float(initial.quat().x);
+    current.value[5] = float(initial.quat().y);
+    current.value[6] = float(initial.quat().z);
+    for (size_t i = 0; i < events.size(); i++) {
+      auto &event = events[i];
+      const double next =
+          i + 1 < events.size() ? events[i + 1].time : HUGE_VAL;
+      Breakpoint target = current;
+      const size_t count = std::min(event.values.size(), size_t(7));
+      std::copy_n(event.values.begin(), count, target.value);
+      if (count == 7) {
+        normalize(target.value + 3);
+      }
+      current.time = event.time;
+      add(current);
+      if (event.morphTime > 0.0f) {
+        double end = std::min(event.time + event.morphTime, next);
+        float fraction = float((end - event.time) / event.morphTime);
+        // Interpolate to where the move is interrupted
+        setupSlerp(mPoints.back(), target);
+        interpolate(mPoints.back(), target, fraction, current.value);
+        current.time = end;
+        add(current);
+      } else {
+        target.time = event.time;
+        current = target;
+        add(current);
+      }
+    }
+    if (!mPoints.empty()) {
+      mPoints.back().angle = 0.0f;
+      mPoints.back().inverseSine = 0.0f;
+    }
+  }
+
+  /// Breakpoints built from up to events events don't allocate
+  void reserve(size_t events) { mPoints.reserve(2 * events); }
+
+  void clear() { mPoints.clear(); }
+  bool empty() const { return mPoints.empty(); }
+  size_t size() const { return mPoints.size(); }
+  const Breakpoint &breakpoint(size_t index) const { return mPoints[index]; }
+
+  /**
+   * @brief Breakpoint for time and interpolation fraction to the next one
+   * @param cursor as in ScalarCurve::value()
+   */
+  size_t segment(double time, size_t &cursor, float &fraction) const {
+    fraction = 0.0f;
+    if (mPoints.empty()) {
+      return 0;
+    }
+    if (cursor >= mPoints.size() || mPoints[cursor].time > time) {
+      cursor = ScalarCurve::seekBreakpoints(mPoints, time);
+    }
+    while (cursor + 1 < mPoints.size() && mPoints[cursor + 1].time <= time) {
+      cursor++;
+    }
+    if (cursor + 1 < mPoints.size() && time > mPoints[cursor].time) {
+      fraction = float((time - mPoints[cursor].time) /
+                       (mPoints[cursor + 1].time - mPoints[cursor].time));
+    }
+    return cursor;
+  }
+
+  /// Pose at time, one object at a time
+  Pose pose(double time, size_t &cursor) const {
+    float fraction;
+    size_t index = segment(time, cursor, fraction);
+    float value[7];
+    if (index + 1 < mPoints.size()) {
+      interpolate(mPoints[index], mPoints[index + 1], fraction, value);
+    } else {
+      std::copy_n(mPoints[index].value, 7, value);
+    }
+    return toPose(value);
+  }
+
+  static Pose toPose(const float *value) {
+    return Pose(Vec3d(value[0], value[1], value[2]),
+                Quatd(value[3], value[4], value[5], value[6]));
+  }
+
+  /// Slerp weights of the start and end orientation of segment a
+  static void slerpWeights(const Breakpoint &a, float fraction, float &start,
+                           float &end) {
+    if (a.inverseSine == 0.0f) {
+      // Nearly the same orientation
+      start = 1.0f - fraction;
+      end = fraction;
+    } else {
+      start = std::sin((1.0f - fraction) * a.angle) * a.inverseSine;
+      end = std::sin(fraction * a.angle) * a.inverseSine;
+    }
+  }
+
+private:
+  static void normalize(float *q) {
+    float length = std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] +
+                             q[3] * q[3]);
+    if (length > 0.0f) {
+      for (int i = 0; i < 4; i++) {
+        q[i] /= length;
+      }
+    } else {
+      q[0] = 1.0f;
+    }
+  }
+
+  static void interpolate(const Breakpoint &a, const Breakpoint &b,
+                          float fraction, float *value) {
+    for (int i = 0; i < 3; i++) {
+      value[i] = a.value[i] + (b.value[i] - a.value[i]) * fraction;
+    }
+    float start, end;
+    slerpWeights(a, fraction, start, end);
+    for (int i = 3; i < 7; i++) {
+      value[i] = start * a.value[i] + end * b.value[i];
+    }
+  }
+
+  /// Put the orientation of b in the same hemisphere as a's and set up the
+  /// slerp from a to b
+  static void setupSlerp(Breakpoint &a, Breakpoint &b) {
+    float dot = 0.0f;
+    for (int i = 3; i < 7; i++) {
+      dot += a.value[i] * b.value[i];
+    }
+    if (dot < 0.0f) {
+      for (int i = 3; i < 7; i++) {
+        b.value[i] = -b.value[i];
+      }
+      dot = -dot;
+    }
+    a.angle = std::acos(std::min(dot, 1.0f));
+    float sine = std::sin(a.angle);
+    a.inverseSine = sine > 1e-4f ? 1.0f / sine : 0.0f;
+  }
+
+  void add(Breakpoint point) {
+    if (!mPoints.empty()) {
+      auto &previous = mPoints.back();
+      if (previous.time == point.time &&
+          std::equal(point.value, point.value + 7, previous.value)) {
+        return;
+      }
+      setupSlerp(previous, point);
+    }
+    point.angle = 0.0f;
+    point.inverseSine = 0.0f;
+    mPoints.push_back(point);
+  }
+
+  std::vector<Breakpoint> mPoints;
+};
+
+/**
+ * @brief Sequence files parsed once and shared by all objects
+ *
+ * Files are loaded by name, as objects refer to them, on the main thread
+ * before audio starts. The audio thread then only calls find(), which
+ * doesn't lock, allocate or read files. The bank isn't changed after that.
+ */
+class AutomationBank {
+public:
+  /**
+   * @brief Parse the sequence file name in directory
+   *
+   * Names without an extension get ".sequence", as with PresetSequencer.
+   * Returns false if the file can't be read or has no events.
+   */
+  bool load(const std::string &directory, const std::string &name) {
+    if (mFiles.count(name)) {
+      return true;
+    }
+    std::string path = directory + name;
+    if (name.find('.', name.find_last_of('/') + 1) == std::string::npos) {
+      path += ".sequence";
+    }
+    std::ifstream file(path);
+    AutomationEvents events;
+    if (!file.good() || !events.parse(file)) {
+      return false;
+    }
+    mFiles[name] = std::move(events);
+    return true;
+  }
+
+  /// Parse files in directory that look like sequences (first line is '+'),
+  /// named as objects refer to them: "A" for A.sequence
+  void preload(const std::string &directory) {
+    const std::string extension = ".sequence";
+    FileList files = itemListInDir(directory);
+    for (auto &entry : files) {
+      if (entry.isDir()) {
+        continue;
+      }
+      std::ifstream file(entry.filepath());
+      if (file.peek() == '+') {
+        std::string name = entry.file();
+        if (name.size() > extension.size() &&
+            name.compare(name.size() - extension.size(), extension.size(),
+                         extension) == 0) {
+          name.resize(name.size() - extension.size());
+        }
+        load(directory, name);
+      }
+    }
+  }
+
+  /// Events of a loaded file, or nullptr. Safe from the audio thread.
+  const AutomationEvents *find(const std::string &name) const {
+    auto it = mFiles.find(name);
+    return it == mFiles.end() ? nullptr : &it->second;
+  }
+
+  /// Most events of any parameter of any file, to reserve curves with
+  size_t maxEvents() const {
+    size_t count = 0;
+    for (auto &file : mFiles) {
+      count = std::max(count, file.second.maxEvents());
+    }
+    return count;
+  }
+
+  const std::map<std::string, AutomationEvents> &files() const {
+    return mFiles;
+  }
+
+private:
+  std::map<std::string, AutomationEvents> mFiles;
+};
+
+/**
+ * @brief Evaluates the poses of many PoseCurves together
+ *
+ * Every block, clear() and add() each playing curve with its time, then
+ * evaluate() and read back pose(index).
+ */
+class PoseAutomationBatch {
+public:
+  explicit PoseAutomationBatch(size_t maxCurves = 64) { reserve(maxCurves); }
+
+  void reserve(size_t maxCurves) {
+    mCapacity = (maxCurves + 3) & ~size_t(3);
+    for (auto &component : mStart) {
+      component.assign(mCapacity, 0.0f);
+    }
+    for (auto &component : mEnd) {
+      component.assign(mCapacity, 0.0f);
+    }
+    for (auto &component : mOut) {
+      component.assign(mCapacity, 0.0f);
+    }
+    mFraction.assign(mCapacity, 0.0f);
+    mStartWeight.assign(mCapacity, 0.0f);
+    mEndWeight.assign(mCapacity, 0.0f);
+  }
+
+  void clear() { mCount = 0; }
+  size_t size() const { return mCount; }
+
+  /**
+   * @brief Add curve at time
+   * @return index for pose(), or -1 if the batch is full
+   */
+  int add(const PoseCurve &curve, double time, size_t &cursor) {
+    if (mCount >= mCapacity || curve.empty()) {
+      return -1;
+    }
+    const size_t i = mCount++;
+    float fraction;
+    size_t index = curve.segment(time, cursor, fraction);
+    auto &a = curve.breakpoint(index);
+    auto &b = index + 1 < curve.size() ? curve.breakpoint(index + 1) : a;
+    for (int c = 0; c < 7; c++) {
+      mStart[c][i] = a.value[c];
+      mEnd[c][i] = b.value[c];
+    }
+    mFraction[i] = fraction;
+    PoseCurve::slerpWeights(a, fraction, mStartWeight[i], mEndWeight[i]);
+    return int(i);
+  }
+
+  /// Interpolate all added curves
+  void evaluate() {
+    size_t i = 0;
+#ifdef AL_AUTOMATIONCURVES_SSE
+    for (; i + 4 <= mCount; i += 4) {
+      __m128 f = _mm_loadu_ps(&mFraction[i]);
+      for (int c = 0; c < 3; c++) {
+        __m128 a = _mm_loadu_ps(&mStart[c][i]);
+        __m128 b = _mm_loadu_ps(&mEnd[c][i]);
+        _mm_storeu_ps(&mOut[c][i],
+                      _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), f)));
+      }
+      __m128 wa = _mm_loadu_ps(&mStartWeight[i]);
+      __m128 wb = _mm_loadu_ps(&mEndWeight[i]);
+      for (int c = 3; c < 7; c++) {
+        __m128 a = _mm_loadu_ps(&mStart[c][i]);
+        __m128 b = _mm_loadu_ps(&mEnd[c][i]);
+        _mm_storeu_ps(&mOut[c][i],
+                      _mm_add_ps(_mm_mul_ps(a, wa), _mm_mul_ps(b, wb)));
+      }
+    }
+#endif
+    for (; i < mCount; i++) {
+      for (int c = 0; c < 3; c++) {
+        mOut[c][i] = mStart[c][i] + (mEnd[c][i] - mStart[c][i]) * mFraction[i];
+      }
+      for (int c = 3; c < 7; c++) {
+        mOut[c][i] =
+            mStart[c][i] * mStartWeight[i] + mEnd[c][i] * mEndWeight[i];
+      }
+    }
+  }
+
+  Pose pose(int index) const {
+    float value[7];
+    for (int c = 0; c < 7; c++) {
+      value[c] = mOut[c][index];
+    }
+    return PoseCurve::toPose(value);
+  }
+
+private:
+  size_t mCapacity{0};
+  size_t mCount{0};
+  // Components of the segment ends and the result, one array per component
+  std::vector<float> mStart[7];
+  std::vector<float> mEnd[7];
+  std::vector<float> mOut[7];
+  std::vector<float> mFraction;
+  std::vector<float> mStartWeight;
+  std::vector<float> mEndWeight;
+};
+
+} // namespace al
+
+#endif // AL_AUTOMATIONCURVES_HPP
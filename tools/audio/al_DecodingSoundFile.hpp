@@ -0,0 +1,521 @@
+#ifndef AL_DECODINGSOUNDFILE_HPP
+#define AL_DECODINGSOUNDFILE_HPP
+
+// Streaming playback of compressed sound files (MP3, FLAC, Ogg Vorbis/Opus
+// and anything else libsndfile can read).
+//
+// Decoding runs on a small pool of worker threads shared by all open files.
+// Each file decodes into its own lock free ring buffer ahead of the read
+// position. The amount decoded ahead adapts: it starts small and grows every
+// time the reader catches up with the decoder, up to the size of the ring.
+// Ring sizes are limited by a memory budget shared by all files.
+//
+// DecodingSoundFile has the same interface as SoundFileBuffered (read(),
+// seek(), loop() ...) and also implements SoundFileReader, so it can be used
+// with PlaybackTransport and StreamScheduler. readAt() serves any frame that
+// is decoded or about to be, skipping over frames the reader jumped past, and
+// only seeks the decoder for frames behind the ring or further ahead than it
+// holds. Frames that aren't decoded yet are read as silence.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sndfile.h>
+
+#include "al_SoundFileReader.hpp"
+
+namespace al {
+
+class DecodingSoundFile;
+
+/**
+ * @brief Worker threads that decode for all DecodingSoundFile objects
+ */
+class DecoderPool {
+public:
+  static DecoderPool &instance() {
+    static DecoderPool pool;
+    return pool;
+  }
+
+  ~DecoderPool() { stop(); }
+
+  /// Set number of worker threads. Takes effect when the pool next starts.
+  void workers(unsigned count) { mNumWorkers = std::max(1u, count); }
+
+  /// Total bytes of ring buffers all files can hold
+  void memoryBudget(size_t bytes) { mMemoryBudget = bytes; }
+  size_t memoryBudget() const { return mMemoryBudget; }
+  size_t memoryUsed() const { return mMemoryUsed; }
+
+  /// Wake up workers. Called when a file needs decoding.
+  void notify() { mCondition.notify_one(); }
+
+private:
+  friend class DecodingSoundFile;
+
+  DecoderPool() {}
+
+  void add(DecodingSoundFile *file) {
+    std::unique_lock<std::mutex> lk(mMutex);
+    mFiles.push_back(file);
+    if (!mRunning) {
+      mRunning = true;
+      for (unsigned i = 0; i < mNumWorkers; i++) {
+        mThreads.emplace_back(&DecoderPool::worker, this);
+      }
+    }
+  }
+
+  void remove(DecodingSoundFile *file);
+
+  void stop() {
+    {
+      std::unique_lock<std::mutex> lk(mMutex);
+      mRunning = false;
+    }
+    mCondition.notify_all();
+    for (auto &thread : mThreads) {
+      thread.join();
+    }
+    mThreads.clear();
+  }
+
+  /// Reserve ring memory. Returns the number of bytes granted.
+  size_t allocate(size_t requested, size_t minimum) {
+    size_t used = mMemoryUsed;
+    size_t available = used < mMemoryBudget ? mMemoryBudget - used : 0;
+    size_t granted = std::max(minimum, std::min(requested, available));
+    mMemoryUsed += granted;
+    return granted;
+  }
+  void release(size_t bytes) { mMemoryUsed -= bytes; }
+
+  void worker();
+
+  std::vector<DecodingSoundFile *> mFiles;
+  std::vector<std::thread> mThreads;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  bool mRunning{false};
+  unsigned mNumWorkers{2};
+  size_t mMemoryBudget{256 * 1024 * 1024};
+  std::atomic<size_t> mMemoryUsed{0};
+};
+
+class DecodingSoundFile : public SoundFileReader {
+public:
+  /**
+   * @param ringSeconds seconds of audio the ring can hold, if the pool's
+   * memory budget allows it. At least one second is always allocated.
+   */
+  DecodingSoundFile(double ringSeconds = 10.0) : mRingSeconds(ringSeconds) {}
+  DecodingSoundFile(std::string fullPath, bool loop = false,
+                    double ringSeconds = 10.0)
+      : mRingSeconds(ringSeconds) {
+    mLoop = loop;
+    open(fullPath);
+  }
+  ~DecodingSoundFile() { close(); }
+
+  DecodingSoundFile(const DecodingSoundFile &) = delete;
+  DecodingSoundFile &operator=(const DecodingSoundFile &) = delete;
+
+  bool open(std::string fullPath) {
+    close();
+    SF_INFO info;
+    std::memset(&info, 0, sizeof(info));
+    mFile = sf_open(fullPath.c_str(), SFM_READ, &info);
+    if (!mFile) {
+      return false;
+    }
+    mChannels = info.channels;
+    mFrameRate = info.samplerate;
+    mFrames = info.frames > 0 ? uint64_t(info.frames) : 0;
+    mFormat = info.format;
+
+    size_t frameBytes = mChannels * sizeof(float);
+    size_t minimumBytes = size_t(mFrameRate) * frameBytes;
+    mRingBytes = DecoderPool::instance().allocate(
+        size_t(mRingSeconds * mFrameRate) * frameBytes, minimumBytes);
+    mRing.assign(mRingBytes / sizeof(float), 0.0f);
+    mRingFrames = mRing.size() / mChannels;
+    // Start by decoding a quarter second ahead
+    mReadAhead = std::min(mRingFrames, size_t(mFrameRate / 4));
+
+    mReadFrame = 0;
+    mWritten = 0;
+    mRead = 0;
+    mSeekTarget = -1;
+    mSeekBaseCount = 0;
+    mSeekBaseFrame = 0;
+    mReaderGeneration = mSeekGeneration.load();
+    mLastRead = 0;
+    mEndOfFile = false;
+    mOpened = true;
+    DecoderPool::instance().add(this);
+    DecoderPool::instance().notify();
+    return true;
+  }
+
+  void close() override {
+    if (!mOpened) {
+      return;
+    }
+    DecoderPool::instance().remove(this);
+    sf_close(mFile);
+    mFile = nullptr;
+    DecoderPool::instance().release(mRingBytes);
+    mRingBytes = 0;
+    mOpened = false;
+  }
+
+  bool opened() const override { return mOpened; }
+  int channels() const override { return mChannels; }
+  double frameRate() const override { return mFrameRate; }
+  uint64_t frames() const override { return mFrames; }
+
+  // SoundFileBuffered interface
+
+  /**
+   * @brief Read interleaved frames at the current position
+   * @return frames read. Missing frames (decoder underrun) are set to 0.
+   */
+  size_t read(float *buffer, int numFrames) {
+    adoptSeek();
+    size_t count = consume(buffer, numFrames);
+    std::fill(buffer + count * mChannels, buffer + numFrames * mChannels,
+              0.0f);
+    return count;
+  }
+
+  void seek(int frame) { requestSeek(uint64_t(std::max(frame, 0))); }
+  int currentPosition() const { return int(mReadFrame); }
+  void loop(bool loop) { mLoop = loop; }
+  bool loop() const { return mLoop; }
+
+  // SoundFileReader interface
+
+  /**
+   * @brief Read from frame
+   *
+   * Frames between the last read and frame are skipped if they are decoded
+   * or within the ring ahead of the decoder. Only a frame behind the last
+   * read or further ahead than the ring holds seeks the decoder. Frames not
+   * decoded yet are set to 0 and not counted, see endOfFile().
+   */
+  size_t readAt(uint64_t frame, float *buffer, size_t numFrames) override {
+    mLastRead = now();
+    adoptSeek();
+    size_t count = 0;
+    if (mOpened && mSeekTarget < 0) {
+      uint64_t distance = distanceFrom(mReadFrame, frame);
+      if (distance >= mRingFrames) {
+        requestSeek(frame);
+      } else if (consume(nullptr, size_t(distance), false) == distance) {
+        count = consume(buffer, numFrames);
+      }
+    }
+    std::fill(buffer + count * mChannels, buffer + numFrames * mChannels,
+              0.0f);
+    return count;
+  }
+
+  bool endOfFile(uint64_t frame) const override {
+    if (mLoop) {
+      return false;
+    }
+    if (mFrames > 0) {
+      return frame >= mFrames;
+    }
+    // Length not in the header, known once the decoder got to the end
+    return mEndOfFile && frame >= mEndFrame;
+  }
+
+  /**
+   * @brief Make sure frame is decoded or being decoded
+   *
+   * While the file is being read (by the audio thread, or a reader that
+   * streams from this one) this only wakes up the decoder: moving it would
+   * pull frames away from under the reader, and readAt() seeks by itself
+   * when it has to. Otherwise, if frame is not in the ring, the decoder seeks
+   * to it and this waits until numFrames are decoded.
+   */
+  void prefetch(uint64_t frame, size_t numFrames) override {
+    numFrames = std::min(numFrames, mRingFrames);
+    // The caller wants numFrames ahead, so decode at least that far ahead
+    size_t readAhead = mReadAhead;
+    while (numFrames > readAhead &&
+           !mReadAhead.compare_exchange_weak(readAhead, numFrames)) {
+    }
+    if (reading() || !mOpened) {
+      DecoderPool::instance().notify();
+      return;
+    }
+    // Read position, as the reader will see it after adopting a seek
+    bool seeked = mSeekGeneration != mReaderGeneration;
+    uint64_t readCount = seeked ? mSeekBaseCount.load() : mRead.load();
+    uint64_t readFrame = seeked ? mSeekBaseFrame.load() : mReadFrame.load();
+    if (mSeekTarget < 0 &&
+        distanceFrom(readFrame, frame) < mWritten - readCount) {
+      DecoderPool::instance().notify();
+      return; // Already decoded
+    }
+    uint32_t generation = mSeekGeneration;
+    requestSeek(frame);
+    if (mFrames > 0 && !mLoop) {
+      numFrames = size_t(std::min<uint64_t>(
+          numFrames, mFrames > frame ? mFrames - frame : 0));
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (mOpened) {
+      if (mSeekGeneration != generation && mSeekTarget < 0 &&
+          (mWritten - mSeekBaseCount >= numFrames || mEndOfFile)) {
+        break;
+      }
+      DecoderPool::instance().notify();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      if (std::chrono::steady_clock::now() - start > std::chrono::seconds(2)) {
+        break;
+      }
+    }
+  }
+
+  std::string formatInfo() const override {
+    SF_FORMAT_INFO info;
+    info.format = mFormat & SF_FORMAT_TYPEMASK;
+    std::string name = "unknown";
+    if (sf_command(nullptr, SFC_GET_FORMAT_INFO, &info, sizeof(info)) == 0 &&
+        info.name) {
+      name = info.name;
+    }
+    return name + " (decoded)";
+  }
+
+  /// Frames decoded and not yet read
+  size_t available() const {
+    uint64_t read = std::max(mRead.load(), mSeekBaseCount.load());
+    uint64_t written = mWritten;
+    return written > read ? size_t(written - read) : 0;
+  }
+  /// Current target of frames to decode ahead of the read position
+  size_t readAhead() const { return mReadAhead; }
+  /// Number of reads that found less frames than requested
+  uint32_t underruns() const { return mUnderruns; }
+
+private:
+  friend class DecoderPool;
+
+  // Reads within this many nanoseconds mean the file is being read
+  static const int64_t kReadingTimeout = 100000000;
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  bool reading() const {
+    int64_t lastRead = mLastRead;
+    return lastRead != 0 && now() - lastRead < kReadingTimeout;
+  }
+
+  void requestSeek(uint64_t frame) {
+    mSeekTarget = int64_t(frame);
+    DecoderPool::instance().notify();
+  }
+
+  // Frames to read from position to reach frame, wrapping looping files.
+  // Frames behind position are out of reach (maximum value).
+  uint64_t distanceFrom(uint64_t position, uint64_t frame) const {
+    if (mLoop && mFrames > 0) {
+      return (frame % mFrames + mFrames - position % mFrames) % mFrames;
+    }
+    return frame >= position ? frame - position : UINT64_MAX;
+  }
+
+  // Reader side. Move read position to the result of a completed seek.
+  void adoptSeek() {
+    uint32_t generation = mSeekGeneration.load(std::memory_order_acquire);
+    if (generation != mReaderGeneration) {
+      mReaderGeneration = generation;
+      mRead.store(mSeekBaseCount, std::memory_order_release);
+      mReadFrame = mSeekBaseFrame.load();
+    }
+  }
+
+  // Reader side. Copy frames out of the ring, or skip them if buffer is
+  // nullptr.
+  size_t consume(float *buffer, size_t numFrames, bool countUnderrun = true) {
+    if (!mOpened || mSeekTarget >= 0) {
+      return 0;
+    }
+    uint64_t read = mRead.load(std::memory_order_relaxed);
+    uint64_t written = mWritten.load(std::memory_order_acquire);
+    size_t count = std::min<size_t>(numFrames, size_t(written - read));
+    for (size_t i = 0; buffer && i < count;) {
+      size_t index = size_t((read + i) % mRingFrames);
+      size_t run = std::min(count - i, mRingFrames - index);
+      std::memcpy(buffer + i * mChannels, mRing.data() + index * mChannels,
+                  run * mChannels * sizeof(float));
+      i += run;
+    }
+    // A seek completed while copying may have overwritten the frames. Drop
+    // them, the next read adopts the seek.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (mSeekGeneration.load(std::memory_order_relaxed) != mReaderGeneration) {
+      return 0;
+    }
+    mRead.store(read + count, std::memory_order_release);
+    uint64_t readFrame = mReadFrame + count;
+    if (mLoop && mFrames > 0 && readFrame >= mFrames) {
+      readFrame -= mFrames;
+    }
+    mReadFrame = readFrame;
+    if (countUnderrun && count < numFrames && !mEndOfFile) {
+      mUnderruns++;
+      mStarved = true;
+    }
+    if (written - (read + count) < mReadAhead) {
+      DecoderPool::instance().notify();
+    }
+    return count;
+  }
+
+  // Worker side, with exclusive access to the file. Returns true if any
+  // frames were decoded.
+  bool decode() {
+    int64_t seekTarget = mSeekTarget.load(std::memory_order_acquire);
+    if (seekTarget >= 0) {
+      sf_seek(mFile, sf_count_t(seekTarget), SEEK_SET);
+      mEndOfFile = false;
+      // Frames written before this point are discarded by the reader when
+      // it adopts the seek.
+      mSeekBaseCount = mWritten.load();
+      mSeekBaseFrame = uint64_t(seekTarget);
+      mSeekGeneration.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_release);
+      mSeekTarget.compare_exchange_strong(seekTarget, -1);
+    }
+    // Double the read ahead whenever the reader was starved
+    if (mStarved.exchange(false)) {
+      mReadAhead = std::min(mRingFrames, mReadAhead * 2);
+    }
+    uint64_t written = mWritten.load(std::memory_order_relaxed);
+    // Frames before the last seek are free even if the reader hasn't adopted
+    // the seek yet (see consume()).
+    uint64_t read = std::max(mRead.load(std::memory_order_acquire),
+                             mSeekBaseCount.load());
+    size_t used = size_t(written - read);
+    if (available() >= mReadAhead || mEndOfFile || used >= mRingFrames) {
+      return false;
+    }
+    size_t index = size_t(written % mRingFrames);
+    size_t toDecode = std::min(
+        {mRingFrames - used, mRingFrames - index, size_t(4096)});
+    sf_count_t count = sf_readf_float(mFile, mRing.data() + index * mChannels,
+                                      sf_count_t(toDecode));
+    if (count <= 0) {
+      if (mLoop) {
+        sf_seek(mFile, 0, SEEK_SET);
+      } else {
+        mEndFrame = mSeekBaseFrame + (written - mSeekBaseCount);
+        mEndOfFile = true;
+      }
+      return false;
+    }
+    mWritten.store(written + count, std::memory_order_release);
+    return true;
+  }
+
+  bool needsDecode() const {
+    return mSeekTarget >= 0 || (!mEndOfFile && available() < mReadAhead);
+  }
+
+  SNDFILE *mFile{nullptr};
+  int mFormat{0};
+  int mChannels{0};
+  double mFrameRate{0.0};
+  uint64_t mFrames{0};
+  double mRingSeconds;
+  bool mOpened{false};
+  std::atomic<bool> mLoop{false};
+
+  std::vector<float> mRing;
+  size_t mRingFrames{0};
+  size_t mRingBytes{0};
+  std::atomic<size_t> mReadAhead{0};
+
+  // Frame counters since open. mWritten is advanced by the decoder, mRead by
+  // the reader.
+  std::atomic<uint64_t> mWritten{0};
+  std::atomic<uint64_t> mRead{0};
+  std::atomic<uint64_t> mReadFrame{0}; // File position of next read
+
+  // Seeks are requested through mSeekTarget, done by the decoder and then
+  // adopted by the reader when mSeekGeneration changes.
+  std::atomic<int64_t> mSeekTarget{-1};
+  std::atomic<uint64_t> mSeekBaseCount{0};
+  std::atomic<uint64_t> mSeekBaseFrame{0};
+  std::atomic<uint32_t> mSeekGeneration{0};
+  std::atomic<uint32_t> mReaderGeneration{0};
+  std::atomic<int64_t> mLastRead{0}; // Time of the last readAt()
+
+  std::atomic<bool> mEndOfFile{false};
+  std::atomic<uint64_t> mEndFrame{0}; // File position of the end of file
+  std::atomic<bool> mStarved{false};
+  std::atomic<uint32_t> mUnderruns{0};
+  std::atomic<bool> mBusy{false}; // Claimed by a worker
+};
+
+inline void DecoderPool::remove(DecodingSoundFile *file) {
+  std::unique_lock<std::mutex> lk(mMutex);
+  mFiles.erase(std::remove(mFiles.begin(), mFiles.end(), file), mFiles.end());
+  // Wait for a worker that may still be decoding this file
+  while (file->mBusy) {
+    lk.unlock();
+    std::this_thread::yield();
+    lk.lock();
+  }
+}
+
+inline void DecoderPool::worker() {
+  std::unique_lock<std::mutex> lk(mMutex);
+  while (mRunning) {
+    // Serve the file with the least decoded audio first
+    DecodingSoundFile *next = nullptr;
+    double leastSeconds = 0.0;
+    for (auto *file : mFiles) {
+      if (file->mBusy || !file->needsDecode()) {
+        continue;
+      }
+      double seconds = file->available() / file->mFrameRate;
+      if (!next || seconds < leastSeconds) {
+        next = file;
+        leastSeconds = seconds;
+      }
+    }
+    if (!next) {
+      mCondition.wait_for(lk, std::chrono::milliseconds(20));
+      continue;
+    }
+    next->mBusy = true;
+    lk.unlock();
+    next->decode();
+    lk.lock();
+    next->mBusy = false;
+  }
+}
+
+} // namespace al
+
+#endif // AL_DECODINGSOUNDFILE_HPP
@@ -0,0 +1,309 @@
+#ifndef AL_FUSEDOUTPUTSTAGE_HPP
+#define AL_FUSEDOUTPUTSTAGE_HPP
+
+// Output processing for speaker arrays in a single pass over the block.
+//
+// Replaces the chain of metering, stereo downmix to buses, LFE send and
+// speaker distance compensation that used to make one full pass each over
+// all output channels. The block is processed in tiles of kTileFrames frames.
+// For each tile every channel is read once: its peak is metered, it is added
+// to the stereo downmix, and it is written back delayed and scaled by its
+// compensation gain. The LFE send is taken from the downmix of the tile, so
+// it costs no extra pass either.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "al/io/al_AudioIOData.hpp"
+#include "al/sound/al_Speaker.hpp"
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#define AL_FUSEDOUTPUTSTAGE_SSE 1
+#include <xmmintrin.h>
+#endif
+
+namespace al {
+
+class FusedOutputStage {
+public:
+  static const size_t kTileFrames = 64;
+
+  /**
+   * @brief Allocate for numChannels output channels
+   * @param maxDelayFrames longest compensation delay
+   *
+   * Resets all gains to 1, delays to 0 and removes the downmix and LFE send.
+   */
+  void configure(int numChannels, size_t maxDelayFrames = 2048) {
+    mChannels.clear();
+    mChannels.resize(numChannels);
+    size_t delaySize = 1;
+    while (delaySize < maxDelayFrames + kTileFrames) {
+      delaySize <<= 1;
+    }
+    mDelaySize = delaySize;
+    mMaxDelay = maxDelayFrames;
+    mWritePosition = 0;
+    mMeterValues.reset(new std::atomic<float>[numChannels]);
+    for (int i = 0; i < numChannels; i++) {
+      mMeterValues[i] = 0.0f;
+    }
+    mLfeChannel = -1;
+    mHasDownmix = false;
+  }
+
+  int channels() const { return int(mChannels.size()); }
+
+  void setSpeakerGain(int channel, float gain) {
+    mChannels[channel].gain = gain;
+  }
+
+  void setSpeakerDelay(int channel, size_t frames) {
+    auto &ch = mChannels[channel];
+    ch.delay = std::min(frames, mMaxDelay);
+    if (ch.delay > 0 && ch.delayLine.empty()) {
+      ch.delayLine.assign(mDelaySize, 0.0f);
+    }
+  }
+
+  /**
+   * @brief Compensate for the distance of each speaker to the center
+   * @param referenceDistance distance that gets a gain of 1. If 0 the
+   * farthest speaker is used, so no gain is above 1.
+   *
+   * Nearer speakers are attenuated in proportion to their distance and
+   * delayed so sound from all speakers arrives at the center at the same
+   * time.
+   */
+  void compensateDistances(const Speakers &layout, double sampleRate,
+                           float referenceDistance = 0.0f) {
+    float farthest = 0.0f;
+    for (auto &speaker : layout) {
+      farthest = std::max(farthest, speaker.radius);
+    }
+    if (referenceDistance <= 0.0f) {
+      referenceDistance = farthest;
+    }
+    const double speedOfSound = 343.0;
+    for (auto &speaker : layout) {
+      int channel = speaker.deviceChannel;
+      if (channel < 0 || channel >= channels() || referenceDistance <= 0.0f) {
+        continue;
+      }
+      setSpeakerGain(channel, speaker.radius / referenceDistance);
+      setSpeakerDelay(channel,
+                      size_t(std::lround((farthest - speaker.radius) /
+                                         speedOfSound * sampleRate)));
+    }
+  }
+
+  /// Gains of channel in the stereo downmix
+  void setDownmixGains(int channel, float left, float right) {
+    mChannels[channel].left = left;
+    mChannels[channel].right = right;
+    mHasDownmix = true;
+  }
+
+  /**
+   * @brief Stereo downmix from speaker azimuths
+   *
+   * Each speaker is panned with constant power by its azimuth (positive to
+   * the left). Gains are scaled by sqrt(2 / number of speakers), so the
+   * downmix has the power of the array for uncorrelated signals.
+   */
+  void stereoDownmixFromLayout(const Speakers &layout) {
+    if (layout.empty()) {
+      return;
+    }
+    const float scale = std::sqrt(2.0f / layout.size());
+    for (auto &speaker : layout) {
+      int channel = speaker.deviceChannel;
+      if (channel < 0 || channel >= channels()) {
+        continue;
+      }
+      float pan = std::sin(speaker.azimuth * float(M_PI) / 180.0f);
+      float angle = (pan + 1.0f) * float(M_PI) / 4.0f;
+      setDownmixGains(channel, scale * std::sin(angle),
+                      scale * std::cos(angle));
+    }
+  }
+
+  /// ITU 5.1 (L, R, C, LFE, Ls, Rs on channels 0-5) to stereo
+  void stereoDownmix5_1() {
+    const float c = float(M_SQRT1_2);
+    setDownmixGains(0, 1.0f, 0.0f);
+    setDownmixGains(1, 0.0f, 1.0f);
+    setDownmixGains(2, c, c);
+    setDownmixGains(3, 0.0f, 0.0f);
+    setDownmixGains(4, c, 0.0f);
+    setDownmixGains(5, 0.0f, c);
+  }
+
+  /**
+   * @brief Send the stereo downmix to an LFE channel
+   *
+   * The send is added after compensation and is not metered.
+   */
+  void lfeSend(int channel, float level) {
+    mLfeChannel = channel;
+    mLfeLevel = level;
+  }
+
+  /**
+   * @brief Replace the output with the stereo downmix
+   *
+   * The downmix is written to outputs 0 and 1 and all other channels are
+   * silenced. Can be changed while processing.
+   */
+  void stereoOutput(bool enable) { mStereoOutput = enable; }
+  bool stereoOutput() const { return mStereoOutput; }
+
+  /// Copy the peak of every channel in the last block
+  void meterValues(float *values, int count) const {
+    count = std::min(count, channels());
+    for (int i = 0; i < count; i++) {
+      values[i] = mMeterValues[i];
+    }
+  }
+
+  /// Process the output channels of io in place. Call at the end of onSound.
+  void process(AudioIOData &io) {
+    const size_t frames = io.framesPerBuffer();
+    const int numChannels = std::min(channels(), int(io.channelsOut()));
+    const bool stereo = mStereoOutput && mHasDownmix;
+    const bool needsDownmix = mHasDownmix && (stereo || mLfeChannel >= 0);
+    for (int c = 0; c < numChannels; c++) {
+      mChannels[c].peak = 0.0f;
+    }
+    for (size_t offset = 0; offset < frames; offset += kTileFrames) {
+      const size_t count = std::min(size_t(kTileFrames), frames - offset);
+      std::fill_n(mLeft, count, 0.0f);
+      std::fill_n(mRight, count, 0.0f);
+      for (int c = 0; c < numChannels; c++) {
+        auto &ch = mChannels[c];
+        float *samples = io.outBuffer(c) + offset;
+        ch.peak = std::max(ch.peak, peak(samples, count));
+        if (needsDownmix) {
+          accumulate(mLeft, samples, ch.left, count);
+          accumulate(mRight, samples, ch.right, count);
+        }
+        if (stereo) {
+          std::fill_n(samples, count, 0.0f);
+        } else if (ch.delay > 0) {
+          delay(ch, samples, count);
+        } else if (ch.gain != 1.0f) {
+          scale(samples, ch.gain, count);
+        }
+      }
+      if (stereo) {
+        std::copy_n(mLeft, count, io.outBuffer(0) + offset);
+        std::copy_n(mRight, count, io.outBuffer(1) + offset);
+      }
+      if (mLfeChannel >= 0 && mLfeChannel < int(io.channelsOut()) &&
+          needsDownmix) {
+        float *lfe = io.outBuffer(mLfeChannel) + offset;
+        accumulate(lfe, mLeft, mLfeLevel, count);
+        accumulate(lfe, mRight, mLfeLevel, count);
+      }
+      mWritePosition = (mWritePosition + count) & (mDelaySize - 1);
+    }
+    for (int c = 0; c < numChannels; c++) {
+      mMeterValues[c] = mChannels[c].peak;
+    }
+  }
+
+private:
+  struct Channel {
+    float gain{1.0f};
+    size_t delay{0};
+    std::vector<float> delayLine;
+    float left{0.0f};
+    float right{0.0f};
+    float peak{0.0f};
+  };
+
+  // Write samples into the delay line and replace them with the delayed and
+  // scaled samples
+  void delay(Channel &ch, float *samples, size_t count) {
+    const size_t mask = mDelaySize - 1;
+    float *line = ch.delayLine.data();
+    for (size_t i = 0; i < count; i++) {
+      size_t write = (mWritePosition + i) & mask;
+      line[write] = samples[i];
+      samples[i] = ch.gain * line[(write - ch.delay) & mask];
+    }
+  }
+
+  static float peak(const float *samples, size_t count) {
+    size_t i = 0;
+    float result = 0.0f;
+#ifdef AL_FUSEDOUTPUTSTAGE_SSE
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 maximum = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+      maximum = _mm_max_ps(maximum,
+                           _mm_andnot_ps(signMask, _mm_loadu_ps(samples + i)));
+    }
+    maximum = _mm_max_ps(maximum, _mm_movehl_ps(maximum, maximum));
+    maximum = _mm_max_ss(maximum, _mm_shuffle_ps(maximum, maximum, 0x55));
+    result = _mm_cvtss_f32(maximum);
+#endif
+    for (; i < count; i++) {
+      result = std::max(result, std::abs(samples[i]));
+    }
+    return result;
+  }
+
+  static void accumulate(float *dest, const float *src, float gain,
+                         size_t count) {
+    if (gain == 0.0f) {
+      return;
+    }
+    size_t i = 0;
+#ifdef AL_FUSEDOUTPUTSTAGE_SSE
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i + 4 <= count; i += 4) {
+      _mm_storeu_ps(dest + i,
+                    _mm_add_ps(_mm_loadu_ps(dest + i),
+                               _mm_mul_ps(_mm_loadu_ps(src + i), g)));
+    }
+#endif
+    for (; i < count; i++) {
+      dest[i] += gain * src[i];
+    }
+  }
+
+  static void scale(float *samples, float gain, size_t count) {
+    size_t i = 0;
+#ifdef AL_FUSEDOUTPUTSTAGE_SSE
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i + 4 <= count; i += 4) {
+      _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), g));
+    }
+#endif
+    for (; i < count; i++) {
+      samples[i] *= gain;
+    }
+  }
+
+  std::vector<Channel> mChannels;
+  size_t mDelaySize{1};
+  size_t mMaxDelay{0};
+  size_t mWritePosition{0};
+
+  bool mHasDownmix{false};
+  std::atomic<bool> mStereoOutput{false};
+  int mLfeChannel{-1};
+  float mLfeLevel{0.0f};
+
+  float mLeft[kTileFrames];
+  float mRight[kTileFrames];
+  std::unique_ptr<std::atomic<float>[]> mMeterValues;
+};
+
+} // namespace al
+
+#endif // AL_FUSEDOUTPUTSTAGE_HPP
@@ -0,0 +1,339 @@
+#ifndef AL_GAINTABLESPATIALIZER_HPP
+#define AL_GAINTABLESPATIALIZER_HPP
+
+// Spatializer that looks up speaker gains in a precomputed table.
+//
+// GainTable bakes the gains of any spatializer (Lbap, Vbap ...) on a
+// latitude/longitude grid of directions when the layout is compiled, by
+// rendering a single sample from each direction. At runtime a source's gains
+// are a bilinear blend of the four surrounding grid rows, computed four
+// speakers at a time, so the cost per source doesn't depend on how expensive
+// the baked spatializer is. Gains are ramped across each block from the
+// previous block's gains, so moving sources don't produce zipper noise.
+//
+// Distance dependent spatializers like Dbap are baked at distance 1.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "al/io/al_AudioIOData.hpp"
+#include "al/sound/al_Spatializer.hpp"
+#include "al/sound/al_Speaker.hpp"
+#include "al/spatial/al_Pose.hpp"
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#define AL_GAINTABLESPATIALIZER_SSE 1
+#include <xmmintrin.h>
+#endif
+
+namespace al {
+
+/**
+ * @brief Render one sample of value 1 through spatializer from pose
+ * @param probe scratch AudioIOData
+ * @param gains receives the gain of each output channel
+ */
+inline void probeSpatializerGains(Spatializer &spatializer, const Pose &pose,
+                                  AudioIOData &probe, float *gains,
+                                  int numChannels) {
+  if (probe.framesPerBuffer() != 1 || probe.channelsOut() < numChannels) {
+    probe.framesPerBuffer(1);
+    probe.channels(numChannels, true);
+  }
+  probe.zeroOut();
+  const float one = 1.0f;
+  const unsigned int frames = 1;
+  spatializer.prepare(probe);
+  spatializer.renderBuffer(probe, pose, &one, frames);
+  spatializer.finalize(probe);
+  for (int i = 0; i < numChannels; i++) {
+    gains[i] = probe.outBuffer(i)[0];
+  }
+}
+
+/// Number of output channels needed for a speaker layout
+inline int layoutChannels(const Speakers &layout) {
+  int channels = 0;
+  for (auto &speaker : layout) {
+    channels = std::max(channels, int(speaker.deviceChannel) + 1);
+  }
+  return channels;
+}
+
+class GainTable {
+public:
+  /**
+   * @brief Compute the gains of spatializer for all grid directions
+   * @param resolution grid spacing in degrees
+   */
+  void bake(Spatializer &spatializer, const Speakers &layout,
+            float resolution = 2.0f) {
+    mChannels = layoutChannels(layout);
+    mStride = (mChannels + 3) & ~3;
+    mAzimuths = std::max(4, int(std::lround(360.0f / resolution)));
+    mElevations = std::max(2, int(std::lround(180.0f / resolution)) + 1);
+    mAzimuthStep = 2.0 * M_PI / mAzimuths;
+    mElevationStep = M_PI / (mElevations - 1);
+    mGains.assign(size_t(mAzimuths) * mElevations * mStride, 0.0f);
+
+    AudioIOData probe;
+    for (int e = 0; e < mElevations; e++) {
+      double elevation = -M_PI / 2.0 + e * mElevationStep;
+      for (int a = 0; a < mAzimuths; a++) {
+        double azimuth = -M_PI + a * mAzimuthStep;
+        Pose pose(direction(azimuth, elevation));
+        probeSpatializerGains(spatializer, pose, probe, row(e, a), mChannels);
+      }
+    }
+  }
+
+  bool baked() const { return !mGains.empty(); }
+  /// Output channels covered by the table
+  int channels() const { return mChannels; }
+  /// Channels padded to a multiple of 4. Size of gain buffers for lookup().
+  int stride() const { return mStride; }
+  size_t bytes() const { return mGains.size() * sizeof(float); }
+
+  /**
+   * @brief Interpolated gains for a direction relative to the listener
+   * @param gains buffer of stride() floats
+   */
+  void lookup(const Vec3d &dir, float *gains) const {
+    double length = dir.mag();
+    double azimuth = 0.0;
+    double elevation = 0.0;
+    if (length > 0.0) {
+      elevation = std::asin(std::max(-1.0, std::min(1.0, dir.y / length)));
+      azimuth = std::atan2(dir.x, -dir.z);
+    }
+    double a = (azimuth + M_PI) / mAzimuthStep;
+    double e = (elevation + M_PI / 2.0) / mElevationStep;
+    int a0 = std::min(int(a), mAzimuths - 1);
+    int e0 = std::min(int(e), mElevations - 2);
+    float fa = float(a - a0);
+    float fe = float(std::min(1.0, e - e0));
+    int a1 = (a0 + 1) % mAzimuths;
+    blend(row(e0, a0), row(e0, a1), row(e0 + 1, a0), row(e0 + 1, a1),
+          (1.0f - fa) * (1.0f - fe), fa * (1.0f - fe), (1.0f - fa) * fe,
+          fa * fe, gains);
+  }
+
+  /// Direction of the grid point at azimuth and elevation (radians)
+  static Vec3d direction(double azimuth, double elevation) {
+    return Vec3d(std::sin(azimuth) * std::cos(elevation), std::sin(elevation),
+                 -std::cos(azimuth) * std::cos(elevation));
+  }
+
+private:
+  float *row(int e, int a) {
+    return mGains.data() + (size_t(e) * mAzimuths + a) * mStride;
+  }
+  const float *row(int e, int a) const {
+    return mGains.data() + (size_t(e) * mAzimuths + a) * mStride;
+  }
+
+  void blend(const float *r0, const float *r1, const float *r2,
+             const float *r3, float w0, float w1, float w2, float w3,
+             float *gains) const {
+#ifdef AL_GAINTABLESPATIALIZER_SSE
+    const __m128 v0 = _mm_set1_ps(w0);
+    const __m128 v1 = _mm_set1_ps(w1);
+    const __m128 v2 = _mm_set1_ps(w2);
+    const __m128 v3 = _mm_set1_ps(w3);
+    for (int i = 0; i < mStride; i += 4) {
+      __m128 sum = _mm_mul_ps(_mm_loadu_ps(r0 + i), v0);
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(r1 + i), v1));
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(r2 + i), v2));
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(r3 + i), v3));
+      _mm_storeu_ps(gains + i, sum);
+    }
+#else
+    for (int i = 0; i < mStride; i++) {
+      gains[i] = r0[i] * w0 + r1[i] * w1 + r2[i] * w2 + r3[i] * w3;
+    }
+#endif
+  }
+
+  std::vector<float> mGains; // mElevations x mAzimuths x mStride
+  int mChannels{0};
+  int mStride{0};
+  int mAzimuths{0};
+  int mElevations{0};
+  double mAzimuthStep{1.0};
+  double mElevationStep{1.0};
+};
+
+/**
+ * @brief Add samples to an output channel with a gain ramped from
+ * startGain to endGain over numFrames
+ */
+inline void accumulateGainRamp(float *dest, const float *samples,
+                               float startGain, float endGain,
+                               unsigned int numFrames) {
+  const float step = (endGain - startGain) / numFrames;
+  unsigned int i = 0;
+#ifdef AL_GAINTABLESPATIALIZER_SSE
+  __m128 gain = _mm_setr_ps(startGain, startGain + step, startGain + 2 * step,
+                            startGain + 3 * step);
+  const __m128 increment = _mm_set1_ps(4 * step);
+  for (; i + 4 <= numFrames; i += 4) {
+    __m128 sum = _mm_add_ps(_mm_loadu_ps(dest + i),
+                            _mm_mul_ps(_mm_loadu_ps(samples + i), gain));
+    _mm_storeu_ps(dest + i, sum);
+    gain = _mm_add_ps(gain, increment);
+  }
+#endif
+  for (; i < numFrames; i++) {
+    dest[i] += (startGain + step * i) * samples[i];
+  }
+}
+
+/// Whether all samples are 0, e.g. from a voice that skipped rendering
+inline bool isSilent(const float *samples, unsigned int numFrames) {
+  unsigned int i = 0;
+#ifdef AL_GAINTABLESPATIALIZER_SSE
+  const __m128 zero = _mm_setzero_ps();
+  for (; i + 4 <= numFrames; i += 4) {
+    if (_mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(samples + i), zero))) {
+      return false;
+    }
+  }
+#endif
+  for (; i < numFrames; i++) {
+    if (samples[i] != 0.0f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Whether a source rendered from current is likely the same one that
+ * was rendered from previous in the last block (less than 30 degrees apart)
+ */
+inline bool continuesSource(const Vec3d &previous, const Vec3d &current) {
+  double lengths = previous.mag() * current.mag();
+  if (lengths == 0.0) {
+    return true;
+  }
+  return previous.dot(current) / lengths > std::cos(M_PI / 6.0);
+}
+
+/**
+ * @brief Spatializer using a GainTable baked from BaseSpatializer
+ *
+ * Usage: scene.setSpatializer<GainTableSpatializer<Lbap>>(speakers);
+ *
+ * Spatializer::renderBuffer() doesn't say which source is rendered, so the
+ * previous gains used for ramping are kept per call in the block. A source
+ * whose direction differs from the previous block's source at the same
+ * call by more than 30 degrees is taken to be a different source and starts
+ * without a ramp. Silent buffers are skipped.
+ */
+template <class BaseSpatializer>
+class GainTableSpatializer : public Spatializer {
+public:
+  GainTableSpatializer(const Speakers &sl, float resolution = 2.0f,
+                       int maxSources = 256)
+      : Spatializer(sl), mBase(sl), mResolution(resolution),
+        mMaxSources(maxSources) {}
+
+  void compile() override {
+    mBase.compile();
+    mTable.bake(mBase, mSpeakers, mResolution);
+    mSources.assign(mMaxSources, Source());
+    for (auto &source : mSources) {
+      source.gains.assign(mTable.stride(), 0.0f);
+    }
+    mTarget.assign(mTable.stride(), 0.0f);
+    mSampleGains.assign(mTable.stride(), 0.0f);
+  }
+
+  void prepare(AudioIOData &io) override {
+    (void)io;
+    // Forget sources that weren't rendered in the last block
+    size_t rendered = std::min(mSourceIndex, mSources.size());
+    for (size_t i = rendered; i < mActiveSources; i++) {
+      mSources[i].active = false;
+    }
+    mActiveSources = rendered;
+    mSourceIndex = 0;
+  }
+
+  void renderBuffer(AudioIOData &io, const Pose &reldir, const float *samples,
+                    const unsigned int &numFrames) override {
+    Source *source = nullptr;
+    if (mSourceIndex < mSources.size()) {
+      source = &mSources[mSourceIndex];
+    }
+    mSourceIndex++;
+    if (isSilent(samples, numFrames)) {
+      // Nothing to mix. The next sound from this slot starts without a ramp.
+      if (source) {
+        source->active = false;
+      }
+      return;
+    }
+    Vec3d dir = reldir.vec();
+    mTable.lookup(dir, mTarget.data());
+    bool ramp = source && source->active && numFrames > 1 &&
+                continuesSource(source->direction, dir);
+    const int channels = std::min(mTable.channels(), int(io.channelsOut()));
+    for (int c = 0; c < channels; c++) {
+      float start = ramp ? source->gains[c] : mTarget[c];
+      float end = mTarget[c];
+      if (start == 0.0f && end == 0.0f) {
+        continue;
+      }
+      accumulateGainRamp(io.outBuffer(c), samples, start, end, numFrames);
+    }
+    if (source) {
+      std::copy(mTarget.begin(), mTarget.end(), source->gains.begin());
+      source->direction = dir;
+      source->active = true;
+    }
+  }
+
+  void renderSample(AudioIOData &io, const Pose &reldir, const float &sample,
+                    const unsigned int &frameIndex) override {
+    if (frameIndex == 0) {
+      mTable.lookup(reldir.vec(), mSampleGains.data());
+    }
+    const int channels = std::min(mTable.channels(), int(io.channelsOut()));
+    for (int c = 0; c < channels; c++) {
+      io.outBuffer(c)[frameIndex] += mSampleGains[c] * sample;
+    }
+  }
+
+  void print(std::ostream &stream = std::cout) override {
+    stream << "Gain table (" << mResolution << " degrees, "
+           << mTable.bytes() / 1024 << " KiB) baked from:" << std::endl;
+    mBase.print(stream);
+  }
+
+  const GainTable &table() const { return mTable; }
+
+private:
+  struct Source {
+    std::vector<float> gains;
+    Vec3d direction;
+    bool active{false};
+  };
+
+  BaseSpatializer mBase;
+  GainTable mTable;
+  float mResolution;
+  size_t mMaxSources;
+
+  std::vector<Source> mSources;
+  size_t mSourceIndex{0};
+  size_t mActiveSources{0};
+  std::vector<float> mTarget;
+  std::vector<float> mSampleGains;
+};
+
+} // namespace al
+
+#endif // AL_GAINTABLESPATIALIZER_HPP
@@ -0,0 +1,430 @@
+#ifndef AL_MAPPEDSOUNDFILE_HPP
+#define AL_MAPPEDSOUNDFILE_HPP
+
+// Memory mapped reader for uncompressed PCM sound files.
+//
+// Supports WAV (including WAVE_FORMAT_EXTENSIBLE), RF64 and CAF files holding
+// 16, 24 or 32 bit integer or 32/64 bit float samples. The file is mapped into
+// memory and never copied: channel views point directly into the mapping and
+// conversion to float happens when samples are read at mix time. The pages
+// ahead of the read position are requested from the OS with madvise(), so
+// reads don't need to wait on disk and seeking anywhere in the file is
+// instant.
+//
+// Only available on POSIX systems. On other systems open() fails, and
+// openSoundFileReader() falls back to DecodingSoundFile.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define AL_MAPPEDSOUNDFILE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "al_DecodingSoundFile.hpp"
+#include "al_SampleConversion.hpp"
+#include "al_SoundFileReader.hpp"
+
+namespace al {
+
+/**
+ * @brief View of one channel of a memory mapped file
+ */
+struct ChannelView {
+  const uint8_t *base{nullptr}; ///< First sample of the channel
+  size_t stride{0};             ///< Bytes between consecutive frames
+  uint64_t frames{0};
+  SampleFormat format{SampleFormat::NONE};
+  bool bigEndian{false};
+
+  float operator[](uint64_t frame) const {
+    return sample_conversion::readSample(base + frame * stride, format,
+                                         bigEndian);
+  }
+
+  /// Convert count frames starting at frame into dst
+  void read(uint64_t frame, float *dst, size_t count) const {
+    convertToFloatStrided(base + frame * stride, stride, format, bigEndian, dst,
+                          count);
+  }
+};
+
+class MappedSoundFile : public SoundFileReader {
+public:
+  MappedSoundFile() {}
+  MappedSoundFile(std::string fullPath) { open(fullPath); }
+  ~MappedSoundFile() { close(); }
+
+  MappedSoundFile(const MappedSoundFile &) = delete;
+  MappedSoundFile &operator=(const MappedSoundFile &) = delete;
+
+  bool open(std::string fullPath) {
+    close();
+#ifdef AL_MAPPEDSOUNDFILE_MMAP
+    int fd = ::open(fullPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 12) {
+      ::close(fd);
+      return false;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // The mapping keeps its own reference to the file
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    mMap = static_cast<const uint8_t *>(map);
+    mMapSize = static_cast<size_t>(st.st_size);
+
+    if (!parseWav() && !parseCaf()) {
+      close();
+      return false;
+    }
+    madvise(const_cast<uint8_t *>(mMap), mMapSize, MADV_SEQUENTIAL);
+    mAdvisedEnd = 0;
+    adviseAhead(0);
+    return true;
+#else
+    (void)fullPath;
+    return false;
+#endif
+  }
+
+  void close() override {
+#ifdef AL_MAPPEDSOUNDFILE_MMAP
+    if (mMap) {
+      munmap(const_cast<uint8_t *>(mMap), mMapSize);
+    }
+#endif
+    mMap = nullptr;
+    mMapSize = 0;
+    mData = nullptr;
+    mFrames = 0;
+    mChannels = 0;
+    mFormat = SampleFormat::NONE;
+  }
+
+  bool opened() const override { return mData != nullptr; }
+  int channels() const override { return mChannels; }
+  double frameRate() const override { return mFrameRate; }
+  uint64_t frames() const override { return mFrames; }
+
+  SampleFormat sampleFormat() const { return mFormat; }
+  bool bigEndian() const { return mBigEndian; }
+  size_t bytesPerFrame() const { return mFrameBytes; }
+
+  /// Pointer to the first byte of the interleaved sample data
+  const uint8_t *data() const { return mData; }
+
+  ChannelView channel(int index) const {
+    ChannelView view;
+    if (index >= 0 && index < mChannels) {
+      view.base = mData + index * sampleFormatBytes(mFormat);
+      view.stride = mFrameBytes;
+      view.frames = mFrames;
+      view.format = mFormat;
+      view.bigEndian = mBigEndian;
+    }
+    return view;
+  }
+
+  size_t readAt(uint64_t frame, float *buffer, size_t numFrames) override {
+    if (frame >= mFrames) {
+      return 0;
+    }
+    size_t count =
+        static_cast<size_t>(std::min<uint64_t>(numFrames, mFrames - frame));
+    // Interleaved frames are contiguous in the file, so the whole block is
+    // converted in one run.
+    convertToFloat(mData + frame * mFrameBytes, mFormat, mBigEndian, buffer,
+                   count * mChannels);
+    adviseAhead(frame + count);
+    return count;
+  }
+
+  /// Read count frames of one channel starting at frame into dst
+  size_t readChannelAt(int channelIndex, uint64_t frame, float *dst,
+                       size_t count) {
+    if (frame >= mFrames) {
+      return 0;
+    }
+    count = static_cast<size_t>(std::min<uint64_t>(count, mFrames - frame));
+    channel(channelIndex).read(frame, dst, count);
+    adviseAhead(frame + count);
+    return count;
+  }
+
+  /**
+   * @brief Touch the pages for the region so they are resident
+   *
+   * Page faults for this region won't happen in the audio thread after this
+   * returns (unless the OS evicts the pages again).
+   */
+  void prefetch(uint64_t frame, size_t numFrames) override {
+    if (frame >= mFrames) {
+      return;
+    }
+    numFrames =
+        static_cast<size_t>(std::min<uint64_t>(numFrames, mFrames - frame));
+    const uint8_t *start = mData + frame * mFrameBytes;
+    size_t bytes = numFrames * mFrameBytes;
+    advise(start, bytes);
+    volatile uint8_t sink = 0;
+    for (size_t offset = 0; offset < bytes; offset += 4096) {
+      sink = sink + start[offset];
+    }
+  }
+
+  /// Number of frames kept advised ahead of the last read position
+  void readAheadFrames(uint64_t frames) { mReadAheadFrames = frames; }
+
+  std::string formatInfo() const override {
+    std::string info = mContainer + " ";
+    switch (mFormat) {
+    case SampleFormat::INT16:
+      info += "int16";
+      break;
+    case SampleFormat::INT24:
+      info += "int24";
+      break;
+    case SampleFormat::INT32:
+      info += "int32";
+      break;
+    case SampleFormat::FLOAT32:
+      info += "float32";
+      break;
+    case SampleFormat::FLOAT64:
+      info += "float64";
+      break;
+    default:
+      info += "unknown";
+    }
+    return info + (mBigEndian ? " BE (mmap)" : " (mmap)");
+  }
+
+private:
+  static uint16_t le16(const uint8_t *p) { return uint16_t(p[0] | (p[1] << 8)); }
+  static uint32_t le32(const uint8_t *p) {
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) |
+           (uint32_t(p[3]) << 24);
+  }
+  static uint64_t le64(const uint8_t *p) {
+    return uint64_t(le32(p)) | (uint64_t(le32(p + 4)) << 32);
+  }
+  static uint32_t be32(const uint8_t *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+           (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+  }
+  static uint64_t be64(const uint8_t *p) {
+    return (uint64_t(be32(p)) << 32) | be32(p + 4);
+  }
+
+  static SampleFormat pcmFormat(bool isFloat, unsigned bits) {
+    if (isFloat) {
+      return bits == 32 ? SampleFormat::FLOAT32
+                        : (bits == 64 ? SampleFormat::FLOAT64
+                                      : SampleFormat::NONE);
+    }
+    switch (bits) {
+    case 16:
+      return SampleFormat::INT16;
+    case 24:
+      return SampleFormat::INT24;
+    case 32:
+      return SampleFormat::INT32;
+    default:
+      return SampleFormat::NONE;
+    }
+  }
+
+  bool setData(uint64_t offset, uint64_t size) {
+    if (mFormat == SampleFormat::NONE || mChannels <= 0 || mFrameRate <= 0 ||
+        offset > mMapSize) {
+      return false;
+    }
+    mFrameBytes = sampleFormatBytes(mFormat) * mChannels;
+    // Truncated files are common when recordings are interrupted, so clamp
+    // the data size to what is actually in the file.
+    size = std::min<uint64_t>(size, mMapSize - offset);
+    mData = mMap + offset;
+    mFrames = size / mFrameBytes;
+    return true;
+  }
+
+  bool parseWav() {
+    const uint8_t *p = mMap;
+    bool rf64 = std::memcmp(p, "RF64", 4) == 0;
+    if ((!rf64 && std::memcmp(p, "RIFF", 4) != 0) ||
+        std::memcmp(p + 8, "WAVE", 4) != 0) {
+      return false;
+    }
+    uint64_t dataSize64 = 0;
+    bool haveFormat = false;
+    size_t pos = 12;
+    while (pos + 8 <= mMapSize) {
+      const uint8_t *chunk = mMap + pos;
+      uint64_t chunkSize = le32(chunk + 4);
+      const uint8_t *body = chunk + 8;
+      if (std::memcmp(chunk, "ds64", 4) == 0 && pos + 8 + 24 <= mMapSize) {
+        dataSize64 = le64(body + 8);
+      } else if (std::memcmp(chunk, "fmt ", 4) == 0 &&
+                 pos + 8 + 16 <= mMapSize) {
+        uint16_t formatTag = le16(body);
+        mChannels = le16(body + 2);
+        mFrameRate = le32(body + 4);
+        unsigned bits = le16(body + 14);
+        if (formatTag == 0xFFFE && chunkSize >= 40 &&
+            pos + 8 + 40 <= mMapSize) {
+          // WAVE_FORMAT_EXTENSIBLE. The first two bytes of the sub format
+          // GUID hold the actual format tag.
+          formatTag = le16(body + 24);
+        }
+        if (formatTag == 1) {
+          mFormat = pcmFormat(false, bits);
+        } else if (formatTag == 3) {
+          mFormat = pcmFormat(true, bits);
+        } else {
+          std::cerr << "MappedSoundFile: unsupported WAV format " << formatTag
+                    << std::endl;
+          return false;
+        }
+        haveFormat = true;
+      } else if (std::memcmp(chunk, "data", 4) == 0) {
+        if (!haveFormat) {
+          return false;
+        }
+        if (rf64 && chunkSize == 0xFFFFFFFF) {
+          chunkSize = dataSize64;
+        }
+        mContainer = rf64 ? "RF64" : "WAV";
+        mBigEndian = false;
+        return setData(pos + 8, chunkSize);
+      }
+      pos += 8 + chunkSize + (chunkSize & 1); // Chunks are padded to 2 bytes
+    }
+    return false;
+  }
+
+  bool parseCaf() {
+    if (std::memcmp(mMap, "caff", 4) != 0) {
+      return false;
+    }
+    bool haveFormat = false;
+    size_t pos = 8;
+    while (pos + 12 <= mMapSize) {
+      const uint8_t *chunk = mMap + pos;
+      int64_t chunkSize = static_cast<int64_t>(be64(chunk + 4));
+      const uint8_t *body = chunk + 12;
+      if (std::memcmp(chunk, "desc", 4) == 0 && pos + 12 + 32 <= mMapSize) {
+        uint64_t rateBits = be64(body);
+        double rate;
+        std::memcpy(&rate, &rateBits, sizeof(double));
+        mFrameRate = rate;
+        if (std::memcmp(body + 8, "lpcm", 4) != 0) {
+          std::cerr << "MappedSoundFile: CAF file is not linear PCM"
+                    << std::endl;
+          return false;
+        }
+        uint32_t flags = be32(body + 12);
+        mChannels = static_cast<int>(be32(body + 24));
+        unsigned bits = be32(body + 28);
+        mFormat = pcmFormat(flags & 1, bits);
+        mBigEndian = (flags & 2) == 0;
+        haveFormat = true;
+      } else if (std::memcmp(chunk, "data", 4) == 0) {
+        if (!haveFormat) {
+          return false;
+        }
+        // Data starts after the 4 byte edit count. A size of -1 means the
+        // data extends to the end of the file.
+        uint64_t size = chunkSize < 0 ? mMapSize - (pos + 16)
+                                      : static_cast<uint64_t>(chunkSize) - 4;
+        mContainer = "CAF";
+        return setData(pos + 16, size);
+      }
+      if (chunkSize < 0) {
+        return false;
+      }
+      pos += 12 + static_cast<size_t>(chunkSize);
+    }
+    return false;
+  }
+
+  void advise(const uint8_t *start, size_t bytes) {
+#ifdef AL_MAPPEDSOUNDFILE_MMAP
+    // madvise needs a page aligned address
+    const size_t pageSize = 4096;
+    uintptr_t address = reinterpret_cast<uintptr_t>(start);
+    uintptr_t aligned = address & ~(uintptr_t(pageSize) - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(mMap) + mMapSize;
+    bytes = std::min<size_t>(bytes + (address - aligned), end - aligned);
+    madvise(reinterpret_cast<void *>(aligned), bytes, MADV_WILLNEED);
+#else
+    (void)start;
+    (void)bytes;
+#endif
+  }
+
+  // Keep a window of mReadAheadFrames advised ahead of the read position.
+  // The window is only renewed when half of it has been consumed, so the
+  // syscall happens rarely and not on every block.
+  void adviseAhead(uint64_t frame) {
+    if (frame + mReadAheadFrames / 2 < mAdvisedEnd && frame >= mAdvisedStart) {
+      return;
+    }
+    uint64_t end = std::min<uint64_t>(frame + mReadAheadFrames, mFrames);
+    if (end <= frame) {
+      return;
+    }
+    advise(mData + frame * mFrameBytes, (end - frame) * mFrameBytes);
+    mAdvisedStart = frame;
+    mAdvisedEnd = end;
+  }
+
+  const uint8_t *mMap{nullptr};
+  size_t mMapSize{0};
+  const uint8_t *mData{nullptr};
+  size_t mFrameBytes{0};
+  uint64_t mFrames{0};
+  int mChannels{0};
+  double mFrameRate{0.0};
+  SampleFormat mFormat{SampleFormat::NONE};
+  bool mBigEndian{false};
+  std::string mContainer;
+
+  uint64_t mReadAheadFrames{48000 * 4};
+  uint64_t mAdvisedStart{0};
+  uint64_t mAdvisedEnd{0};
+};
+
+/**
+ * @brief Open a sound file for random access reading
+ *
+ * Uncompressed WAV, RF64 and CAF files are memory mapped. Anything else
+ * (FLAC, Ogg, MP3 ...) is decoded in the background by DecoderPool into a
+ * ring of up to ringSeconds.
+ */
+inline std::unique_ptr<SoundFileReader>
+openSoundFileReader(std::string fullPath, double ringSeconds = 10.0) {
+  auto mapped = std::make_unique<MappedSoundFile>();
+  if (mapped->open(fullPath)) {
+    return mapped;
+  }
+  auto decoding = std::make_unique<DecodingSoundFile>(ringSeconds);
+  decoding->open(fullPath);
+  return decoding;
+}
+
+} // namespace al
+
+#endif // AL_MAPPEDSOUNDFILE_HPP
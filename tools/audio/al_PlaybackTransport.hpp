@@ -0,0 +1,281 @@
+#ifndef AL_PLAYBACKTRANSPORT_HPP
+#define AL_PLAYBACKTRANSPORT_HPP
+
+// Shared playhead for a set of SoundFileReaders with non blocking seeking.
+//
+// Seek requests from the GUI are posted to a streaming thread that prefetches
+// the target region of every file. Once all files are ready the audio thread
+// switches to the new position at the start of the next block, crossfading
+// from the old position over a few hundred samples. All files are always read
+// at the same playhead, so they can't drift apart.
+//
+// While no seek is pending the streaming thread keeps the region ahead of the
+// playhead resident, so page faults don't happen on the audio thread.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "al_SoundFileReader.hpp"
+
+namespace al {
+
+class PlaybackTransport {
+public:
+  struct Block {
+    uint64_t position{0};     ///< Frame to read for this block
+    bool crossfade{false};    ///< Block switches position with a crossfade
+    uint64_t fadeFrom{0};     ///< Position to fade out from
+    size_t fadeFrames{0};     ///< Length of the crossfade
+  };
+
+  ~PlaybackTransport() { stop(); }
+
+  /// Add a reader driven by this transport. Call before start().
+  void addReader(SoundFileReader *reader, bool loop) {
+    mReaders.push_back({reader, loop});
+  }
+
+  void start() {
+    if (mRunning) {
+      return;
+    }
+    mRunning = true;
+    mThread = std::thread(&PlaybackTransport::streamingThread, this);
+  }
+
+  void stop() {
+    if (!mRunning) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lk(mMutex);
+      mRunning = false;
+    }
+    mCondition.notify_one();
+    mThread.join();
+  }
+
+  /// Length of crossfade when switching position. Default is 256 frames.
+  void crossfadeFrames(size_t frames) { mCrossfadeFrames = frames; }
+
+  /// Number of frames prefetched at the seek target and ahead of the playhead
+  void prefetchFrames(size_t frames) { mPrefetchFrames = frames; }
+
+  /**
+   * @brief Request a seek to frame. Returns immediately.
+   *
+   * If a seek is already pending, it is replaced by this one.
+   */
+  void requestSeek(uint64_t frame) {
+    {
+      std::unique_lock<std::mutex> lk(mMutex);
+      mRequestedFrame = frame;
+      mRequestTime = std::chrono::steady_clock::now();
+      mRequestPending = true;
+      mRequestId++;
+    }
+    mCondition.notify_one();
+  }
+
+  /**
+   * @brief Request a seek relative to the current position
+   *
+   * Relative to the pending seek target if there is one, so repeated requests
+   * accumulate even if they come in faster than they are served.
+   */
+  void requestRelativeSeek(int64_t frames) {
+    uint64_t base;
+    {
+      std::unique_lock<std::mutex> lk(mMutex);
+      base = seekPending() ? mRequestedFrame : mPlayhead.load();
+    }
+    if (frames < 0 && uint64_t(-frames) > base) {
+      requestSeek(0);
+    } else {
+      requestSeek(base + frames);
+    }
+  }
+
+  uint64_t playhead() const { return mPlayhead; }
+  bool seekPending() const { return mRequestId != mSwitchedId; }
+
+  /// Time from the last seek request to the switch in the audio thread
+  double lastSeekLatencyMs() const { return mLastLatencyMs; }
+  /// Time the streaming thread took to prefetch for the last seek
+  double lastPrefetchMs() const { return mLastPrefetchMs; }
+
+  /**
+   * @brief Start processing a block in the audio thread
+   *
+   * Must be followed by a call to endBlock() after the files have been read.
+   */
+  Block beginBlock(size_t frames) {
+    Block block;
+    block.position = mPlayhead;
+    uint32_t ready = mReadySeek.load(std::memory_order_acquire);
+    if (ready != mConsumedSeek) {
+      mConsumedSeek = ready;
+      block.crossfade = true;
+      block.fadeFrom = block.position;
+      block.fadeFrames = std::min(mCrossfadeFrames, frames);
+      block.position = mReadyFrame;
+      auto latency = std::chrono::steady_clock::now() - mReadyRequestTime;
+      mLastLatencyMs =
+          std::chrono::duration<double, std::milli>(latency).count();
+      mSwitchedSeek.store(ready, std::memory_order_release);
+      mSwitchedId = mReadyId;
+    }
+    mBlockPosition = block.position;
+    return block;
+  }
+
+  void endBlock(size_t frames) { mPlayhead = mBlockPosition + frames; }
+
+  /// Apply a pending seek while the audio thread is not reading any files
+  void idleBlock() {
+    beginBlock(0);
+    endBlock(0);
+  }
+
+  /// Position within reader for a transport position, wrapping looped files
+  static uint64_t readerPosition(const SoundFileReader &reader, bool loop,
+                                 uint64_t position) {
+    if (loop && reader.frames() > 0) {
+      return position % reader.frames();
+    }
+    return position;
+  }
+
+  /**
+   * @brief Crossfade interleaved buffers in place
+   *
+   * dest holds the new material and is faded in over fadeFrames while
+   * previous is faded out.
+   */
+  static void crossfade(float *dest, const float *previous, int channels,
+                        size_t fadeFrames) {
+    if (fadeFrames == 0) {
+      return;
+    }
+    const float increment = 1.0f / fadeFrames;
+    float gain = 0.0f;
+    for (size_t frame = 0; frame < fadeFrames; frame++) {
+      for (int c = 0; c < channels; c++) {
+        size_t index = frame * channels + c;
+        dest[index] = previous[index] + gain * (dest[index] - previous[index]);
+      }
+      gain += increment;
+    }
+  }
+
+private:
+  struct ReaderEntry {
+    SoundFileReader *reader;
+    bool loop;
+  };
+
+  void prefetchAll(uint64_t position) {
+    for (auto &entry : mReaders) {
+      entry.reader->prefetch(
+          readerPosition(*entry.reader, entry.loop, position), mPrefetchFrames);
+    }
+  }
+
+  void streamingThread() {
+    // Refills run every 100 ms on absolute deadlines, so the time they take
+    // doesn't add up. Seek requests wake the thread early.
+    const auto period = std::chrono::milliseconds(100);
+    auto deadline = std::chrono::steady_clock::now() + period;
+    std::unique_lock<std::mutex> lk(mMutex);
+    while (mRunning) {
+      if (!mRequestPending) {
+        mCondition.wait_until(lk, deadline);
+      }
+      const auto now = std::chrono::steady_clock::now();
+      if (now >= deadline) {
+        deadline += period;
+        if (deadline <= now) {
+          deadline = now + period; // Fell behind: don't refill in a burst
+        }
+      }
+      if (!mRunning) {
+        break;
+      }
+      if (mRequestPending) {
+        uint64_t target = mRequestedFrame;
+        auto requestTime = mRequestTime;
+        uint32_t requestId = mRequestId;
+        mRequestPending = false;
+        lk.unlock();
+        auto prefetchStart = std::chrono::steady_clock::now();
+        prefetchAll(target);
+        mLastPrefetchMs = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - prefetchStart)
+                              .count();
+        lk.lock();
+        if (mRequestPending) {
+          continue; // Superseded while prefetching
+        }
+        mReadyFrame = target;
+        mReadyRequestTime = requestTime;
+        mReadyId = requestId;
+        uint32_t seekIndex = mReadySeek.load() + 1;
+        mReadySeek.store(seekIndex, std::memory_order_release);
+        // mReadyFrame can't be replaced until the audio thread has switched
+        lk.unlock();
+        while (mSwitchedSeek.load(std::memory_order_acquire) != seekIndex &&
+               mRunning) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        lk.lock();
+      } else {
+        // Keep the region ahead of the playhead resident
+        uint64_t position = mPlayhead;
+        lk.unlock();
+        prefetchAll(position);
+        lk.lock();
+      }
+    }
+  }
+
+  std::vector<ReaderEntry> mReaders;
+
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::atomic<bool> mRunning{false};
+
+  // Written with mMutex held
+  uint64_t mRequestedFrame{0};
+  std::chrono::steady_clock::time_point mRequestTime;
+  bool mRequestPending{false};
+  std::atomic<uint32_t> mRequestId{0};
+
+  // Written by streaming thread before publishing through mReadySeek
+  uint64_t mReadyFrame{0};
+  std::chrono::steady_clock::time_point mReadyRequestTime;
+  uint32_t mReadyId{0};
+  std::atomic<uint32_t> mReadySeek{0};
+  std::atomic<uint32_t> mSwitchedSeek{0};
+
+  // Audio thread
+  uint32_t mConsumedSeek{0};
+  std::atomic<uint32_t> mSwitchedId{0};
+  uint64_t mBlockPosition{0};
+  std::atomic<uint64_t> mPlayhead{0};
+  std::atomic<double> mLastLatencyMs{0.0};
+  std::atomic<double> mLastPrefetchMs{0.0};
+
+  size_t mCrossfadeFrames{256};
+  size_t mPrefetchFrames{48000};
+};
+
+} // namespace al
+
+#endif // AL_PLAYBACKTRANSPORT_HPP
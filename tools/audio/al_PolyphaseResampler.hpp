@@ -0,0 +1,339 @@
+#ifndef AL_POLYPHASERESAMPLER_HPP
+#define AL_POLYPHASERESAMPLER_HPP
+
+// Polyphase sample rate converter for multichannel streams.
+//
+// The ratio between the two rates is reduced to a fraction and a windowed
+// sinc filter is precomputed for every phase of it, so each output sample is a
+// single dot product over the filter taps (SSE when available). Common rate
+// pairs like 44.1 <-> 48 kHz are exact. Ratios needing more than
+// kMaxPhases phases use the nearest of kMaxPhases phases.
+//
+// Input is pushed interleaved and kept deinterleaved per channel, so the dot
+// products read contiguous memory. Input and output positions are absolute
+// frame numbers, so a stream can be restarted at any output frame with
+// reset().
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#define AL_POLYPHASERESAMPLER_SSE 1
+#include <xmmintrin.h>
+#endif
+
+namespace al {
+
+enum class ResamplerQuality {
+  FAST,     ///< 8 taps. Audible aliasing on bright material.
+  STANDARD, ///< 32 taps
+  HIGH      ///< 64 taps
+};
+
+inline std::string toString(ResamplerQuality quality) {
+  switch (quality) {
+  case ResamplerQuality::FAST:
+    return "fast";
+  case ResamplerQuality::STANDARD:
+    return "standard";
+  case ResamplerQuality::HIGH:
+    return "high";
+  }
+  return "";
+}
+
+/// "fast", "standard" or "high". Anything else gives STANDARD.
+inline ResamplerQuality resamplerQualityFromString(const std::string &name) {
+  if (name == "fast") {
+    return ResamplerQuality::FAST;
+  } else if (name == "high") {
+    return ResamplerQuality::HIGH;
+  }
+  return ResamplerQuality::STANDARD;
+}
+
+class PolyphaseResampler {
+public:
+  static const uint64_t kMaxPhases = 1024;
+
+  /**
+   * @brief Prepare for conversion
+   * @param historyFrames input frames that can be buffered per channel
+   *
+   * Allocates, so call outside the audio thread.
+   */
+  void setup(double inRate, double outRate, int channels,
+             ResamplerQuality quality = ResamplerQuality::STANDARD,
+             size_t historyFrames = 8192) {
+    mChannels = channels;
+    mQuality = quality;
+    uint64_t in = uint64_t(std::llround(inRate));
+    uint64_t out = uint64_t(std::llround(outRate));
+    uint64_t divisor = gcd(in, out);
+    mInStep = in / divisor;
+    mOutStep = out / divisor;
+    mPhases = std::min(mOutStep, uint64_t(kMaxPhases));
+
+    switch (quality) {
+    case ResamplerQuality::FAST:
+      mTaps = 8;
+      break;
+    case ResamplerQuality::STANDARD:
+      mTaps = 32;
+      break;
+    case ResamplerQuality::HIGH:
+      mTaps = 64;
+      break;
+    }
+    computeFilters(double(out) / double(in));
+
+    mHistoryFrames = std::max(historyFrames, size_t(mTaps) * 4);
+    mHistory.assign(mHistoryFrames * mChannels, 0.0f);
+    reset(0);
+  }
+
+  /**
+   * @brief Restart the stream at output frame outputFrame
+   * @return first input frame to push. Can be negative at the start of the
+   * stream, where the input should be silence.
+   */
+  int64_t reset(uint64_t outputFrame) {
+    mOutputFrame = outputFrame;
+    mAccumulator = outputFrame * mInStep;
+    mBase = firstTap();
+    mFilled = 0;
+    return mBase;
+  }
+
+  /// Input frame the next push() must start at
+  int64_t nextInputFrame() const { return mBase + int64_t(mFilled); }
+  /// Output frame the next pull() produces
+  uint64_t nextOutputFrame() const { return mOutputFrame; }
+
+  /// Number of input frames push() can take
+  size_t inputSpace() {
+    compact();
+    return mHistoryFrames - mFilled;
+  }
+
+  /**
+   * @brief Add interleaved input frames
+   * @return frames taken, which can be less than numFrames if the history is
+   * full
+   */
+  size_t push(const float *interleaved, size_t numFrames) {
+    numFrames = std::min(numFrames, inputSpace());
+    for (int c = 0; c < mChannels; c++) {
+      float *dest = mHistory.data() + c * mHistoryFrames + mFilled;
+      const float *src = interleaved + c;
+      for (size_t i = 0; i < numFrames; i++) {
+        dest[i] = src[i * mChannels];
+      }
+    }
+    mFilled += numFrames;
+    return numFrames;
+  }
+
+  /// Add numFrames frames of silence
+  size_t pushSilence(size_t numFrames) {
+    numFrames = std::min(numFrames, inputSpace());
+    for (int c = 0; c < mChannels; c++) {
+      std::fill_n(mHistory.data() + c * mHistoryFrames + mFilled, numFrames,
+                  0.0f);
+    }
+    mFilled += numFrames;
+    return numFrames;
+  }
+
+  /**
+   * @brief Produce up to numFrames interleaved output frames
+   * @return number of frames written. Less than numFrames when more input is
+   * needed.
+   */
+  size_t pull(float *interleaved, size_t numFrames) {
+    size_t done = 0;
+    const int64_t end = mBase + int64_t(mFilled);
+    while (done < numFrames) {
+      int64_t first = firstTap();
+      if (first + int64_t(mTaps) > end) {
+        break;
+      }
+      const float *filter = mFilters.data() + phase() * mTaps;
+      const float *history = mHistory.data() + (first - mBase);
+      float *out = interleaved + done * mChannels;
+      for (int c = 0; c < mChannels; c++) {
+        out[c] = dot(filter, history + c * mHistoryFrames, mTaps);
+      }
+      mAccumulator += mInStep;
+      mOutputFrame++;
+      done++;
+    }
+    return done;
+  }
+
+  int channels() const { return mChannels; }
+  int taps() const { return mTaps; }
+  uint64_t phases() const { return mPhases; }
+  ResamplerQuality quality() const { return mQuality; }
+  /// Output frames per input frame
+  double ratio() const { return double(mOutStep) / double(mInStep); }
+
+  /// Input frame position of output frame (exact for rational ratios)
+  double inputPosition(uint64_t outputFrame) const {
+    return double(outputFrame) * mInStep / mOutStep;
+  }
+
+private:
+  static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+      uint64_t t = a % b;
+      a = b;
+      b = t;
+    }
+    return a == 0 ? 1 : a;
+  }
+
+  // Zeroth order modified Bessel function for the Kaiser window
+  static double besselI0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 30; k++) {
+      term *= (x / (2.0 * k)) * (x / (2.0 * k));
+      sum += term;
+    }
+    return sum;
+  }
+
+  void computeFilters(double ratio) {
+    double rolloff = 0.95;
+    double beta = 10.0;
+    if (mQuality == ResamplerQuality::FAST) {
+      rolloff = 0.85;
+      beta = 5.0;
+    } else if (mQuality == ResamplerQuality::STANDARD) {
+      rolloff = 0.91;
+      beta = 8.0;
+    }
+    // Cutoff relative to the input Nyquist frequency. Lowered when
+    // downsampling to filter out what the output rate can't represent.
+    const double cutoff = std::min(1.0, ratio) * rolloff;
+    const double halfLength = mTaps / 2.0;
+    const double normalization = besselI0(beta);
+    mFilters.resize(mPhases * mTaps);
+    for (uint64_t p = 0; p < mPhases; p++) {
+      const double fraction = double(p) / mPhases;
+      float *filter = mFilters.data() + p * mTaps;
+      double sum = 0.0;
+      for (int k = 0; k < mTaps; k++) {
+        double distance = k - (halfLength - 1.0) - fraction;
+        double x = cutoff * distance;
+        double sinc = x == 0.0 ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+        double w = distance / halfLength;
+        double window =
+            std::abs(w) >= 1.0
+                ? 0.0
+                : besselI0(beta * std::sqrt(1.0 - w * w)) / normalization;
+        filter[k] = float(sinc * window);
+        sum += filter[k];
+      }
+      for (int k = 0; k < mTaps; k++) {
+        filter[k] = float(filter[k] / sum);
+      }
+    }
+  }
+
+  // First input frame under the filter for the current output frame
+  int64_t firstTap() const {
+    uint64_t index = mAccumulator / mOutStep;
+    if (phaseRoundsUp()) {
+      index++;
+    }
+    return int64_t(index) - (mTaps / 2 - 1);
+  }
+
+  // With fewer phases than mOutStep the nearest phase can be the next input
+  // frame's phase 0
+  bool phaseRoundsUp() const {
+    uint64_t remainder = mAccumulator % mOutStep;
+    return (remainder * mPhases + mOutStep / 2) / mOutStep == mPhases;
+  }
+
+  uint64_t phase() const {
+    uint64_t remainder = mAccumulator % mOutStep;
+    uint64_t p = (remainder * mPhases + mOutStep / 2) / mOutStep;
+    return p == mPhases ? 0 : p;
+  }
+
+  // Drop history no longer needed by the filter
+  void compact() {
+    int64_t consumed = firstTap() - mBase;
+    if (consumed <= 0) {
+      return;
+    }
+    size_t drop = std::min(size_t(consumed), mFilled);
+    if (drop < mHistoryFrames / 2 && mFilled < mHistoryFrames) {
+      return; // Not worth moving yet
+    }
+    for (int c = 0; c < mChannels; c++) {
+      float *channel = mHistory.data() + c * mHistoryFrames;
+      std::memmove(channel, channel + drop, (mFilled - drop) * sizeof(float));
+    }
+    mFilled -= drop;
+    mBase += int64_t(drop);
+  }
+
+  static float dot(const float *a, const float *b, int count) {
+#ifdef AL_POLYPHASERESAMPLER_SSE
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+      sum0 = _mm_add_ps(sum0,
+                        _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+      sum1 = _mm_add_ps(
+          sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    __m128 sum = _mm_add_ps(sum0, sum1);
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+    float result = _mm_cvtss_f32(sum);
+    for (; i < count; i++) {
+      result += a[i] * b[i];
+    }
+    return result;
+#else
+    float result = 0.0f;
+    for (int i = 0; i < count; i++) {
+      result += a[i] * b[i];
+    }
+    return result;
+#endif
+  }
+
+  int mChannels{0};
+  ResamplerQuality mQuality{ResamplerQuality::STANDARD};
+  int mTaps{32};
+  uint64_t mInStep{1};
+  uint64_t mOutStep{1};
+  uint64_t mPhases{1};
+  std::vector<float> mFilters; // mPhases x mTaps
+
+  // Input history, one block of mHistoryFrames per channel. Holds input
+  // frames mBase to mBase + mFilled.
+  std::vector<float> mHistory;
+  size_t mHistoryFrames{0};
+  int64_t mBase{0};
+  size_t mFilled{0};
+
+  // Input position of the next output frame is mAccumulator / mOutStep
+  uint64_t mAccumulator{0};
+  uint64_t mOutputFrame{0};
+};
+
+} // namespace al
+
+#endif // AL_POLYPHASERESAMPLER_HPP
@@ -0,0 +1,248 @@
+#ifndef AL_RESAMPLINGREADER_HPP
+#define AL_RESAMPLINGREADER_HPP
+
+// SoundFileReader that converts another reader to a different sample rate.
+//
+// Conversion is done in prefetch(), which PlaybackTransport calls from its
+// streaming thread, into a ring of converted frames ahead of the playhead.
+// readAt() in the audio thread only copies from the ring. There are two
+// rings: after a seek the target is converted into the spare ring while the
+// audio thread can still read (and crossfade from) the old position.
+//
+// Looping files are converted across the loop point without restarting the
+// filter, so the loop is seamless.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "al_PolyphaseResampler.hpp"
+#include "al_SoundFileReader.hpp"
+
+namespace al {
+
+class ResamplingReader : public SoundFileReader {
+public:
+  /**
+   * @param source reader to convert. Owned by this reader.
+   * @param ringSeconds seconds of converted audio each ring holds. Must be
+   * more than the transport's prefetch length.
+   */
+  ResamplingReader(std::unique_ptr<SoundFileReader> source, double frameRate,
+                   ResamplerQuality quality, bool loop,
+                   double ringSeconds = 4.0)
+      : mSource(std::move(source)), mFrameRate(frameRate), mLoop(loop) {
+    mChannels = mSource->channels();
+    mResampler.setup(mSource->frameRate(), frameRate, mChannels, quality);
+    mFrames = uint64_t(mSource->frames() * mResampler.ratio());
+    mRingFrames = size_t(ringSeconds * frameRate);
+    for (auto &ring : mRings) {
+      ring.data.resize(mRingFrames * mChannels);
+    }
+    mSourceBuffer.resize(kChunkFrames * mChannels);
+    mOutputBuffer.resize(kChunkFrames * mChannels);
+  }
+
+  bool opened() const override { return mSource->opened(); }
+  void close() override { mSource->close(); }
+
+  int channels() const override { return mChannels; }
+  double frameRate() const override { return mFrameRate; }
+  uint64_t frames() const override { return mFrames; }
+
+  /**
+   * @brief Copy converted frames
+   *
+   * Returns 0 frames if frame has not been converted yet. Frames of a looping
+   * file continue past the loop point, so the caller doesn't need to wrap.
+   */
+  size_t readAt(uint64_t frame, float *buffer, size_t numFrames) override {
+    for (auto &ring : mRings) {
+      uint32_t version = ring.version.load(std::memory_order_acquire);
+      uint64_t position = locate(ring, frame);
+      if (position == kInvalid) {
+        continue;
+      }
+      mReadFrame = position;
+      uint64_t end = ring.end.load(std::memory_order_acquire);
+      size_t count = size_t(std::min<uint64_t>(numFrames, end - position));
+      for (size_t i = 0; i < count;) {
+        size_t index = size_t((position + i) % mRingFrames);
+        size_t run = std::min(count - i, mRingFrames - index);
+        std::copy_n(ring.data.data() + index * mChannels, run * mChannels,
+                    buffer + i * mChannels);
+        i += run;
+      }
+      // Discard the copy if the ring was restarted or overwritten meanwhile
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (ring.version.load(std::memory_order_relaxed) != version ||
+          ring.start.load(std::memory_order_relaxed) > position) {
+        mUnderruns++;
+        return 0;
+      }
+      if (count < numFrames && (mLoop || position + count < mFrames)) {
+        mUnderruns++;
+      }
+      return count;
+    }
+    mUnderruns++;
+    return 0;
+  }
+
+  /// Convert numFrames frames from frame on. Call from a non realtime thread.
+  void prefetch(uint64_t frame, size_t numFrames) override {
+    numFrames = std::min(numFrames, mRingFrames - size_t(kChunkFrames));
+    Ring *ring = &mRings[mActive];
+    uint64_t position = locate(*ring, frame, true);
+    if (position == kInvalid || ring->end == 0) {
+      // Seek. Restart the filter at frame in the spare ring, leaving the
+      // active ring readable until the audio thread has switched.
+      mActive = 1 - mActive;
+      ring = &mRings[mActive];
+      restart(*ring, frame);
+      position = frame;
+    }
+    fill(*ring, position + numFrames);
+  }
+
+  std::string formatInfo() const override {
+    return mSource->formatInfo() + ", resampled from " +
+           std::to_string(int(mSource->frameRate())) + " (" +
+           toString(mResampler.quality()) + ")";
+  }
+
+  SoundFileReader *source() { return mSource.get(); }
+  uint32_t underruns() const { return mUnderruns; }
+
+private:
+  static const size_t kChunkFrames = 1024;
+  static constexpr uint64_t kInvalid = std::numeric_limits<uint64_t>::max();
+
+  // Converted frames start to end, in output frames that keep counting past
+  // the loop point for looping files
+  struct Ring {
+    std::vector<float> data;
+    std::atomic<uint64_t> start{0};
+    std::atomic<uint64_t> end{0};
+    std::atomic<uint32_t> version{0};
+  };
+
+  // Position in the ring holding frame, or kInvalid. With includeEnd the
+  // position right after the last converted frame is also found.
+  uint64_t locate(const Ring &ring, uint64_t frame,
+                  bool includeEnd = false) const {
+    uint64_t start = ring.start.load(std::memory_order_acquire);
+    uint64_t end = ring.end.load(std::memory_order_acquire);
+    if (mLoop && mFrames > 0 && frame < start) {
+      frame += (start - frame + mFrames - 1) / mFrames * mFrames;
+    }
+    if (frame >= start && (frame < end || (includeEnd && frame == end))) {
+      return frame;
+    }
+    return kInvalid;
+  }
+
+  void restart(Ring &ring, uint64_t frame) {
+    ring.version.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_release);
+    ring.start.store(frame, std::memory_order_release);
+    ring.end.store(frame, std::memory_order_release);
+    mSourceFrame = mResampler.reset(frame);
+  }
+
+  void fill(Ring &ring, uint64_t until) {
+    if (!mLoop) {
+      until = std::min(until, mFrames);
+    }
+    // Don't overwrite frames the audio thread hasn't read yet
+    uint64_t start = ring.start.load(std::memory_order_relaxed);
+    uint64_t readFrame = mReadFrame;
+    uint64_t floor = readFrame >= start ? readFrame : start;
+    until = std::min(until, floor + mRingFrames);
+
+    uint64_t end = ring.end.load(std::memory_order_relaxed);
+    while (end < until) {
+      size_t count = std::min(size_t(until - end), size_t(kChunkFrames));
+      count = std::min(count, size_t(mRingFrames - end % mRingFrames));
+      size_t converted = mResampler.pull(mOutputBuffer.data(), count);
+      if (converted == 0) {
+        if (!readSource()) {
+          break; // Source not ready
+        }
+        continue;
+      }
+      uint64_t newEnd = end + converted;
+      if (newEnd > start + mRingFrames) {
+        start = newEnd - mRingFrames;
+        ring.start.store(start, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_release);
+      }
+      std::copy_n(mOutputBuffer.data(), converted * mChannels,
+                  ring.data.data() + (end % mRingFrames) * mChannels);
+      end = newEnd;
+      ring.end.store(end, std::memory_order_release);
+    }
+  }
+
+  // Push the next chunk of source frames into the resampler
+  bool readSource() {
+    size_t count = std::min(size_t(kChunkFrames), mResampler.inputSpace());
+    if (count == 0) {
+      return false;
+    }
+    const int64_t sourceFrames = int64_t(mSource->frames());
+    if (mSourceFrame < 0) {
+      // Silence before the start of the file
+      count = std::min<size_t>(count, size_t(-mSourceFrame));
+      mResampler.pushSilence(count);
+      mSourceFrame += count;
+      return true;
+    }
+    if (mSourceFrame >= sourceFrames && !mLoop) {
+      mResampler.pushSilence(count);
+      mSourceFrame += count;
+      return true;
+    }
+    uint64_t position = uint64_t(mSourceFrame);
+    if (mLoop && sourceFrames > 0) {
+      position %= uint64_t(sourceFrames);
+    }
+    count = size_t(std::min<uint64_t>(count, sourceFrames - position));
+    mSource->prefetch(position, count);
+    size_t read = mSource->readAt(position, mSourceBuffer.data(), count);
+    if (read == 0) {
+      return false;
+    }
+    mResampler.push(mSourceBuffer.data(), read);
+    mSourceFrame += read;
+    return true;
+  }
+
+  std::unique_ptr<SoundFileReader> mSource;
+  double mFrameRate;
+  bool mLoop;
+  int mChannels{0};
+  uint64_t mFrames{0};
+
+  // Streaming thread
+  PolyphaseResampler mResampler;
+  int64_t mSourceFrame{0}; // Next source frame to push, without loop wrapping
+  std::vector<float> mSourceBuffer;
+  std::vector<float> mOutputBuffer;
+  int mActive{0};
+
+  Ring mRings[2];
+  size_t mRingFrames{0};
+
+  // Audio thread
+  std::atomic<uint64_t> mReadFrame{0};
+  std::atomic<uint32_t> mUnderruns{0};
+};
+
+} // namespace al
+
+#endif // AL_RESAMPLINGREADER_HPP
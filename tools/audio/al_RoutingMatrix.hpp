@@ -0,0 +1,189 @@
+#ifndef AL_ROUTINGMATRIX_HPP
+#define AL_ROUTINGMATRIX_HPP
+
+// Sparse gain matrix from the channels of a set of inputs (e.g. sound files)
+// to output channels.
+//
+// Each input block is given interleaved. The channels that have routes are
+// deinterleaved once into contiguous scratch buffers and every route is then
+// a single SIMD multiply-accumulate into its output channel. Gain changes,
+// including mute and unmute, are ramped per route over rampFrames() so they
+// don't click. Routes that are silent and not ramping cost nothing.
+//
+// Gains and mutes can be set from any thread. Routes and inputs must be added
+// before audio processing starts.
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#define AL_ROUTINGMATRIX_SSE 1
+#include <xmmintrin.h>
+#endif
+
+namespace al {
+
+class RoutingMatrix {
+public:
+  /// @param maxFrames largest block deinterleaved at once
+  RoutingMatrix(size_t maxFrames = 2048) : mMaxFrames(maxFrames) {}
+
+  /// Add an input with channels channels. Returns the input index.
+  int addInput(int channels) {
+    mInputs.emplace_back(new Input);
+    mInputs.back()->channels = channels;
+    mScratch.resize(std::max(mScratch.size(), channels * mMaxFrames));
+    return int(mInputs.size()) - 1;
+  }
+
+  /// Route inChannel of input to outChannel. Returns the route index.
+  int addRoute(int input, int inChannel, int outChannel, float gain = 1.0f) {
+    auto &in = *mInputs[input];
+    in.routes.emplace_back(new Route);
+    auto &route = *in.routes.back();
+    route.inChannel = inChannel;
+    route.outChannel = outChannel;
+    route.gain = gain;
+    route.current = route.target = gain * in.gain;
+    if (std::find(in.usedChannels.begin(), in.usedChannels.end(), inChannel) ==
+        in.usedChannels.end()) {
+      in.usedChannels.push_back(inChannel);
+    }
+    return int(in.routes.size()) - 1;
+  }
+
+  /// Length of gain ramps. Default is 512 frames.
+  void rampFrames(size_t frames) { mRampFrames = std::max(size_t(1), frames); }
+
+  void setRouteGain(int input, int route, float gain) {
+    mInputs[input]->routes[route]->gain = gain;
+  }
+  /// Gain applied to all routes of input
+  void setInputGain(int input, float gain) { mInputs[input]->gain = gain; }
+  void setInputMute(int input, bool mute) { mInputs[input]->mute = mute; }
+  bool inputMute(int input) const { return mInputs[input]->mute; }
+
+  /**
+   * @brief Mix one block of input into the output channels
+   * @param interleaved frames * channels samples
+   * @param outputs one buffer of at least frames samples per output channel
+   *
+   * Adds to the outputs. Call once per block for every input, from the audio
+   * thread.
+   */
+  void mix(int input, const float *interleaved, size_t frames,
+           float *const *outputs) {
+    auto &in = *mInputs[input];
+    const float inputGain = in.mute ? 0.0f : in.gain.load();
+    bool active = false;
+    for (auto &route : in.routes) {
+      float target = route->gain * inputGain;
+      if (target != route->target) {
+        route->target = target;
+        route->rampRemaining = mRampFrames;
+        route->rampStep = (target - route->current) / mRampFrames;
+      }
+      active |= route->current != 0.0f || route->rampRemaining > 0;
+    }
+    if (!active) {
+      return;
+    }
+    for (size_t offset = 0; offset < frames; offset += mMaxFrames) {
+      size_t count = std::min(mMaxFrames, frames - offset);
+      deinterleave(in, interleaved + offset * in.channels, count);
+      for (auto &route : in.routes) {
+        const float *source = mScratch.data() + route->inChannel * mMaxFrames;
+        float *dest = outputs[route->outChannel] + offset;
+        size_t done = 0;
+        if (route->rampRemaining > 0) {
+          done = std::min(count, route->rampRemaining);
+          accumulateRamp(dest, source, route->current, route->rampStep, done);
+          route->rampRemaining -= done;
+          route->current = route->rampRemaining > 0
+                               ? route->current + route->rampStep * done
+                               : route->target;
+        }
+        if (route->current != 0.0f && done < count) {
+          accumulate(dest + done, source + done, route->current, count - done);
+        }
+      }
+    }
+  }
+
+private:
+  struct Route {
+    int inChannel{0};
+    int outChannel{0};
+    std::atomic<float> gain{1.0f};
+    // Audio thread
+    float current{0.0f};
+    float target{0.0f};
+    float rampStep{0.0f};
+    size_t rampRemaining{0};
+  };
+
+  struct Input {
+    int channels{0};
+    std::atomic<float> gain{1.0f};
+    std::atomic<bool> mute{false};
+    std::vector<std::unique_ptr<Route>> routes;
+    std::vector<int> usedChannels;
+  };
+
+  void deinterleave(const Input &in, const float *interleaved, size_t frames) {
+    const int channels = in.channels;
+    for (int channel : in.usedChannels) {
+      float *dest = mScratch.data() + channel * mMaxFrames;
+      const float *src = interleaved + channel;
+      for (size_t i = 0; i < frames; i++) {
+        dest[i] = src[i * channels];
+      }
+    }
+  }
+
+  static void accumulate(float *dest, const float *src, float gain,
+                         size_t count) {
+    size_t i = 0;
+#ifdef AL_ROUTINGMATRIX_SSE
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i + 4 <= count; i += 4) {
+      __m128 sum = _mm_add_ps(_mm_loadu_ps(dest + i),
+                              _mm_mul_ps(_mm_loadu_ps(src + i), g));
+      _mm_storeu_ps(dest + i, sum);
+    }
+#endif
+    for (; i < count; i++) {
+      dest[i] += gain * src[i];
+    }
+  }
+
+  static void accumulateRamp(float *dest, const float *src, float gain,
+                             float step, size_t count) {
+    size_t i = 0;
+#ifdef AL_ROUTINGMATRIX_SSE
+    __m128 g = _mm_setr_ps(gain, gain + step, gain + 2 * step, gain + 3 * step);
+    const __m128 increment = _mm_set1_ps(4 * step);
+    for (; i + 4 <= count; i += 4) {
+      __m128 sum = _mm_add_ps(_mm_loadu_ps(dest + i),
+                              _mm_mul_ps(_mm_loadu_ps(src + i), g));
+      _mm_storeu_ps(dest + i, sum);
+      g = _mm_add_ps(g, increment);
+    }
+#endif
+    for (; i < count; i++) {
+      dest[i] += (gain + step * i) * src[i];
+    }
+  }
+
+  std::vector<std::unique_ptr<Input>> mInputs;
+  std::vector<float> mScratch; // One block of mMaxFrames per channel
+  size_t mMaxFrames;
+  size_t mRampFrames{512};
+};
+
+} // namespace al
+
+#endif // AL_ROUTINGMATRIX_HPP
@@ -0,0 +1,272 @@
+#ifndef AL_SAMPLECACHE_HPP
+#define AL_SAMPLECACHE_HPP
+
+// Process wide cache of decoded sample files.
+//
+// Voices that play back the same file share a single copy of the audio. The
+// cache is keyed by path and sample rate, and entries are reference counted:
+// they stay resident while any CachedSamplePlayer uses them and are released
+// when the last one goes away. Small files are decoded to float in memory,
+// large uncompressed files are memory mapped and converted while playing.
+//
+// A CachedSamplePlayer is only a playback cursor into the shared data, so it
+// is cheap to have one per voice.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "al/sound/al_SoundFile.hpp"
+
+#include "al_MappedSoundFile.hpp"
+
+namespace al {
+
+/**
+ * @brief Decoded or mapped audio shared between players
+ */
+class CachedSample {
+public:
+  int channels() const { return mChannels; }
+  double frameRate() const { return mFrameRate; }
+  uint64_t frames() const { return mFrames; }
+  bool mapped() const { return mMapped != nullptr; }
+  bool valid() const { return mFrames > 0; }
+
+  /// Approximate memory held by this sample. 0 for mapped files.
+  size_t residentBytes() const { return mData.size() * sizeof(float); }
+
+  /**
+   * @brief Copy interleaved frames starting at frame into buffer
+   * @return number of frames copied
+   *
+   * Const and without internal state, so any number of players can read
+   * concurrently.
+   */
+  size_t read(uint64_t frame, float *buffer, size_t numFrames) const {
+    if (frame >= mFrames) {
+      return 0;
+    }
+    size_t count =
+        static_cast<size_t>(std::min<uint64_t>(numFrames, mFrames - frame));
+    if (mMapped) {
+      convertToFloat(mMapped->data() + frame * mMapped->bytesPerFrame(),
+                     mMapped->sampleFormat(), mMapped->bigEndian(), buffer,
+                     count * mChannels);
+    } else {
+      std::copy(mData.begin() + frame * mChannels,
+                mData.begin() + (frame + count) * mChannels, buffer);
+    }
+    return count;
+  }
+
+private:
+  friend class SampleCache;
+
+  std::vector<float> mData;
+  std::unique_ptr<MappedSoundFile> mMapped;
+  int mChannels{0};
+  double mFrameRate{0.0};
+  uint64_t mFrames{0};
+};
+
+class SampleCache {
+public:
+  static SampleCache &instance() {
+    static SampleCache cache;
+    return cache;
+  }
+
+  /**
+   * @brief Get a file from the cache, loading it if needed
+   * @param sampleRate rate to convert the file to. 0 keeps the file rate.
+   * @return nullptr if the file could not be loaded
+   *
+   * Loading happens in the calling thread, so the first request for a file
+   * should not be made from the audio thread.
+   */
+  std::shared_ptr<const CachedSample> get(const std::string &path,
+                                          double sampleRate = 0.0) {
+    std::unique_lock<std::mutex> lk(mMutex);
+    auto key = std::make_pair(path, sampleRate);
+    auto it = mEntries.find(key);
+    if (it != mEntries.end()) {
+      if (auto sample = it->second.lock()) {
+        mHits++;
+        return sample;
+      }
+    }
+    mMisses++;
+    auto sample = load(path, sampleRate);
+    if (sample) {
+      mEntries[key] = sample;
+    } else {
+      mEntries.erase(key);
+    }
+    return sample;
+  }
+
+  /// Files larger than this many bytes are mapped instead of decoded
+  void mapThreshold(size_t bytes) { mMapThreshold = bytes; }
+
+  /// Number of files currently held by at least one player
+  size_t size() {
+    std::unique_lock<std::mutex> lk(mMutex);
+    size_t count = 0;
+    for (auto &entry : mEntries) {
+      count += entry.second.expired() ? 0 : 1;
+    }
+    return count;
+  }
+  uint64_t hits() const { return mHits; }
+  uint64_t misses() const { return mMisses; }
+
+private:
+  SampleCache() {}
+
+  std::shared_ptr<CachedSample> load(const std::string &path,
+                                     double sampleRate) {
+    auto sample = std::make_shared<CachedSample>();
+    auto mapped = std::make_unique<MappedSoundFile>();
+    if (mapped->open(path)) {
+      size_t bytes = mapped->frames() * mapped->bytesPerFrame();
+      bool sameRate = sampleRate == 0.0 || sampleRate == mapped->frameRate();
+      if (bytes > mMapThreshold && sameRate) {
+        sample->mChannels = mapped->channels();
+        sample->mFrameRate = mapped->frameRate();
+        sample->mFrames = mapped->frames();
+        sample->mMapped = std::move(mapped);
+        return sample;
+      }
+      sample->mChannels = mapped->channels();
+      sample->mFrameRate = mapped->frameRate();
+      sample->mData.resize(mapped->frames() * mapped->channels());
+      mapped->readAt(0, sample->mData.data(), mapped->frames());
+    } else {
+      // Formats that can't be mapped are decoded by SoundFile
+      SoundFile soundFile;
+      if (!soundFile.open(path.c_str())) {
+        return nullptr;
+      }
+      sample->mChannels = soundFile.channels;
+      sample->mFrameRate = soundFile.sampleRate;
+      sample->mData = std::move(soundFile.data);
+    }
+    if (sample->mChannels <= 0) {
+      return nullptr;
+    }
+    sample->mFrames = sample->mData.size() / sample->mChannels;
+    if (sampleRate != 0.0 && sampleRate != sample->mFrameRate) {
+      convertRate(*sample, sampleRate);
+    }
+    return sample;
+  }
+
+  // Linear interpolation. Done once at load time, so voices play back at the
+  // device rate without any per sample cost.
+  static void convertRate(CachedSample &sample, double sampleRate) {
+    const int channels = sample.mChannels;
+    const double ratio = sample.mFrameRate / sampleRate;
+    uint64_t outFrames = uint64_t(std::floor(sample.mFrames / ratio));
+    std::vector<float> converted(outFrames * channels);
+    for (uint64_t frame = 0; frame < outFrames; frame++) {
+      double position = frame * ratio;
+      uint64_t index = uint64_t(position);
+      float frac = float(position - index);
+      uint64_t next = std::min(index + 1, sample.mFrames - 1);
+      for (int c = 0; c < channels; c++) {
+        float a = sample.mData[index * channels + c];
+        float b = sample.mData[next * channels + c];
+        converted[frame * channels + c] = a + frac * (b - a);
+      }
+    }
+    sample.mData = std::move(converted);
+    sample.mFrames = outFrames;
+    sample.mFrameRate = sampleRate;
+  }
+
+  std::mutex mMutex;
+  std::map<std::pair<std::string, double>, std::weak_ptr<CachedSample>>
+      mEntries;
+  size_t mMapThreshold{64 * 1024 * 1024};
+  std::atomic<uint64_t> mHits{0};
+  std::atomic<uint64_t> mMisses{0};
+};
+
+/**
+ * @brief Playback cursor into a cached sample
+ *
+ * Has the same controls as SoundFilePlayerTS. open() should be called outside
+ * the audio thread (e.g. in a voice's init()), getFrames() in the audio
+ * thread.
+ */
+class CachedSamplePlayer {
+public:
+  bool open(const std::string &path, double sampleRate = 0.0) {
+    mSample = SampleCache::instance().get(path, sampleRate);
+    mPosition = 0;
+    return mSample != nullptr;
+  }
+
+  int channels() const { return mSample ? mSample->channels() : 0; }
+  double frameRate() const { return mSample ? mSample->frameRate() : 0.0; }
+  uint64_t frames() const { return mSample ? mSample->frames() : 0; }
+  uint64_t position() const { return mPosition; }
+
+  void setPlay() {
+    mPlaying = true;
+    pauseSignal = false;
+  }
+  void setPause() { mPlaying = false; }
+  void setRewind() { mPosition = 0; }
+  void setLoop(bool loop = true) { mLoop = loop; }
+
+  /**
+   * @brief Write numFrames interleaved frames into buffer
+   *
+   * Writes silence while paused. At the end of the file playback pauses and
+   * pauseSignal is set, unless looping.
+   */
+  void getFrames(int numFrames, float *buffer, int bufferLength) {
+    int channels = this->channels();
+    size_t frames = channels > 0 ? std::min(numFrames, bufferLength / channels)
+                                 : 0;
+    size_t done = 0;
+    if (mSample && mPlaying) {
+      while (done < frames) {
+        size_t count = mSample->read(mPosition, buffer + done * channels,
+                                     frames - done);
+        done += count;
+        mPosition += count;
+        if (done < frames) {
+          if (mLoop && mSample->frames() > 0) {
+            mPosition = 0;
+          } else {
+            mPlaying = false;
+            pauseSignal = true;
+            break;
+          }
+        }
+      }
+    }
+    std::fill(buffer + done * channels, buffer + bufferLength, 0.0f);
+  }
+
+  std::atomic<bool> pauseSignal{false};
+
+private:
+  std::shared_ptr<const CachedSample> mSample;
+  uint64_t mPosition{0};
+  std::atomic<bool> mPlaying{false};
+  bool mLoop{false};
+};
+
+} // namespace al
+
+#endif // AL_SAMPLECACHE_HPP
@@ -0,0 +1,230 @@
+#ifndef AL_SAMPLECONVERSION_HPP
+#define AL_SAMPLECONVERSION_HPP
+
+// Conversion of raw PCM sample data to float.
+//
+// The conversions are done on contiguous runs of samples, so that they can be
+// applied directly to interleaved data in a memory mapped file. SSE2 is used
+// when available, with a scalar fallback for other architectures and for big
+// endian data. 24 bit data only has a vector path when the compiler targets
+// SSSE3 (e.g. -mssse3 or -march=native), which the default build flags don't.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AL_SAMPLECONVERSION_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#define AL_SAMPLECONVERSION_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+namespace al {
+
+enum class SampleFormat : uint8_t {
+  NONE = 0,
+  INT16,
+  INT24,
+  INT32,
+  FLOAT32,
+  FLOAT64
+};
+
+inline size_t sampleFormatBytes(SampleFormat format) {
+  switch (format) {
+  case SampleFormat::INT16:
+    return 2;
+  case SampleFormat::INT24:
+    return 3;
+  case SampleFormat::INT32:
+  case SampleFormat::FLOAT32:
+    return 4;
+  case SampleFormat::FLOAT64:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+namespace sample_conversion {
+
+inline uint16_t swap16(uint16_t v) { return uint16_t((v >> 8) | (v << 8)); }
+
+inline uint32_t swap32(uint32_t v) {
+  return (v >> 24) | ((v >> 8) & 0xFF00u) | ((v << 8) & 0xFF0000u) | (v << 24);
+}
+
+inline uint64_t swap64(uint64_t v) {
+  return (uint64_t(swap32(uint32_t(v))) << 32) | swap32(uint32_t(v >> 32));
+}
+
+// Read one sample at src. Unaligned access is done through memcpy.
+inline float readSample(const uint8_t *src, SampleFormat format,
+                        bool bigEndian) {
+  switch (format) {
+  case SampleFormat::INT16: {
+    uint16_t v;
+    std::memcpy(&v, src, 2);
+    if (bigEndian) {
+      v = swap16(v);
+    }
+    return int16_t(v) * (1.0f / 32768.0f);
+  }
+  case SampleFormat::INT24: {
+    // Assembled unsigned in the top three bytes, so that the sign bit can be
+    // set without overflow, then shifted down arithmetically to sign extend
+    uint32_t u = bigEndian ? (uint32_t(src[0]) << 24) |
+                                 (uint32_t(src[1]) << 16) |
+                                 (uint32_t(src[2]) << 8)
+                           : (uint32_t(src[2]) << 24) |
+                                 (uint32_t(src[1]) << 16) |
+                                 (uint32_t(src[0]) << 8);
+    return (int32_t(u) >> 8) * (1.0f / 8388608.0f);
+  }
+  case SampleFormat::INT32: {
+    uint32_t v;
+    std::memcpy(&v, src, 4);
+    if (bigEndian) {
+      v = swap32(v);
+    }
+    return int32_t(v) * (1.0f / 2147483648.0f);
+  }
+  case SampleFormat::FLOAT32: {
+    uint32_t v;
+    std::memcpy(&v, src, 4);
+    if (bigEndian) {
+      v = swap32(v);
+    }
+    float f;
+    std::memcpy(&f, &v, 4);
+    return f;
+  }
+  case SampleFormat::FLOAT64: {
+    uint64_t v;
+    std::memcpy(&v, src, 8);
+    if (bigEndian) {
+      v = swap64(v);
+    }
+    double d;
+    std::memcpy(&d, &v, 8);
+    return float(d);
+  }
+  default:
+    return 0.0f;
+  }
+}
+
+inline void int16ToFloat(const uint8_t *src, float *dst, size_t count) {
+  size_t i = 0;
+#ifdef AL_SAMPLECONVERSION_SSE2
+  const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2));
+    // Place each 16 bit value in the upper half of a 32 bit lane and shift
+    // back down arithmetically to sign extend.
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(zero, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(zero, v), 16);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+#endif
+  for (; i < count; i++) {
+    dst[i] = readSample(src + i * 2, SampleFormat::INT16, false);
+  }
+}
+
+inline void int24ToFloat(const uint8_t *src, float *dst, size_t count) {
+  size_t i = 0;
+#ifdef AL_SAMPLECONVERSION_SSSE3
+  const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+  // Move the three bytes of each sample into the top of a 32 bit lane. The
+  // low byte is zeroed (-1 index), keeping the value scaled to 32 bit range.
+  const __m128i shuffle =
+      _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+  // Loads 16 bytes for 4 samples (12 bytes), so stop early to stay in bounds.
+  for (; i + 6 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 3));
+    __m128i s = _mm_shuffle_epi8(v, shuffle);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(s), scale));
+  }
+#endif
+  for (; i < count; i++) {
+    dst[i] = readSample(src + i * 3, SampleFormat::INT24, false);
+  }
+}
+
+inline void int32ToFloat(const uint8_t *src, float *dst, size_t count) {
+  size_t i = 0;
+#ifdef AL_SAMPLECONVERSION_SSE2
+  const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+  }
+#endif
+  for (; i < count; i++) {
+    dst[i] = readSample(src + i * 4, SampleFormat::INT32, false);
+  }
+}
+
+} // namespace sample_conversion
+
+/**
+ * @brief Convert count contiguous samples in format to float.
+ *
+ * src does not need to be aligned.
+ */
+inline void convertToFloat(const uint8_t *src, SampleFormat format,
+                           bool bigEndian, float *dst, size_t count) {
+  using namespace sample_conversion;
+  if (!bigEndian) {
+    switch (format) {
+    case SampleFormat::INT16:
+      int16ToFloat(src, dst, count);
+      return;
+    case SampleFormat::INT24:
+      int24ToFloat(src, dst, count);
+      return;
+    case SampleFormat::INT32:
+      int32ToFloat(src, dst, count);
+      return;
+    case SampleFormat::FLOAT32:
+      std::memcpy(dst, src, count * sizeof(float));
+      return;
+    default:
+      break;
+    }
+  }
+  const size_t bytes = sampleFormatBytes(format);
+  for (size_t i = 0; i < count; i++) {
+    dst[i] = readSample(src + i * bytes, format, bigEndian);
+  }
+}
+
+/**
+ * @brief Convert count samples separated by stride bytes to float.
+ *
+ * Used to extract a single channel from interleaved data.
+ */
+inline void convertToFloatStrided(const uint8_t *src, size_t stride,
+                                  SampleFormat format, bool bigEndian,
+                                  float *dst, size_t count) {
+  if (format == SampleFormat::FLOAT32 && !bigEndian) {
+    for (size_t i = 0; i < count; i++) {
+      std::memcpy(dst + i, src + i * stride, sizeof(float));
+    }
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    dst[i] = sample_conversion::readSample(src + i * stride, format, bigEndian);
+  }
+}
+
+} // namespace al
+
+#endif // AL_SAMPLECONVERSION_HPP
@@ -0,0 +1,56 @@
+#ifndef AL_SOUNDFILEREADER_HPP
+#define AL_SOUNDFILEREADER_HPP
+
+// Random access interface to sound files used by the playback tools.
+//
+// Readers are addressed by frame position instead of keeping an internal
+// read head, so that several files can be driven by a single playhead and
+// seeking does not need to touch the reader from the audio thread.
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace al {
+
+class SoundFileReader {
+public:
+  virtual ~SoundFileReader() {}
+
+  virtual bool opened() const = 0;
+  virtual void close() = 0;
+
+  virtual int channels() const = 0;
+  virtual double frameRate() const = 0;
+  virtual uint64_t frames() const = 0;
+
+  /**
+   * @brief Read interleaved frames starting at frame into buffer
+   * @return number of frames read. Less than numFrames at end of file, or for
+   * readers that decode in the background, if the frames aren't decoded yet
+   * (these are set to 0). endOfFile() tells the two apart.
+   *
+   * Called from the audio thread.
+   */
+  virtual size_t readAt(uint64_t frame, float *buffer, size_t numFrames) = 0;
+
+  /// True if frame is past the end of the file, so reading it returns nothing
+  virtual bool endOfFile(uint64_t frame) const { return frame >= frames(); }
+
+  /**
+   * @brief Hint that frames starting at frame will be read soon
+   *
+   * May block, so it should be called from a non realtime thread.
+   */
+  virtual void prefetch(uint64_t frame, size_t numFrames) {
+    (void)frame;
+    (void)numFrames;
+  }
+
+  /// Short description of the file format for display
+  virtual std::string formatInfo() const { return ""; }
+};
+
+} // namespace al
+
+#endif // AL_SOUNDFILEREADER_HPP
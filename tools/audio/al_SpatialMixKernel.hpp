@@ -0,0 +1,373 @@
+#ifndef AL_SPATIALMIXKERNEL_HPP
+#define AL_SPATIALMIXKERNEL_HPP
+
+// Batched mixing of many mono sources into many speaker channels.
+//
+// SpatialMixKernel computes out = X * G for a block, where X holds the mono
+// output of every source (sources x frames) and G the speaker gains of every
+// source (sources x channels). G is interpolated linearly from the previous
+// block's gains to the new ones across the block, which is folded into the
+// product as X * G0 + (X * ramp) * (G1 - G0). When no gain changes the ramp
+// term is skipped.
+//
+// The product is computed in tiles of 8 frames x 4 channels held in SSE
+// registers while all sources are accumulated, so outputs are written once
+// per tile instead of once per source. Sources with zero gains for a group
+// of 4 channels are skipped for that group, which makes panners with sparse
+// gains (Lbap, Vbap) cost far less than sources x speakers.
+//
+// BatchedSpatializer<Base> collects voices in renderBuffer() and mixes them
+// all with the kernel in finalize(). Gains are taken from Base by rendering
+// a single sample, so any spatializer can be batched.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "al/io/al_AudioIOData.hpp"
+#include "al/sound/al_Spatializer.hpp"
+#include "al/sound/al_Speaker.hpp"
+#include "al/spatial/al_Pose.hpp"
+
+#include "al_GainTableSpatializer.hpp"
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#define AL_SPATIALMIXKERNEL_SSE 1
+#include <xmmintrin.h>
+#endif
+
+namespace al {
+
+class SpatialMixKernel {
+public:
+  static const unsigned kTileFrames = 8;
+
+  /// Allocate for up to maxSources sources of maxFrames frames
+  void configure(int maxSources, int channels, unsigned maxFrames) {
+    mMaxSources = maxSources;
+    mChannels = channels;
+    mGainStride = (channels + 3) & ~3;
+    mFrameStride = (maxFrames + kTileFrames - 1) / kTileFrames * kTileFrames;
+    mSamples.assign(size_t(maxSources) * mFrameStride, 0.0f);
+    mRampedSamples.assign(mSamples.size(), 0.0f);
+    mStartGains.assign(size_t(maxSources) * mGainStride, 0.0f);
+    mEndGains.assign(mStartGains.size(), 0.0f);
+    mDeltaGains.assign(mStartGains.size(), 0.0f);
+    mRamp.assign(mFrameStride, 0.0f);
+    mActive.assign(size_t(mGainStride / 4) * maxSources, 0);
+    mActiveCount.assign(mGainStride / 4, 0);
+  }
+
+  int maxSources() const { return mMaxSources; }
+  int channels() const { return mChannels; }
+  unsigned maxFrames() const { return mFrameStride; }
+
+  /// Block of mono samples for source
+  float *samples(int source) {
+    return mSamples.data() + size_t(source) * mFrameStride;
+  }
+  /// Gains at the start of the block. channels() values.
+  float *startGains(int source) {
+    return mStartGains.data() + size_t(source) * mGainStride;
+  }
+  /// Gains at the end of the block. channels() values.
+  float *endGains(int source) {
+    return mEndGains.data() + size_t(source) * mGainStride;
+  }
+
+  /**
+   * @brief Add the first numSources sources to outputs
+   * @param outputs one buffer of numFrames samples per channel
+   */
+  void mix(int numSources, unsigned numFrames, float *const *outputs) {
+    if (numSources == 0 || numFrames == 0) {
+      return;
+    }
+    prepareRamp(numSources, numFrames);
+    const int groups = mGainStride / 4;
+    for (int group = 0; group < groups; group++) {
+      const int *active = mActive.data() + size_t(group) * mMaxSources;
+      const int count = mActiveCount[group];
+      if (count == 0) {
+        continue;
+      }
+      for (unsigned frame = 0; frame < numFrames; frame += kTileFrames) {
+        float tile[4][kTileFrames];
+        if (mRamping) {
+          mixTile<true>(active, count, group * 4, frame, tile);
+        } else {
+          mixTile<false>(active, count, group * 4, frame, tile);
+        }
+        const unsigned frames = std::min(kTileFrames, numFrames - frame);
+        for (int c = 0; c < 4 && group * 4 + c < mChannels; c++) {
+          float *out = outputs[group * 4 + c] + frame;
+          for (unsigned i = 0; i < frames; i++) {
+            out[i] += tile[c][i];
+          }
+        }
+      }
+    }
+  }
+
+private:
+  // Compute gain deltas, ramped samples and the sources active in each group
+  // of 4 channels
+  void prepareRamp(int numSources, unsigned numFrames) {
+    for (unsigned i = 0; i < mFrameStride; i++) {
+      mRamp[i] = i < numFrames ? float(i) / numFrames : 0.0f;
+    }
+    std::fill(mActiveCount.begin(), mActiveCount.end(), 0);
+    mRamping = false;
+    const int groups = mGainStride / 4;
+    for (int s = 0; s < numSources; s++) {
+      float *start = startGains(s);
+      float *end = endGains(s);
+      float *delta = mDeltaGains.data() + size_t(s) * mGainStride;
+      for (int c = mChannels; c < mGainStride; c++) {
+        start[c] = end[c] = 0.0f;
+      }
+      for (int c = 0; c < mGainStride; c++) {
+        delta[c] = end[c] - start[c];
+        mRamping |= delta[c] != 0.0f;
+      }
+      for (int group = 0; group < groups; group++) {
+        bool silent = true;
+        for (int c = group * 4; c < group * 4 + 4; c++) {
+          silent &= start[c] == 0.0f && end[c] == 0.0f;
+        }
+        if (!silent) {
+          mActive[size_t(group) * mMaxSources + mActiveCount[group]++] = s;
+        }
+      }
+      // Zero the padding so the last tile doesn't pick up stale samples
+      float *x = samples(s);
+      std::fill(x + numFrames, x + paddedFrames(numFrames), 0.0f);
+    }
+    if (!mRamping) {
+      return;
+    }
+    for (int s = 0; s < numSources; s++) {
+      const float *x = samples(s);
+      float *xr = mRampedSamples.data() + size_t(s) * mFrameStride;
+      for (unsigned i = 0; i < paddedFrames(numFrames); i++) {
+        xr[i] = x[i] * mRamp[i];
+      }
+    }
+  }
+
+  static unsigned paddedFrames(unsigned numFrames) {
+    return (numFrames + kTileFrames - 1) / kTileFrames * kTileFrames;
+  }
+
+  template <bool Ramp>
+  void mixTile(const int *active, int count, int channel, unsigned frame,
+               float tile[4][kTileFrames]) {
+#ifdef AL_SPATIALMIXKERNEL_SSE
+    __m128 acc[4][2];
+    for (int c = 0; c < 4; c++) {
+      acc[c][0] = _mm_setzero_ps();
+      acc[c][1] = _mm_setzero_ps();
+    }
+    for (int i = 0; i < count; i++) {
+      const int s = active[i];
+      const float *x = samples(s) + frame;
+      const __m128 x0 = _mm_loadu_ps(x);
+      const __m128 x1 = _mm_loadu_ps(x + 4);
+      const __m128 g = _mm_loadu_ps(startGains(s) + channel);
+      accumulate(acc[0], x0, x1, _mm_shuffle_ps(g, g, 0x00));
+      accumulate(acc[1], x0, x1, _mm_shuffle_ps(g, g, 0x55));
+      accumulate(acc[2], x0, x1, _mm_shuffle_ps(g, g, 0xAA));
+      accumulate(acc[3], x0, x1, _mm_shuffle_ps(g, g, 0xFF));
+      if (Ramp) {
+        const float *xr =
+            mRampedSamples.data() + size_t(s) * mFrameStride + frame;
+        const __m128 xr0 = _mm_loadu_ps(xr);
+        const __m128 xr1 = _mm_loadu_ps(xr + 4);
+        const __m128 d = _mm_loadu_ps(mDeltaGains.data() +
+                                      size_t(s) * mGainStride + channel);
+        accumulate(acc[0], xr0, xr1, _mm_shuffle_ps(d, d, 0x00));
+        accumulate(acc[1], xr0, xr1, _mm_shuffle_ps(d, d, 0x55));
+        accumulate(acc[2], xr0, xr1, _mm_shuffle_ps(d, d, 0xAA));
+        accumulate(acc[3], xr0, xr1, _mm_shuffle_ps(d, d, 0xFF));
+      }
+    }
+    for (int c = 0; c < 4; c++) {
+      _mm_storeu_ps(tile[c], acc[c][0]);
+      _mm_storeu_ps(tile[c] + 4, acc[c][1]);
+    }
+#else
+    for (int c = 0; c < 4; c++) {
+      std::fill_n(tile[c], kTileFrames, 0.0f);
+    }
+    for (int i = 0; i < count; i++) {
+      const int s = active[i];
+      const float *x = samples(s) + frame;
+      const float *xr =
+          mRampedSamples.data() + size_t(s) * mFrameStride + frame;
+      const float *g = startGains(s) + channel;
+      const float *d = mDeltaGains.data() + size_t(s) * mGainStride + channel;
+      for (int c = 0; c < 4; c++) {
+        for (unsigned f = 0; f < kTileFrames; f++) {
+          tile[c][f] += x[f] * g[c] + (Ramp ? xr[f] * d[c] : 0.0f);
+        }
+      }
+    }
+#endif
+  }
+
+#ifdef AL_SPATIALMIXKERNEL_SSE
+  static inline void accumulate(__m128 *acc, __m128 x0, __m128 x1,
+                                __m128 g) {
+    acc[0] = _mm_add_ps(acc[0], _mm_mul_ps(x0, g));
+    acc[1] = _mm_add_ps(acc[1], _mm_mul_ps(x1, g));
+  }
+#endif
+
+  int mMaxSources{0};
+  int mChannels{0};
+  int mGainStride{0};
+  unsigned mFrameStride{0};
+  std::vector<float> mSamples;       // maxSources x mFrameStride
+  std::vector<float> mRampedSamples; // Samples multiplied by mRamp
+  std::vector<float> mStartGains;    // maxSources x mGainStride
+  std::vector<float> mEndGains;
+  std::vector<float> mDeltaGains;
+  std::vector<float> mRamp; // 0 to 1 across the block
+  std::vector<int> mActive; // Active sources per group of 4 channels
+  std::vector<int> mActiveCount;
+  bool mRamping{false};
+};
+
+/**
+ * @brief Spatializer that mixes all sources of a block in one batch
+ *
+ * Usage: scene.setSpatializer<BatchedSpatializer<Vbap>>(speakers);
+ *
+ * Gains ramp from the previous block's gains of the source rendered at the
+ * same position in the block, as in GainTableSpatializer. Sources beyond
+ * maxSources are mixed directly. Silent buffers are skipped.
+ */
+template <class BaseSpatializer>
+class BatchedSpatializer : public Spatializer {
+public:
+  BatchedSpatializer(const Speakers &sl, int maxSources = 256,
+                     unsigned maxFrames = 2048)
+      : Spatializer(sl), mBase(sl), mMaxSources(maxSources),
+        mMaxFrames(maxFrames) {}
+
+  void compile() override {
+    mBase.compile();
+    mChannels = layoutChannels(mSpeakers);
+    // Base spatializers may write to channels outside the layout (e.g. a
+    // stereo panner on a layout with one speaker)
+    mChannels = std::max(mChannels, 2);
+    mKernel.configure(mMaxSources, mChannels, mMaxFrames);
+    mPrevious.assign(size_t(mMaxSources) * mChannels, 0.0f);
+    mPreviousDirection.assign(mMaxSources, Vec3d());
+    mPreviousActive.assign(mMaxSources, false);
+    mGains.assign(mChannels, 0.0f);
+    mOutputs.assign(mChannels, nullptr);
+    mScratch.assign(mKernel.maxFrames(), 0.0f);
+  }
+
+  void prepare(AudioIOData &io) override {
+    (void)io;
+    for (int s = mSlot; s < mLastSlot; s++) {
+      mPreviousActive[s] = false;
+    }
+    mLastSlot = mSlot;
+    mSlot = 0;
+    mCount = 0;
+  }
+
+  void renderBuffer(AudioIOData &io, const Pose &reldir, const float *samples,
+                    const unsigned int &numFrames) override {
+    // Slots follow the order of calls, including silent ones, so they line
+    // up with the previous block's
+    const int slot = mSlot < mMaxSources ? mSlot++ : -1;
+    if (isSilent(samples, numFrames)) {
+      if (slot >= 0) {
+        mPreviousActive[slot] = false;
+      }
+      return;
+    }
+    if (slot < 0 || numFrames > mKernel.maxFrames()) {
+      // Out of batch space. Mix without ramping.
+      probeSpatializerGains(mBase, reldir, mProbe, mGains.data(), mChannels);
+      const int channels = std::min(mChannels, int(io.channelsOut()));
+      for (int c = 0; c < channels; c++) {
+        if (mGains[c] != 0.0f) {
+          accumulateGainRamp(io.outBuffer(c), samples, mGains[c], mGains[c],
+                             numFrames);
+        }
+      }
+      return;
+    }
+    const int s = mCount++;
+    mFrames = numFrames;
+    float *end = mKernel.endGains(s);
+    float *start = mKernel.startGains(s);
+    float *previous = mPrevious.data() + size_t(slot) * mChannels;
+    probeSpatializerGains(mBase, reldir, mProbe, end, mChannels);
+    Vec3d dir = reldir.vec();
+    if (mPreviousActive[slot] &&
+        continuesSource(mPreviousDirection[slot], dir)) {
+      std::copy_n(previous, mChannels, start);
+    } else {
+      std::copy_n(end, mChannels, start);
+    }
+    std::copy_n(end, mChannels, previous);
+    mPreviousDirection[slot] = dir;
+    mPreviousActive[slot] = true;
+    std::copy_n(samples, numFrames, mKernel.samples(s));
+  }
+
+  void renderSample(AudioIOData &io, const Pose &reldir, const float &sample,
+                    const unsigned int &frameIndex) override {
+    if (frameIndex == 0) {
+      probeSpatializerGains(mBase, reldir, mProbe, mGains.data(), mChannels);
+    }
+    const int channels = std::min(mChannels, int(io.channelsOut()));
+    for (int c = 0; c < channels; c++) {
+      io.outBuffer(c)[frameIndex] += mGains[c] * sample;
+    }
+  }
+
+  void finalize(AudioIOData &io) override {
+    // Channels the device doesn't have are mixed into a scratch buffer
+    const int channels = std::min(mChannels, int(io.channelsOut()));
+    for (int c = 0; c < mChannels; c++) {
+      mOutputs[c] = c < channels ? io.outBuffer(c) : mScratch.data();
+    }
+    mKernel.mix(mCount, mFrames, mOutputs.data());
+  }
+
+  void print(std::ostream &stream = std::cout) override {
+    stream << "Batched (" << mMaxSources << " sources):" << std::endl;
+    mBase.print(stream);
+  }
+
+private:
+  BaseSpatializer mBase;
+  SpatialMixKernel mKernel;
+  AudioIOData mProbe;
+  int mMaxSources;
+  unsigned mMaxFrames;
+  int mChannels{0};
+
+  int mCount{0}; // Sources in the kernel
+  int mSlot{0};
+  int mLastSlot{0};
+  unsigned mFrames{0};
+  std::vector<float> mPrevious; // Last gains per source slot
+  std::vector<Vec3d> mPreviousDirection;
+  std::vector<bool> mPreviousActive;
+  std::vector<float> mGains;
+  std::vector<float *> mOutputs;
+  std::vector<float> mScratch;
+};
+
+} // namespace al
+
+#endif // AL_SPATIALMIXKERNEL_HPP
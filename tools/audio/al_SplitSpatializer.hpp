@@ -0,0 +1,574 @@
+#ifndef AL_SPLITSPATIALIZER_HPP
+#define AL_SPLITSPATIALIZER_HPP
+
+// Spatialization of a large speaker array split across several render
+// processes or threads on one host.
+//
+// The speakers are partitioned into groups of about the same size. Each
+// partition spatializes every source, but only into its own speakers, with
+// gains looked up in a GainTable baked from the full layout, so panning is
+// the same as with one renderer. In the audio thread SplitSpatializer only
+// copies each source's samples and direction into a ring of blocks in shared
+// memory and joins the partitions' output.
+//
+// Blocks are numbered, and the output of every partition for a block is
+// only used together with the others for the same block, so channels stay
+// sample aligned. With a latency of one block (the default) the partitions
+// render block N while the audio thread is producing block N + 1. With a
+// latency of 0 the audio thread waits for the partitions to render the block
+// it's producing. Either way it waits at most a set fraction of the block
+// period, and a partition that isn't done in time outputs silence for that
+// block and counts an underrun.
+//
+// Partitions run as forked processes (Linux and macOS) or as threads that
+// share no state but the ring. Each partition reports its load, the fraction
+// of the block period it spent rendering, so the headroom per partition is
+// 1 - load.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "al/io/al_AudioIOData.hpp"
+#include "al/sound/al_Spatializer.hpp"
+#include "al/sound/al_Speaker.hpp"
+#include "al/spatial/al_Pose.hpp"
+
+#include "al_GainTableSpatializer.hpp"
+
+namespace al {
+
+/**
+ * @brief Ring of source and output blocks shared by the audio thread and
+ * the partitions
+ *
+ * The memory is an anonymous shared mapping, so it is shared with processes
+ * forked after it's created.
+ */
+class SplitRenderRing {
+public:
+  static const int kMaxPartitions = 16;
+  static const int kDepth = 4;
+
+  struct Header {
+    std::atomic<uint64_t> published;                // Blocks written
+    std::atomic<uint64_t> rendered[kMaxPartitions]; // Blocks done
+    std::atomic<float> load[kMaxPartitions];
+    std::atomic<float> peakLoad[kMaxPartitions];
+    std::atomic<int> stop;
+    std::atomic<double> sampleRate;
+  };
+
+  // Per block: source count and frames, then directions (x, y, z and 1 for
+  // sound or 0 for silence) and samples of each source
+  struct Block {
+    uint32_t sources;
+    uint32_t frames;
+  };
+
+  ~SplitRenderRing() { release(); }
+
+  bool allocate(int maxSources, int channels, unsigned maxFrames) {
+    release();
+    mMaxSources = maxSources;
+    mChannels = channels;
+    mMaxFrames = maxFrames;
+    mBlockBytes = align(sizeof(Block)) +
+                  align(sizeof(float) * 4 * maxSources) +
+                  align(sizeof(float) * size_t(maxSources) * maxFrames);
+    mOutputBytes = align(sizeof(float) * size_t(channels) * maxFrames);
+    mBytes = align(sizeof(Header)) + kDepth * (mBlockBytes + mOutputBytes);
+#ifndef _WIN32
+    void *memory = mmap(nullptr, mBytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      return false;
+    }
+    mMemory = static_cast<char *>(memory);
+#else
+    mMemory = new char[mBytes];
+#endif
+    std::memset(mMemory, 0, mBytes);
+    Header *h = new (mMemory) Header;
+    h->published = 0;
+    for (int i = 0; i < kMaxPartitions; i++) {
+      h->rendered[i] = 0;
+      h->load[i] = 0.0f;
+      h->peakLoad[i] = 0.0f;
+    }
+    h->stop = 0;
+    h->sampleRate = 44100.0;
+    return true;
+  }
+
+  void release() {
+    if (!mMemory) {
+      return;
+    }
+#ifndef _WIN32
+    munmap(mMemory, mBytes);
+#else
+    delete[] mMemory;
+#endif
+    mMemory = nullptr;
+  }
+
+  Header &header() { return *reinterpret_cast<Header *>(mMemory); }
+
+  Block &block(uint64_t index) {
+    return *reinterpret_cast<Block *>(blockMemory(index));
+  }
+  float *directions(uint64_t index) {
+    return reinterpret_cast<float *>(blockMemory(index) +
+                                     align(sizeof(Block)));
+  }
+  float *samples(uint64_t index, int source) {
+    return reinterpret_cast<float *>(
+               blockMemory(index) + align(sizeof(Block)) +
+               align(sizeof(float) * 4 * mMaxSources)) +
+           size_t(source) * mMaxFrames;
+  }
+  float *output(uint64_t index, int channel) {
+    return reinterpret_cast<float *>(mMemory + align(sizeof(Header)) +
+                                     kDepth * mBlockBytes +
+                                     (index % kDepth) * mOutputBytes) +
+           size_t(channel) * mMaxFrames;
+  }
+
+  int maxSources() const { return mMaxSources; }
+  int channels() const { return mChannels; }
+  unsigned maxFrames() const { return mMaxFrames; }
+
+private:
+  static size_t align(size_t bytes) { return (bytes + 63) & ~size_t(63); }
+
+  char *blockMemory(uint64_t index) {
+    return mMemory + align(sizeof(Header)) + (index % kDepth) * mBlockBytes;
+  }
+
+  char *mMemory{nullptr};
+  size_t mBytes{0};
+  size_t mBlockBytes{0};
+  size_t mOutputBytes{0};
+  int mMaxSources{0};
+  int mChannels{0};
+  unsigned mMaxFrames{0};
+};
+
+/// Renders the sources of a block into a subset of the output channels
+class SplitRenderPartition {
+public:
+  void configure(const GainTable *table, std::vector<int> channels,
+                 int maxSources) {
+    mTable = table;
+    mChannels = std::move(channels);
+    mPrevious.assign(size_t(maxSources) * mChannels.size(), 0.0f);
+    mDirection.assign(maxSources, Vec3d());
+    mActive.assign(maxSources, false);
+    mGains.assign(table->stride(), 0.0f);
+  }
+
+  const std::vector<int> &channels() const { return mChannels; }
+
+  /// Render block index of ring into the partition's output channels
+  void render(SplitRenderRing &ring, uint64_t index) {
+    auto &block = ring.block(index);
+    const unsigned frames = std::min(block.frames, ring.maxFrames());
+    const int sources = std::min(int(block.sources), ring.maxSources());
+    const size_t numChannels = mChannels.size();
+    for (int channel : mChannels) {
+      std::fill_n(ring.output(index, channel), frames, 0.0f);
+    }
+    const float *directions = ring.directions(index);
+    for (int s = 0; s < sources; s++) {
+      const float *d = directions + 4 * s;
+      if (d[3] == 0.0f) {
+        mActive[s] = false;
+        continue;
+      }
+      Vec3d dir(d[0], d[1], d[2]);
+      mTable->lookup(dir, mGains.data());
+      const bool ramp =
+          mActive[s] && frames > 1 && continuesSource(mDirection[s], dir);
+      float *previous = mPrevious.data() + s * numChannels;
+      const float *samples = ring.samples(index, s);
+      for (size_t i = 0; i < numChannels; i++) {
+        const int channel = mChannels[i];
+        const float end = mGains[channel];
+        const float start = ramp ? previous[i] : end;
+        previous[i] = end;
+        if (start == 0.0f && end == 0.0f) {
+          continue;
+        }
+        accumulateGainRamp(ring.output(index, channel), samples, start, end,
+                           frames);
+      }
+      mDirection[s] = dir;
+      mActive[s] = true;
+    }
+    for (int s = sources; s < int(mActive.size()); s++) {
+      mActive[s] = false;
+    }
+  }
+
+  /**
+   * @brief Render published blocks until the ring is stopped
+   * @param partition index of this partition in the ring
+   */
+  void run(SplitRenderRing &ring, int partition) {
+    auto &header = ring.header();
+    uint64_t next = header.rendered[partition].load();
+    int idle = 0;
+#ifndef _WIN32
+    const pid_t parent = getppid();
+#endif
+    while (!header.stop.load(std::memory_order_acquire)) {
+      if (header.published.load(std::memory_order_acquire) <= next) {
+        if (++idle < 64) {
+          std::this_thread::yield();
+        } else {
+          std::this_thread::sleep_for(std::chrono::microseconds(50));
+#ifndef _WIN32
+          if (getppid() != parent) {
+            break; // The audio process is gone
+          }
+#endif
+        }
+        continue;
+      }
+      idle = 0;
+      auto start = std::chrono::steady_clock::now();
+      render(ring, next);
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      const double period =
+          ring.block(next).frames / std::max(1.0, header.sampleRate.load());
+      next++;
+      header.rendered[partition].store(next, std::memory_order_release);
+      const float load = float(
+          std::chrono::duration<double>(elapsed).count() / period);
+      header.load[partition] = load;
+      header.peakLoad[partition] =
+          std::max(load, header.peakLoad[partition] * 0.999f);
+    }
+  }
+
+private:
+  const GainTable *mTable{nullptr};
+  std::vector<int> mChannels;
+  std::vector<float> mPrevious; // Last gains per source slot and channel
+  std::vector<Vec3d> mDirection;
+  std::vector<bool> mActive;
+  std::vector<float> mGains;
+};
+
+/**
+ * @brief Spatializer rendering its speakers in several partitions
+ *
+ * Usage:
+ *   auto split = scene.setSpatializer<SplitSpatializer<Lbap>>(speakers);
+ *   split->start(4);
+ *
+ * Call start() before audio is running. Until it is called, or if it fails,
+ * all speakers are rendered in the audio thread.
+ */
+template <class BaseSpatializer>
+class SplitSpatializer : public Spatializer {
+public:
+  enum class Mode { PROCESSES, THREADS };
+
+  SplitSpatializer(const Speakers &sl, float resolution = 2.0f,
+                   int maxSources = 128, unsigned maxFrames = 2048)
+      : Spatializer(sl), mBase(sl), mResolution(resolution),
+        mMaxSources(maxSources), mMaxFrames(maxFrames) {}
+
+  ~SplitSpatializer() { stop(); }
+
+  void compile() override {
+    stop();
+    mBase.compile();
+    mTable.bake(mBase, mSpeakers, mResolution);
+    mChannels = mTable.channels();
+    mRing.allocate(mMaxSources, mChannels, mMaxFrames);
+    mLocal.configure(&mTable, layoutDeviceChannels(), mMaxSources);
+  }
+
+  /**
+   * @brief Start rendering in partitions
+   * @param latencyBlocks 1 to render a block while the next one is being
+   * produced, 0 to wait for the partitions in the same block
+   * @return false if the partitions couldn't be started
+   */
+  bool start(int partitions, Mode mode = Mode::PROCESSES,
+             int latencyBlocks = 1) {
+    stop();
+    auto channels = layoutDeviceChannels();
+    partitions = std::max(1, std::min({partitions,
+                                       int(SplitRenderRing::kMaxPartitions),
+                                       int(channels.size())}));
+    auto &header = mRing.header();
+    header.stop = 0;
+    header.published = mBlock;
+    mPartitions.clear();
+    for (int p = 0; p < partitions; p++) {
+      header.rendered[p] = mBlock;
+      header.load[p] = 0.0f;
+      header.peakLoad[p] = 0.0f;
+      // Contiguous groups of speakers of about the same size
+      size_t begin = channels.size() * p / partitions;
+      size_t end = channels.size() * (p + 1) / partitions;
+      mPartitions.emplace_back(new SplitRenderPartition);
+      mPartitions.back()->configure(
+          &mTable,
+          std::vector<int>(channels.begin() + begin, channels.begin() + end),
+          mMaxSources);
+    }
+    mUnderruns.assign(partitions, 0);
+    mLatency = std::max(0, std::min(latencyBlocks, 1));
+#ifndef _WIN32
+    if (mode == Mode::PROCESSES) {
+      for (int p = 0; p < partitions; p++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+          mPartitions[p]->run(mRing, p);
+          _exit(0);
+        }
+        if (pid < 0) {
+          std::cerr << "SplitSpatializer: fork failed" << std::endl;
+          stop();
+          return false;
+        }
+        mProcesses.push_back(pid);
+      }
+      mRunning = true;
+      return true;
+    }
+#else
+    (void)mode;
+#endif
+    for (int p = 0; p < partitions; p++) {
+      mThreads.emplace_back(
+          [this, p]() { mPartitions[p]->run(mRing, p); });
+    }
+    mRunning = true;
+    return true;
+  }
+
+  /// Longest time the audio thread waits for a partition, as a fraction of
+  /// the block period
+  void setMaxWait(float fraction) { mMaxWait = std::max(0.0f, fraction); }
+
+  /// Stop the partitions and render in the audio thread again
+  void stop() {
+    if (!mRunning) {
+      return;
+    }
+    mRing.header().stop.store(1, std::memory_order_release);
+    for (auto &thread : mThreads) {
+      thread.join();
+    }
+    mThreads.clear();
+#ifndef _WIN32
+    for (pid_t pid : mProcesses) {
+      waitpid(pid, nullptr, 0);
+    }
+#endif
+    mProcesses.clear();
+    mRunning = false;
+  }
+
+  bool running() const { return mRunning; }
+  int partitions() const { return mRunning ? int(mPartitions.size()) : 0; }
+  /// Channels rendered by partition
+  const std::vector<int> &partitionChannels(int partition) const {
+    return mPartitions[partition]->channels();
+  }
+  /// Fraction of the last block period partition spent rendering
+  float load(int partition) { return mRing.header().load[partition]; }
+  /// Recent maximum of load(). Headroom is 1 - peakLoad().
+  float peakLoad(int partition) { return mRing.header().peakLoad[partition]; }
+  /// Blocks partition didn't finish in time
+  uint32_t underruns(int partition) const { return mUnderruns[partition]; }
+  /// Blocks dropped because all slots of the ring were in use
+  uint32_t overruns() const { return mOverruns; }
+
+  void prepare(AudioIOData &io) override {
+    mFrames = std::min(unsigned(io.framesPerBuffer()), mRing.maxFrames());
+    mCount = 0;
+    mRing.header().sampleRate = io.framesPerSecond();
+    // The slot of this block must have been rendered by all partitions
+    mWriting = true;
+    if (mRunning) {
+      for (size_t p = 0; p < mPartitions.size(); p++) {
+        uint64_t rendered = mRing.header().rendered[p].load(
+            std::memory_order_acquire);
+        if (rendered + SplitRenderRing::kDepth <= mBlock) {
+          mWriting = false;
+        }
+      }
+      if (!mWriting) {
+        mOverruns++;
+      }
+    }
+  }
+
+  void renderBuffer(AudioIOData &io, const Pose &reldir, const float *samples,
+                    const unsigned int &numFrames) override {
+    (void)io;
+    if (!mWriting || mCount >= mMaxSources) {
+      return;
+    }
+    const int s = mCount++;
+    float *d = mRing.directions(mBlock) + 4 * s;
+    Vec3d dir = reldir.vec();
+    d[0] = float(dir.x);
+    d[1] = float(dir.y);
+    d[2] = float(dir.z);
+    const unsigned frames = std::min(numFrames, mFrames);
+    if (isSilent(samples, frames)) {
+      d[3] = 0.0f;
+      return;
+    }
+    d[3] = 1.0f;
+    float *dest = mRing.samples(mBlock, s);
+    std::copy_n(samples, frames, dest);
+    std::fill(dest + frames, dest + mFrames, 0.0f);
+  }
+
+  void renderSample(AudioIOData &io, const Pose &reldir, const float &sample,
+                    const unsigned int &frameIndex) override {
+    (void)io;
+    if (!mWriting || frameIndex >= mFrames) {
+      return;
+    }
+    if (frameIndex == 0) {
+      if (mCount >= mMaxSources) {
+        return;
+      }
+      const int s = mCount++;
+      float *d = mRing.directions(mBlock) + 4 * s;
+      Vec3d dir = reldir.vec();
+      d[0] = float(dir.x);
+      d[1] = float(dir.y);
+      d[2] = float(dir.z);
+      d[3] = 1.0f;
+      std::fill_n(mRing.samples(mBlock, s), mFrames, 0.0f);
+    }
+    if (mCount > 0) {
+      mRing.samples(mBlock, mCount - 1)[frameIndex] = sample;
+    }
+  }
+
+  void finalize(AudioIOData &io) override {
+    if (!mWriting) {
+      return;
+    }
+    auto &block = mRing.block(mBlock);
+    block.sources = mCount;
+    block.frames = mFrames;
+    if (!mRunning) {
+      mLocal.render(mRing, mBlock);
+      addOutput(io, mLocal.channels(), mBlock);
+      return;
+    }
+    auto &header = mRing.header();
+    mBlock++;
+    header.published.store(mBlock, std::memory_order_release);
+    if (mBlock <= uint64_t(mLatency)) {
+      return;
+    }
+    const uint64_t target = mBlock - 1 - mLatency;
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::duration<double>(
+                        mMaxWait * mFrames / io.framesPerSecond());
+    for (size_t p = 0; p < mPartitions.size(); p++) {
+      while (header.rendered[p].load(std::memory_order_acquire) <= target &&
+             std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::yield();
+      }
+      if (header.rendered[p].load(std::memory_order_acquire) > target) {
+        addOutput(io, mPartitions[p]->channels(), target);
+      } else {
+        mUnderruns[p]++;
+      }
+    }
+  }
+
+  void print(std::ostream &stream = std::cout) override {
+    stream << "Split into " << partitions() << " partitions ("
+           << mTable.bytes() / 1024 << " KiB gain table) from:" << std::endl;
+    mBase.print(stream);
+  }
+
+private:
+  std::vector<int> layoutDeviceChannels() const {
+    std::vector<int> channels;
+    for (auto &speaker : mSpeakers) {
+      channels.push_back(int(speaker.deviceChannel));
+    }
+    std::sort(channels.begin(), channels.end());
+    channels.erase(std::unique(channels.begin(), channels.end()),
+                   channels.end());
+    return channels;
+  }
+
+  void addOutput(AudioIOData &io, const std::vector<int> &channels,
+                 uint64_t index) {
+    const unsigned frames =
+        std::min(mRing.block(index).frames, unsigned(io.framesPerBuffer()));
+    for (int channel : channels) {
+      if (channel >= int(io.channelsOut())) {
+        continue;
+      }
+      const float *source = mRing.output(index, channel);
+      float *dest = io.outBuffer(channel);
+      for (unsigned i = 0; i < frames; i++) {
+        dest[i] += source[i];
+      }
+    }
+  }
+
+  BaseSpatializer mBase;
+  GainTable mTable;
+  float mResolution;
+  int mMaxSources;
+  unsigned mMaxFrames;
+  int mChannels{0};
+
+  SplitRenderRing mRing;
+  SplitRenderPartition mLocal; // All channels, when not running
+  std::vector<std::unique_ptr<SplitRenderPartition>> mPartitions;
+  std::vector<std::thread> mThreads;
+#ifndef _WIN32
+  std::vector<pid_t> mProcesses;
+#else
+  std::vector<int> mProcesses;
+#endif
+  bool mRunning{false};
+  int mLatency{1};
+  float mMaxWait{0.5f};
+
+  // Audio thread
+  uint64_t mBlock{0};
+  unsigned mFrames{0};
+  int mCount{0};
+  bool mWriting{true};
+  std::vector<uint32_t> mUnderruns;
+  uint32_t mOverruns{0};
+};
+
+} // namespace al
+
+#endif // AL_SPLITSPATIALIZER_HPP
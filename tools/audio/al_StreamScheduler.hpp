@@ -0,0 +1,442 @@
+#ifndef AL_STREAMSCHEDULER_HPP
+#define AL_STREAMSCHEDULER_HPP
+
+// Streaming of many sound files from a single I/O thread.
+//
+// Instead of each voice owning a buffered file with its own thread and buffer,
+// voices get a ScheduledStream from a StreamScheduler. The scheduler thread
+// refills all streams from a fixed pool of blocks, serving the pending reads
+// in elevator (SCAN) order sorted by file and offset, so the disk head sweeps
+// across the files instead of jumping between them. Thread count and memory
+// stay constant regardless of how many streams are playing.
+//
+// Opening and closing streams only posts a request, so it is safe to do from
+// voice trigger callbacks in the audio thread.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#endif
+
+#include "al_MappedSoundFile.hpp"
+
+namespace al {
+
+/**
+ * @brief Lock free single producer single consumer queue of block indices
+ */
+class BlockIndexQueue {
+public:
+  void resize(size_t capacity) {
+    mData.resize(capacity + 1);
+    mRead = 0;
+    mWrite = 0;
+  }
+
+  bool push(uint32_t value) {
+    size_t write = mWrite.load(std::memory_order_relaxed);
+    size_t next = (write + 1) % mData.size();
+    if (next == mRead.load(std::memory_order_acquire)) {
+      return false;
+    }
+    mData[write] = value;
+    mWrite.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool front(uint32_t &value) const {
+    size_t read = mRead.load(std::memory_order_relaxed);
+    if (read == mWrite.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = mData[read];
+    return true;
+  }
+
+  void pop() {
+    size_t read = mRead.load(std::memory_order_relaxed);
+    mRead.store((read + 1) % mData.size(), std::memory_order_release);
+  }
+
+  size_t size() const {
+    size_t write = mWrite.load(std::memory_order_acquire);
+    size_t read = mRead.load(std::memory_order_acquire);
+    return (write + mData.size() - read) % mData.size();
+  }
+
+private:
+  std::vector<uint32_t> mData{0};
+  std::atomic<size_t> mRead{0};
+  std::atomic<size_t> mWrite{0};
+};
+
+class StreamScheduler;
+
+/**
+ * @brief Sequential reader for one file served by a StreamScheduler
+ *
+ * read() must only be called from one thread (the audio thread).
+ */
+class ScheduledStream {
+public:
+  enum State : int { IDLE = 0, OPEN_REQUESTED, OPEN, CLOSE_REQUESTED };
+
+  /**
+   * @brief Read interleaved frames
+   * @return number of frames read. Less than numFrames on underrun or at the
+   * end of the file.
+   */
+  size_t read(float *buffer, size_t numFrames);
+
+  bool ready() const { return mState == OPEN && mChannels > 0; }
+  /// True when all frames in the file have been read
+  bool finished() const {
+    return mState == OPEN && mFramesRead >= mFrames && mFrames > 0;
+  }
+  int channels() const { return mChannels; }
+  double frameRate() const { return mFrameRate; }
+  uint64_t frames() const { return mFrames; }
+  /// Number of reads that couldn't be fully served from the buffer
+  uint32_t underruns() const { return mUnderruns; }
+
+private:
+  friend class StreamScheduler;
+
+  StreamScheduler *mScheduler{nullptr};
+  std::atomic<int> mState{IDLE};
+  std::string mPath; // Reserved up front, so open() doesn't allocate
+
+  // Owned by the scheduler thread while the stream is open
+  std::unique_ptr<SoundFileReader> mReader;
+  uint64_t mFileKey{0};
+  uint64_t mNextReadFrame{0};
+
+  // Set by the scheduler thread before the stream becomes OPEN
+  int mChannels{0};
+  double mFrameRate{0.0};
+  uint64_t mFrames{0};
+
+  BlockIndexQueue mFilled;   // Scheduler -> audio
+  BlockIndexQueue mRecycled; // Audio -> scheduler
+  size_t mBlockOffset{0};    // Frames consumed from the front filled block
+  std::atomic<uint64_t> mFramesRead{0};
+  std::atomic<uint32_t> mUnderruns{0};
+};
+
+class StreamScheduler {
+public:
+  /**
+   * @param maxStreams number of streams that can be open at once
+   * @param blockFrames frames per pool block for a single channel file
+   * @param blocksPerStream blocks kept buffered ahead for each stream
+   * @param maxChannels files with more channels use shorter blocks
+   */
+  StreamScheduler(size_t maxStreams = 64, size_t blockFrames = 4096,
+                  size_t blocksPerStream = 4, int maxChannels = 2)
+      : mBlockSamples(blockFrames * maxChannels),
+        mBlocksPerStream(blocksPerStream), mStreams(maxStreams) {
+    // Each stream can hold at most blocksPerStream blocks, so this pool never
+    // runs out, even with all streams open.
+    size_t numBlocks = maxStreams * blocksPerStream;
+    mPool.resize(numBlocks * mBlockSamples);
+    mBlockFrames.resize(numBlocks, 0);
+    for (uint32_t i = 0; i < numBlocks; i++) {
+      mFreeBlocks.push_back(numBlocks - 1 - i);
+    }
+    for (auto &stream : mStreams) {
+      stream.mScheduler = this;
+      stream.mPath.reserve(kMaxPathLength);
+      stream.mFilled.resize(numBlocks);
+      stream.mRecycled.resize(numBlocks);
+    }
+  }
+
+  ~StreamScheduler() { stop(); }
+
+  void start() {
+    if (mRunning) {
+      return;
+    }
+    mRunning = true;
+    mThread = std::thread(&StreamScheduler::ioThread, this);
+  }
+
+  void stop() {
+    if (!mRunning) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lk(mMutex);
+      mRunning = false;
+    }
+    mCondition.notify_one();
+    mThread.join();
+  }
+
+  static const size_t kMaxPathLength = 1024;
+
+  /**
+   * @brief Get a stream for a file
+   * @return nullptr if all streams are in use, or the path is longer than
+   * kMaxPathLength
+   *
+   * Returns immediately without allocating. The stream produces no frames
+   * until the file has been opened by the scheduler thread.
+   */
+  ScheduledStream *open(const std::string &fullPath) {
+    if (fullPath.size() > kMaxPathLength) {
+      return nullptr;
+    }
+    for (auto &stream : mStreams) {
+      int expected = ScheduledStream::IDLE;
+      // Claim stream before writing the path, so a concurrent open() can't
+      // take the same one.
+      if (stream.mState.compare_exchange_strong(expected, -1)) {
+        stream.mPath = fullPath;
+        stream.mBlockOffset = 0;
+        stream.mFramesRead = 0;
+        stream.mUnderruns = 0;
+        stream.mChannels = 0;
+        stream.mState.store(ScheduledStream::OPEN_REQUESTED,
+                            std::memory_order_release);
+        return &stream;
+      }
+    }
+    return nullptr;
+  }
+
+  /// Release a stream obtained with open(). Returns immediately.
+  void close(ScheduledStream *stream) {
+    if (stream) {
+      stream->mState.store(ScheduledStream::CLOSE_REQUESTED,
+                           std::memory_order_release);
+    }
+  }
+
+  /// Number of pool blocks currently holding data
+  size_t blocksInUse() const { return mBlocksInUse; }
+  size_t totalBlocks() const { return mBlockFrames.size(); }
+  size_t openStreams() const { return mOpenStreams; }
+  /// Blocks read by the scheduler since start
+  uint64_t blocksRead() const { return mBlocksRead; }
+
+private:
+  friend class ScheduledStream;
+
+  struct ReadRequest {
+    ScheduledStream *stream;
+    uint64_t fileKey;
+    uint64_t offset;
+
+    bool operator<(const ReadRequest &other) const {
+      return fileKey < other.fileKey ||
+             (fileKey == other.fileKey && offset < other.offset);
+    }
+  };
+
+  float *block(uint32_t index) { return mPool.data() + index * mBlockSamples; }
+
+  static uint64_t fileKey(const std::string &path) {
+#if defined(__unix__) || defined(__APPLE__)
+    // Inode numbers are a reasonable proxy for placement on disk
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+      return uint64_t(st.st_ino);
+    }
+#endif
+    return std::hash<std::string>()(path);
+  }
+
+  // Returns false if the stream was closed while the file was opening
+  bool openStream(ScheduledStream &stream) {
+    stream.mReader = openSoundFileReader(stream.mPath);
+    if (!stream.mReader->opened()) {
+      std::cerr << "ERROR: StreamScheduler could not open " << stream.mPath
+                << std::endl;
+    }
+    stream.mFileKey = fileKey(stream.mPath);
+    stream.mNextReadFrame = 0;
+    stream.mChannels = stream.mReader->channels();
+    stream.mFrameRate = stream.mReader->frameRate();
+    stream.mFrames = stream.mReader->frames();
+    int expected = ScheduledStream::OPEN_REQUESTED;
+    if (!stream.mState.compare_exchange_strong(expected, ScheduledStream::OPEN,
+                                               std::memory_order_acq_rel)) {
+      closeStream(stream);
+      return false;
+    }
+    return true;
+  }
+
+  void closeStream(ScheduledStream &stream) {
+    uint32_t index;
+    while (stream.mRecycled.front(index)) {
+      stream.mRecycled.pop();
+      mFreeBlocks.push_back(index);
+    }
+    while (stream.mFilled.front(index)) {
+      stream.mFilled.pop();
+      mFreeBlocks.push_back(index);
+    }
+    if (stream.mReader) {
+      stream.mReader->close();
+      stream.mReader.reset();
+    }
+    stream.mState.store(ScheduledStream::IDLE, std::memory_order_release);
+  }
+
+  void ioThread() {
+    std::vector<ReadRequest> requests;
+    requests.reserve(mStreams.size());
+    uint64_t headKey = 0;
+    uint64_t headOffset = 0;
+    bool ascending = true;
+
+    std::unique_lock<std::mutex> lk(mMutex);
+    while (mRunning) {
+      mCondition.wait_for(lk, std::chrono::milliseconds(5));
+      if (!mRunning) {
+        break;
+      }
+      lk.unlock();
+
+      size_t openStreams = 0;
+      requests.clear();
+      for (auto &stream : mStreams) {
+        int state = stream.mState.load(std::memory_order_acquire);
+        if (state == ScheduledStream::OPEN_REQUESTED) {
+          if (!openStream(stream)) {
+            continue;
+          }
+          state = ScheduledStream::OPEN;
+        } else if (state == ScheduledStream::CLOSE_REQUESTED) {
+          closeStream(stream);
+          continue;
+        }
+        if (state != ScheduledStream::OPEN) {
+          continue;
+        }
+        openStreams++;
+        uint32_t index;
+        while (stream.mRecycled.front(index)) {
+          stream.mRecycled.pop();
+          mFreeBlocks.push_back(index);
+        }
+        if (stream.mReader->opened() &&
+            stream.mNextReadFrame < stream.mFrames &&
+            stream.mFilled.size() < mBlocksPerStream) {
+          requests.push_back(
+              {&stream, stream.mFileKey,
+               stream.mNextReadFrame * stream.mChannels * sizeof(float)});
+        }
+      }
+      mOpenStreams = openStreams;
+
+      // Elevator ordering: continue the sweep from the last read position in
+      // the current direction, then reverse for the remaining requests.
+      std::sort(requests.begin(), requests.end());
+      ReadRequest head{nullptr, headKey, headOffset};
+      auto split = std::lower_bound(requests.begin(), requests.end(), head);
+      bool reverses;
+      if (ascending) {
+        reverses = split != requests.begin();
+        std::rotate(requests.begin(), split, requests.end());
+        std::reverse(requests.end() - (split - requests.begin()),
+                     requests.end());
+      } else {
+        reverses = split != requests.end();
+        std::reverse(requests.begin(), split);
+      }
+      if (reverses) {
+        ascending = !ascending;
+      }
+
+      for (auto &request : requests) {
+        if (mFreeBlocks.empty()) {
+          break;
+        }
+        ScheduledStream &stream = *request.stream;
+        uint32_t index = mFreeBlocks.back();
+        size_t blockFrames = mBlockSamples / stream.mChannels;
+        size_t framesRead = stream.mReader->readAt(stream.mNextReadFrame,
+                                                   block(index), blockFrames);
+        if (framesRead == 0) {
+          // Nothing ready yet (a file still decoding): retry on the next pass.
+          // Past the end, stop requesting reads for this file.
+          if (stream.mReader->endOfFile(stream.mNextReadFrame)) {
+            stream.mNextReadFrame = stream.mFrames;
+          }
+          continue;
+        }
+        mFreeBlocks.pop_back();
+        mBlockFrames[index] = framesRead;
+        stream.mNextReadFrame += framesRead;
+        stream.mFilled.push(index);
+        headKey = request.fileKey;
+        headOffset = request.offset;
+        mBlocksRead++;
+      }
+      mBlocksInUse = totalBlocks() - mFreeBlocks.size();
+      lk.lock();
+    }
+  }
+
+  const size_t mBlockSamples;
+  const size_t mBlocksPerStream;
+  std::vector<float> mPool;
+  std::vector<size_t> mBlockFrames;
+  std::vector<uint32_t> mFreeBlocks; // Only touched by the scheduler thread
+  std::vector<ScheduledStream> mStreams;
+
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::atomic<bool> mRunning{false};
+
+  std::atomic<size_t> mBlocksInUse{0};
+  std::atomic<size_t> mOpenStreams{0};
+  std::atomic<uint64_t> mBlocksRead{0};
+};
+
+inline size_t ScheduledStream::read(float *buffer, size_t numFrames) {
+  if (mState.load(std::memory_order_acquire) != OPEN || mChannels == 0) {
+    return 0;
+  }
+  size_t framesDone = 0;
+  uint32_t index;
+  while (framesDone < numFrames && mFilled.front(index)) {
+    size_t blockFrames = mScheduler->mBlockFrames[index];
+    size_t count = std::min(numFrames - framesDone, blockFrames - mBlockOffset);
+    std::memcpy(buffer + framesDone * mChannels,
+                mScheduler->block(index) + mBlockOffset * mChannels,
+                count * mChannels * sizeof(float));
+    framesDone += count;
+    mBlockOffset += count;
+    if (mBlockOffset == blockFrames) {
+      mFilled.pop();
+      mRecycled.push(index);
+      mBlockOffset = 0;
+    }
+  }
+  mFramesRead += framesDone;
+  if (framesDone < numFrames && mFramesRead < mFrames) {
+    mUnderruns++;
+  }
+  return framesDone;
+}
+
+} // namespace al
+
+#endif // AL_STREAMSCHEDULER_HPP
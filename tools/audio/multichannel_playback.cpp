@@ -2,28 +2,36 @@
 #include "al/io/al_File.hpp"
 #include "al/io/al_Imgui.hpp"
 #include "al/io/al_Toml.hpp"
-#include "al/sound/al_DownMixer.hpp"
-#include "al/sound/al_SpeakerAdjustment.hpp"
 #include "al/sphere/al_AlloSphereSpeakerLayout.hpp"
 #include "al/sphere/al_SphereUtils.hpp"
 #include "al/ui/al_FileSelector.hpp"
 #include "al/ui/al_ParameterGUI.hpp"
-#include "al_ext/soundfile/al_SoundfileBuffered.hpp"
+
+#include "al_FusedOutputStage.hpp"
+#include "al_MappedSoundFile.hpp"
+#include "al_PlaybackTransport.hpp"
+#include "al_ResamplingReader.hpp"
+#include "al_RoutingMatrix.hpp"
 
 using namespace al;
 
 struct MappedAudioFile {
-  std::unique_ptr<SoundFileBuffered> soundfile;
+  std::unique_ptr<SoundFileReader> soundfile;
   std::vector<size_t> outChannelMap;
   std::string fileInfoText;
   std::string fileName;
   float gain;
+  bool loop{false};
   bool mute{false};
+  int routingInput{0};
 };
 
 class AudioPlayerApp : public App {
 public:
   std::string rootDir{""};
+  // Device sample rate. 0 uses the device's default rate.
+  double sampleRate{0.0};
+  ResamplerQuality resamplerQuality{ResamplerQuality::STANDARD};
 
   ParameterBool play{"play", "", 0.0};
   ParameterBool downmixStereo{"downmixStereo", "", 0.0};
@@ -34,9 +42,12 @@ public:
   bool loadFile(std::string fileName, std::vector<size_t> channelMap,
                 float gain, bool loop) {
     soundfiles.push_back(MappedAudioFile());
-    soundfiles.back().soundfile = std::make_unique<SoundFileBuffered>(
-        File::conformPathToOS(rootDir) + fileName, false, 4096);
-    soundfiles.back().soundfile->loop(loop);
+    // Uncompressed files are memory mapped, so all files share a single
+    // playhead and seeking is instant. Compressed files are decoded ahead in
+    // the background.
+    soundfiles.back().soundfile =
+        openSoundFileReader(File::conformPathToOS(rootDir) + fileName);
+    soundfiles.back().loop = loop;
     if (!soundfiles.back().soundfile->opened()) {
       std::cerr << "ERROR: opening "
                 << File::conformPathToOS(rootDir) + fileName << std::endl;
@@ -58,6 +69,8 @@ public:
     soundfiles.back().fileInfoText +=
         " length: " + std::to_string(soundfiles.back().soundfile->frames()) +
         "\n";
+    soundfiles.back().fileInfoText +=
+        " format: " + soundfiles.back().soundfile->formatInfo() + "\n";
     soundfiles.back().fileInfoText +=
         " gain: " + std::to_string(soundfiles.back().gain) + "\n";
     return true;
@@ -65,39 +78,58 @@ public:
 
   // App callbacks
   void onInit() override {
-    rewind.registerChangeCallback([&](float /*value*/) {
-      play = 0.0;
-      for (auto &sf : soundfiles) {
-        sf.soundfile->seek(0);
-      }
-      play = 1.0;
-    });
+    // Seeks are served by the transport's streaming thread. Playback
+    // continues until the target is prefetched for all files and then
+    // switches with a crossfade.
+    rewind.registerChangeCallback(
+        [&](float /*value*/) { transport.requestSeek(0); });
     fw.registerChangeCallback([&](float /*value*/) {
-      play = 0.0;
-      for (auto &sf : soundfiles) {
-        sf.soundfile->seek(sf.soundfile->currentPosition() +
-                           5 * sf.soundfile->frameRate());
-      }
-      play = 1.0;
+      transport.requestRelativeSeek(
+          int64_t(5 * soundfiles[0].soundfile->frameRate()));
     });
     back.registerChangeCallback([&](float /*value*/) {
-      play = 0.0;
-      for (auto &sf : soundfiles) {
-        sf.soundfile->seek(sf.soundfile->currentPosition() -
-                           5 * sf.soundfile->frameRate());
-      }
-      play = 1.0;
+      transport.requestRelativeSeek(
+          -int64_t(5 * soundfiles[0].soundfile->frameRate()));
     });
 
     AudioDevice dev = AudioDevice::defaultOutput();
     if (sphere::isSphereMachine()) {
       dev = AudioDevice("ECHO X5");
-      gainAdjustment.configure(AlloSphereSpeakerLayoutCompensated(), 1.82);
     }
-    configureAudio(dev, soundfiles.back().soundfile->frameRate(), 1024,
-                   dev.channelsOutMax(), 0);
 
-    audioIO().append(gainAdjustment);
+    // The device runs at its own rate. Files at other rates are converted on
+    // the transport's streaming thread.
+    double rate = sampleRate > 0.0 ? sampleRate : dev.defaultSampleRate();
+    if (rate <= 0.0) {
+      rate = soundfiles.back().soundfile->frameRate();
+    }
+    for (auto &sf : soundfiles) {
+      if (sf.soundfile->frameRate() != rate) {
+        sf.soundfile = std::make_unique<ResamplingReader>(
+            std::move(sf.soundfile), rate, resamplerQuality, sf.loop);
+        sf.fileInfoText +=
+            " resampled to: " + std::to_string(int(rate)) + "\n";
+      }
+    }
+    configureAudio(dev, rate, 1024, dev.channelsOutMax(), 0);
+
+    int maxFileChannels = 1;
+    for (auto &sf : soundfiles) {
+      transport.addReader(sf.soundfile.get(), sf.loop);
+      maxFileChannels = std::max(maxFileChannels, sf.soundfile->channels());
+      sf.routingInput = routing.addInput(sf.soundfile->channels());
+      int numRoutes = std::min(int(sf.outChannelMap.size()),
+                               sf.soundfile->channels());
+      for (int i = 0; i < numRoutes; i++) {
+        routing.addRoute(sf.routingInput, i, int(sf.outChannelMap[i]),
+                         sf.gain);
+      }
+    }
+    transport.prefetchFrames(
+        size_t(2 * soundfiles.back().soundfile->frameRate()));
+    transport.start();
+    readBuffer.resize(2048 * maxFileChannels);
+    fadeBuffer.resize(2048 * maxFileChannels);
 
     int highestChannel = 0;
     for (const auto &sf : soundfiles) {
@@ -109,11 +141,20 @@ public:
       }
     }
     audioIO().channelsOut(highestChannel + 1);
+    outputs.resize(audioIO().channelsOut());
+
+    // Speaker compensation and downmix in a single pass over the output
+    mOutputStage.configure(audioIO().channelsOut());
+    if (sphere::isSphereMachine()) {
+      mOutputStage.compensateDistances(AlloSphereSpeakerLayoutCompensated(),
+                                       rate, 1.82f);
+    }
     if (soundfiles.size() == 6) {
       // assume 5.1 to stereo
-      mDownMixer.set5_1toStereo(audioIO());
-      mDownMixer.setOutputs({0, 1});
+      mOutputStage.stereoDownmix5_1();
     }
+    downmixStereo.registerChangeCallback(
+        [&](float value) { mOutputStage.stereoOutput(value == 1.0f); });
   }
 
   void onCreate() override { imguiInit(); }
@@ -134,15 +175,24 @@ public:
                                     " (Global)##AudioIO");
     ParameterGUI::drawAudioIO(audioIO());
     if (soundfiles.size() > 0) {
-      ImGui::Text("Time: %f", soundfiles[0].soundfile->currentPosition() /
-                                  soundfiles[0].soundfile->frameRate());
+      ImGui::Text("Time: %f",
+                  transport.playhead() / soundfiles[0].soundfile->frameRate());
+    }
+    if (transport.seekPending()) {
+      ImGui::Text("Seeking...");
+    } else {
+      ImGui::Text("Seek latency: %.1f ms (prefetch %.1f ms)",
+                  transport.lastSeekLatencyMs(), transport.lastPrefetchMs());
     }
     ImGui::Separator();
     for (auto &sf : soundfiles) {
       ImGui::Text("*** %s", sf.fileName.c_str());
       ImGui::SameLine(0, 20);
       ImGui::PushID(sf.soundfile.get());
-      ImGui::Checkbox("Mute", &sf.mute);
+      if (ImGui::Checkbox("Mute", &sf.mute)) {
+        // Ramped by the routing matrix
+        routing.setInputMute(sf.routingInput, sf.mute);
+      }
       ImGui::Text("%s", sf.fileInfoText.c_str());
       ImGui::PopID();
     }
@@ -154,31 +204,56 @@ public:
   }
 
   void onSound(AudioIOData &io) override {
-    float buffer[2048 * 60];
     if (play.get() == 1.0f) {
+      const size_t frames = io.framesPerBuffer();
+      auto block = transport.beginBlock(frames);
+      for (size_t i = 0; i < outputs.size(); i++) {
+        outputs[i] = io.outBuffer(i);
+      }
       for (auto &sf : soundfiles) {
         int numChannels = sf.soundfile->channels();
-        int framesRead = sf.soundfile->read(buffer, io.framesPerBuffer());
-        if (framesRead != io.framesPerBuffer()) {
-          std::cout << "short buffer " << framesRead << std::endl;
+        float *buffer = readBuffer.data();
+        if (block.crossfade) {
+          // Read the old position first so buffered readers keep streaming
+          // sequentially up to the switch.
+          readFile(sf, block.fadeFrom, fadeBuffer.data(), frames);
         }
-        for (size_t i = 0; i < sf.outChannelMap.size(); i++) {
-          size_t outIndex = sf.outChannelMap[i];
-          if (!sf.mute) {
-            for (uint64_t sample = 0; sample < framesRead; sample++) {
-              io.outBuffer(outIndex)[sample] +=
-                  sf.gain * buffer[sample * numChannels + i];
-            }
-          }
+        readFile(sf, block.position, buffer, frames);
+        if (block.crossfade) {
+          PlaybackTransport::crossfade(buffer, fadeBuffer.data(), numChannels,
+                                       block.fadeFrames);
         }
+        routing.mix(sf.routingInput, buffer, frames, outputs.data());
       }
-      if (downmixStereo.get() == 1.0) {
-        mDownMixer.downMix(io);
-      }
+      transport.endBlock(frames);
+    } else {
+      transport.idleBlock();
     }
+    mOutputStage.process(io);
+  }
+
+  // Read frames at transport position. Frames past the end of a file that is
+  // not looping, or not decoded yet, are set to 0.
+  size_t readFile(MappedAudioFile &sf, uint64_t position, float *buffer,
+                  size_t frames) {
+    int numChannels = sf.soundfile->channels();
+    uint64_t filePosition =
+        PlaybackTransport::readerPosition(*sf.soundfile, sf.loop, position);
+    size_t framesRead = sf.soundfile->readAt(filePosition, buffer, frames);
+    // Wrap to the start only at the loop point, not when frames are missing
+    // because a decoding reader is behind
+    if (sf.loop && framesRead < frames &&
+        sf.soundfile->endOfFile(filePosition + framesRead)) {
+      framesRead += sf.soundfile->readAt(0, buffer + framesRead * numChannels,
+                                         frames - framesRead);
+    }
+    std::fill(buffer + framesRead * numChannels, buffer + frames * numChannels,
+              0.0f);
+    return framesRead;
   }
 
   void onExit() override {
+    transport.stop();
     for (auto &sf : soundfiles) {
       sf.soundfile->close();
     }
@@ -187,8 +262,12 @@ public:
 
 private:
   std::vector<MappedAudioFile> soundfiles;
-  SpeakerDistanceGainAdjustmentProcessor gainAdjustment;
-  DownMixer mDownMixer;
+  PlaybackTransport transport;
+  std::vector<float> readBuffer;
+  std::vector<float> fadeBuffer;
+  RoutingMatrix routing;
+  std::vector<float *> outputs;
+  FusedOutputStage mOutputStage;
 };
 
 int main(int argc, char *argv[]) {
@@ -197,6 +276,8 @@ int main(int argc, char *argv[]) {
   /* Load configuration from text file. Config file should look like:
 
 rootDir = "files/"
+sampleRate = 48000 # Optional, default is the device's rate
+resamplerQuality = "standard" # "fast", "standard" or "high"
 [[file]]
 name = "test.wav"
 outChannels = [0, 1]
@@ -219,6 +300,13 @@ gain = 1.2
   if (appConfig.hasKey<std::string>("rootDir")) {
     app.rootDir = appConfig.gets("rootDir");
   }
+  if (appConfig.hasKey<double>("sampleRate")) {
+    app.sampleRate = appConfig.getd("sampleRate");
+  }
+  if (appConfig.hasKey<std::string>("resamplerQuality")) {
+    app.resamplerQuality =
+        resamplerQualityFromString(appConfig.gets("resamplerQuality"));
+  }
   if (appConfig.hasKey<double>("globalGain")) {
     assert(app.audioDomain()->parameters()[0]->getName() == "gain");
     app.audioDomain()->parameters()[0]->fromFloat(appConfig.getd("globalGain"));
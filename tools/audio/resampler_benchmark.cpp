@@ -0,0 +1,83 @@
+// Measures the cost of PolyphaseResampler for 60 channels, the channel count
+// of the AlloSphere, at every quality setting.
+//
+// Each case converts 10 seconds of noise, once as a single 60 channel stream
+// and once as 60 mono streams (one per file). The real time factor is how
+// many times faster than real time the conversion runs on one core.
+//
+// Usage: resampler_benchmark [seconds]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "al_PolyphaseResampler.hpp"
+
+using namespace al;
+
+static const int kChannels = 60;
+static const size_t kBlockFrames = 1024;
+
+// Convert seconds of input for all streams. Returns elapsed seconds.
+double convert(std::vector<PolyphaseResampler> &streams,
+               const std::vector<float> &noise, double inRate, double seconds) {
+  std::vector<float> output(kBlockFrames * kChannels);
+  size_t inputFrames = size_t(inRate * seconds);
+  auto start = std::chrono::steady_clock::now();
+  for (auto &stream : streams) {
+    size_t pushed = 0;
+    while (pushed < inputFrames) {
+      size_t count = std::min(kBlockFrames, inputFrames - pushed);
+      // Noise is reused from the start of the buffer. Only the cost matters.
+      count = stream.push(noise.data(), count);
+      pushed += count;
+      while (stream.pull(output.data(), kBlockFrames) > 0) {
+      }
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double>(elapsed).count();
+}
+
+int main(int argc, char *argv[]) {
+  double seconds = argc > 1 ? std::atof(argv[1]) : 10.0;
+  const double rates[][2] = {
+      {44100, 48000}, {48000, 44100}, {96000, 48000}, {88200, 48000}};
+  const ResamplerQuality qualities[] = {ResamplerQuality::FAST,
+                                        ResamplerQuality::STANDARD,
+                                        ResamplerQuality::HIGH};
+
+  std::vector<float> noise(kBlockFrames * kChannels);
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+  for (auto &sample : noise) {
+    sample = distribution(generator);
+  }
+
+  std::printf("%d channels, %.1f s of audio per case\n", kChannels, seconds);
+  std::printf("%-9s %-13s %5s %6s %14s %14s\n", "quality", "conversion",
+              "taps", "phases", "60ch stream", "60 mono");
+  for (auto quality : qualities) {
+    for (auto &rate : rates) {
+      std::vector<PolyphaseResampler> multichannel(1);
+      multichannel[0].setup(rate[0], rate[1], kChannels, quality);
+      std::vector<PolyphaseResampler> mono(kChannels);
+      for (auto &stream : mono) {
+        stream.setup(rate[0], rate[1], 1, quality);
+      }
+      double multichannelTime = convert(multichannel, noise, rate[0], seconds);
+      double monoTime = convert(mono, noise, rate[0], seconds);
+      char conversion[32];
+      std::snprintf(conversion, sizeof(conversion), "%.1f->%.1f",
+                    rate[0] / 1000.0, rate[1] / 1000.0);
+      std::printf("%-9s %-13s %5d %6llu %13.1fx %13.1fx\n",
+                  toString(quality).c_str(), conversion,
+                  multichannel[0].taps(),
+                  (unsigned long long)multichannel[0].phases(),
+                  seconds / multichannelTime, seconds / monoTime);
+    }
+  }
+  return 0;
+}
@@ -7,22 +7,32 @@
 #include "al/io/al_Toml.hpp"
 #include "al/math/al_Spherical.hpp"
 #include "al/scene/al_DistributedScene.hpp"
-#include "al/sound/al_DownMixer.hpp"
 #include "al/sound/al_Lbap.hpp"
 #include "al/sound/al_Speaker.hpp"
-#include "al/sound/al_SpeakerAdjustment.hpp"
 #include "al/sphere/al_AlloSphereSpeakerLayout.hpp"
 #include "al/sphere/al_Meter.hpp"
 #include "al/sphere/al_SphereUtils.hpp"
 #include "al/ui/al_FileSelector.hpp"
 #include "al/ui/al_ParameterGUI.hpp"
 
-#include "al_ext/soundfile/al_SoundfileBuffered.hpp"
 #include "al_ext/statedistribution/al_CuttleboneDomain.hpp"
 
+#include "al_AmbisonicBus.hpp"
+#include "al_AutomationCurves.hpp"
+#include "al_FusedOutputStage.hpp"
+#include "al_GainTableSpatializer.hpp"
+#include "al_MappedSoundFile.hpp"
+#include "al_SplitSpatializer.hpp"
+#include "al_StreamScheduler.hpp"
+
 #include "Gamma/Analysis.h"
 #include "Gamma/scl.h"
 
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
 using namespace al;
 
 struct SharedState {
@@ -30,7 +40,7 @@ struct SharedState {
 };
 
 struct MappedAudioFile {
-  std::unique_ptr<SoundFileBuffered> soundfile;
+  std::unique_ptr<SoundFileReader> soundfile;
   std::vector<size_t> outChannelMap;
   std::string fileInfoText;
   std::string fileName;
@@ -43,6 +53,8 @@ struct AudioObjectData {
   uint16_t audioSampleRate;
   uint16_t audioBlockSize;
   Mesh *mesh;
+  StreamScheduler *streams;
+  AutomationBank *automation;
 };
 
 class AudioObject : public PositionedVoice {
@@ -62,18 +74,15 @@ public:
     registerTriggerParameters(file, automation, gain);
     registerParameters(env);             // Propagate from audio rendering node
     registerParameters(parameterPose()); // Update position in secondary nodes
-
-    mSequencer << parameterPose();
-    mPresetHandler << parameterPose();
-    mSequencer << mPresetHandler; // For morphing
   }
 
   void onProcess(AudioIOData &io) override {
+    if (!mStream || !mStream->ready()) {
+      return;
+    }
     float buffer[2048 * 60];
-    int numChannels = soundfile.channels();
-    assert(io.framesPerBuffer() < INT32_MAX);
-    auto framesRead =
-        soundfile.read(buffer, static_cast<int>(io.framesPerBuffer()));
+    int numChannels = mStream->channels();
+    auto framesRead = mStream->read(buffer, io.framesPerBuffer());
     int outIndex = 0;
     size_t inChannel = 0;
     if (!mute) {
@@ -102,17 +111,31 @@ public:
 
     if (isPrimary()) {
       auto &rootPath = objData->rootPath;
-      soundfile.open(File::conformPathToOS(rootPath) + file.get());
-      if (!soundfile.opened()) {
-        std::cerr << "ERROR: opening audio file: "
+      // The file is opened and streamed by the app's shared scheduler thread
+      mStreams = objData->streams;
+      mStream = mStreams->open(File::conformPathToOS(rootPath) + file.get());
+      if (!mStream) {
+        std::cerr << "ERROR: no free streams for audio file: "
                   << File::conformPathToOS(rootPath) + file.get() << std::endl;
       }
 
-      float seqStep = (float)objData->audioBlockSize / objData->audioSampleRate;
-      mSequencer.setSequencerStepTime(seqStep);
-
-      mSequencer.playSequence(File::conformPathToOS(rootPath) +
-                              automation.get());
+      // The automation file was parsed when the app started. Only its
+      // breakpoints from this object's starting pose are computed here, into
+      // curves reserved for the longest file.
+      mAutomationTime = 0.0;
+      mPoseCursor = 0;
+      mGainCursor = 0;
+      mPoseCurve.clear();
+      mGainCurve.clear();
+      if (auto *events = objData->automation->find(automation.get())) {
+        if (auto *poseEvents = events->find("/_pose")) {
+          mPoseCurve.build(*poseEvents, pose());
+          setPose(mPoseCurve.pose(0.0, mPoseCursor));
+        }
+        if (auto *gainEvents = events->find("/gain")) {
+          mGainCurve.build(*gainEvents, gain);
+        }
+      }
     }
     auto colorIndex = automation.get()[0] - 'A';
     c = HSV(colorIndex / 6.0f, 1.0f, 1.0f);
@@ -120,18 +143,54 @@ public:
 
   void onTriggerOff() override {
     if (isPrimary()) {
-      mPresetHandler.stopMorphing();
-      mSequencer.stopSequence();
-      soundfile.close();
+      closeStream();
     }
   }
 
-  void onFree() override { soundfile.close(); }
+  void onFree() override { closeStream(); }
+
+  /// Make room for curves of up to events events per parameter
+  void reserveAutomation(size_t events) {
+    mPoseCurve.reserve(events);
+    mGainCurve.reserve(events);
+  }
+
+  /// Add the pose for the current block to batch. Returns the index in
+  /// batch, or -1 if the object isn't automated.
+  int addAutomation(PoseAutomationBatch &batch) {
+    if (mPoseCurve.empty()) {
+      return -1;
+    }
+    return batch.add(mPoseCurve, mAutomationTime, mPoseCursor);
+  }
+
+  /// Set the automated values for the current block and advance the time
+  void applyAutomation(const PoseAutomationBatch &batch, int index,
+                       double blockTime) {
+    if (index >= 0) {
+      setPose(batch.pose(index));
+    }
+    if (!mGainCurve.empty()) {
+      gain = mGainCurve.value(mAutomationTime, mGainCursor);
+    }
+    mAutomationTime += blockTime;
+  }
 
 private:
-  PresetSequencer mSequencer;
-  PresetHandler mPresetHandler{""};
-  SoundFileBuffered soundfile{8192};
+  void closeStream() {
+    if (mStream) {
+      mStreams->close(mStream);
+      mStream = nullptr;
+    }
+  }
+
+  PoseCurve mPoseCurve;
+  ScalarCurve mGainCurve;
+  double mAutomationTime{0.0};
+  size_t mPoseCursor{0};
+  size_t mGainCursor{0};
+  StreamScheduler *mStreams{nullptr};
+  ScheduledStream *mStream{nullptr};
   Color c;
 
   gam::EnvFollow<> mEnvFollow;
@@ -147,7 +206,10 @@ public:
   ParameterBool downMix{"downMix"};
 
   PersistentConfig config;
-  DownMixer downMixer;
+
+  // Speaker partitions rendered in separate processes. 0 renders all speakers
+  // in the audio thread.
+  int renderPartitions{0};
 
   void setPath(std::string path) {
     rootDir = al::File::conformDirectory(path);
@@ -160,24 +222,56 @@ public:
     mObjectData.rootPath = rootDir;
     mObjectData.audioSampleRate = audioIO().framesPerSecond();
     mObjectData.audioBlockSize = audioIO().framesPerBuffer();
+    mObjectData.streams = &mStreams;
+    mObjectData.automation = &mAutomationBank;
     scene.setDefaultUserData(&mObjectData);
+    if (isPrimary()) {
+      mStreams.start();
+      loadAutomation();
+    }
 
     if (al::sphere::isSimulatorMachine()) {
     }
     auto sl = al::AlloSphereSpeakerLayoutCompensated();
-    mSpatializer = scene.setSpatializer<Lbap>(sl);
+    if (isPrimary() && renderPartitions > 0) {
+      // Same gains as below, with groups of speakers rendered in parallel one
+      // block later
+      mSplitSpatializer = scene.setSpatializer<SplitSpatializer<Lbap>>(sl);
+      mSplitSpatializer->start(renderPartitions);
+      mSpatializer = mSplitSpatializer;
+    } else {
+      // Lbap gains are baked into a direction table once, so moving objects
+      // only cost a table lookup per block
+      mSpatializer = scene.setSpatializer<GainTableSpatializer<Lbap>>(sl);
+    }
+    // For 3rd order Ambisonics, decoded to the speakers once per block:
+    //    mSpatializer = scene.setSpatializer<AmbisonicBusSpatializer>(sl);
 
     audioIO().channelsOut(60);
     audioIO().print();
 
-    downMixer.layoutToStereo(sl, audioIO());
-    downMixer.setStereoOutput();
+    // Metering, stereo downmix, LFE send and speaker compensation all happen
+    // in one pass at the end of onSound()
+    mOutputStage.configure(audioIO().channelsOut());
+    mOutputStage.stereoDownmixFromLayout(sl);
+    mOutputStage.lfeSend(47, 0.1f);
+    if (sphere::isSphereMachine()) {
+      mOutputStage.compensateDistances(sl, audioIO().framesPerSecond(), 1.82f);
+    }
+    downMix.registerChangeCallback(
+        [&](float value) { mOutputStage.stereoOutput(value == 1.0f); });
 
     mSequencer << scene;
 
     registerDynamicScene(scene);
     scene.registerSynthClass<AudioObject>(); // Allow AudioObject in sequences
-    scene.allocatePolyphony<AudioObject>(16);
+    scene.allocatePolyphony<AudioObject>(64);
+    mAutomated.reserve(64);
+    for (auto *voice = scene.getFreeVoices(); voice; voice = voice->next) {
+      if (auto *object = dynamic_cast<AudioObject *>(voice)) {
+        object->reserveAutomation(mAutomationBank.maxEvents());
+      }
+    }
 
     // Prepare GUI
     if (isPrimary()) {
@@ -185,6 +279,16 @@ public:
       auto &gui = guiDomain->newGUI();
       gui << downMix << mSequencer << audioDomain()->parameters()[0];
       gui.drawFunction = [&]() {
+        ImGui::Text("Streams: %i  Blocks in use: %i/%i",
+                    (int)mStreams.openStreams(), (int)mStreams.blocksInUse(),
+                    (int)mStreams.totalBlocks());
+        if (mSplitSpatializer) {
+          for (int p = 0; p < mSplitSpatializer->partitions(); p++) {
+            ImGui::Text("Partition %i: headroom %.0f%%  underruns %u", p,
+                        100.0f * (1.0f - mSplitSpatializer->peakLoad(p)),
+                        mSplitSpatializer->underruns(p));
+          }
+        }
         if (ParameterGUI::drawAudioIO(audioIO())) {
           scene.prepare(audioIO());
           mObjectData.audioSampleRate = audioIO().framesPerSecond();
@@ -207,12 +311,9 @@ public:
   void onAnimate(double dt) override {
     mSequencer.update(dt);
     if (isPrimary()) {
-      auto &values = mMeter.getMeterValues();
-      assert(values.size() < 65);
-      memcpy(state().meterValues, values.data(), values.size() * sizeof(float));
-    } else {
-      mMeter.setMeterValues(state().meterValues, 64);
+      mOutputStage.meterValues(state().meterValues, 64);
     }
+    mMeter.setMeterValues(state().meterValues, 64);
   }
 
   void onDraw(Graphics &g) override {
@@ -237,42 +338,129 @@ public:
   }
 
   void onSound(AudioIOData &io) override {
-    mSequencer.render(io);
-    mMeter.processSound(io);
-    // downmix to stereo to bus 0 and 1
-    downMixer.downMixToBus(io);
-    // This can be used to create a global reverb
-    while (io()) {
-      float lfeLevel = 0.1;
-      io.out(47) += io.bus(0) * lfeLevel;
-      io.out(47) += io.bus(1) * lfeLevel;
+    // Poses of all automated objects for this block, evaluated together
+    mAutomation.clear();
+    mAutomated.clear();
+    for (auto *voice = scene.getActiveVoices(); voice; voice = voice->next) {
+      if (auto *object = dynamic_cast<AudioObject *>(voice)) {
+        mAutomated.push_back({object, object->addAutomation(mAutomation)});
+      }
     }
-    if (downMix) {
-      downMixer.copyBusToOuts(io);
+    mAutomation.evaluate();
+    const double blockTime = io.framesPerBuffer() / io.framesPerSecond();
+    for (auto &automated : mAutomated) {
+      automated.object->applyAutomation(mAutomation, automated.index,
+                                        blockTime);
     }
+    mSequencer.render(io);
+    mOutputStage.process(io);
   }
 
-  void onExit() override {}
+  void onExit() override {
+    mStreams.stop();
+    if (mSplitSpatializer) {
+      mSplitSpatializer->stop();
+    }
+  }
 
 private:
+  // Parse the automation files of every AudioObject in the folder's
+  // sequences, and the other sequence files there, before audio starts
+  void loadAutomation() {
+    mAutomationBank.preload(rootDir);
+    const std::string extension = ".synthSequence";
+    for (auto &entry : itemListInDir(rootDir)) {
+      const std::string &name = entry.file();
+      if (entry.isDir() || name.size() < extension.size() ||
+          name.compare(name.size() - extension.size(), extension.size(),
+                       extension) != 0) {
+        continue;
+      }
+      std::ifstream file(entry.filepath());
+      std::string line;
+      while (std::getline(file, line)) {
+        // @ start duration AudioObject "file" "automation" gain ...
+        auto fields = splitFields(line);
+        if (fields.size() < 6 || (fields[0] != "@" && fields[0] != "+") ||
+            fields[3] != "AudioObject") {
+          continue;
+        }
+        if (!mAutomationBank.load(rootDir, fields[5])) {
+          std::cerr << "WARNING: can't read automation file " << fields[5]
+                    << " used in " << name << std::endl;
+        }
+      }
+    }
+    for (auto &file : mAutomationBank.files()) {
+      for (auto &parameter : file.second.parameters) {
+        if (parameter.first != "/_pose" && parameter.first != "/gain") {
+          std::cerr << "WARNING: automation file " << file.first
+                    << " sets " << parameter.first
+                    << ", only /_pose and /gain are automated" << std::endl;
+        }
+      }
+    }
+  }
+
+  // Space separated fields, with double quoted fields kept whole
+  static std::vector<std::string> splitFields(const std::string &line) {
+    std::vector<std::string> fields;
+    size_t i = 0;
+    while (i < line.size()) {
+      if (line[i] == ' ' || line[i] == '\t' || line[i] == '\r') {
+        i++;
+      } else if (line[i] == '"') {
+        size_t end = line.find('"', i + 1);
+        if (end == std::string::npos) {
+          end = line.size();
+        }
+        fields.push_back(line.substr(i + 1, end - i - 1));
+        i = end + 1;
+      } else {
+        size_t end = line.find_first_of(" \t\r", i);
+        if (end == std::string::npos) {
+          end = line.size();
+        }
+        fields.push_back(line.substr(i, end - i));
+        i = end;
+      }
+    }
+    return fields;
+  }
+
+  struct AutomatedObject {
+    AudioObject *object;
+    int index;
+  };
+
   VAOMesh mObjectMesh;
   VAOMesh mSphereMesh;
 
   SynthSequencer mSequencer{TimeMasterMode::TIME_MASTER_CPU};
   AudioObjectData mObjectData;
-  SpeakerDistanceGainAdjustmentProcessor gainAdjustment;
+  // Single I/O thread and buffer pool for all AudioObject files
+  StreamScheduler mStreams{64, 8192, 3, 2};
+  // Sequence files parsed once, evaluated for all objects every block
+  AutomationBank mAutomationBank;
+  PoseAutomationBatch mAutomation{64};
+  std::vector<AutomatedObject> mAutomated;
+  FusedOutputStage mOutputStage;
   Meter mMeter;
   std::shared_ptr<Spatializer> mSpatializer;
+  std::shared_ptr<SplitSpatializer<Lbap>> mSplitSpatializer;
 };
 
 int main(int argc, char *argv[]) {
   SpatialSequencer app;
 
-  std::string folder;
-  if (argc > 1) {
-    folder = argv[1];
-  } else {
-    folder = "Morris Allosphere piece";
+  std::string folder = "Morris Allosphere piece";
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--partitions" && i + 1 < argc) {
+      app.renderPartitions = std::atoi(argv[++i]);
+    } else {
+      folder = arg;
+    }
   }
   app.setPath(folder);
 
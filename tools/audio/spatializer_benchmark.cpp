@@ -0,0 +1,575 @@
+// Measures the cost of the spatializers for a DynamicScene, to choose one for
+// a room.
+//
+// Every case renders a scene like 11_audio_spatialization_scene.cpp without
+// an audio device: N voices playing noise, moving in one of three patterns
+// (static, orbiting, jumping to a random direction every block), rendered
+// through a spatializer to a layout of 2, 8, 60 (AlloSphere) or 128
+// speakers. Cases are swept over source counts and block sizes. For every
+// case the best of three runs is reported as nanoseconds per sample per
+// source, and last level cache misses per block are read from perf_event
+// where the kernel allows it.
+//
+// Costs are also written normalized by a fixed calibration loop, so a
+// baseline recorded on one machine can be compared on a similar one. With
+// --baseline the program exits with an error if any case is slower than its
+// baseline by more than the tolerance. With --relative it does if a batched
+// or table spatializer is slower than the spatializer it replaces, measured
+// in the same run, by more than the tolerance. That one needs no baseline, so
+// CI can run it on any machine.
+//
+// Usage: spatializer_benchmark [--quick] [--csv file] [--baseline file]
+//                              [--relative] [--tolerance fraction]
+//                              [--seconds s] [--filter name]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "al/io/al_AudioIOData.hpp"
+#include "al/scene/al_DynamicScene.hpp"
+#include "al/sound/al_Ambisonics.hpp"
+#include "al/sound/al_Dbap.hpp"
+#include "al/sound/al_Lbap.hpp"
+#include "al/sound/al_Speaker.hpp"
+#include "al/sound/al_StereoPanner.hpp"
+#include "al/sound/al_Vbap.hpp"
+#include "al/sphere/al_AlloSphereSpeakerLayout.hpp"
+
+#include "al_AmbisonicBus.hpp"
+#include "al_GainTableSpatializer.hpp"
+#include "al_SpatialMixKernel.hpp"
+
+using namespace al;
+
+static const double kSampleRate = 48000.0;
+static const size_t kNoiseFrames = 4096;
+
+// Cache misses of this thread, if perf_event is available
+class CacheMissCounter {
+public:
+  CacheMissCounter() {
+#ifdef __linux__
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    mFd = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+  }
+
+  ~CacheMissCounter() {
+#ifdef __linux__
+    if (mFd >= 0) {
+      close(mFd);
+    }
+#endif
+  }
+
+  bool available() const { return mFd >= 0; }
+
+  void start() {
+#ifdef __linux__
+    if (mFd >= 0) {
+      ioctl(mFd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(mFd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  /// Misses since start(), or -1
+  long long stop() {
+#ifdef __linux__
+    long long count = 0;
+    if (mFd >= 0) {
+      ioctl(mFd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(mFd, &count, sizeof(count)) == sizeof(count)) {
+        return count;
+      }
+    }
+#endif
+    return -1;
+  }
+
+private:
+  int mFd{-1};
+};
+
+// Plays a loop of noise, so synthesis costs next to nothing
+struct NoiseVoice : public PositionedVoice {
+  void onProcess(AudioIOData &io) override {
+    const float *noise = static_cast<const float *>(userData());
+    while (io()) {
+      io.out(0) += noise[mPosition];
+      mPosition = (mPosition + 1) % kNoiseFrames;
+    }
+  }
+
+  size_t mPosition{0};
+  Vec3d mDirection;
+  double mSpeed{0.0};
+};
+
+enum class Motion { STATIC, ORBIT, JUMP };
+
+const char *toString(Motion motion) {
+  switch (motion) {
+  case Motion::STATIC:
+    return "static";
+  case Motion::ORBIT:
+    return "orbit";
+  case Motion::JUMP:
+    return "jump";
+  }
+  return "";
+}
+
+struct Layout {
+  std::string name;
+  Speakers speakers;
+  bool rings; // More than one elevation
+};
+
+// Rings of speakers, given as {elevation, count}
+Speakers ringLayout(const std::vector<std::pair<float, int>> &rings) {
+  Speakers speakers;
+  int channel = 0;
+  for (auto &ring : rings) {
+    for (int i = 0; i < ring.second; i++) {
+      speakers.push_back(
+          Speaker(channel++, 360.0f * i / ring.second - 180.0f, ring.first));
+    }
+  }
+  return speakers;
+}
+
+// Spatializers that need constructor arguments setSpatializer() can't pass
+struct Vbap3D : public Vbap {
+  Vbap3D(const Speakers &sl) : Vbap(sl, true) {}
+};
+
+struct Ambisonics2D : public AmbisonicsSpatializer {
+  Ambisonics2D(const Speakers &sl) : AmbisonicsSpatializer(sl, 2, 3) {}
+};
+
+struct Ambisonics3D : public AmbisonicsSpatializer {
+  Ambisonics3D(const Speakers &sl) : AmbisonicsSpatializer(sl, 3, 3) {}
+};
+
+struct SpatializerCase {
+  const char *name;
+  bool (*supports)(const Layout &layout);
+  void (*install)(DynamicScene &scene, const Speakers &speakers);
+  // Spatializer this one replaces, listed before it, for --relative
+  const char *reference;
+};
+
+static bool anyLayout(const Layout &) { return true; }
+static bool stereoLayout(const Layout &layout) {
+  return layout.speakers.size() == 2;
+}
+static bool ringLayouts(const Layout &layout) { return layout.rings; }
+
+static const SpatializerCase kSpatializers[] = {
+    {"StereoPanner", stereoLayout,
+     [](DynamicScene &s, const Speakers &sl) {
+       s.setSpatializer<StereoPanner>(sl);
+     },
+     nullptr},
+    {"Vbap",
+     [](const Layout &layout) {
+       return !layout.rings && layout.speakers.size() > 2;
+     },
+     [](DynamicScene &s, const Speakers &sl) { s.setSpatializer<Vbap>(sl); },
+     nullptr},
+    {"Vbap3D", ringLayouts,
+     [](DynamicScene &s, const Speakers &sl) { s.setSpatializer<Vbap3D>(sl); },
+     nullptr},
+    {"Dbap", anyLayout,
+     [](DynamicScene &s, const Speakers &sl) { s.setSpatializer<Dbap>(sl); },
+     nullptr},
+    {"Lbap", ringLayouts,
+     [](DynamicScene &s, const Speakers &sl) { s.setSpatializer<Lbap>(sl); },
+     nullptr},
+    {"Ambisonics",
+     [](const Layout &layout) {
+       return !layout.rings && layout.speakers.size() > 2;
+     },
+     [](DynamicScene &s, const Speakers &sl) {
+       s.setSpatializer<Ambisonics2D>(sl);
+     },
+     nullptr},
+    {"Ambisonics3D", ringLayouts,
+     [](DynamicScene &s, const Speakers &sl) {
+       s.setSpatializer<Ambisonics3D>(sl);
+     },
+     nullptr},
+    {"GainTable<Lbap>", ringLayouts,
+     [](DynamicScene &s, const Speakers &sl) {
+       s.setSpatializer<GainTableSpatializer<Lbap>>(sl);
+     },
+     "Lbap"},
+    {"Batched<Lbap>", ringLayouts,
+     [](DynamicScene &s, const Speakers &sl) {
+       s.setSpatializer<BatchedSpatializer<Lbap>>(sl);
+     },
+     "Lbap"},
+    {"Batched<Dbap>", anyLayout,
+     [](DynamicScene &s, const Speakers &sl) {
+       s.setSpatializer<BatchedSpatializer<Dbap>>(sl);
+     },
+     "Dbap"},
+    {"AmbisonicBus", anyLayout,
+     [](DynamicScene &s, const Speakers &sl) {
+       s.setSpatializer<AmbisonicBusSpatializer>(sl);
+     },
+     nullptr},
+};
+
+struct Result {
+  double nsPerSampleSource{0.0};
+  long long cacheMissesPerBlock{-1};
+};
+
+// Batching and tables pay off with many sources and speakers. Smaller cases
+// aren't compared with --relative, their costs are dominated by overhead.
+static bool comparedRelative(const Layout &layout, int sources) {
+  return sources >= 16 && layout.speakers.size() >= 8;
+}
+
+static Vec3d randomDirection(std::mt19937 &generator) {
+  std::normal_distribution<double> normal;
+  Vec3d dir(normal(generator), normal(generator), normal(generator));
+  double length = std::max(dir.mag(), 1e-9);
+  return Vec3d(dir.x / length, dir.y / length, dir.z / length);
+}
+
+static void moveVoices(std::vector<NoiseVoice *> &voices, Motion motion,
+                       double time, std::mt19937 &generator) {
+  const double distance = 3.0;
+  for (auto *voice : voices) {
+    Vec3d dir = voice->mDirection;
+    if (motion == Motion::ORBIT) {
+      double angle = voice->mSpeed * time;
+      double c = std::cos(angle);
+      double s = std::sin(angle);
+      dir = Vec3d(c * dir.x + s * dir.z, dir.y, -s * dir.x + c * dir.z);
+    } else if (motion == Motion::JUMP) {
+      dir = randomDirection(generator);
+    }
+    voice->setPose(
+        Pose(Vec3d(dir.x * distance, dir.y * distance, dir.z * distance)));
+  }
+}
+
+static Result runCase(const SpatializerCase &spatializer, const Layout &layout,
+                      int sources, unsigned blockSize, Motion motion,
+                      double seconds, const std::vector<float> &noise,
+                      CacheMissCounter &counter) {
+  AudioIOData io;
+  io.framesPerSecond(kSampleRate);
+  io.framesPerBuffer(blockSize);
+  int channels = 0;
+  for (auto &speaker : layout.speakers) {
+    channels = std::max(channels, int(speaker.deviceChannel) + 1);
+  }
+  io.channels(std::max(channels, 2), true);
+
+  DynamicScene scene;
+  spatializer.install(scene, layout.speakers);
+  scene.setDefaultUserData(const_cast<float *>(noise.data()));
+  scene.prepare(io);
+
+  std::mt19937 generator(sources);
+  std::uniform_real_distribution<double> speed(0.2, 2.0);
+  std::vector<NoiseVoice *> voices;
+  for (int i = 0; i < sources; i++) {
+    auto *voice = scene.getVoice<NoiseVoice>();
+    voice->mDirection = randomDirection(generator);
+    voice->mSpeed = speed(generator);
+    voice->mPosition = (i * 97) % kNoiseFrames;
+    voices.push_back(voice);
+    scene.triggerOn(voice);
+  }
+
+  const size_t blocks =
+      std::max(size_t(8), size_t(seconds * kSampleRate / blockSize));
+  double time = 0.0;
+  auto renderBlock = [&]() {
+    moveVoices(voices, motion, time, generator);
+    io.zeroOut();
+    io.frame(0);
+    scene.render(io);
+    time += blockSize / kSampleRate;
+  };
+  // Warm up and let the scene insert the voices
+  for (int i = 0; i < 4; i++) {
+    renderBlock();
+  }
+
+  Result best;
+  best.nsPerSampleSource = 1e30;
+  for (int run = 0; run < 3; run++) {
+    counter.start();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < blocks; i++) {
+      renderBlock();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    long long misses = counter.stop();
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() /
+                (double(blocks) * blockSize * sources);
+    if (ns < best.nsPerSampleSource) {
+      best.nsPerSampleSource = ns;
+      best.cacheMissesPerBlock = misses < 0 ? -1 : misses / (long long)blocks;
+    }
+  }
+  return best;
+}
+
+// Nanoseconds per iteration of a fixed multiply-add loop. Normalizes results
+// across machines of similar architecture.
+static double calibrate() {
+  std::vector<float> a(4096, 0.5f);
+  std::vector<float> b(4096, 0.25f);
+  double best = 1e30;
+  for (int run = 0; run < 5; run++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int repeat = 0; repeat < 2000; repeat++) {
+      for (size_t i = 0; i < a.size(); i++) {
+        a[i] = a[i] * 0.999f + b[i];
+      }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    best = std::min(best, std::chrono::duration<double, std::nano>(elapsed)
+                                  .count() /
+                              (2000.0 * a.size()));
+  }
+  // Keep the loop from being optimized away
+  if (a[0] == 1234.5f) {
+    std::printf(" ");
+  }
+  return best;
+}
+
+static std::string caseKey(const std::string &spatializer,
+                           const std::string &layout, int sources,
+                           unsigned block, const std::string &motion) {
+  std::ostringstream key;
+  key << spatializer << "," << layout << "," << sources << "," << block << ","
+      << motion;
+  return key.str();
+}
+
+// Normalized cost per case key from a CSV written by this program
+static bool readBaseline(const std::string &path,
+                         std::map<std::string, double> &baseline) {
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  std::string line;
+  std::getline(file, line); // Header
+  while (std::getline(file, line)) {
+    std::vector<std::string> fields;
+    std::stringstream stream(line);
+    std::string field;
+    while (std::getline(stream, field, ',')) {
+      fields.push_back(field);
+    }
+    if (fields.size() < 8) {
+      continue;
+    }
+    std::string key = fields[0] + "," + fields[1] + "," + fields[2] + "," +
+                      fields[3] + "," + fields[4];
+    baseline[key] = std::atof(fields[7].c_str());
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  bool quick = false;
+  bool relative = false;
+  std::string csvPath;
+  std::string baselinePath;
+  std::string filter;
+  double tolerance = 0.3;
+  double seconds = 0.5;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--quick") {
+      quick = true;
+    } else if (arg == "--csv" && hasValue) {
+      csvPath = argv[++i];
+    } else if (arg == "--baseline" && hasValue) {
+      baselinePath = argv[++i];
+    } else if (arg == "--relative") {
+      relative = true;
+    } else if (arg == "--tolerance" && hasValue) {
+      tolerance = std::atof(argv[++i]);
+    } else if (arg == "--seconds" && hasValue) {
+      seconds = std::atof(argv[++i]);
+    } else if (arg == "--filter" && hasValue) {
+      filter = argv[++i];
+    } else {
+      std::printf("Usage: %s [--quick] [--csv file] [--baseline file] "
+                  "[--relative] [--tolerance fraction] [--seconds s] "
+                  "[--filter name]\n",
+                  argv[0]);
+      return 2;
+    }
+  }
+
+  std::map<std::string, double> baseline;
+  if (!baselinePath.empty() && !readBaseline(baselinePath, baseline)) {
+    std::printf("Can't read baseline %s\n", baselinePath.c_str());
+    return 2;
+  }
+
+  std::vector<Layout> layouts;
+  layouts.push_back({"2", StereoSpeakerLayout(), false});
+  layouts.push_back({"8", ringLayout({{0.0f, 8}}), false});
+  layouts.push_back({"60", AlloSphereSpeakerLayoutCompensated(), true});
+  layouts.push_back(
+      {"128", ringLayout({{-32.0f, 32}, {0.0f, 48}, {32.0f, 32}, {64.0f, 16}}),
+       true});
+
+  std::vector<int> sourceCounts = {1, 4, 16, 64, 256};
+  std::vector<unsigned> blockSizes = {64, 256, 1024};
+  std::vector<Motion> motions = {Motion::STATIC, Motion::ORBIT, Motion::JUMP};
+  if (quick) {
+    sourceCounts = {1, 16, 256};
+    blockSizes = {256};
+    motions = {Motion::ORBIT};
+    seconds = std::min(seconds, 0.25);
+  }
+
+  std::vector<float> noise(kNoiseFrames);
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<float> distribution(-0.1f, 0.1f);
+  for (auto &sample : noise) {
+    sample = distribution(generator);
+  }
+
+  CacheMissCounter counter;
+  const double calibration = calibrate();
+  std::printf("Calibration: %.3f ns per iteration. Cache misses %s.\n",
+              calibration,
+              counter.available() ? "from perf_event" : "not available");
+
+  FILE *csv = nullptr;
+  if (!csvPath.empty()) {
+    csv = std::fopen(csvPath.c_str(), "w");
+    if (!csv) {
+      std::printf("Can't write %s\n", csvPath.c_str());
+      return 2;
+    }
+    std::fprintf(csv, "spatializer,speakers,sources,block,motion,"
+                      "ns_per_sample_source,cache_misses_per_block,"
+                      "normalized\n");
+  }
+
+  std::printf("%-16s %8s %7s %5s %-6s %12s %12s\n", "spatializer", "speakers",
+              "sources", "block", "motion", "ns/smp/src", "misses/blk");
+  int regressions = 0;
+  int compared = 0;
+  int slowerThanReference = 0;
+  int comparedToReference = 0;
+  std::map<std::string, double> costs; // ns per sample per source, this run
+  for (auto &spatializer : kSpatializers) {
+    if (!filter.empty() &&
+        std::string(spatializer.name).find(filter) == std::string::npos) {
+      continue;
+    }
+    for (auto &layout : layouts) {
+      if (!spatializer.supports(layout)) {
+        continue;
+      }
+      for (int sources : sourceCounts) {
+        for (unsigned blockSize : blockSizes) {
+          for (Motion motion : motions) {
+            Result result = runCase(spatializer, layout, sources, blockSize,
+                                    motion, seconds, noise, counter);
+            double normalized = result.nsPerSampleSource / calibration;
+            std::string key = caseKey(spatializer.name, layout.name, sources,
+                                      blockSize, toString(motion));
+            costs[key] = result.nsPerSampleSource;
+            const char *status = "";
+            auto reference = baseline.find(key);
+            if (reference != baseline.end()) {
+              compared++;
+              if (normalized > reference->second * (1.0 + tolerance)) {
+                status = "  REGRESSION";
+                regressions++;
+              }
+            }
+            auto replaced =
+                spatializer.reference
+                    ? costs.find(caseKey(spatializer.reference, layout.name,
+                                         sources, blockSize,
+                                         toString(motion)))
+                    : costs.end();
+            if (relative && replaced != costs.end() &&
+                comparedRelative(layout, sources)) {
+              comparedToReference++;
+              if (result.nsPerSampleSource >
+                  replaced->second * (1.0 + tolerance)) {
+                status = "  SLOWER THAN REFERENCE";
+                slowerThanReference++;
+              }
+            }
+            std::printf("%-16s %8s %7d %5u %-6s %12.2f %12lld%s\n",
+                        spatializer.name, layout.name.c_str(), sources,
+                        blockSize, toString(motion), result.nsPerSampleSource,
+                        result.cacheMissesPerBlock, status);
+            if (csv) {
+              std::fprintf(csv, "%s,%.4f,%lld,%.4f\n", key.c_str(),
+                           result.nsPerSampleSource,
+                           result.cacheMissesPerBlock, normalized);
+              std::fflush(csv);
+            }
+          }
+        }
+      }
+    }
+  }
+  if (csv) {
+    std::fclose(csv);
+  }
+
+  if (!baselinePath.empty()) {
+    std::printf("%d cases compared to baseline, %d slower by more than "
+                "%.0f%%\n",
+                compared, regressions, tolerance * 100.0);
+  }
+  if (relative) {
+    std::printf("%d cases compared to the spatializer they replace, %d slower "
+                "by more than %.0f%%\n",
+                comparedToReference, slowerThanReference, tolerance * 100.0);
+  }
+  if (regressions > 0 || slowerThanReference > 0) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/bash
+usage="$(basename "$0") base benchmark [tolerance]
+-- compare spatializer costs with those of another revision.
+
+Builds spatializer_benchmark at the base revision in a temporary worktree,
+records its quick sweep, then runs benchmark (this checkout's build) against
+it. Both run one after the other on the same machine, so a slowdown anywhere
+in the rendering path, including Lbap and the rest of allolib, fails without
+a baseline recorded on other hardware.
+
+where:
+    base       revision to compare with, e.g. origin/master or HEAD~1
+    benchmark  spatializer_benchmark built from this checkout
+    tolerance  fraction a case may be slower by (default 0.3)
+
+Set CMAKE to the cmake binary to use.
+"
+
+if [ $# -lt 2 ]; then
+  echo "$usage"
+  exit 1
+fi
+
+BASE=$1
+BENCHMARK=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+TOLERANCE=${3:-0.3}
+CMAKE_BINARY=${CMAKE:-cmake}
+
+ROOT=$(cd "$(dirname "${BASH_SOURCE[0]}")/../.." && pwd)
+WORK=$(mktemp -d)
+trap 'git -C "${ROOT}" worktree remove --force "${WORK}/base"; rm -rf "${WORK}"' EXIT
+
+set -e
+git -C "${ROOT}" worktree add --detach "${WORK}/base" "${BASE}"
+SOURCE=${WORK}/base/tools/audio/spatializer_benchmark.cpp
+if [ ! -f "${SOURCE}" ]; then
+  echo "No spatializer_benchmark at ${BASE}, nothing to compare"
+  exit 0
+fi
+git -C "${WORK}/base" submodule update --init --recursive
+
+mkdir "${WORK}/build"
+(
+  cd "${WORK}/build"
+  ${CMAKE_BINARY} "${WORK}/base" -DAL_APP_FILE="${SOURCE}" \
+    -DCMAKE_BUILD_TYPE=Release
+  ${CMAKE_BINARY} --build . --target spatializer_benchmark
+)
+
+"${WORK}/base/tools/audio/bin/spatializer_benchmark" --quick \
+  --csv "${WORK}/base.csv"
+"${BENCHMARK}" --quick --baseline "${WORK}/base.csv" \
+  --tolerance "${TOLERANCE}" --relative
@@ -0,0 +1,240 @@
+// Checks SplitSpatializer on one machine without an audio device.
+//
+// A dummy backend calls the audio callback for N noise sources moving around
+// the AlloSphere layout, first as fast as possible while waiting for the
+// partitions, comparing the output with GainTableSpatializer<Lbap> delayed
+// by the split latency, then paced at the real block period to measure the
+// load and headroom of each partition.
+//
+// Usage: split_render_test [--partitions n] [--sources n] [--block frames]
+//                          [--seconds s] [--threads] [--latency 0|1]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "al/io/al_AudioIOData.hpp"
+#include "al/sound/al_Lbap.hpp"
+#include "al/sound/al_Speaker.hpp"
+#include "al/sphere/al_AlloSphereSpeakerLayout.hpp"
+
+#include "al_GainTableSpatializer.hpp"
+#include "al_SplitSpatializer.hpp"
+
+using namespace al;
+
+static const double kSampleRate = 48000.0;
+
+struct Options {
+  int partitions{4};
+  int sources{64};
+  int block{256};
+  double seconds{5.0};
+  bool threads{false};
+  int latency{1};
+};
+
+struct TestSource {
+  std::vector<float> samples;
+  double azimuth;
+  double elevation;
+  double speed;
+};
+
+class DummyBackend {
+public:
+  DummyBackend(const Options &options, int channels)
+      : mOptions(options), mRandom(1) {
+    mIO.framesPerSecond(kSampleRate);
+    mIO.framesPerBuffer(options.block);
+    mIO.channels(channels, true);
+    std::uniform_real_distribution<float> noise(-0.5f, 0.5f);
+    std::uniform_real_distribution<double> angle(-M_PI, M_PI);
+    mSources.resize(options.sources);
+    for (auto &source : mSources) {
+      source.samples.resize(options.block);
+      for (auto &sample : source.samples) {
+        sample = noise(mRandom);
+      }
+      source.azimuth = angle(mRandom);
+      source.elevation = angle(mRandom) / 4.0;
+      source.speed = angle(mRandom) * 0.5; // radians per second
+    }
+  }
+
+  AudioIOData &io() { return mIO; }
+
+  /// One block of all sources through spatializer into io()
+  void callback(Spatializer &spatializer, uint64_t block) {
+    mIO.zeroOut();
+    spatializer.prepare(mIO);
+    const double t = block * mOptions.block / kSampleRate;
+    const unsigned int frames = mOptions.block;
+    for (int s = 0; s < int(mSources.size()); s++) {
+      auto &source = mSources[s];
+      // Every eighth source is silent half of the time
+      if (s % 8 == 7 && (block / 16) % 2) {
+        std::vector<float> silence(frames, 0.0f);
+        spatializer.renderBuffer(mIO, Pose(direction(source, t)),
+                                 silence.data(), frames);
+        continue;
+      }
+      spatializer.renderBuffer(mIO, Pose(direction(source, t)),
+                               source.samples.data(), frames);
+    }
+    spatializer.finalize(mIO);
+  }
+
+private:
+  static Vec3d direction(const TestSource &source, double t) {
+    return GainTable::direction(source.azimuth + source.speed * t,
+                                source.elevation);
+  }
+
+  const Options &mOptions;
+  AudioIOData mIO;
+  std::mt19937 mRandom;
+  std::vector<TestSource> mSources;
+};
+
+static bool parseOptions(int argc, char *argv[], Options &options) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--partitions" && hasValue) {
+      options.partitions = std::atoi(argv[++i]);
+    } else if (arg == "--sources" && hasValue) {
+      options.sources = std::atoi(argv[++i]);
+    } else if (arg == "--block" && hasValue) {
+      options.block = std::atoi(argv[++i]);
+    } else if (arg == "--seconds" && hasValue) {
+      options.seconds = std::atof(argv[++i]);
+    } else if (arg == "--latency" && hasValue) {
+      options.latency = std::atoi(argv[++i]);
+    } else if (arg == "--threads") {
+      options.threads = true;
+    } else {
+      std::fprintf(stderr,
+                   "Usage: split_render_test [--partitions n] [--sources n] "
+                   "[--block frames] [--seconds s] [--threads] "
+                   "[--latency 0|1]\n");
+      return false;
+    }
+  }
+  options.block = std::max(16, std::min(options.block, 2048));
+  options.sources = std::max(1, std::min(options.sources, 128));
+  options.latency = std::max(0, std::min(options.latency, 1));
+  return true;
+}
+
+/// Largest difference between split and reference output over blocks
+static float compareOutput(const Options &options, const Speakers &layout,
+                           SplitSpatializer<Lbap> &split) {
+  const int channels = layoutChannels(layout);
+  GainTableSpatializer<Lbap> reference(layout);
+  reference.compile();
+  DummyBackend splitBackend(options, channels);
+  DummyBackend referenceBackend(options, channels);
+  // Reference output of the last blocks, to compare with the delayed split
+  std::vector<std::vector<float>> previous(size_t(channels) * 2);
+  float maxError = 0.0f;
+  for (uint64_t block = 0; block < 64; block++) {
+    splitBackend.callback(split, block);
+    referenceBackend.callback(reference, block);
+    for (int c = 0; c < channels; c++) {
+      auto &current = previous[(block % 2) * channels + c];
+      const float *out = referenceBackend.io().outBuffer(c);
+      current.assign(out, out + options.block);
+      if (block < uint64_t(options.latency)) {
+        continue;
+      }
+      auto &expected =
+          previous[((block - options.latency) % 2) * channels + c];
+      const float *actual = splitBackend.io().outBuffer(c);
+      for (int i = 0; i < options.block; i++) {
+        maxError = std::max(maxError, std::abs(actual[i] - expected[i]));
+      }
+    }
+  }
+  return maxError;
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    return 2;
+  }
+  Speakers layout = AlloSphereSpeakerLayoutCompensated();
+  const auto mode = options.threads ? SplitSpatializer<Lbap>::Mode::THREADS
+                                    : SplitSpatializer<Lbap>::Mode::PROCESSES;
+  std::printf("%i sources, %i speakers, %i frame blocks, %i %s\n",
+              options.sources, int(layout.size()), options.block,
+              options.partitions, options.threads ? "threads" : "processes");
+
+  // Output must match the single renderer, delayed by the latency
+  bool failed = false;
+  {
+    Options unsplit = options;
+    unsplit.latency = 0;
+    SplitSpatializer<Lbap> split(layout);
+    split.compile();
+    float error = compareOutput(unsplit, layout, split);
+    std::printf("Unsplit error: %g\n", error);
+    failed |= error > 1e-5f;
+  }
+  {
+    SplitSpatializer<Lbap> split(layout);
+    split.compile();
+    split.setMaxWait(1000.0f); // Never give up on a partition here
+    if (!split.start(options.partitions, mode, options.latency)) {
+      return 1;
+    }
+    float error = compareOutput(options, layout, split);
+    std::printf("Split error: %g\n", error);
+    failed |= error > 1e-5f;
+  }
+
+  // Real time pacing
+  SplitSpatializer<Lbap> split(layout);
+  split.compile();
+  if (!split.start(options.partitions, mode, options.latency)) {
+    return 1;
+  }
+  DummyBackend backend(options, layoutChannels(layout));
+  const auto period =
+      std::chrono::duration<double>(options.block / kSampleRate);
+  const uint64_t blocks =
+      uint64_t(options.seconds * kSampleRate / options.block);
+  auto next = std::chrono::steady_clock::now();
+  double callbackTime = 0.0;
+  for (uint64_t block = 0; block < blocks; block++) {
+    next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        period);
+    std::this_thread::sleep_until(next);
+    auto start = std::chrono::steady_clock::now();
+    backend.callback(split, block);
+    callbackTime = std::max(
+        callbackTime,
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+            .count());
+  }
+  std::printf("Audio callback: %.1f%% of the block period at most, %u "
+              "overruns\n",
+              100.0 * callbackTime / period.count(), split.overruns());
+  for (int p = 0; p < split.partitions(); p++) {
+    auto &channels = split.partitionChannels(p);
+    std::printf("Partition %i (channels %i-%i): load %.1f%%, headroom %.1f%%, "
+                "%u underruns\n",
+                p, channels.front(), channels.back(), 100.0f * split.load(p),
+                100.0f * (1.0f - split.peakLoad(p)), split.underruns(p));
+    failed |= split.underruns(p) > 0;
+  }
+  split.stop();
+  return failed ? 1 : 0;
+}
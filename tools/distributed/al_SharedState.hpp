@@ -0,0 +1,288 @@
+#ifndef AL_SHAREDSTATE_HPP
+#define AL_SHAREDSTATE_HPP
+
+// Shared memory state for render processes on the same host as the simulator.
+//
+// SharedStateWriter creates a named shared memory region holding three copies
+// of the state. Each frame it writes the copy after the last published one
+// and publishes it. Every copy has a sequence number that is odd while the
+// copy is being written (a seqlock), so renderers can read a copy in place,
+// without locking or copying, and check afterwards that it wasn't rewritten
+// while they used it. With three copies the writer only gets back to the one
+// a renderer is reading after publishing two newer frames.
+//
+// SharedStateReader maps the region read only, so renderers can't affect the
+// simulator or each other. Renderers on other hosts still need a network
+// transport.
+//
+// POSIX shared memory (shm_open) only.
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace al {
+
+struct SharedStateHeader {
+  static const uint32_t kMagic = 0x53534c41; // "ALSS"
+  static const int kCopies = 3;
+
+  uint32_t magic;
+  uint32_t stateBytes;
+  std::atomic<uint32_t> latest; // Copy last published
+  std::atomic<uint64_t> frame;  // Frames published
+  std::atomic<uint64_t> sequence[kCopies];
+
+  /// Offset of the first copy, aligned to a page
+  static size_t dataOffset() {
+    return (sizeof(SharedStateHeader) + 4095) & ~size_t(4095);
+  }
+  static size_t copyBytes(size_t stateBytes) {
+    return (stateBytes + 63) & ~size_t(63);
+  }
+  static size_t totalBytes(size_t stateBytes) {
+    return dataOffset() + kCopies * copyBytes(stateBytes);
+  }
+};
+
+template <class State> class SharedStateWriter {
+public:
+  ~SharedStateWriter() { close(); }
+
+  /// Create the region name ("/blob_state" ...), replacing an old one
+  bool open(const std::string &name) {
+    close();
+#ifndef _WIN32
+    const size_t bytes = SharedStateHeader::totalBytes(sizeof(State));
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    if (ftruncate(fd, off_t(bytes)) != 0) {
+      ::close(fd);
+      shm_unlink(name.c_str());
+      return false;
+    }
+    void *memory =
+        mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      return false;
+    }
+    mMemory = static_cast<uint8_t *>(memory);
+    mBytes = bytes;
+    mName = name;
+    auto *header = new (mMemory) SharedStateHeader;
+    header->stateBytes = uint32_t(sizeof(State));
+    header->latest = 0;
+    header->frame = 0;
+    for (auto &sequence : header->sequence) {
+      sequence = 0;
+    }
+    // Written last, so readers don't accept a half initialized region
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = SharedStateHeader::kMagic;
+    return true;
+#else
+    (void)name;
+    return false;
+#endif
+  }
+
+  void close() {
+#ifndef _WIN32
+    if (mMemory) {
+      munmap(mMemory, mBytes);
+      shm_unlink(mName.c_str());
+      mMemory = nullptr;
+    }
+#endif
+  }
+
+  bool isOpen() const { return mMemory != nullptr; }
+
+  /**
+   * @brief Start writing the next copy of the state
+   *
+   * The copy holds an older frame. Write all of it, then call endWrite().
+   */
+  State &beginWrite() {
+    auto &header = this->header();
+    mWriting = (header.latest.load(std::memory_order_relaxed) + 1) %
+               SharedStateHeader::kCopies;
+    auto &sequence = header.sequence[mWriting];
+    sequence.store(sequence.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return *reinterpret_cast<State *>(copy(mWriting));
+  }
+
+  /// Publish the copy from beginWrite()
+  void endWrite() {
+    auto &header = this->header();
+    auto &sequence = header.sequence[mWriting];
+    sequence.store(sequence.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+    header.latest.store(mWriting, std::memory_order_release);
+    header.frame.fetch_add(1, std::memory_order_release);
+  }
+
+  /// Copy state into the next copy and publish it
+  void write(const State &state) {
+    std::memcpy(static_cast<void *>(&beginWrite()), &state, sizeof(State));
+    endWrite();
+  }
+
+private:
+  SharedStateHeader &header() {
+    return *reinterpret_cast<SharedStateHeader *>(mMemory);
+  }
+  uint8_t *copy(uint32_t index) {
+    return mMemory + SharedStateHeader::dataOffset() +
+           index * SharedStateHeader::copyBytes(sizeof(State));
+  }
+
+  uint8_t *mMemory{nullptr};
+  size_t mBytes{0};
+  std::string mName;
+  uint32_t mWriting{0};
+};
+
+template <class State> class SharedStateReader {
+public:
+  ~SharedStateReader() { close(); }
+
+  /// Map the region name read only. Fails if no writer created it.
+  bool open(const std::string &name) {
+    close();
+#ifndef _WIN32
+    const size_t bytes = SharedStateHeader::totalBytes(sizeof(State));
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < bytes) {
+      ::close(fd);
+      return false;
+    }
+    void *memory = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+      return false;
+    }
+    mMemory = static_cast<const uint8_t *>(memory);
+    mBytes = bytes;
+    if (header().magic != SharedStateHeader::kMagic ||
+        header().stateBytes != sizeof(State)) {
+      std::cerr << "SharedStateReader: " << name
+                << " holds a different state" << std::endl;
+      close();
+      return false;
+    }
+    return true;
+#else
+    (void)name;
+    return false;
+#endif
+  }
+
+  void close() {
+#ifndef _WIN32
+    if (mMemory) {
+      munmap(const_cast<uint8_t *>(mMemory), mBytes);
+      mMemory = nullptr;
+    }
+#endif
+  }
+
+  bool isOpen() const { return mMemory != nullptr; }
+
+  /// Frames published by the writer
+  uint64_t frame() const {
+    return header().frame.load(std::memory_order_acquire);
+  }
+
+  /**
+   * @brief The latest published state, in place
+   *
+   * Read what's needed, then call release() to check that the writer didn't
+   * start rewriting it meanwhile. Returns nullptr if nothing was published.
+   */
+  const State *acquire() {
+    auto &header = this->header();
+    if (header.frame.load(std::memory_order_acquire) == 0) {
+      return nullptr;
+    }
+    while (true) {
+      mReading = header.latest.load(std::memory_order_acquire);
+      mSequence = header.sequence[mReading].load(std::memory_order_acquire);
+      if (!(mSequence & 1)) {
+        return reinterpret_cast<const State *>(copy(mReading));
+      }
+      std::this_thread::yield(); // Rare: the writer wrapped around
+    }
+  }
+
+  /// True if the state from acquire() was consistent while it was read
+  bool release() {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    bool consistent =
+        header().sequence[mReading].load(std::memory_order_relaxed) ==
+        mSequence;
+    if (!consistent) {
+      mTorn++;
+    }
+    return consistent;
+  }
+
+  /// Copy the latest consistent state into state
+  bool read(State &state) {
+    for (int attempt = 0; attempt < 8; attempt++) {
+      const State *shared = acquire();
+      if (!shared) {
+        return false;
+      }
+      std::memcpy(static_cast<void *>(&state), shared, sizeof(State));
+      if (release()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Reads that overlapped a write and had to be discarded
+  uint64_t torn() const { return mTorn; }
+
+private:
+  const SharedStateHeader &header() const {
+    return *reinterpret_cast<const SharedStateHeader *>(mMemory);
+  }
+  const uint8_t *copy(uint32_t index) const {
+    return mMemory + SharedStateHeader::dataOffset() +
+           index * SharedStateHeader::copyBytes(sizeof(State));
+  }
+
+  const uint8_t *mMemory{nullptr};
+  size_t mBytes{0};
+  uint32_t mReading{0};
+  uint64_t mSequence{0};
+  uint64_t mTorn{0};
+};
+
+} // namespace al
+
+#endif // AL_SHAREDSTATE_HPP
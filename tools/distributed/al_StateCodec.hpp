@@ -0,0 +1,484 @@
+#ifndef AL_STATECODEC_HPP
+#define AL_STATECODEC_HPP
+
+// Compact encoding of a DistributedAppWithState state for broadcasting.
+//
+// Only the fields declared to the codec are encoded. Float arrays (vertex
+// positions ...) are quantized to 8 or 16 bits within a declared bounding
+// box, and other fields are copied as raw bytes. Every keyframe interval the
+// whole quantized state is sent as a keyframe. Frames in between only carry
+// the difference from the last keyframe: quantized values as zigzag varints
+// and raw fields XORed, in groups of eight preceded by a mask of the values
+// that changed, so parts of the state that didn't move since the keyframe
+// cost one bit per value.
+//
+// Broadcast receivers don't acknowledge frames, so deltas are always against
+// the last keyframe rather than the previous frame. A lost delta frame doesn't
+// affect the next one, and a renderer that missed a keyframe (or joined late)
+// waits for the next one.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace al {
+
+struct StateCodecStats {
+  uint64_t frame{0};
+  bool keyframe{false};
+  size_t stateBytes{0};   // Bytes of the declared fields, unencoded
+  size_t encodedBytes{0}; // Bytes of the last frame
+  double encodeMicros{0.0};
+  double decodeMicros{0.0};
+  uint32_t undecodable{0}; // Frames received without their keyframe
+
+  /// Bits per second to send encoded frames at rate
+  double bitsPerSecond(double rate) const { return encodedBytes * 8.0 * rate; }
+};
+
+class StateCodec {
+public:
+  /**
+   * @brief Quantize an array of float vectors (Vec3f ...) within a box
+   * @param state the state struct the field belongs to
+   * @param min lowest value of each component
+   * @param max highest value of each component
+   * @param bits 8 or 16
+   */
+  template <class State, class T, size_t Count>
+  void addQuantized(const State &state, const T (&field)[Count], const T &min,
+                    const T &max, int bits = 16) {
+    static_assert(sizeof(T) % sizeof(float) == 0,
+                  "Quantized fields must be made of floats");
+    QuantizedField q;
+    q.offset = offsetIn(state, field);
+    q.count = Count;
+    q.components = sizeof(T) / sizeof(float);
+    q.bits = bits <= 8 ? 8 : 16;
+    const float *low = reinterpret_cast<const float *>(&min);
+    const float *high = reinterpret_cast<const float *>(&max);
+    const float levels = float((1 << q.bits) - 1);
+    for (int c = 0; c < q.components; c++) {
+      float range = std::max(high[c] - low[c], 1e-9f);
+      q.min.push_back(low[c]);
+      q.scale.push_back(levels / range);
+      q.step.push_back(range / levels);
+    }
+    q.first = mQuantizedCount;
+    mQuantizedCount += q.count * q.components;
+    mQuantized.push_back(q);
+    reset();
+  }
+
+  /// Send a field exactly, as bytes
+  template <class State, class T>
+  void addRaw(const State &state, const T &field) {
+    RawField r;
+    r.offset = offsetIn(state, field);
+    r.bytes = sizeof(T);
+    r.first = mRawCount;
+    mRawCount += r.bytes;
+    mRaw.push_back(r);
+    reset();
+  }
+
+  /// Send a keyframe every frames frames
+  void setKeyframeInterval(unsigned int frames) {
+    mKeyframeInterval = std::max(1u, frames);
+  }
+
+  /// Make the next encoded frame a keyframe
+  void forceKeyframe() { mForceKeyframe = true; }
+
+  /**
+   * @brief Encode the declared fields of state into packet
+   * @return bytes of the encoded frame
+   */
+  size_t encode(const void *state, std::vector<uint8_t> &packet) {
+    auto start = std::chrono::steady_clock::now();
+    const uint8_t *base = static_cast<const uint8_t *>(state);
+    quantize(base, mCurrent.data());
+    for (auto &r : mRaw) {
+      std::memcpy(mCurrentRaw.data() + r.first, base + r.offset, r.bytes);
+    }
+
+    const bool keyframe = mForceKeyframe || !mHasKeyframe ||
+                          mFrame - mKeyframe >= mKeyframeInterval;
+    if (keyframe) {
+      mKeyframe = mFrame;
+      mHasKeyframe = true;
+      mForceKeyframe = false;
+      mKey.swap(mCurrent);
+      mKeyRaw.swap(mCurrentRaw);
+    }
+    // Worst case: keyframe size, or a mask and a 3 byte varint per value
+    packet.resize(sizeof(Header) + mQuantizedCount * 3 + mRawCount * 2 +
+                  (mQuantizedCount + mRawCount) / 8 + 16);
+    Header header;
+    header.magic = kMagic;
+    header.frame = uint32_t(mFrame);
+    header.keyframe = uint32_t(mKeyframe);
+    header.flags = keyframe ? kKeyframeFlag : 0;
+    header.layout = layoutHash();
+    std::memcpy(packet.data(), &header, sizeof(Header));
+    uint8_t *out = packet.data() + sizeof(Header);
+    if (keyframe) {
+      out = writeKeyframe(out);
+    } else {
+      out = writeDeltas(out, mCurrent.data(), mKey.data(), mQuantizedCount);
+      out = writeXor(out, mCurrentRaw.data(), mKeyRaw.data(), mRawCount);
+    }
+    packet.resize(out - packet.data());
+
+    mStats.frame = mFrame;
+    mStats.keyframe = keyframe;
+    mStats.stateBytes = stateBytes();
+    mStats.encodedBytes = packet.size();
+    mStats.encodeMicros = elapsedMicros(start);
+    mFrame++;
+    return packet.size();
+  }
+
+  /**
+   * @brief Decode a frame into the declared fields of state
+   * @return false if the packet is invalid or its keyframe is missing, in
+   * which case state is unchanged
+   */
+  bool decode(const uint8_t *packet, size_t size, void *state) {
+    auto start = std::chrono::steady_clock::now();
+    Header header;
+    if (size < sizeof(Header)) {
+      return false;
+    }
+    std::memcpy(&header, packet, sizeof(Header));
+    if (header.magic != kMagic || header.layout != layoutHash()) {
+      return false;
+    }
+    const uint8_t *in = packet + sizeof(Header);
+    const uint8_t *end = packet + size;
+    if (header.flags & kKeyframeFlag) {
+      // Into the current frame, which deltas overwrite anyway, so that a
+      // truncated keyframe leaves the previous one usable
+      if (!readKeyframe(in, end, mCurrent.data(), mCurrentRaw.data())) {
+        return false;
+      }
+      mKeyframe = header.keyframe;
+      mHasKeyframe = true;
+      mKey = mCurrent;
+      mKeyRaw = mCurrentRaw;
+    } else {
+      if (!mHasKeyframe || header.keyframe != uint32_t(mKeyframe)) {
+        mStats.undecodable++;
+        return false;
+      }
+      in = readDeltas(in, end, mKey.data(), mCurrent.data(), mQuantizedCount);
+      if (!in ||
+          !readXor(in, end, mKeyRaw.data(), mCurrentRaw.data(), mRawCount)) {
+        return false;
+      }
+    }
+    uint8_t *base = static_cast<uint8_t *>(state);
+    dequantize(mCurrent.data(), base);
+    for (auto &r : mRaw) {
+      std::memcpy(base + r.offset, mCurrentRaw.data() + r.first, r.bytes);
+    }
+    mStats.frame = header.frame;
+    mStats.keyframe = (header.flags & kKeyframeFlag) != 0;
+    mStats.stateBytes = stateBytes();
+    mStats.encodedBytes = size;
+    mStats.decodeMicros = elapsedMicros(start);
+    return true;
+  }
+
+  /// Statistics of the last encoded or decoded frame
+  const StateCodecStats &stats() const { return mStats; }
+
+  /// Bytes of the declared fields in the state struct
+  size_t stateBytes() const {
+    size_t bytes = mRawCount;
+    for (auto &q : mQuantized) {
+      bytes += q.count * q.components * sizeof(float);
+    }
+    return bytes;
+  }
+
+private:
+  static const uint32_t kMagic = 0x43534c41; // "ALSC"
+  static const uint32_t kKeyframeFlag = 1;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t frame;
+    uint32_t keyframe;
+    uint32_t flags;
+    uint32_t layout;
+  };
+
+  struct QuantizedField {
+    size_t offset;
+    size_t count;
+    int components;
+    int bits;
+    size_t first; // Index in the quantized values
+    std::vector<float> min;
+    std::vector<float> scale;
+    std::vector<float> step;
+  };
+
+  struct RawField {
+    size_t offset;
+    size_t bytes;
+    size_t first; // Index in the raw bytes
+  };
+
+  template <class State, class T>
+  static size_t offsetIn(const State &state, const T &field) {
+    return reinterpret_cast<const uint8_t *>(&field) -
+           reinterpret_cast<const uint8_t *>(&state);
+  }
+
+  static double
+  elapsedMicros(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  }
+
+  void reset() {
+    mCurrent.assign(mQuantizedCount, 0);
+    mKey.assign(mQuantizedCount, 0);
+    mCurrentRaw.assign(mRawCount, 0);
+    mKeyRaw.assign(mRawCount, 0);
+    mHasKeyframe = false;
+  }
+
+  uint32_t layoutHash() const {
+    // FNV-1a of the field layout, so mismatched codecs reject each other
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](uint64_t value) {
+      for (int i = 0; i < 8; i++) {
+        hash = (hash ^ uint8_t(value >> (8 * i))) * 16777619u;
+      }
+    };
+    for (auto &q : mQuantized) {
+      mix(q.offset);
+      mix(q.count * 64 + q.components * 8 + q.bits);
+    }
+    for (auto &r : mRaw) {
+      mix(r.offset);
+      mix(r.bytes);
+    }
+    return hash;
+  }
+
+  // Values are stored component by component: all x, then all y ...
+  void quantize(const uint8_t *base, uint16_t *values) const {
+    for (auto &q : mQuantized) {
+      const float *v = reinterpret_cast<const float *>(base + q.offset);
+      const float levels = float((1 << q.bits) - 1);
+      for (int c = 0; c < q.components; c++) {
+        uint16_t *out = values + q.first + c * q.count;
+        const float min = q.min[c];
+        const float scale = q.scale[c];
+        for (size_t i = 0; i < q.count; i++) {
+          float x = (v[i * q.components + c] - min) * scale + 0.5f;
+          x = std::min(std::max(x, 0.0f), levels);
+          out[i] = uint16_t(x);
+        }
+      }
+    }
+  }
+
+  void dequantize(const uint16_t *values, uint8_t *base) const {
+    for (auto &q : mQuantized) {
+      float *v = reinterpret_cast<float *>(base + q.offset);
+      for (int c = 0; c < q.components; c++) {
+        const uint16_t *in = values + q.first + c * q.count;
+        const float min = q.min[c];
+        const float step = q.step[c];
+        for (size_t i = 0; i < q.count; i++) {
+          v[i * q.components + c] = min + in[i] * step;
+        }
+      }
+    }
+  }
+
+  uint8_t *writeKeyframe(uint8_t *out) const {
+    for (auto &q : mQuantized) {
+      const uint16_t *values = mKey.data() + q.first;
+      const size_t n = q.count * q.components;
+      if (q.bits == 8) {
+        for (size_t i = 0; i < n; i++) {
+          *out++ = uint8_t(values[i]);
+        }
+      } else {
+        for (size_t i = 0; i < n; i++) {
+          *out++ = uint8_t(values[i]);
+          *out++ = uint8_t(values[i] >> 8);
+        }
+      }
+    }
+    std::memcpy(out, mKeyRaw.data(), mRawCount);
+    return out + mRawCount;
+  }
+
+  bool readKeyframe(const uint8_t *&in, const uint8_t *end, uint16_t *key,
+                    uint8_t *keyRaw) const {
+    for (auto &q : mQuantized) {
+      uint16_t *values = key + q.first;
+      const size_t n = q.count * q.components;
+      const size_t bytes = q.bits == 8 ? n : 2 * n;
+      if (size_t(end - in) < bytes) {
+        return false;
+      }
+      if (q.bits == 8) {
+        for (size_t i = 0; i < n; i++) {
+          values[i] = *in++;
+        }
+      } else {
+        for (size_t i = 0; i < n; i++) {
+          values[i] = uint16_t(in[0] | (in[1] << 8));
+          in += 2;
+        }
+      }
+    }
+    if (size_t(end - in) < mRawCount) {
+      return false;
+    }
+    std::memcpy(keyRaw, in, mRawCount);
+    in += mRawCount;
+    return true;
+  }
+
+  static uint8_t *writeVarint(uint8_t *out, uint32_t value) {
+    while (value >= 0x80) {
+      *out++ = uint8_t(value | 0x80);
+      value >>= 7;
+    }
+    *out++ = uint8_t(value);
+    return out;
+  }
+
+  static const uint8_t *readVarint(const uint8_t *in, const uint8_t *end,
+                                   uint32_t &value) {
+    value = 0;
+    for (int shift = 0; in < end && shift < 32; shift += 7) {
+      uint8_t byte = *in++;
+      value |= uint32_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return in;
+      }
+    }
+    return nullptr;
+  }
+
+  // Groups of 8 values: a mask of changed values, then their zigzag
+  // differences as varints
+  static uint8_t *writeDeltas(uint8_t *out, const uint16_t *current,
+                              const uint16_t *key, size_t count) {
+    for (size_t group = 0; group < count; group += 8) {
+      const size_t n = std::min(count - group, size_t(8));
+      uint8_t *mask = out++;
+      *mask = 0;
+      for (size_t i = 0; i < n; i++) {
+        int32_t delta = int32_t(current[group + i]) - int32_t(key[group + i]);
+        if (delta != 0) {
+          *mask |= uint8_t(1 << i);
+          out = writeVarint(out, uint32_t((delta << 1) ^ (delta >> 31)));
+        }
+      }
+    }
+    return out;
+  }
+
+  static const uint8_t *readDeltas(const uint8_t *in, const uint8_t *end,
+                                   const uint16_t *key, uint16_t *current,
+                                   size_t count) {
+    for (size_t group = 0; group < count; group += 8) {
+      if (in >= end) {
+        return nullptr;
+      }
+      const size_t n = std::min(count - group, size_t(8));
+      const uint8_t mask = *in++;
+      for (size_t i = 0; i < n; i++) {
+        int32_t delta = 0;
+        if (mask & (1 << i)) {
+          uint32_t zigzag;
+          in = readVarint(in, end, zigzag);
+          if (!in) {
+            return nullptr;
+          }
+          delta = int32_t(zigzag >> 1) ^ -int32_t(zigzag & 1);
+        }
+        current[group + i] = uint16_t(key[group + i] + delta);
+      }
+    }
+    return in;
+  }
+
+  // Groups of 8 bytes: a mask of changed bytes, then the changed bytes XORed
+  // with the keyframe
+  static uint8_t *writeXor(uint8_t *out, const uint8_t *current,
+                           const uint8_t *key, size_t count) {
+    for (size_t group = 0; group < count; group += 8) {
+      const size_t n = std::min(count - group, size_t(8));
+      uint8_t *mask = out++;
+      *mask = 0;
+      for (size_t i = 0; i < n; i++) {
+        uint8_t x = current[group + i] ^ key[group + i];
+        if (x) {
+          *mask |= uint8_t(1 << i);
+          *out++ = x;
+        }
+      }
+    }
+    return out;
+  }
+
+  static bool readXor(const uint8_t *in, const uint8_t *end,
+                      const uint8_t *key, uint8_t *current, size_t count) {
+    for (size_t group = 0; group < count; group += 8) {
+      if (in >= end) {
+        return false;
+      }
+      const size_t n = std::min(count - group, size_t(8));
+      const uint8_t mask = *in++;
+      for (size_t i = 0; i < n; i++) {
+        uint8_t x = 0;
+        if (mask & (1 << i)) {
+          if (in >= end) {
+            return false;
+          }
+          x = *in++;
+        }
+        current[group + i] = key[group + i] ^ x;
+      }
+    }
+    return true;
+  }
+
+  std::vector<QuantizedField> mQuantized;
+  std::vector<RawField> mRaw;
+  size_t mQuantizedCount{0};
+  size_t mRawCount{0};
+
+  // Quantized values and raw bytes of the current frame and the keyframe
+  std::vector<uint16_t> mCurrent;
+  std::vector<uint16_t> mKey;
+  std::vector<uint8_t> mCurrentRaw;
+  std::vector<uint8_t> mKeyRaw;
+
+  uint64_t mFrame{0};
+  uint64_t mKeyframe{0};
+  bool mHasKeyframe{false};
+  bool mForceKeyframe{false};
+  unsigned int mKeyframeInterval{60};
+  StateCodecStats mStats;
+};
+
+} // namespace al
+
+#endif // AL_STATECODEC_HPP
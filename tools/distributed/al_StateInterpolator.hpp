@@ -0,0 +1,231 @@
+#ifndef AL_STATEINTERPOLATOR_HPP
+#define AL_STATEINTERPOLATOR_HPP
+
+// Smooth rendering of a distributed state that arrives at a lower or uneven
+// rate.
+//
+// Renderers push each state they receive with the simulator's time stamp. The
+// interpolator keeps the last few and gives a view of the state at the
+// current time minus a playout delay, between the two states around that
+// time: declared float fields (vertex positions ...) are interpolated
+// linearly, Poses with slerp, and everything else comes from the newer state.
+// The simulator can then broadcast at e.g. 30 Hz while renderers draw at their
+// own frame rate.
+//
+// The view time has to stay behind the newest state, or the view stops at it
+// until the next one arrives and then jumps. So the playout delay is at least
+// one state period, measured from the time stamps, plus a margin for network
+// jitter: 1.5 periods by default.
+//
+// The simulator's clock is mapped to the renderer's through the smallest
+// (arrival - stamp) difference seen, which follows the fastest delivery and
+// slowly relaxes so that clock drift is tracked.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "al/spatial/al_Pose.hpp"
+
+namespace al {
+
+template <class State> class StateInterpolator {
+public:
+  static const int kStates = 4;
+
+  StateInterpolator() {
+    for (auto &state : mStates) {
+      state.reset(new State);
+    }
+  }
+
+  /// Interpolate a float, or an array of vectors of floats (Vec3f ...)
+  template <class T, size_t Count>
+  void addLinear(const State &state, const T (&field)[Count]) {
+    static_assert(sizeof(T) % sizeof(float) == 0,
+                  "Linear fields must be made of floats");
+    mLinear.push_back(
+        {offsetIn(state, field), Count * sizeof(T) / sizeof(float)});
+  }
+  void addLinear(const State &state, const float &field) {
+    mLinear.push_back({offsetIn(state, field), 1});
+  }
+  void addLinear(const State &state, const double &field) {
+    mDoubles.push_back(offsetIn(state, field));
+  }
+
+  /// Interpolate a Pose: position linearly, orientation with slerp
+  void addPose(const State &state, const Pose &field) {
+    mPoses.push_back(offsetIn(state, field));
+  }
+
+  /**
+   * @brief Delay of the view behind the newest state, in measured periods
+   *
+   * Must be more than 1, so that the next state arrives before the view gets
+   * to the newest one. What is above 1 covers network jitter. 1.5 by default.
+   */
+  void setPlayoutPeriods(double periods) { mPlayoutPeriods = periods; }
+
+  /// Use a fixed delay in seconds instead of one from the measured period.
+  /// 0 goes back to the measured period.
+  void setPlayoutDelay(double seconds) { mFixedDelay = seconds; }
+
+  /// Delay of the view behind the newest state, in seconds
+  double playoutDelay() const {
+    return mFixedDelay > 0.0 ? mFixedDelay : mPlayoutPeriods * mPeriod;
+  }
+
+  /// Average time between the states pushed, in simulator seconds
+  double period() const { return mPeriod; }
+
+  /// A state stamped time (simulator seconds) arrived now
+  void push(const State &state, double time) { push(state, time, now()); }
+
+  void push(const State &state, double time, double localTime) {
+    if (mCount > 0 && time <= mTimes[mNewest]) {
+      return; // Duplicate or out of order
+    }
+    if (mCount > 0) {
+      // Average the period, ignoring gaps such as a paused simulator
+      const double period = time - mTimes[mNewest];
+      if (mPeriod == 0.0) {
+        mPeriod = period;
+      } else if (period < 4.0 * mPeriod) {
+        mPeriod += (period - mPeriod) * 0.1;
+      }
+    }
+    mNewest = (mNewest + 1) % kStates;
+    std::memcpy(static_cast<void *>(mStates[mNewest].get()), &state,
+                sizeof(State));
+    mTimes[mNewest] = time;
+    mCount = std::min(mCount + 1, kStates);
+
+    const double offset = localTime - time;
+    if (mCount == 1 || offset < mOffset) {
+      mOffset = offset;
+    } else {
+      // Let the mapping drift up by 1 ms per second at most
+      mOffset += std::min(offset - mOffset, 0.001 * (localTime - mLastPush));
+    }
+    mLastPush = localTime;
+  }
+
+  /// True once a state was pushed
+  bool hasState() const { return mCount > 0; }
+
+  /// The newest state pushed
+  const State &newest() const { return *mStates[mNewest]; }
+
+  /**
+   * @brief Write the state at the current time minus the playout delay
+   * @return false if no state was pushed, leaving view unchanged
+   */
+  bool interpolate(State &view) { return interpolate(view, now()); }
+
+  bool interpolate(State &view, double localTime) {
+    if (mCount == 0) {
+      return false;
+    }
+    const double time = localTime - mOffset - playoutDelay();
+    // The two states around time: from the newest back to the oldest kept
+    int newer = mNewest;
+    int older = newer;
+    for (int i = 1; i < mCount; i++) {
+      older = (newer + kStates - 1) % kStates;
+      if (mTimes[older] <= time) {
+        break;
+      }
+      if (i + 1 < mCount) {
+        newer = older;
+      }
+    }
+    std::memcpy(static_cast<void *>(&view), mStates[newer].get(),
+                sizeof(State));
+    mFraction = 1.0;
+    if (older == newer) {
+      return true;
+    }
+    const double period = mTimes[newer] - mTimes[older];
+    mFraction =
+        std::min(std::max((time - mTimes[older]) / period, 0.0), 1.0);
+    if (mFraction >= 1.0) {
+      return true;
+    }
+    const uint8_t *a = reinterpret_cast<const uint8_t *>(mStates[older].get());
+    const uint8_t *b = reinterpret_cast<const uint8_t *>(mStates[newer].get());
+    uint8_t *out = reinterpret_cast<uint8_t *>(&view);
+    const float t = float(mFraction);
+    for (auto &field : mLinear) {
+      const float *x = reinterpret_cast<const float *>(a + field.offset);
+      const float *y = reinterpret_cast<const float *>(b + field.offset);
+      float *v = reinterpret_cast<float *>(out + field.offset);
+      for (size_t i = 0; i < field.floats; i++) {
+        v[i] = x[i] + (y[i] - x[i]) * t;
+      }
+    }
+    for (auto offset : mDoubles) {
+      const double x = *reinterpret_cast<const double *>(a + offset);
+      const double y = *reinterpret_cast<const double *>(b + offset);
+      *reinterpret_cast<double *>(out + offset) = x + (y - x) * mFraction;
+    }
+    for (auto offset : mPoses) {
+      const Pose &x = *reinterpret_cast<const Pose *>(a + offset);
+      const Pose &y = *reinterpret_cast<const Pose *>(b + offset);
+      *reinterpret_cast<Pose *>(out + offset) =
+          Pose(x.pos() + (y.pos() - x.pos()) * mFraction,
+               Quatd::slerp(x.quat(), y.quat(), mFraction));
+    }
+    return true;
+  }
+
+  /**
+   * @brief Position of the last view between the two states around it
+   *
+   * 0 is the older state, 1 the newer. Staying at 1 means states arrive
+   * later than the playout delay allows for.
+   */
+  double fraction() const { return mFraction; }
+
+private:
+  struct LinearField {
+    size_t offset;
+    size_t floats;
+  };
+
+  template <class T>
+  static size_t offsetIn(const State &state, const T &field) {
+    return reinterpret_cast<const uint8_t *>(&field) -
+           reinterpret_cast<const uint8_t *>(&state);
+  }
+
+  static double now() {
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Ring of the last states pushed, oldest first from mNewest + 1
+  std::unique_ptr<State> mStates[kStates];
+  double mTimes[kStates]{};
+  int mNewest{kStates - 1};
+  int mCount{0};
+
+  double mOffset{0.0}; // Renderer time - simulator time
+  double mLastPush{0.0};
+  double mPeriod{0.0};
+  double mPlayoutPeriods{1.5};
+  double mFixedDelay{0.0};
+  double mFraction{1.0};
+
+  std::vector<LinearField> mLinear;
+  std::vector<size_t> mDoubles;
+  std::vector<size_t> mPoses;
+};
+
+} // namespace al
+
+#endif // AL_STATEINTERPOLATOR_HPP
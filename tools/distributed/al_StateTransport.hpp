@@ -0,0 +1,716 @@
+#ifndef AL_STATETRANSPORT_HPP
+#define AL_STATETRANSPORT_HPP
+
+// UDP transport for state frames bigger than a datagram.
+//
+// StateSender splits each frame into packets that fit the network MTU, each
+// with the frame number, fragment index and send time, and sends them from
+// its own thread to a multicast group (or broadcast address), optionally
+// paced to a byte rate. If a new frame is queued before the previous one is
+// sent, only the newest one is sent, except for keyframes (frames that later
+// frames are decoded against): a queued keyframe is always sent, followed by
+// the newest frame queued after it.
+//
+// Every parity group of fragments is followed by a parity packet, the XOR of
+// its fragments, from which the receiver rebuilds one lost fragment per
+// group. Groups are interleaved (fragment i is in group i % groups), so a
+// burst of lost packets hits different groups. Keyframes are also sent more
+// than once; the receiver fills in the fragments it missed from the repeats.
+//
+// StateReceiver reassembles frames on a receive thread. A frame is only
+// handed to the app once all its packets arrived or were rebuilt. Frames that
+// can't be completed because packets were lost are dropped when a newer frame
+// completes, so the app always sees the last complete frame, and a complete
+// keyframe before it. Statistics count complete, dropped and missed frames,
+// lost and rebuilt packets, and the latency from the send time of a frame to
+// its completion. Packet loss can be simulated on the receiver for testing.
+//
+// POSIX sockets only. Latency across hosts assumes synchronized clocks.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+namespace al {
+
+/// Header at the start of every packet
+struct StateFragmentHeader {
+  uint32_t magic;
+  uint32_t frame;
+  uint32_t fragment; // Parity packets follow the fragments
+  uint32_t fragments;
+  uint32_t frameBytes;
+  uint32_t fragmentBytes; // Payload of every fragment but the last
+  uint32_t parityGroups;  // Number of parity packets, 0 for none
+  uint32_t flags;
+  uint64_t sendTime; // Microseconds since the epoch
+};
+
+inline uint64_t stateTransportMicros() {
+  return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count());
+}
+
+inline bool isMulticastAddress(const std::string &address) {
+  int first = std::atoi(address.c_str());
+  return first >= 224 && first <= 239;
+}
+
+class StateSender {
+public:
+  static const uint32_t kMagic = 0x46534c41; // "ALSF"
+  static const uint32_t kKeyframeFlag = 1;
+
+  ~StateSender() { close(); }
+
+  /**
+   * @brief Open a socket to send to address and start the send thread
+   * @param address multicast group or broadcast address
+   * @param ttl multicast hops. 1 stays on the local network.
+   */
+  bool open(const std::string &address = "239.255.0.42",
+            uint16_t port = 16447, int ttl = 1) {
+    close();
+#ifndef _WIN32
+    mSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (mSocket < 0) {
+      return false;
+    }
+    int buffer = 8 << 20;
+    setsockopt(mSocket, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    if (isMulticastAddress(address)) {
+      unsigned char hops = (unsigned char)ttl;
+      unsigned char loop = 1; // Receivers on this host get the frames too
+      setsockopt(mSocket, IPPROTO_IP, IP_MULTICAST_TTL, &hops, sizeof(hops));
+      setsockopt(mSocket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    } else {
+      int enable = 1;
+      setsockopt(mSocket, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+    }
+    std::memset(&mDestination, 0, sizeof(mDestination));
+    mDestination.sin_family = AF_INET;
+    mDestination.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &mDestination.sin_addr) != 1) {
+      std::cerr << "StateSender: invalid address " << address << std::endl;
+      close();
+      return false;
+    }
+    mRunning = true;
+    mThread = std::thread([this]() { sendLoop(); });
+    return true;
+#else
+    (void)address;
+    (void)port;
+    (void)ttl;
+    return false;
+#endif
+  }
+
+  void close() {
+    if (mRunning) {
+      {
+        std::unique_lock<std::mutex> lk(mMutex);
+        mRunning = false;
+      }
+      mCondition.notify_one();
+      mThread.join();
+    }
+#ifndef _WIN32
+    if (mSocket >= 0) {
+      ::close(mSocket);
+      mSocket = -1;
+    }
+#endif
+  }
+
+  /// UDP payload bytes per packet. 1472 fits a 1500 byte MTU.
+  void setPacketSize(size_t bytes) {
+    mPacketSize = std::max(bytes, sizeof(StateFragmentHeader) + 64);
+  }
+
+  /// Limit the send rate, to avoid overflowing receive buffers. 0 for none.
+  void setRateLimit(double bytesPerSecond) { mRate = bytesPerSecond; }
+
+  /// Fragments per parity packet, 8 by default (12.5% more packets). 0 sends
+  /// no parity.
+  void setParityGroupSize(unsigned int fragments) { mParityGroup = fragments; }
+
+  /// Extra times each keyframe is sent, 1 by default
+  void setKeyframeRepeats(unsigned int repeats) { mKeyframeRepeats = repeats; }
+
+  /**
+   * @brief Queue a frame
+   *
+   * Replaces a queued frame that wasn't sent yet, unless that is a keyframe
+   * and this one isn't: then this one is sent after the keyframe.
+   */
+  void send(const uint8_t *data, size_t size, bool keyframe = false) {
+    std::unique_lock<std::mutex> lk(mMutex);
+    if (mPending) {
+      // A frame queued before a keyframe is of no use after it
+      mReplaced++;
+      mPending = false;
+    }
+    if (keyframe) {
+      if (mKeyframePending) {
+        mReplaced++;
+      }
+      mQueuedKeyframe.assign(data, data + size);
+      mKeyframePending = true;
+    } else {
+      mQueued.assign(data, data + size);
+      mPending = true;
+    }
+    lk.unlock();
+    mCondition.notify_one();
+  }
+
+  /// Frames sent
+  uint64_t frames() const { return mFrames; }
+  /// Packets sent
+  uint64_t packets() const { return mPackets; }
+  /// Frames replaced by a newer one before they were sent
+  uint64_t replaced() const { return mReplaced; }
+
+private:
+  void sendLoop() {
+    std::vector<uint8_t> frame;
+    std::vector<uint8_t> packet;
+    std::vector<uint8_t> parity;
+    uint32_t frameNumber = 0;
+    while (true) {
+      bool keyframe;
+      {
+        std::unique_lock<std::mutex> lk(mMutex);
+        mCondition.wait(lk, [this]() {
+          return mPending || mKeyframePending || !mRunning;
+        });
+        if (!mRunning) {
+          return;
+        }
+        keyframe = mKeyframePending;
+        if (keyframe) {
+          frame.swap(mQueuedKeyframe);
+          mKeyframePending = false;
+        } else {
+          frame.swap(mQueued);
+          mPending = false;
+        }
+      }
+      const size_t payload = mPacketSize - sizeof(StateFragmentHeader);
+      StateFragmentHeader header;
+      header.magic = kMagic;
+      header.frame = frameNumber++;
+      header.fragments =
+          uint32_t(std::max<size_t>(1, (frame.size() + payload - 1) / payload));
+      header.frameBytes = uint32_t(frame.size());
+      header.fragmentBytes = uint32_t(payload);
+      header.parityGroups =
+          mParityGroup > 0 ? (header.fragments + mParityGroup - 1) / mParityGroup
+                           : 0;
+      header.flags = keyframe ? kKeyframeFlag : 0;
+      header.sendTime = stateTransportMicros();
+      packet.resize(mPacketSize);
+
+      // Parity packet g is the XOR of fragments g, g + groups, g + 2 groups
+      // ..., each padded with zeros to the payload size
+      parity.assign(header.parityGroups * payload, 0);
+      for (uint32_t i = 0; i < header.fragments && header.parityGroups > 0;
+           i++) {
+        size_t offset = size_t(i) * payload;
+        size_t bytes = std::min(payload, frame.size() - offset);
+        uint8_t *group = parity.data() + (i % header.parityGroups) * payload;
+        for (size_t b = 0; b < bytes; b++) {
+          group[b] ^= frame[offset + b];
+        }
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      size_t sent = 0;
+      const unsigned int passes = keyframe ? 1 + mKeyframeRepeats : 1;
+      const uint32_t packets = header.fragments + header.parityGroups;
+      for (unsigned int pass = 0; pass < passes; pass++) {
+        for (uint32_t i = 0; i < packets && mRunning; i++) {
+          header.fragment = i;
+          const uint8_t *data;
+          size_t bytes;
+          if (i < header.fragments) {
+            size_t offset = size_t(i) * payload;
+            data = frame.data() + offset;
+            bytes = std::min(payload, frame.size() - offset);
+          } else {
+            data = parity.data() + (i - header.fragments) * payload;
+            bytes = payload;
+          }
+          std::memcpy(packet.data(), &header, sizeof(header));
+          std::memcpy(packet.data() + sizeof(header), data, bytes);
+#ifndef _WIN32
+          sendto(mSocket, packet.data(), sizeof(header) + bytes, 0,
+                 reinterpret_cast<sockaddr *>(&mDestination),
+                 sizeof(mDestination));
+#endif
+          mPackets++;
+          sent += sizeof(header) + bytes;
+          if (mRate > 0.0) {
+            std::this_thread::sleep_until(
+                start + std::chrono::duration_cast<
+                            std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>(sent / mRate)));
+          }
+        }
+      }
+      mFrames++;
+    }
+  }
+
+#ifndef _WIN32
+  int mSocket{-1};
+  sockaddr_in mDestination;
+#endif
+  size_t mPacketSize{1472};
+  std::atomic<double> mRate{0.0};
+  std::atomic<unsigned int> mParityGroup{8};
+  std::atomic<unsigned int> mKeyframeRepeats{1};
+
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::atomic<bool> mRunning{false};
+  std::vector<uint8_t> mQueued;
+  bool mPending{false};
+  std::vector<uint8_t> mQueuedKeyframe;
+  bool mKeyframePending{false};
+
+  std::atomic<uint64_t> mFrames{0};
+  std::atomic<uint64_t> mPackets{0};
+  std::atomic<uint64_t> mReplaced{0};
+};
+
+struct StateTransportStats {
+  uint64_t frames{0};        // Frames completed
+  uint64_t dropped{0};       // Frames started but not completed
+  uint64_t missed{0};        // Frames of which no packet arrived
+  uint64_t packets{0};       // Packets received
+  uint64_t lostPackets{0};   // Packets missing from dropped frames
+  uint64_t rebuiltPackets{0}; // Lost packets rebuilt from parity
+  double latencyMicros{0.0}; // Send to completion, last frame
+  double maxLatencyMicros{0.0};
+
+  double frameLoss() const {
+    uint64_t total = frames + dropped + missed;
+    return total > 0 ? double(dropped + missed) / total : 0.0;
+  }
+};
+
+class StateReceiver {
+public:
+  ~StateReceiver() { close(); }
+
+  /// Listen on port, joining address if it's a multicast group
+  bool open(const std::string &address = "239.255.0.42",
+            uint16_t port = 16447) {
+    close();
+#ifndef _WIN32
+    mSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (mSocket < 0) {
+      return false;
+    }
+    int enable = 1;
+    setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+#ifdef SO_REUSEPORT
+    setsockopt(mSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+#endif
+    // Large frames arrive as bursts of packets
+    int buffer = 16 << 20;
+    setsockopt(mSocket, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    timeval timeout{0, 100000};
+    setsockopt(mSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in local;
+    std::memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(mSocket, reinterpret_cast<sockaddr *>(&local), sizeof(local)) <
+        0) {
+      std::cerr << "StateReceiver: can't bind port " << port << std::endl;
+      close();
+      return false;
+    }
+    if (isMulticastAddress(address)) {
+      ip_mreq request;
+      inet_pton(AF_INET, address.c_str(), &request.imr_multiaddr);
+      request.imr_interface.s_addr = htonl(INADDR_ANY);
+      if (setsockopt(mSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request,
+                     sizeof(request)) < 0) {
+        std::cerr << "StateReceiver: can't join " << address << std::endl;
+        close();
+        return false;
+      }
+    }
+    mRunning = true;
+    mThread = std::thread([this]() { receiveLoop(); });
+    return true;
+#else
+    (void)address;
+    (void)port;
+    return false;
+#endif
+  }
+
+  void close() {
+    if (mRunning) {
+      mRunning = false;
+      mThread.join();
+    }
+#ifndef _WIN32
+    if (mSocket >= 0) {
+      ::close(mSocket);
+      mSocket = -1;
+    }
+#endif
+  }
+
+  /**
+   * @brief Drop this fraction of the received packets, to test loss
+   * @param seed seeds the choice of packets, so that a test drops the same
+   * ones every run. With 0 it comes from std::random_device.
+   */
+  void setSimulatedLoss(float fraction, uint32_t seed = 0) {
+    mLossSeed = seed != 0 ? seed : uint32_t(std::random_device{}()) | 1u;
+    mSimulatedLoss = fraction;
+  }
+
+  /**
+   * @brief Get the last complete frame, if one completed since the last call
+   * @param frame swapped with the receiver's copy
+   *
+   * If a keyframe completed before the last complete frame and wasn't
+   * received yet, the keyframe is returned first and the last frame on the
+   * next call, so call this until it returns false.
+   */
+  bool receive(std::vector<uint8_t> &frame, uint32_t *frameNumber = nullptr) {
+    std::unique_lock<std::mutex> lk(mMutex);
+    if (mHasKeyframe) {
+      frame.swap(mKeyframe);
+      if (frameNumber) {
+        *frameNumber = mKeyframeNumber;
+      }
+      mHasKeyframe = false;
+      return true;
+    }
+    if (!mHasNew) {
+      return false;
+    }
+    frame.swap(mComplete);
+    if (frameNumber) {
+      *frameNumber = mCompleteFrame;
+    }
+    mHasNew = false;
+    return true;
+  }
+
+  StateTransportStats stats() {
+    std::unique_lock<std::mutex> lk(mMutex);
+    StateTransportStats stats = mStats;
+    stats.packets = mPackets;
+    return stats;
+  }
+
+private:
+  struct Assembly {
+    bool active{false};
+    bool keyframe{false};
+    uint32_t frame{0};
+    uint32_t fragments{0};
+    uint32_t fragmentBytes{0};
+    uint32_t groups{0};
+    uint32_t received{0};
+    uint64_t sendTime{0};
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> have;
+    std::vector<uint8_t> parity;
+    std::vector<uint8_t> haveParity;
+    std::vector<uint32_t> groupReceived; // Fragments received per group
+  };
+
+  static const int kAssemblies = 3;
+  static const uint32_t kMaxFrameBytes = 1u << 28;
+
+  void receiveLoop() {
+    std::vector<uint8_t> packet(65536);
+    std::mt19937 random;
+    uint32_t seed = 0;
+    std::uniform_real_distribution<float> chance(0.0f, 1.0f);
+    while (mRunning) {
+      if (mLossSeed != seed) {
+        seed = mLossSeed;
+        random.seed(seed);
+        chance.reset();
+      }
+#ifndef _WIN32
+      ssize_t bytes = recv(mSocket, packet.data(), packet.size(), 0);
+#else
+      long bytes = -1;
+#endif
+      if (bytes < ssize_t(sizeof(StateFragmentHeader))) {
+        continue;
+      }
+      if (mSimulatedLoss > 0.0f && chance(random) < mSimulatedLoss) {
+        continue;
+      }
+      StateFragmentHeader header;
+      std::memcpy(&header, packet.data(), sizeof(header));
+      if (!valid(header)) {
+        continue;
+      }
+      mPackets++;
+      addFragment(header, packet.data() + sizeof(header),
+                  size_t(bytes) - sizeof(header));
+    }
+  }
+
+  static bool valid(const StateFragmentHeader &header) {
+    if (header.magic != StateSender::kMagic ||
+        header.frameBytes > kMaxFrameBytes || header.fragmentBytes == 0) {
+      return false;
+    }
+    const uint64_t fragments = std::max<uint64_t>(
+        1, (uint64_t(header.frameBytes) + header.fragmentBytes - 1) /
+               header.fragmentBytes);
+    return header.fragments == fragments &&
+           header.parityGroups <= header.fragments &&
+           uint64_t(header.fragment) < fragments + header.parityGroups;
+  }
+
+  // Frame numbers wrap around, so compare them by difference
+  static bool newer(uint32_t a, uint32_t b) { return int32_t(a - b) > 0; }
+
+  void addFragment(const StateFragmentHeader &header, const uint8_t *payload,
+                   size_t bytes) {
+    if (mHaveFloor && !newer(header.frame, mFloor)) {
+      return; // Late packet of a frame that's done or dropped
+    }
+    Assembly *assembly = nullptr;
+    for (auto &a : mAssemblies) {
+      if (a.active && a.frame == header.frame) {
+        assembly = &a;
+      }
+    }
+    if (!assembly) {
+      assembly = startAssembly(header);
+    }
+    if (assembly->fragments != header.fragments ||
+        assembly->fragmentBytes != header.fragmentBytes ||
+        assembly->groups != header.parityGroups) {
+      return;
+    }
+    uint32_t group;
+    if (header.fragment >= header.fragments) {
+      // Parity packet
+      group = header.fragment - header.fragments;
+      if (assembly->haveParity[group] || bytes != header.fragmentBytes) {
+        return;
+      }
+      std::memcpy(assembly->parity.data() + size_t(group) * bytes, payload,
+                  bytes);
+      assembly->haveParity[group] = 1;
+    } else {
+      if (assembly->have[header.fragment] ||
+          bytes != fragmentSize(*assembly, header.fragment)) {
+        return;
+      }
+      const size_t offset = size_t(header.fragment) * header.fragmentBytes;
+      std::memcpy(assembly->data.data() + offset, payload, bytes);
+      assembly->have[header.fragment] = 1;
+      assembly->received++;
+      if (assembly->groups == 0) {
+        if (assembly->received == assembly->fragments) {
+          complete(*assembly);
+        }
+        return;
+      }
+      group = header.fragment % assembly->groups;
+      assembly->groupReceived[group]++;
+    }
+    rebuild(*assembly, group);
+    if (assembly->received == assembly->fragments) {
+      complete(*assembly);
+    }
+  }
+
+  static size_t fragmentSize(const Assembly &assembly, uint32_t fragment) {
+    const size_t offset = size_t(fragment) * assembly.fragmentBytes;
+    return std::min<size_t>(assembly.fragmentBytes,
+                            assembly.data.size() - offset);
+  }
+
+  // If one fragment of group is missing and its parity arrived, rebuild it
+  // as the XOR of the parity and the group's other fragments
+  void rebuild(Assembly &assembly, uint32_t group) {
+    const uint32_t size =
+        assembly.fragments / assembly.groups +
+        (group < assembly.fragments % assembly.groups ? 1 : 0);
+    if (!assembly.haveParity[group] ||
+        assembly.groupReceived[group] + 1 != size) {
+      return;
+    }
+    uint8_t *missing = nullptr;
+    uint32_t missingFragment = 0;
+    std::vector<uint8_t> &rebuilt = mRebuilt;
+    const uint8_t *parity =
+        assembly.parity.data() + size_t(group) * assembly.fragmentBytes;
+    rebuilt.assign(parity, parity + assembly.fragmentBytes);
+    for (uint32_t i = group; i < assembly.fragments; i += assembly.groups) {
+      uint8_t *data = assembly.data.data() + size_t(i) * assembly.fragmentBytes;
+      if (!assembly.have[i]) {
+        missing = data;
+        missingFragment = i;
+        continue;
+      }
+      const size_t bytes = fragmentSize(assembly, i);
+      for (size_t b = 0; b < bytes; b++) {
+        rebuilt[b] ^= data[b];
+      }
+    }
+    std::memcpy(missing, rebuilt.data(),
+                fragmentSize(assembly, missingFragment));
+    assembly.have[missingFragment] = 1;
+    assembly.received++;
+    assembly.groupReceived[group]++;
+    std::unique_lock<std::mutex> lk(mMutex);
+    mStats.rebuiltPackets++;
+  }
+
+  Assembly *startAssembly(const StateFragmentHeader &header) {
+    // Reuse a free slot, or the oldest frame in progress
+    Assembly *slot = nullptr;
+    for (auto &a : mAssemblies) {
+      if (!a.active) {
+        slot = &a;
+        break;
+      }
+      if (!slot || newer(slot->frame, a.frame)) {
+        slot = &a;
+      }
+    }
+    if (slot->active) {
+      drop(*slot);
+    }
+    if (mHaveSeen && newer(header.frame, mNewestSeen)) {
+      uint32_t gap = header.frame - mNewestSeen - 1;
+      std::unique_lock<std::mutex> lk(mMutex);
+      mStats.missed += gap;
+    }
+    if (!mHaveSeen || newer(header.frame, mNewestSeen)) {
+      mNewestSeen = header.frame;
+      mHaveSeen = true;
+    }
+    slot->active = true;
+    slot->keyframe = (header.flags & StateSender::kKeyframeFlag) != 0;
+    slot->frame = header.frame;
+    slot->fragments = header.fragments;
+    slot->fragmentBytes = header.fragmentBytes;
+    slot->groups = header.parityGroups;
+    slot->received = 0;
+    slot->sendTime = header.sendTime;
+    slot->data.resize(header.frameBytes);
+    slot->have.assign(header.fragments, 0);
+    slot->parity.resize(size_t(header.parityGroups) * header.fragmentBytes);
+    slot->haveParity.assign(header.parityGroups, 0);
+    slot->groupReceived.assign(header.parityGroups, 0);
+    return slot;
+  }
+
+  void drop(Assembly &assembly) {
+    raiseFloor(assembly.frame);
+    std::unique_lock<std::mutex> lk(mMutex);
+    mStats.dropped++;
+    mStats.lostPackets += assembly.fragments - assembly.received;
+    assembly.active = false;
+  }
+
+  void complete(Assembly &assembly) {
+    // Frames older than this one can't be shown anymore
+    for (auto &a : mAssemblies) {
+      if (a.active && newer(assembly.frame, a.frame)) {
+        drop(a);
+      }
+    }
+    double latency = double(stateTransportMicros() - assembly.sendTime);
+    std::unique_lock<std::mutex> lk(mMutex);
+    if (assembly.keyframe) {
+      // Kept until received, even if newer frames complete meanwhile. Frames
+      // before it are of no use anymore.
+      mKeyframe.swap(assembly.data);
+      mKeyframeNumber = assembly.frame;
+      mHasKeyframe = true;
+      mHasNew = false;
+    } else {
+      mComplete.swap(assembly.data);
+      mCompleteFrame = assembly.frame;
+      mHasNew = true;
+    }
+    mStats.frames++;
+    mStats.latencyMicros = latency;
+    mStats.maxLatencyMicros = std::max(mStats.maxLatencyMicros, latency);
+    assembly.active = false;
+    raiseFloor(assembly.frame);
+  }
+
+  void raiseFloor(uint32_t frame) {
+    if (!mHaveFloor || newer(frame, mFloor)) {
+      mFloor = frame;
+      mHaveFloor = true;
+    }
+  }
+
+#ifndef _WIN32
+  int mSocket{-1};
+#endif
+  std::thread mThread;
+  std::atomic<bool> mRunning{false};
+  std::atomic<float> mSimulatedLoss{0.0f};
+  std::atomic<uint32_t> mLossSeed{0};
+
+  // Receive thread
+  Assembly mAssemblies[kAssemblies];
+  uint32_t mFloor{0}; // Newest frame completed or dropped
+  bool mHaveFloor{false};
+  uint32_t mNewestSeen{0};
+  bool mHaveSeen{false};
+  std::atomic<uint64_t> mPackets{0};
+  std::vector<uint8_t> mRebuilt;
+
+  // Shared with the app
+  std::mutex mMutex;
+  std::vector<uint8_t> mComplete;
+  uint32_t mCompleteFrame{0};
+  bool mHasNew{false};
+  std::vector<uint8_t> mKeyframe;
+  uint32_t mKeyframeNumber{0};
+  bool mHasKeyframe{false};
+  StateTransportStats mStats;
+};
+
+} // namespace al
+
+#endif // AL_STATETRANSPORT_HPP
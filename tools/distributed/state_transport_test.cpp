@@ -0,0 +1,216 @@
+// Sends state frames to itself through StateSender and StateReceiver over
+// loopback multicast, optionally dropping packets, and checks that every
+// frame handed to the app is complete and intact, that keyframes get through
+// and that not too many frames are lost.
+//
+// Without options it runs a lossless case and cases with 0.1% and 1% packet
+// loss. With options it runs the one case they describe.
+//
+// Usage: state_transport_test [--bytes n] [--rate fps] [--seconds s]
+//                             [--loss fraction] [--packet bytes]
+//                             [--keyframes interval] [--parity group]
+//                             [--seed n] [--address group] [--port n]
+//
+// Packets are dropped with a fixed seed (1 unless --seed is given), so the
+// same ones are dropped every run.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "al_StateTransport.hpp"
+
+using namespace al;
+
+struct Options {
+  size_t bytes{1 << 20};
+  double rate{60.0};
+  double seconds{5.0};
+  float loss{0.0f};
+  size_t packet{1472};
+  int keyframes{30}; // Every this many frames is a keyframe
+  int parity{8};
+  uint32_t seed{1}; // Of the simulated loss
+  double maxFrameLoss{1.0}; // Fails above this fraction of lost frames
+  std::string address{"239.255.0.42"};
+  int port{16447};
+};
+
+// Frame contents derived from a seed stored in the first bytes
+static void fillFrame(std::vector<uint8_t> &frame, uint32_t seed) {
+  uint32_t x = seed * 2654435761u + 1;
+  std::memcpy(frame.data(), &seed, sizeof(seed));
+  for (size_t i = sizeof(seed); i < frame.size(); i++) {
+    x = x * 1664525u + 1013904223u;
+    frame[i] = uint8_t(x >> 24);
+  }
+}
+
+static bool checkFrame(const std::vector<uint8_t> &frame, size_t bytes) {
+  if (frame.size() != bytes || bytes < sizeof(uint32_t)) {
+    return false;
+  }
+  uint32_t seed;
+  std::memcpy(&seed, frame.data(), sizeof(seed));
+  std::vector<uint8_t> expected(bytes);
+  fillFrame(expected, seed);
+  return expected == frame;
+}
+
+static bool isKeyframe(uint32_t seed, const Options &options) {
+  return seed % uint32_t(options.keyframes) == 0;
+}
+
+static bool parseOptions(int argc, char *argv[], Options &options) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--bytes" && hasValue) {
+      options.bytes = size_t(std::atof(argv[++i]));
+    } else if (arg == "--rate" && hasValue) {
+      options.rate = std::atof(argv[++i]);
+    } else if (arg == "--seconds" && hasValue) {
+      options.seconds = std::atof(argv[++i]);
+    } else if (arg == "--loss" && hasValue) {
+      options.loss = float(std::atof(argv[++i]));
+    } else if (arg == "--packet" && hasValue) {
+      options.packet = size_t(std::atoi(argv[++i]));
+    } else if (arg == "--keyframes" && hasValue) {
+      options.keyframes = std::atoi(argv[++i]);
+    } else if (arg == "--parity" && hasValue) {
+      options.parity = std::atoi(argv[++i]);
+    } else if (arg == "--seed" && hasValue) {
+      options.seed = uint32_t(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--address" && hasValue) {
+      options.address = argv[++i];
+    } else if (arg == "--port" && hasValue) {
+      options.port = std::atoi(argv[++i]);
+    } else {
+      std::fprintf(stderr,
+                   "Usage: state_transport_test [--bytes n] [--rate fps] "
+                   "[--seconds s] [--loss fraction] [--packet bytes] "
+                   "[--keyframes interval] [--parity group] [--seed n] "
+                   "[--address group] [--port n]\n");
+      return false;
+    }
+  }
+  options.bytes = std::max(options.bytes, sizeof(uint32_t));
+  options.rate = std::max(1.0, options.rate);
+  options.keyframes = std::max(1, options.keyframes);
+  options.parity = std::max(0, options.parity);
+  return true;
+}
+
+// Returns true if the case passed
+static bool runCase(const Options &options) {
+  StateReceiver receiver;
+  StateSender sender;
+  if (!receiver.open(options.address, uint16_t(options.port)) ||
+      !sender.open(options.address, uint16_t(options.port))) {
+    std::fprintf(stderr, "Can't open sockets\n");
+    return false;
+  }
+  receiver.setSimulatedLoss(options.loss, options.seed);
+  sender.setPacketSize(options.packet);
+  sender.setParityGroupSize(unsigned(options.parity));
+  std::printf("%zu byte frames at %.0f Hz, %zu byte packets, %.2f%% loss, "
+              "keyframe every %d, parity every %d\n",
+              options.bytes, options.rate, options.packet,
+              100.0 * options.loss, options.keyframes, options.parity);
+
+  std::vector<uint8_t> frame(options.bytes);
+  std::vector<uint8_t> received;
+  const auto period = std::chrono::duration<double>(1.0 / options.rate);
+  const int frames = int(options.seconds * options.rate);
+  auto next = std::chrono::steady_clock::now();
+  int corrupt = 0;
+  int delivered = 0;
+  int keyframesSent = 0;
+  int keyframesDelivered = 0;
+  for (int f = 0; f <= frames; f++) {
+    if (f < frames) {
+      fillFrame(frame, uint32_t(f));
+      bool keyframe = isKeyframe(uint32_t(f), options);
+      keyframesSent += keyframe ? 1 : 0;
+      sender.send(frame.data(), frame.size(), keyframe);
+    }
+    next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        period);
+    std::this_thread::sleep_until(next);
+    // The renderer side, once per frame
+    while (receiver.receive(received)) {
+      delivered++;
+      if (!checkFrame(received, options.bytes)) {
+        corrupt++;
+        continue;
+      }
+      uint32_t seed;
+      std::memcpy(&seed, received.data(), sizeof(seed));
+      keyframesDelivered += isKeyframe(seed, options) ? 1 : 0;
+    }
+  }
+  // Last packets in flight
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  while (receiver.receive(received)) {
+    delivered++;
+    if (!checkFrame(received, options.bytes)) {
+      corrupt++;
+      continue;
+    }
+    uint32_t seed;
+    std::memcpy(&seed, received.data(), sizeof(seed));
+    keyframesDelivered += isKeyframe(seed, options) ? 1 : 0;
+  }
+
+  auto stats = receiver.stats();
+  std::printf("Sent %llu frames (%llu packets), %llu replaced before "
+              "sending\n",
+              (unsigned long long)sender.frames(),
+              (unsigned long long)sender.packets(),
+              (unsigned long long)sender.replaced());
+  std::printf("Received %llu packets: %llu frames complete, %llu dropped, "
+              "%llu missed, %llu packets lost, %llu rebuilt\n",
+              (unsigned long long)stats.packets,
+              (unsigned long long)stats.frames,
+              (unsigned long long)stats.dropped,
+              (unsigned long long)stats.missed,
+              (unsigned long long)stats.lostPackets,
+              (unsigned long long)stats.rebuiltPackets);
+  std::printf("Frame loss %.1f%%, latency %.2f ms (max %.2f ms)\n",
+              100.0 * stats.frameLoss(), stats.latencyMicros / 1000.0,
+              stats.maxLatencyMicros / 1000.0);
+  std::printf("%i frames seen by the app, %i corrupt, %i of %i keyframes\n",
+              delivered, corrupt, keyframesDelivered, keyframesSent);
+  bool passed = corrupt == 0 && delivered > 0 &&
+                keyframesDelivered == keyframesSent &&
+                stats.frameLoss() <= options.maxFrameLoss;
+  std::printf("%s\n\n", passed ? "PASSED" : "FAILED");
+  return passed;
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (argc > 1) {
+    if (!parseOptions(argc, argv, options)) {
+      return 2;
+    }
+    return runCase(options) ? 0 : 1;
+  }
+  // Lossless, 0.1% and 1% loss. With parity 1 MB frames should rarely be
+  // lost at 0.1%; at 1% some are, but never keyframes.
+  const float losses[] = {0.0f, 0.001f, 0.01f};
+  const double maxFrameLoss[] = {0.02, 0.05, 0.5};
+  bool passed = true;
+  for (int i = 0; i < 3; i++) {
+    options.loss = losses[i];
+    options.maxFrameLoss = maxFrameLoss[i];
+    options.seconds = 3.0;
+    passed &= runCase(options);
+  }
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+#ifndef AL_STATEMESHVIEW_HPP
+#define AL_STATEMESHVIEW_HPP
+
+// Drawing a mesh whose vertex positions live outside of it, such as an array
+// in a distributed state.
+//
+// Drawing a Mesh copies its vertices to the GPU every time, so positions
+// that are copied into a Mesh every frame are copied twice. StateMeshView
+// takes the primitive and indices of a Mesh once, and the positions from an
+// array every frame, copied straight into a GPU buffer. Where the context
+// supports persistently mapped buffers (OpenGL 4.4 or ARB_buffer_storage),
+// the buffer has three regions that stay mapped: every frame the positions
+// are written into the next region, with a fence so that a region the GPU
+// may still be drawing from isn't overwritten. Otherwise the buffer is
+// orphaned and refilled with glBufferSubData.
+//
+// Positions are attribute 0, as in the Graphics shaders, so the color and
+// polygon mode set on Graphics apply. Only positions are supplied: there are
+// no normals, so draw with a uniform color and lighting off.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "al/graphics/al_Graphics.hpp"
+#include "al/graphics/al_Mesh.hpp"
+#include "al/graphics/al_OpenGL.hpp"
+#include "al/math/al_Vec.hpp"
+
+namespace al {
+
+class StateMeshView {
+public:
+  static const int kRegions = 3;
+
+  ~StateMeshView() { destroy(); }
+
+  /**
+   * @brief Create the GPU buffers, with the primitive and indices of mesh
+   * @param vertexCount positions passed to update() every frame
+   *
+   * The positions start as the mesh's vertices (zero past their end), so
+   * drawing before the first update() shows the mesh at rest.
+   *
+   * Call with the graphics context current (onCreate()).
+   */
+  void create(const Mesh &mesh, size_t vertexCount) {
+    destroy();
+    mPrimitive = GLenum(mesh.primitive());
+    mVertexCount = vertexCount;
+    mIndexCount = mesh.indices().size();
+    const size_t bytes = vertexCount * sizeof(Vec3f);
+    std::vector<Vec3f> rest(vertexCount, Vec3f(0, 0, 0));
+    std::copy_n(mesh.vertices().begin(),
+                std::min(mesh.vertices().size(), vertexCount), rest.begin());
+
+    glGenVertexArrays(1, &mVertexArray);
+    glBindVertexArray(mVertexArray);
+
+    glGenBuffers(1, &mPositionBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, mPositionBuffer);
+#ifdef GL_MAP_PERSISTENT_BIT
+    if (glBufferStorage) {
+      const GLbitfield flags =
+          GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_ARRAY_BUFFER, kRegions * bytes, nullptr, flags);
+      mMapped = static_cast<uint8_t *>(
+          glMapBufferRange(GL_ARRAY_BUFFER, 0, kRegions * bytes, flags));
+      if (mMapped) {
+        for (int region = 0; region < kRegions; region++) {
+          std::memcpy(mMapped + region * bytes, rest.data(), bytes);
+        }
+      }
+    }
+#endif
+    if (!mMapped) {
+      glBufferData(GL_ARRAY_BUFFER, bytes, rest.data(), GL_STREAM_DRAW);
+    }
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+    if (mIndexCount > 0) {
+      glGenBuffers(1, &mIndexBuffer);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+      glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                   mIndexCount * sizeof(Mesh::Index), mesh.indices().data(),
+                   GL_STATIC_DRAW);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  void destroy() {
+    if (!mVertexArray) {
+      return;
+    }
+#ifdef GL_MAP_PERSISTENT_BIT
+    for (auto &fence : mFences) {
+      if (fence) {
+        glDeleteSync(fence);
+        fence = nullptr;
+      }
+    }
+#endif
+    if (mMapped) {
+      glBindBuffer(GL_ARRAY_BUFFER, mPositionBuffer);
+      glUnmapBuffer(GL_ARRAY_BUFFER);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      mMapped = nullptr;
+    }
+    glDeleteBuffers(1, &mPositionBuffer);
+    if (mIndexBuffer) {
+      glDeleteBuffers(1, &mIndexBuffer);
+    }
+    glDeleteVertexArrays(1, &mVertexArray);
+    mVertexArray = mPositionBuffer = mIndexBuffer = 0;
+  }
+
+  /// True if positions are written to a persistently mapped buffer
+  bool persistent() const { return mMapped != nullptr; }
+
+  /**
+   * @brief Copy this frame's positions to the GPU
+   *
+   * Call once per frame, not per eye or per pass, with the context current.
+   */
+  void update(const Vec3f *positions) {
+    if (!mVertexArray) {
+      return;
+    }
+    const size_t bytes = mVertexCount * sizeof(Vec3f);
+    glBindBuffer(GL_ARRAY_BUFFER, mPositionBuffer);
+    if (mMapped) {
+      mRegion = (mRegion + 1) % kRegions;
+      waitForRegion(mRegion);
+      std::memcpy(mMapped + mRegion * bytes, positions, bytes);
+      glBindVertexArray(mVertexArray);
+      glVertexAttribPointer(
+          0, 3, GL_FLOAT, GL_FALSE, 0,
+          reinterpret_cast<const void *>(uintptr_t(mRegion * bytes)));
+      glBindVertexArray(0);
+    } else {
+      glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+      glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, positions);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  void draw(Graphics &g) {
+    if (!mVertexArray) {
+      return;
+    }
+    g.update(); // Shader and matrices, as for g.draw(mesh)
+    glBindVertexArray(mVertexArray);
+    if (mIndexCount > 0) {
+      glDrawElements(mPrimitive, GLsizei(mIndexCount), GL_UNSIGNED_INT,
+                     nullptr);
+    } else {
+      glDrawArrays(mPrimitive, 0, GLsizei(mVertexCount));
+    }
+    glBindVertexArray(0);
+#ifdef GL_MAP_PERSISTENT_BIT
+    if (mMapped) {
+      if (mFences[mRegion]) {
+        glDeleteSync(mFences[mRegion]);
+      }
+      mFences[mRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+#endif
+  }
+
+private:
+  // Wait until the GPU is done drawing from region
+  void waitForRegion(int region) {
+#ifdef GL_MAP_PERSISTENT_BIT
+    GLsync &fence = mFences[region];
+    if (!fence) {
+      return;
+    }
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) ==
+           GL_TIMEOUT_EXPIRED) {
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+#else
+    (void)region;
+#endif
+  }
+
+  GLuint mVertexArray{0};
+  GLuint mPositionBuffer{0};
+  GLuint mIndexBuffer{0};
+  GLenum mPrimitive{GL_TRIANGLES};
+  size_t mVertexCount{0};
+  size_t mIndexCount{0};
+  uint8_t *mMapped{nullptr};
+  int mRegion{0};
+#ifdef GL_MAP_PERSISTENT_BIT
+  GLsync mFences[kRegions]{};
+#endif
+};
+
+} // namespace al
+
+#endif // AL_STATEMESHVIEW_HPP
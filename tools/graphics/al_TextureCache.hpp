@@ -0,0 +1,192 @@
+#ifndef AL_TEXTURECACHE_HPP
+#define AL_TEXTURECACHE_HPP
+
+// Textures loaded from image files, kept on the GPU for reuse.
+//
+// TextureCache keeps one texture per file path, loaded through a
+// TextureLoader. Asking again for a path that was loaded before returns its
+// texture at once. When the textures take more than the memory budget, the
+// least recently used ones are deleted, except those still held by a user
+// (a panel showing it). Files can be preloaded, e.g. every image in a preset
+// bank, so that recalling a preset doesn't wait for the disk.
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "al/graphics/al_Texture.hpp"
+
+#include "al_TextureLoader.hpp"
+
+namespace al {
+
+struct TextureCacheStats {
+  uint64_t hits{0};
+  uint64_t misses{0};
+  uint64_t evictions{0};
+  size_t textures{0};
+  size_t bytes{0};  // Estimated GPU memory of the loaded textures
+  size_t budget{0};
+
+  double hitRate() const {
+    return hits + misses > 0 ? hits / double(hits + misses) : 0.0;
+  }
+};
+
+class TextureCache {
+public:
+  /// Called with the texture when it is ready, or nullptr if it failed
+  typedef std::function<void(std::shared_ptr<Texture> texture, int width,
+                             int height)>
+      Callback;
+
+  explicit TextureCache(TextureLoader &loader) : mLoader(loader) {
+    mStats.budget = size_t(1) << 30;
+  }
+
+  /// GPU memory for textures in bytes, 1 GB by default. 0 for no limit.
+  void setBudget(size_t bytes) {
+    mStats.budget = bytes;
+    evict();
+  }
+
+  /// Generate mipmaps for textures loaded from now on
+  void setMipmaps(bool mipmaps) { mMipmaps = mipmaps; }
+
+  /**
+   * @brief Get the texture for path
+   *
+   * If it is cached, callback is called before returning. Otherwise the file
+   * is loaded and callback is called from TextureLoader::update() when the
+   * texture is ready. Keep the texture pointer while using it, so that it
+   * isn't evicted.
+   */
+  void get(const std::string &path, Callback callback) {
+    auto found = mEntries.find(path);
+    if (found != mEntries.end() && found->second.ready) {
+      mStats.hits++;
+      touch(found->second);
+      callback(found->second.texture, found->second.width,
+               found->second.height);
+      return;
+    }
+    mStats.misses++;
+    request(path).waiting.push_back(callback);
+  }
+
+  /// Load path if it isn't cached, without counting a hit or miss
+  void preload(const std::string &path) {
+    if (mEntries.find(path) == mEntries.end()) {
+      request(path);
+    }
+  }
+
+  bool cached(const std::string &path) const {
+    auto found = mEntries.find(path);
+    return found != mEntries.end() && found->second.ready;
+  }
+
+  const TextureCacheStats &stats() const { return mStats; }
+
+private:
+  struct Entry {
+    std::shared_ptr<Texture> texture;
+    bool ready{false};
+    int width{0};
+    int height{0};
+    size_t bytes{0};
+    std::list<std::string>::iterator lru;
+    std::vector<Callback> waiting;
+  };
+
+  // The entry for path, loading it if it is new
+  Entry &request(const std::string &path) {
+    auto found = mEntries.find(path);
+    if (found != mEntries.end()) {
+      return found->second;
+    }
+    Entry &entry = mEntries[path];
+    entry.texture = std::make_shared<Texture>();
+    mLru.push_front(path);
+    entry.lru = mLru.begin();
+    mLoader.load(path, *entry.texture,
+                 [this, path](bool loaded, int width, int height) {
+                   loadDone(path, loaded, width, height);
+                 });
+    return entry;
+  }
+
+  void loadDone(const std::string &path, bool loaded, int width, int height) {
+    auto found = mEntries.find(path);
+    if (found == mEntries.end()) {
+      return;
+    }
+    Entry &entry = found->second;
+    std::vector<Callback> waiting;
+    waiting.swap(entry.waiting);
+    if (!loaded) {
+      mLru.erase(entry.lru);
+      mEntries.erase(found);
+      for (auto &callback : waiting) {
+        callback(nullptr, 0, 0);
+      }
+      return;
+    }
+    entry.ready = true;
+    entry.width = width;
+    entry.height = height;
+    entry.bytes = size_t(width) * height * 4;
+    if (mMipmaps) {
+      entry.texture->filterMin(Texture::LINEAR_MIPMAP_LINEAR);
+      entry.texture->generateMipmap();
+      entry.bytes += entry.bytes / 3;
+    }
+    mStats.bytes += entry.bytes;
+    mStats.textures++;
+    std::shared_ptr<Texture> texture = entry.texture;
+    if (!waiting.empty()) {
+      touch(entry);
+    }
+    for (auto &callback : waiting) {
+      callback(texture, width, height);
+    }
+    evict();
+  }
+
+  void touch(Entry &entry) {
+    mLru.splice(mLru.begin(), mLru, entry.lru);
+  }
+
+  // Delete least recently used textures that nobody holds, down to the
+  // budget
+  void evict() {
+    auto path = mLru.end();
+    while (mStats.budget > 0 && mStats.bytes > mStats.budget &&
+           path != mLru.begin()) {
+      --path;
+      Entry &entry = mEntries[*path];
+      if (!entry.ready || entry.texture.use_count() > 1) {
+        continue;
+      }
+      mStats.bytes -= entry.bytes;
+      mStats.textures--;
+      mStats.evictions++;
+      mEntries.erase(*path);
+      path = mLru.erase(path);
+    }
+  }
+
+  TextureLoader &mLoader;
+  std::unordered_map<std::string, Entry> mEntries;
+  std::list<std::string> mLru; // Most recently used first
+  bool mMipmaps{false};
+  TextureCacheStats mStats;
+};
+
+} // namespace al
+
+#endif // AL_TEXTURECACHE_HPP
@@ -0,0 +1,274 @@
+#ifndef AL_TEXTURELOADER_HPP
+#define AL_TEXTURELOADER_HPP
+
+// Loading of image files into textures without stalling the graphics thread.
+//
+// Images are decoded by a pool of threads. The graphics thread calls
+// update() once per frame, which uploads decoded images through a pixel
+// buffer object, a few rows at a time up to a budget of bytes per frame, so
+// a large image is spread over several frames instead of stalling one.
+// Nothing is written to the texture until the image is decoded, so with a
+// second texture the old image can stay on screen until the new one is
+// ready; the callback passed to load() is called from update() when it is.
+//
+// A load for a texture that already has a load in flight replaces it: the
+// older image is dropped when it finishes decoding.
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "al/graphics/al_BufferObject.hpp"
+#include "al/graphics/al_Image.hpp"
+#include "al/graphics/al_OpenGL.hpp"
+#include "al/graphics/al_Texture.hpp"
+
+namespace al {
+
+class TextureLoader {
+public:
+  /// Called when an image is in its texture, or failed to load (width and
+  /// height 0). The texture is unchanged if the image failed to decode, and
+  /// may be partly written if it failed to upload.
+  typedef std::function<void(bool loaded, int width, int height)> Callback;
+
+  explicit TextureLoader(unsigned int threads = 2) {
+    for (unsigned int i = 0; i < std::max(1u, threads); i++) {
+      mThreads.emplace_back([this]() { decodeLoop(); });
+    }
+  }
+
+  ~TextureLoader() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mQuit = true;
+    }
+    mWake.notify_all();
+    for (auto &thread : mThreads) {
+      thread.join();
+    }
+    destroy();
+  }
+
+  /**
+   * @brief Release the staging buffer
+   *
+   * Call with the graphics context current, before it is destroyed
+   * (onExit()). Uploads in flight are dropped without calling back.
+   */
+  void destroy() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      for (auto &job : mUploads) {
+        if (current(*job)) {
+          mLatest.erase(job->texture);
+        }
+      }
+    }
+    mUploads.clear();
+    if (mStaging.created()) {
+      mStaging.destroy();
+    }
+  }
+
+  /// Bytes uploaded per update(), at least one row of the image
+  void setUploadBudget(size_t bytes) { mBudget = bytes; }
+
+  /**
+   * @brief Start loading an image file into texture
+   *
+   * Can be called from any thread. The texture must outlive the load.
+   */
+  void load(const std::string &path, Texture &texture,
+            Callback callback = nullptr) {
+    auto job = std::make_shared<Job>();
+    job->path = path;
+    job->texture = &texture;
+    job->callback = callback;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      job->id = ++mLastId;
+      mLatest[&texture] = job->id;
+      mQueue.push_back(job);
+    }
+    mWake.notify_one();
+  }
+
+  /// True while a load for texture is in flight
+  bool loading(const Texture &texture) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mLatest.count(&texture) > 0;
+  }
+
+  /**
+   * @brief Upload decoded images and call callbacks
+   *
+   * Call once per frame from the graphics thread.
+   */
+  void update() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      for (auto &job : mDecoded) {
+        if (current(*job)) {
+          mUploads.push_back(job);
+        }
+      }
+      mDecoded.clear();
+    }
+    size_t budget = mBudget;
+    while (!mUploads.empty() && budget > 0) {
+      auto job = mUploads.front();
+      bool superseded;
+      {
+        std::lock_guard<std::mutex> lock(mMutex);
+        superseded = !current(*job);
+      }
+      if (superseded) {
+        mUploads.pop_front();
+        continue;
+      }
+      if (job->pixels.empty()) {
+        finish(*job, false);
+        mUploads.pop_front();
+        continue;
+      }
+      const size_t uploaded = uploadRows(*job, budget);
+      if (uploaded == 0) {
+        std::cout << "failed to upload image " << job->path << std::endl;
+        finish(*job, false);
+        mUploads.pop_front();
+        continue;
+      }
+      budget -= std::min(budget, uploaded);
+      if (job->uploadedRows == job->height) {
+        job->texture->filter(Texture::LINEAR);
+        finish(*job, true);
+        mUploads.pop_front();
+      }
+    }
+  }
+
+private:
+  struct Job {
+    uint64_t id;
+    std::string path;
+    Texture *texture;
+    Callback callback;
+    std::vector<uint8_t> pixels; // RGBA, empty if decoding failed
+    int width{0};
+    int height{0};
+    int uploadedRows{0};
+  };
+
+  // With mMutex locked
+  bool current(const Job &job) const {
+    auto latest = mLatest.find(job.texture);
+    return latest != mLatest.end() && latest->second == job.id;
+  }
+
+  void decodeLoop() {
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWake.wait(lock, [this]() { return mQuit || !mQueue.empty(); });
+        if (mQuit) {
+          return;
+        }
+        job = mQueue.front();
+        mQueue.pop_front();
+        if (!current(*job)) {
+          continue; // Replaced before it was decoded
+        }
+      }
+      Image image(job->path);
+      if (image.array().empty()) {
+        std::cout << "failed to load image " << job->path << std::endl;
+      } else {
+        job->width = int(image.width());
+        job->height = int(image.height());
+        job->pixels.swap(image.array());
+      }
+      std::lock_guard<std::mutex> lock(mMutex);
+      mDecoded.push_back(job);
+    }
+  }
+
+  // Upload the next rows that fit in budget. Returns bytes uploaded, 0 if the
+  // staging buffer couldn't be mapped.
+  size_t uploadRows(Job &job, size_t budget) {
+    const size_t rowBytes = size_t(job.width) * 4;
+    if (job.uploadedRows == 0) {
+      job.texture->create2D(job.width, job.height, Texture::RGBA8,
+                            Texture::RGBA, Texture::UBYTE);
+    }
+    const int rows = int(std::min(std::max(budget / rowBytes, size_t(1)),
+                                  size_t(job.height - job.uploadedRows)));
+    const size_t bytes = rows * rowBytes;
+
+    if (!mStaging.created()) {
+      mStaging.bufferType(GL_PIXEL_UNPACK_BUFFER);
+      mStaging.usage(GL_STREAM_DRAW);
+      mStaging.create();
+    }
+    mStaging.bind();
+    mStaging.data(bytes, nullptr); // Orphan the previous chunk
+    void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+                                    GL_MAP_WRITE_BIT |
+                                        GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!mapped) {
+      mStaging.unbind();
+      return 0;
+    }
+    std::memcpy(mapped, job.pixels.data() + job.uploadedRows * rowBytes,
+                bytes);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    job.texture->bind();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, job.uploadedRows, job.width, rows,
+                    GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    job.texture->unbind();
+    mStaging.unbind();
+    job.uploadedRows += rows;
+    return bytes;
+  }
+
+  void finish(Job &job, bool loaded) {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mLatest.erase(job.texture);
+    }
+    job.pixels.clear();
+    if (job.callback) {
+      job.callback(loaded, loaded ? job.width : 0, loaded ? job.height : 0);
+    }
+  }
+
+  std::vector<std::thread> mThreads;
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  bool mQuit{false};
+  uint64_t mLastId{0};
+  std::map<const Texture *, uint64_t> mLatest; // Load in flight per texture
+  std::deque<std::shared_ptr<Job>> mQueue;     // To decode
+  std::vector<std::shared_ptr<Job>> mDecoded;  // To upload
+
+  // Graphics thread
+  std::deque<std::shared_ptr<Job>> mUploads;
+  BufferObject mStaging;
+  size_t mBudget{8 << 20};
+};
+
+} // namespace al
+
+#endif // AL_TEXTURELOADER_HPP
@@ -0,0 +1,305 @@
+#ifndef AL_VIDEOFRAMERING_HPP
+#define AL_VIDEOFRAMERING_HPP
+
+// Video frames decoded ahead of the playhead, for frame accurate playback on
+// several render nodes.
+//
+// A decoder thread decodes frames in order into a ring of RGBA frames, up to
+// the ring's capacity ahead of the frame being shown. The graphics thread
+// calls update() with the playback time, which selects frame number
+// floor(time * fps), so every node given the same time (the primary's)
+// shows the same frame whatever its own decoder timing. The frame is copied
+// into one of two pixel buffer objects, used in turn so that the transfer to
+// the texture of one frame overlaps with writing the next.
+//
+// A time behind the ring or further ahead than its capacity seeks: the ring
+// is emptied and the decoder restarts from that frame. Frames skipped over
+// between two updates are counted as dropped, and frames that weren't decoded
+// yet when they were due as late.
+//
+// The length of the video comes from the container when it has one, probed
+// on the decoder thread before the first frame so that opening the file again
+// doesn't hold up the caller. Else it is known once the decoder reports the
+// end after decoding frames, which is forgotten on seeks; a frame that is
+// only slow to decode isn't the end.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "al/graphics/al_BufferObject.hpp"
+#include "al/graphics/al_OpenGL.hpp"
+#include "al/graphics/al_Texture.hpp"
+
+namespace al {
+
+struct VideoFrameStats {
+  int64_t frame{-1}; // Frame shown
+  uint64_t shown{0};
+  uint64_t dropped{0};
+  uint64_t late{0};
+  uint64_t seeks{0};
+};
+
+class VideoFrameRing {
+public:
+  enum class Decoded {
+    FRAME,     // pixels hold the frame
+    NOT_READY, // Not decoded yet, the same frame is requested again
+    END        // Past the end of the video
+  };
+
+  /// Decode frame number frame into pixels (width * height RGBA). Frames are
+  /// requested in order after a seek. Shouldn't block for long, so that
+  /// seeks and stop() are handled.
+  typedef std::function<Decoded(uint8_t *pixels, int64_t frame)>
+      DecodeFunction;
+  /// Position the decoder so that the next frame decoded is frame
+  typedef std::function<void(int64_t frame)> SeekFunction;
+  /// Frames in the video according to its container, or -1 if it doesn't
+  /// say. Called once from the decoder thread, before the first frame.
+  typedef std::function<int64_t()> LengthFunction;
+
+  ~VideoFrameRing() { stop(); }
+
+  /**
+   * @brief Start decoding from the first frame
+   * @param length probes the frames in the video, can be empty
+   * @param capacity frames decoded ahead of the playhead
+   */
+  void start(int width, int height, double fps, LengthFunction length,
+             DecodeFunction decode, SeekFunction seek, size_t capacity = 8) {
+    stop();
+    mWidth = width;
+    mHeight = height;
+    mFps = fps;
+    mFrames = -1;
+    mLength = length;
+    mDecode = decode;
+    mSeek = seek;
+    mSlots.assign(std::max(capacity, size_t(2)), Slot());
+    mPlayhead = 0;
+    mNextDecode = 0;
+    mGeneration = 0;
+    mEndFrame = -1;
+    mStats = VideoFrameStats();
+    mRunning = true;
+    mThread = std::thread([this]() { decodeLoop(); });
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mRunning = false;
+    }
+    mWake.notify_all();
+    if (mThread.joinable()) {
+      mThread.join();
+    }
+  }
+
+  /// False once stop() was called. Decode functions that wait should check
+  /// it.
+  bool running() const { return mRunning; }
+
+  int64_t frameAt(double time) const {
+    return int64_t(std::floor(time * mFps + 1e-6));
+  }
+
+  /// Frames in the video, or -1 while unknown
+  int64_t frames() const {
+    const int64_t frames = mFrames;
+    return frames >= 0 ? frames : mEndFrame.load();
+  }
+
+  /// Length of the video in seconds, or 0 while unknown
+  double duration() const {
+    const int64_t count = frames();
+    return count > 0 ? count / mFps : 0.0;
+  }
+
+  /**
+   * @brief Show the frame for time in texture
+   *
+   * Call once per frame from the graphics thread, with a texture created
+   * with the video's size. Returns true if a new frame was uploaded.
+   */
+  bool update(double time, Texture &texture) {
+    if (mSlots.empty()) {
+      return false; // Not started
+    }
+    int64_t frame = std::max(frameAt(time), int64_t(0));
+    const int64_t count = frames();
+    if (count > 0) {
+      frame = std::min(frame, count - 1);
+    }
+    if (frame == mStats.frame) {
+      return false;
+    }
+    std::unique_lock<std::mutex> lock(mMutex);
+    const int64_t capacity = int64_t(mSlots.size());
+    if (frame < mPlayhead || frame >= mPlayhead + capacity) {
+      // Outside of what the decoder can have ready: start over from frame
+      mGeneration++;
+      mNextDecode = frame;
+      mEndFrame = -1;
+      for (auto &slot : mSlots) {
+        slot.frame = -1;
+      }
+      mStats.seeks++;
+    } else if (mStats.frame >= 0 && frame > mStats.frame + 1 &&
+               mStats.seeks == mSeeksAtShown) {
+      mStats.dropped += frame - mStats.frame - 1;
+    }
+    mPlayhead = frame;
+    mWake.notify_all();
+
+    Slot &slot = mSlots[frame % capacity];
+    if (slot.frame != frame) {
+      if (frame != mLateFrame) {
+        mStats.late++;
+        mLateFrame = frame;
+      }
+      return false;
+    }
+    upload(slot.pixels, texture);
+    lock.unlock();
+    mStats.frame = frame;
+    mStats.shown++;
+    mSeeksAtShown = mStats.seeks;
+    return true;
+  }
+
+  const VideoFrameStats &stats() const { return mStats; }
+
+private:
+  struct Slot {
+    int64_t frame{-1};
+    std::vector<uint8_t> pixels;
+  };
+
+  void decodeLoop() {
+    std::vector<uint8_t> pixels(size_t(mWidth) * mHeight * 4);
+    uint64_t generation = 0;
+    int64_t frame = 0;
+    int64_t seekFrame = 0; // First frame of this generation
+    bool seek = false;
+    bool ended = false;
+    if (mLength) {
+      const int64_t frames = mLength();
+      std::lock_guard<std::mutex> lock(mMutex);
+      mFrames = frames;
+    }
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mMutex);
+        // Wait for room in the ring, or a seek
+        mWake.wait(lock, [&]() {
+          return !mRunning || mGeneration != generation ||
+                 (!ended && frame < mPlayhead + int64_t(mSlots.size()) &&
+                  (mFrames < 0 || frame < mFrames));
+        });
+        if (!mRunning) {
+          return;
+        }
+        if (mGeneration != generation) {
+          generation = mGeneration;
+          frame = seekFrame = mNextDecode;
+          seek = true;
+          ended = false;
+        }
+      }
+      if (seek) {
+        mSeek(frame);
+        seek = false;
+      }
+      const Decoded decoded = mDecode(pixels.data(), frame);
+
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (mGeneration != generation || decoded == Decoded::NOT_READY) {
+        continue; // Seeked while decoding, or try again
+      }
+      if (decoded == Decoded::END) {
+        // Only an end right after decoded frames gives the length: after a
+        // seek past the end, it is somewhere before the seek target
+        ended = true;
+        if (frame > seekFrame) {
+          mEndFrame = frame;
+        }
+        continue;
+      }
+      if (frame >= mPlayhead) {
+        Slot &slot = mSlots[frame % int64_t(mSlots.size())];
+        slot.pixels.swap(pixels);
+        slot.frame = frame;
+        if (pixels.size() != slot.pixels.size()) {
+          pixels.resize(slot.pixels.size());
+        }
+      }
+      frame++;
+    }
+  }
+
+  // With mMutex locked, so the decoder doesn't replace pixels meanwhile
+  void upload(const std::vector<uint8_t> &pixels, Texture &texture) {
+    const size_t bytes = size_t(mWidth) * mHeight * 4;
+    BufferObject &buffer = mBuffers[mNextBuffer];
+    mNextBuffer = 1 - mNextBuffer;
+    if (!buffer.created()) {
+      buffer.bufferType(GL_PIXEL_UNPACK_BUFFER);
+      buffer.usage(GL_STREAM_DRAW);
+      buffer.create();
+    }
+    buffer.bind();
+    buffer.data(bytes, nullptr);
+    void *mapped =
+        glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+                         GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (mapped) {
+      std::memcpy(mapped, pixels.data(), bytes);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      texture.bind();
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mWidth, mHeight, GL_RGBA,
+                      GL_UNSIGNED_BYTE, nullptr);
+      texture.unbind();
+    }
+    buffer.unbind();
+  }
+
+  int mWidth{0};
+  int mHeight{0};
+  double mFps{30.0};
+  LengthFunction mLength;
+  DecodeFunction mDecode;
+  SeekFunction mSeek;
+
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  std::atomic<bool> mRunning{false};
+  std::vector<Slot> mSlots;
+  int64_t mPlayhead{0};
+  int64_t mNextDecode{0}; // First frame after a seek
+  uint64_t mGeneration{0}; // Seeks requested
+  std::atomic<int64_t> mFrames{-1}; // From the container
+  std::atomic<int64_t> mEndFrame{-1}; // Where the decoder ended, since a seek
+
+  // Graphics thread
+  BufferObject mBuffers[2];
+  int mNextBuffer{0};
+  int64_t mLateFrame{-1};
+  uint64_t mSeeksAtShown{0};
+  VideoFrameStats mStats;
+};
+
+} // namespace al
+
+#endif // AL_VIDEOFRAMERING_HPP
@@ -7,19 +7,32 @@
 
 #include "al/app/al_GUIDomain.hpp"
 #include "al/graphics/al_Image.hpp"
+#include "al/io/al_Imgui.hpp"
 
 #include "al_ext/statedistribution/al_CuttleboneDomain.hpp"
 #include "al_ext/statedistribution/al_CuttleboneStateSimulationDomain.hpp"
 
 #ifdef AL_EXT_LIBAV
 #include "al_ext/video/al_VideoDecoder.hpp"
+extern "C" {
+#include <libavformat/avformat.h>
+}
 #endif
 
 #include <Gamma/Noise.h>
 
+#include "al_TextureCache.hpp"
+#include "al_TextureLoader.hpp"
+#include "al_VideoFrameRing.hpp"
+
 using namespace al;
 
+#include <atomic> // atomic
+#include <chrono> // milliseconds
+#include <cmath> // llround
+#include <cstring> // memcpy
 #include <iostream> // cout
+#include <thread> // sleep_for
 #include <vector> // vector
 
 const size_t numPictures = 7;
@@ -40,6 +53,7 @@ static const char *videoPath = "Sensorium/videos/";
 
 struct VoiceSharedData {
   std::string *dataRoot{nullptr};
+  TextureCache *textureCache{nullptr};
 };
 
 class Panel : public PositionedVoice {
@@ -47,6 +61,7 @@ public:
   ParameterString file{"file"};
   Parameter alpha{"alpha", "", 1.0, 0.0, 1.0};
   Texture tex;
+  Texture *shownTex{&tex};
   float aspectRatio{1.0f};
   ParameterBool billboard{"billboard", "", true};
   std::string currentlyLoadedFile;
@@ -114,13 +129,16 @@ public:
       g.rotate(rot);
     }
     g.tint(1.0, alpha);
-    g.quad(tex, -0.5 * aspectRatio, 0.5, aspectRatio, -1, false);
+    g.quad(*shownTex, -0.5 * aspectRatio, 0.5, aspectRatio, -1, false);
     g.popMatrix();
   }
 };
 
 class PicturePanel : public Panel {
 public:
+  // Held while shown, so that the cache doesn't evict it
+  std::shared_ptr<Texture> picture;
+
   virtual void init() {
     Panel::init();
 
@@ -131,29 +149,56 @@ public:
 
         std::string filename = rootPath + imagePath + value;
 
-        auto imageData = Image(filename);
-
-        if (imageData.array().size() == 0) {
-          std::cout << "failed to load image " << filename << std::endl;
-        }
-        std::cout << "loaded image size: " << imageData.width() << ", "
-                  << imageData.height() << std::endl;
-
-        tex.create2D(imageData.width(), imageData.height());
-        tex.submit(imageData.array().data(), GL_RGBA, GL_UNSIGNED_BYTE);
-
-        tex.filter(Texture::LINEAR);
-        aspectRatio = imageData.width() / (float)imageData.height();
+        // Shown at once if cached. Otherwise the current picture stays
+        // visible while the new one loads in the background.
         currentlyLoadedFile = value;
+        auto show = [this, value](std::shared_ptr<Texture> texture, int w,
+                                  int h) {
+          if (!texture || value != currentlyLoadedFile) {
+            return; // Failed, or another file was requested meanwhile
+          }
+          picture = texture;
+          shownTex = picture.get();
+          aspectRatio = w / (float)h;
+        };
+        data->textureCache->get(filename, show);
       }
     });
   }
 };
 
+#ifdef AL_EXT_LIBAV
+// Frames in a video file according to its container, or -1 if it doesn't say.
+// Opens the file, so it is called from the frame ring's thread.
+static int64_t videoFrameCount(const std::string &filename, double fps) {
+  AVFormatContext *format = nullptr;
+  if (avformat_open_input(&format, filename.c_str(), nullptr, nullptr) < 0) {
+    return -1;
+  }
+  int64_t frames = -1;
+  if (avformat_find_stream_info(format, nullptr) >= 0) {
+    int index =
+        av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (index >= 0) {
+      AVStream *stream = format->streams[index];
+      if (stream->nb_frames > 0) {
+        frames = stream->nb_frames;
+      } else if (stream->duration != AV_NOPTS_VALUE) {
+        frames =
+            std::llround(stream->duration * av_q2d(stream->time_base) * fps);
+      } else if (format->duration != AV_NOPTS_VALUE) {
+        frames = std::llround(format->duration / double(AV_TIME_BASE) * fps);
+      }
+    }
+  }
+  avformat_close_input(&format);
+  return frames;
+}
+#endif
+
 class VideoPanel : public Panel {
 public:
   //  double wallTime{0.0};
-  double previousTime{0.0};
 
   ParameterBool playing{"playing", "", false};
   Parameter currentTime{"currentTime", "", 0.0};
@@ -170,6 +215,7 @@ public:
     file.registerChangeCallback([&](std::string value) {
       if (value != currentlyLoadedFile) {
 #ifdef AL_EXT_LIBAV
+        frames.stop(); // Before the decoder it reads from
         videoDecoder.stop();
 
         videoDecoder.init();
@@ -191,9 +237,20 @@ public:
         videoDecoder.enableAudio(false);
         aspectRatio = videoDecoder.width() / (double)videoDecoder.height();
         currentTime = 0.0;
-        currentTime.max(3000); // TODO set from video length
+        currentTime.max(3000); // Until the length of the video is known
         playing = 1.0;
         videoDecoder.start();
+        const double fps = videoDecoder.fps();
+        frames.start(
+            videoDecoder.width(), videoDecoder.height(), fps,
+            [filename, fps]() { return videoFrameCount(filename, fps); },
+            [this](uint8_t *pixels, int64_t frame) {
+              return decodeFrame(pixels, frame);
+            },
+            [this](int64_t frame) {
+              videoDecoder.stream_seek(
+                  (int64_t)(frame / videoDecoder.fps() * AV_TIME_BASE), -10);
+            });
 
 #else
         std::cerr << "ERROR: video extension al_ext/video not built. Video "
@@ -204,34 +261,30 @@ public:
     });
   }
 
+  // The primary advances currentTime, which replicas receive. Every node
+  // shows the frame for currentTime from frames decoded ahead, so all show
+  // the same frame.
   void update(double dt) {
 #ifdef AL_EXT_LIBAV
-    bool timeChanged = false;
+    if (frames.duration() > 0.0) {
+      currentTime.max(frames.duration());
+    }
     if (isPrimary()) {
       if (playing.get() == 1.0f) {
         currentTime = currentTime.get() + dt;
-        timeChanged = true;
-      }
-    }
-    if (currentTime - previousTime < -3.0 / 30.0) {
-      videoDecoder.stream_seek((int64_t)(currentTime * AV_TIME_BASE), -10);
-      timeChanged = true;
-    } else if (currentTime - previousTime > 3.0 / 30.0) {
-      videoDecoder.stream_seek((int64_t)(currentTime * AV_TIME_BASE), 10);
-      timeChanged = true;
-    } else if (currentTime != previousTime) {
-      timeChanged = true;
-    }
-    if (timeChanged) {
-      uint8_t *frame = videoDecoder.getVideoFrame(currentTime);
-      if (frame) {
-        tex.submit(frame);
+        if (frames.duration() > 0.0 && currentTime >= frames.duration()) {
+          playing = 0.0;
+        }
       }
-      previousTime = currentTime;
     }
+    frames.update(currentTime, tex);
 #endif
   }
 
+#ifdef AL_EXT_LIBAV
+  const VideoFrameStats &frameStats() const { return frames.stats(); }
+#endif
+
   virtual void onProcess(Graphics &g) {
     file.processChange();
     g.pushMatrix();
@@ -248,7 +301,32 @@ public:
 
 private:
 #ifdef AL_EXT_LIBAV
+  // Called from the frame ring's thread. The decoder hands out the frame for
+  // a clock time once it is decoded. It doesn't report the end of the video,
+  // which the ring takes from the container's frame count instead, so a frame
+  // that takes long is only not ready yet.
+  //
+  // The decoder doesn't say which frame it returned either: frame is the one
+  // getVideoFrame() picks for its time, without a check of its pts. Streams
+  // with a constant frame rate map one to one, but a variable rate stream or
+  // a seek that lands before its target can give a neighbouring frame, the
+  // same on every node.
+  VideoFrameRing::Decoded decodeFrame(uint8_t *pixels, int64_t frame) {
+    const double time = frame / videoDecoder.fps();
+    for (int wait = 0; wait < 50 && frames.running(); wait++) {
+      uint8_t *decoded = videoDecoder.getVideoFrame(time);
+      if (decoded) {
+        memcpy(pixels, decoded,
+               size_t(videoDecoder.width()) * videoDecoder.height() * 4);
+        return VideoFrameRing::Decoded::FRAME;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return VideoFrameRing::Decoded::NOT_READY;
+  }
+
   VideoDecoder videoDecoder;
+  VideoFrameRing frames; // After videoDecoder, so it stops first
 #endif
 };
 
@@ -269,7 +347,7 @@ public:
   VAOMesh sphereMesh;
   ParameterString skyboxFile{"skyboxFile"};
   ParameterPose skyboxPose{"skyboxPose"};
-  Texture skyboxTexture;
+  std::shared_ptr<Texture> skyboxTexture;
   std::string currentSkyboxFile;
 
   DistributedScene scene{TimeMasterMode::TIME_MASTER_CPU};
@@ -281,12 +359,20 @@ public:
 
   int8_t currentImage[numPictures + numVideos]{0};
   PresetHandler presets;
+  // Where presets store image files: the pictures' file and the skybox
+  std::vector<std::string> presetImageAddresses;
+  std::string presetSubDirectory;
+  std::atomic<bool> presetMapChanged{false};
   ControlGUI *gui;
 
   VoiceSharedData voiceData;
+  TextureLoader textureLoader;
+  TextureCache textureCache{textureLoader};
 
   void onInit() override {
     voiceData.dataRoot = &this->dataRoot;
+    voiceData.textureCache = &textureCache;
+    textureCache.setMipmaps(true);
     assert(voiceData.dataRoot);
 
     // Enable cuttlebone for state distribution
@@ -332,20 +418,15 @@ public:
 
           std::string filename = dataRoot + imagePath + value;
 
-          auto imageData = Image(filename);
-
-          if (imageData.array().size() == 0) {
-            std::cout << "failed to load image " << filename << std::endl;
-          }
-          std::cout << "SKYBOX loaded image size: " << imageData.width() << ", "
-                    << imageData.height() << std::endl;
-
-          skyboxTexture.create2D(imageData.width(), imageData.height());
-          skyboxTexture.submit(imageData.array().data(), GL_RGBA,
-                               GL_UNSIGNED_BYTE);
-
-          skyboxTexture.filter(Texture::LINEAR);
+          // Keep showing the current skybox until the new one is uploaded
           currentSkyboxFile = value;
+          auto show = [this, value](std::shared_ptr<Texture> texture, int,
+                                    int) {
+            if (texture && value == currentSkyboxFile) {
+              skyboxTexture = texture;
+            }
+          };
+          textureCache.get(filename, show);
         }
       });
       parameterServer() << skyboxFile << skybox << skyboxPose << rotateSpeed
@@ -390,20 +471,69 @@ public:
 
     *gui << skybox << skyboxFile << skyboxPose << rotateSpeed;
     *gui << stereo;
+    gui->drawFunction = [&]() {
+      auto &stats = textureCache.stats();
+      ImGui::Text("Textures: %d, %.0f of %.0f MB", int(stats.textures),
+                  stats.bytes / 1e6, stats.budget / 1e6);
+      ImGui::Text("Cache hits: %d, misses: %d (%.0f%% hits), evicted: %d",
+                  int(stats.hits), int(stats.misses), stats.hitRate() * 100,
+                  int(stats.evictions));
+#ifdef AL_EXT_LIBAV
+      for (size_t i = 0; i < numVideos; i++) {
+        auto &frameStats = videos[i].frameStats();
+        ImGui::Text("Video %d: frame %d, dropped %d, late %d", int(i),
+                    int(frameStats.frame), int(frameStats.dropped),
+                    int(frameStats.late));
+      }
+#endif
+    };
 
+    presetImageAddresses.push_back(skyboxFile.getFullAddress());
     for (size_t i = 0; i < numPictures; i++) {
       *gui << pictures[i].bundle;
       presets.registerParameterBundle(pictures[i].bundle);
+      presetImageAddresses.push_back(pictures[i].bundle.bundlePrefix() +
+                                     pictures[i].file.getFullAddress());
     }
     for (size_t i = 0; i < numVideos; i++) {
       *gui << videos[i].bundle;
       presets.registerParameterBundle(videos[i].bundle);
     }
+    // May be called from the OSC thread, the cache is used from this one
+    presets.registerPresetMapCallback(
+        [this](std::string) { presetMapChanged = true; });
+    presetSubDirectory = presets.getSubDirectory();
+    preloadPresetImages();
+  }
+
+  // Load every image that the presets in the bank show, so that recalling a
+  // preset doesn't wait for the disk
+  void preloadPresetImages() {
+    for (auto &preset : presets.availablePresets()) {
+      auto values = presets.loadPresetValues(preset.second);
+      for (auto &address : presetImageAddresses) {
+        auto value = values.find(address);
+        if (value == values.end() || value->second.empty()) {
+          continue;
+        }
+        const std::string file = value->second[0].get<std::string>();
+        if (!file.empty()) {
+          textureCache.preload(dataRoot + imagePath + file);
+        }
+      }
+    }
   }
 
   void onAnimate(double dt) override {
     skyboxFile.processChange();
     stereo.processChange();
+    // Another bank of presets
+    if (presetMapChanged.exchange(false) ||
+        presets.getSubDirectory() != presetSubDirectory) {
+      presetSubDirectory = presets.getSubDirectory();
+      preloadPresetImages();
+    }
+    textureLoader.update();
 
     scene.update(dt);
     if (isPrimary()) {
@@ -430,9 +560,11 @@ public:
       g.tint(1.f, 1.f);
       g.translate(skyboxPose.get().pos());
       g.rotate(skyboxPose.get().quat());
-      skyboxTexture.bind();
-      g.draw(sphereMesh);
-      skyboxTexture.unbind();
+      if (skyboxTexture) {
+        skyboxTexture->bind();
+        g.draw(sphereMesh);
+        skyboxTexture->unbind();
+      }
       g.popMatrix();
     }
 
@@ -454,6 +586,7 @@ public:
     if (isPrimary()) {
       config.write();
     }
+    textureLoader.destroy(); // While the context is current
   }
 
   bool onKeyDown(const Keyboard &k) override {
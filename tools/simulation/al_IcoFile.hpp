@@ -0,0 +1,403 @@
+#ifndef AL_ICOFILE_HPP
+#define AL_ICOFILE_HPP
+
+// Loading of the blob's icosphere files (162.ico ... 655362.ico).
+//
+// The text files hold vertices (x,y,z per line), triangle indices (one per
+// line) and the 5 or 6 neighbours of every vertex, in sections separated by
+// "|" lines. Parsing the biggest ones takes long, so after parsing a file
+// once IcoFile writes a binary cache next to it (N.ico.cache): a header, the
+// vertices, the indices and the neighbours as CSR arrays (an offset per
+// vertex into one array of neighbour indices), with a checksum of the data.
+// Later loads map the cache and use it in place. The cache is parsed again
+// if the text file changed (size or modification time), or if it fails its
+// checks, and the text file is used directly if the cache can't be written.
+// Indices and neighbours are checked to be vertices of the file, from the
+// text file or the cache.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+
+#include "al/math/al_Vec.hpp"
+
+namespace al {
+
+class IcoFile {
+public:
+  IcoFile() = default;
+  IcoFile(const IcoFile &) = delete;
+  IcoFile &operator=(const IcoFile &) = delete;
+  ~IcoFile() { unmap(); }
+
+  /**
+   * @brief Load an .ico file, through its cache if it is up to date
+   * @return false if neither the cache nor the text file could be read
+   */
+  bool load(const std::string &path) {
+    unmap();
+    mBuffer.clear();
+    const std::string cache = cachePath(path);
+    struct stat source;
+    const bool hasSource = stat(path.c_str(), &source) == 0;
+    const uint64_t sourceBytes = hasSource ? uint64_t(source.st_size) : 0;
+    const uint64_t sourceTime = hasSource ? uint64_t(source.st_mtime) : 0;
+    if (openCache(cache) &&
+        (!hasSource || (header().sourceBytes == sourceBytes &&
+                        header().sourceTime == sourceTime))) {
+      mFromCache = true;
+      return true;
+    }
+    unmap();
+    mFromCache = false;
+    if (!hasSource || !parse(path)) {
+      mBuffer.clear();
+      return false;
+    }
+    auto *h = reinterpret_cast<Header *>(mBuffer.data());
+    h->sourceBytes = sourceBytes;
+    h->sourceTime = sourceTime;
+    h->checksum = checksum(mBuffer.data() + sizeof(Header),
+                           mBuffer.size() - sizeof(Header));
+    mData = mBuffer.data();
+    mBytes = mBuffer.size();
+    if (!inRange()) {
+      std::cerr << "IcoFile: " << path << " refers to missing vertices"
+                << std::endl;
+      unmap();
+      mBuffer.clear();
+      return false;
+    }
+    writeCache(cache);
+    return true;
+  }
+
+  static std::string cachePath(const std::string &path) {
+    return path + ".cache";
+  }
+
+  /// True if the last load() used the binary cache
+  bool fromCache() const { return mFromCache; }
+
+  size_t vertexCount() const { return mData ? header().vertices : 0; }
+  size_t indexCount() const { return mData ? header().indices : 0; }
+
+  const Vec3f *vertices() const {
+    return reinterpret_cast<const Vec3f *>(mData + sizeof(Header));
+  }
+  const uint32_t *indices() const {
+    return reinterpret_cast<const uint32_t *>(vertices() + vertexCount());
+  }
+
+  /// CSR neighbours: those of vertex i are neighbours()[offsets()[i]] up to
+  /// neighbours()[offsets()[i + 1]]
+  const uint32_t *offsets() const { return indices() + indexCount(); }
+  const uint32_t *neighbours() const { return offsets() + vertexCount() + 1; }
+
+  /// Neighbours as lists, like the original loader produced
+  std::vector<std::vector<int>> neighbourLists() const {
+    std::vector<std::vector<int>> lists(vertexCount());
+    const uint32_t *offset = offsets();
+    for (size_t i = 0; i < lists.size(); i++) {
+      lists[i].assign(neighbours() + offset[i], neighbours() + offset[i + 1]);
+    }
+    return lists;
+  }
+
+private:
+  static const uint32_t kMagic = 0x43494c41; // "ALIC"
+  static const uint32_t kVersion = 1;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vertices;
+    uint32_t indices;
+    uint32_t neighbours;
+    uint32_t checksum;
+    uint64_t sourceBytes;
+    uint64_t sourceTime;
+  };
+
+  const Header &header() const {
+    return *reinterpret_cast<const Header *>(mData);
+  }
+
+  static size_t dataBytes(const Header &h) {
+    return sizeof(Header) + h.vertices * sizeof(Vec3f) +
+           (size_t(h.indices) + h.vertices + 1 + h.neighbours) *
+               sizeof(uint32_t);
+  }
+
+  // FNV-1a over 32 bit words
+  static uint32_t checksum(const uint8_t *data, size_t bytes) {
+    uint32_t hash = 2166136261u;
+    const size_t words = bytes / 4;
+    for (size_t i = 0; i < words; i++) {
+      uint32_t word;
+      std::memcpy(&word, data + 4 * i, 4);
+      hash = (hash ^ word) * 16777619u;
+    }
+    return hash;
+  }
+
+  // strtof and strtol skip newlines too, so blanks are skipped here to keep
+  // numbers from being read off the next line
+  static const char *skipBlanks(const char *c, const char *lineEnd) {
+    while (c < lineEnd && (*c == ' ' || *c == '\t')) {
+      c++;
+    }
+    return c;
+  }
+
+  // Parse the text file into mBuffer, laid out like the cache
+  bool parse(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+      return false;
+    }
+    std::string text((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<uint32_t> offsets{0};
+    std::vector<uint32_t> neighbours;
+
+    int section = 0;
+    const char *c = text.c_str();
+    const char *end = c + text.size();
+    while (c < end) {
+      const char *lineEnd = static_cast<const char *>(
+          std::memchr(c, '\n', size_t(end - c)));
+      if (!lineEnd) {
+        lineEnd = end;
+      }
+      if (c == lineEnd || *c == '\r') {
+        // Empty line
+      } else if (*c == '|') {
+        section++;
+      } else if (section == 0) {
+        char *next;
+        for (int k = 0; k < 3; k++) {
+          c = skipBlanks(c, lineEnd);
+          if (c == lineEnd) {
+            return false;
+          }
+          vertices.push_back(std::strtof(c, &next));
+          if (next == c || next > lineEnd) {
+            return false;
+          }
+          c = next < lineEnd && *next == ',' ? next + 1 : next;
+        }
+      } else if (section == 1) {
+        char *next;
+        c = skipBlanks(c, lineEnd);
+        const long index = std::strtol(c, &next, 10);
+        if (c == lineEnd || next == c || next > lineEnd || index < 0) {
+          return false;
+        }
+        indices.push_back(uint32_t(index));
+      } else if (section == 2) {
+        size_t count = 0;
+        char *next;
+        while (true) {
+          c = skipBlanks(c, lineEnd);
+          if (c == lineEnd || *c == '\r') {
+            break;
+          }
+          const long n = std::strtol(c, &next, 10);
+          if (next == c || next > lineEnd || n < 0) {
+            return false;
+          }
+          neighbours.push_back(uint32_t(n));
+          count++;
+          c = next < lineEnd && *next == ',' ? next + 1 : next;
+        }
+        if (count != 5 && count != 6) {
+          return false;
+        }
+        offsets.push_back(uint32_t(neighbours.size()));
+      }
+      c = lineEnd + 1;
+    }
+    const size_t vertexCount = vertices.size() / 3;
+    if (offsets.size() != vertexCount + 1) {
+      return false;
+    }
+
+    Header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = kMagic;
+    h.version = kVersion;
+    h.vertices = uint32_t(vertexCount);
+    h.indices = uint32_t(indices.size());
+    h.neighbours = uint32_t(neighbours.size());
+    mBuffer.resize(dataBytes(h));
+    uint8_t *out = mBuffer.data();
+    auto append = [&out](const void *data, size_t bytes) {
+      std::memcpy(out, data, bytes);
+      out += bytes;
+    };
+    append(&h, sizeof(h));
+    append(vertices.data(), vertices.size() * sizeof(float));
+    append(indices.data(), indices.size() * sizeof(uint32_t));
+    append(offsets.data(), offsets.size() * sizeof(uint32_t));
+    append(neighbours.data(), neighbours.size() * sizeof(uint32_t));
+    return true;
+  }
+
+  bool openCache(const std::string &cache) {
+#ifndef _WIN32
+    int fd = open(cache.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(Header)) {
+      ::close(fd);
+      return false;
+    }
+    void *memory =
+        mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+      return false;
+    }
+    mMapped = true;
+    mData = static_cast<const uint8_t *>(memory);
+    mBytes = size_t(info.st_size);
+#else
+    std::ifstream file(cache, std::ios::binary);
+    if (!file.is_open()) {
+      return false;
+    }
+    mBuffer.assign(std::istreambuf_iterator<char>(file),
+                   std::istreambuf_iterator<char>());
+    if (mBuffer.size() < sizeof(Header)) {
+      return false;
+    }
+    mData = mBuffer.data();
+    mBytes = mBuffer.size();
+#endif
+    const Header &h = header();
+    if (h.magic != kMagic || h.version != kVersion ||
+        dataBytes(h) != mBytes) {
+      return false;
+    }
+    if (checksum(mData + sizeof(Header), mBytes - sizeof(Header)) !=
+        h.checksum) {
+      std::cerr << "IcoFile: " << cache << " is corrupt, reparsing"
+                << std::endl;
+      return false;
+    }
+    return inRange();
+  }
+
+  // Indices and neighbours are vertices, and the CSR offsets are in order
+  bool inRange() const {
+    const uint32_t vertices = header().vertices;
+    for (size_t i = 0; i < indexCount(); i++) {
+      if (indices()[i] >= vertices) {
+        return false;
+      }
+    }
+    const uint32_t *offset = offsets();
+    if (offset[0] != 0 || offset[vertices] != header().neighbours) {
+      return false;
+    }
+    for (uint32_t i = 0; i < vertices; i++) {
+      if (offset[i + 1] < offset[i]) {
+        return false;
+      }
+    }
+    for (uint32_t i = 0; i < header().neighbours; i++) {
+      if (neighbours()[i] >= vertices) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Every process writes its own temporary file, then renames it over the
+  // cache. Nodes parsing the same file at the same time don't write into
+  // each other's file, and as rename is atomic, loads see either the old
+  // cache or a complete new one.
+  void writeCache(const std::string &cache) const {
+#ifndef _WIN32
+    std::string temporary = cache + ".XXXXXX";
+    const int fd = mkstemp(&temporary[0]);
+    if (fd < 0) {
+      return; // Read only directory: keep parsing the text file
+    }
+    fchmod(fd, 0644); // mkstemp creates it readable by the owner only
+    const uint8_t *data = mData;
+    size_t left = mBytes;
+    while (left > 0) {
+      const ssize_t written = ::write(fd, data, left);
+      if (written <= 0) {
+        break;
+      }
+      data += written;
+      left -= size_t(written);
+    }
+    if (::close(fd) != 0 || left > 0) {
+      std::remove(temporary.c_str());
+      return;
+    }
+#else
+    const std::string temporary =
+        cache + "." + std::to_string(_getpid()) + ".tmp";
+    {
+      std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+      if (!file.is_open()) {
+        return; // Read only directory: keep parsing the text file
+      }
+      file.write(reinterpret_cast<const char *>(mData),
+                 std::streamsize(mBytes));
+      if (!file.good()) {
+        file.close();
+        std::remove(temporary.c_str());
+        return;
+      }
+    }
+#endif
+    if (std::rename(temporary.c_str(), cache.c_str()) != 0) {
+      std::remove(temporary.c_str());
+    }
+  }
+
+  void unmap() {
+#ifndef _WIN32
+    if (mMapped) {
+      munmap(const_cast<uint8_t *>(mData), mBytes);
+      mMapped = false;
+    }
+#endif
+    mData = nullptr;
+    mBytes = 0;
+  }
+
+  const uint8_t *mData{nullptr};
+  size_t mBytes{0};
+  bool mMapped{false};
+  bool mFromCache{false};
+  std::vector<uint8_t> mBuffer;
+};
+
+} // namespace al
+
+#endif // AL_ICOFILE_HPP
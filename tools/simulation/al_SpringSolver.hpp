@@ -0,0 +1,317 @@
+#ifndef AL_SPRINGSOLVER_HPP
+#define AL_SPRINGSOLVER_HPP
+
+// Mass spring simulation of a mesh, for the blob.
+//
+// Every vertex is pulled back to its rest position by one spring and towards
+// its neighbours by others, and damped by its velocity. The neighbour lists
+// are converted to CSR arrays (an offset per vertex into one array of
+// neighbour indices), and positions, rest positions and velocities are kept
+// as separate x, y and z arrays. Forces only depend on the positions of the
+// previous step, so vertices are updated in blocks spread across a pool of
+// threads. The neighbour sums are gathered through the CSR arrays, and the
+// rest of the update runs four vertices at a time with SSE.
+//
+// The spring force towards the neighbours, sum(p - n), is computed as
+// degree * p - sum(n), which differs from summing the differences by float
+// rounding only.
+//
+// On a single thread the largest meshes step 5 to 20% slower than the
+// original loops over Vec3f positions (655362 vertices: 10.3 against 9.7 ms
+// on one machine, 12.7 against 10.5 ms on another): each neighbour is
+// gathered from three arrays instead of one. The solver is meant for several
+// threads; spring_benchmark measures both on a given machine.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "al/math/al_Vec.hpp"
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define AL_SPRINGSOLVER_SSE
+#endif
+
+namespace al {
+
+class SpringSolver {
+public:
+  ~SpringSolver() { stopThreads(); }
+
+  /// Neighbours of every vertex, as loaded from an .ico file
+  void setTopology(const std::vector<std::vector<int>> &neighbours) {
+    mOffsets.assign(1, 0);
+    mNeighbours.clear();
+    mDegree.clear();
+    for (auto &list : neighbours) {
+      for (int n : list) {
+        mNeighbours.push_back(uint32_t(n));
+      }
+      mOffsets.push_back(uint32_t(mNeighbours.size()));
+      mDegree.push_back(float(list.size()));
+    }
+  }
+
+  /// CSR neighbours, as loaded by IcoFile
+  void setTopology(const uint32_t *offsets, const uint32_t *neighbours,
+                   size_t count) {
+    mOffsets.assign(offsets, offsets + count + 1);
+    mNeighbours.assign(neighbours + offsets[0], neighbours + offsets[count]);
+    mDegree.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      mDegree[i] = float(offsets[i + 1] - offsets[i]);
+    }
+  }
+
+  /**
+   * @brief Set the rest positions, and reset the vertices to them
+   *
+   * Call after setTopology() with the same number of vertices.
+   */
+  void setRest(const Vec3f *rest, size_t count) {
+    for (int c = 0; c < 3; c++) {
+      mRest[c].resize(count);
+      mPosition[c].resize(count);
+      mVelocity[c].assign(count, 0.0f);
+      for (size_t i = 0; i < count; i++) {
+        mRest[c][i] = mPosition[c][i] = rest[i][c];
+      }
+    }
+  }
+
+  size_t size() const { return mDegree.size(); }
+
+  /// CSR topology: neighbours of i are neighbours()[offsets()[i]] up to
+  /// neighbours()[offsets()[i + 1]]
+  const std::vector<uint32_t> &offsets() const { return mOffsets; }
+  const std::vector<uint32_t> &neighbours() const { return mNeighbours; }
+
+  Vec3f position(size_t i) const {
+    return Vec3f(mPosition[0][i], mPosition[1][i], mPosition[2][i]);
+  }
+
+  /// Move a vertex, keeping its velocity
+  void displace(size_t i, const Vec3f &offset) {
+    for (int c = 0; c < 3; c++) {
+      mPosition[c][i] += offset[c];
+    }
+  }
+
+  /// Copy the positions to an array of vectors
+  void positions(Vec3f *out) const {
+    for (size_t i = 0; i < size(); i++) {
+      out[i] = position(i);
+    }
+  }
+
+  /**
+   * @brief Threads that step the simulation, including the calling thread
+   *
+   * 0 uses one per hardware thread. Small meshes are stepped in the calling
+   * thread only.
+   */
+  void setThreads(unsigned int threads) {
+    stopThreads();
+    if (threads == 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    mQuit = false;
+    const uint64_t generation = mGeneration;
+    for (unsigned int i = 1; i < threads; i++) {
+      mThreads.emplace_back([this, generation]() { workerLoop(generation); });
+    }
+  }
+
+  unsigned int threads() const { return unsigned(mThreads.size()) + 1; }
+
+  /**
+   * @brief Advance one step
+   * @param anchorK spring constant towards the rest position
+   * @param neighbourK spring constant towards each neighbour
+   * @param damping fraction of the velocity lost per step
+   * @param out if set, the new positions are also written there
+   */
+  void step(float anchorK, float neighbourK, float damping,
+            Vec3f *out = nullptr) {
+    mAnchorK = anchorK;
+    mNeighbourK = neighbourK;
+    mDamping = damping;
+    mOut = out;
+    run(Phase::VELOCITY);
+    run(Phase::POSITION);
+  }
+
+private:
+  static const size_t kBlock = 1024; // Vertices per task
+
+  enum class Phase { VELOCITY, POSITION };
+
+  void run(Phase phase) {
+    mPhase = phase;
+    mNextBlock = 0;
+    if (mThreads.empty() || size() < 4 * kBlock) {
+      work();
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mFinished = 0;
+      mGeneration++;
+    }
+    mWake.notify_all();
+    work();
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDone.wait(lock, [this]() { return mFinished == mThreads.size(); });
+  }
+
+  void workerLoop(uint64_t generation) {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWake.wait(lock,
+                   [&]() { return mQuit || mGeneration != generation; });
+        if (mQuit) {
+          return;
+        }
+        generation = mGeneration;
+      }
+      work();
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (++mFinished == mThreads.size()) {
+        mDone.notify_one();
+      }
+    }
+  }
+
+  void stopThreads() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mQuit = true;
+    }
+    mWake.notify_all();
+    for (auto &thread : mThreads) {
+      thread.join();
+    }
+    mThreads.clear();
+  }
+
+  // Take blocks until none are left
+  void work() {
+    const size_t count = size();
+    while (true) {
+      const size_t begin = mNextBlock.fetch_add(kBlock);
+      if (begin >= count) {
+        return;
+      }
+      const size_t end = std::min(begin + kBlock, count);
+      if (mPhase == Phase::VELOCITY) {
+        updateVelocities(begin, end);
+      } else {
+        updatePositions(begin, end);
+      }
+    }
+  }
+
+  void updateVelocities(size_t begin, size_t end) {
+    float sum[3][kBlock];
+    for (size_t i = begin; i < end; i++) {
+      float x = 0.0f, y = 0.0f, z = 0.0f;
+      for (uint32_t k = mOffsets[i]; k < mOffsets[i + 1]; k++) {
+        const uint32_t n = mNeighbours[k];
+        x += mPosition[0][n];
+        y += mPosition[1][n];
+        z += mPosition[2][n];
+      }
+      sum[0][i - begin] = x;
+      sum[1][i - begin] = y;
+      sum[2][i - begin] = z;
+    }
+    for (int c = 0; c < 3; c++) {
+      updateVelocity(mPosition[c].data() + begin, mRest[c].data() + begin,
+                     sum[c], mDegree.data() + begin,
+                     mVelocity[c].data() + begin, end - begin);
+    }
+  }
+
+  // v += -anchorK (p - rest) - neighbourK (degree p - sum) - damping v
+  void updateVelocity(const float *p, const float *rest, const float *sum,
+                      const float *degree, float *v, size_t count) const {
+    size_t i = 0;
+#ifdef AL_SPRINGSOLVER_SSE
+    const __m128 anchorK = _mm_set1_ps(mAnchorK);
+    const __m128 neighbourK = _mm_set1_ps(mNeighbourK);
+    const __m128 damping = _mm_set1_ps(mDamping);
+    for (; i + 4 <= count; i += 4) {
+      const __m128 position = _mm_loadu_ps(p + i);
+      const __m128 velocity = _mm_loadu_ps(v + i);
+      const __m128 stretch =
+          _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(degree + i), position),
+                     _mm_loadu_ps(sum + i));
+      __m128 force =
+          _mm_mul_ps(anchorK, _mm_sub_ps(position, _mm_loadu_ps(rest + i)));
+      force = _mm_add_ps(force, _mm_mul_ps(neighbourK, stretch));
+      force = _mm_add_ps(force, _mm_mul_ps(damping, velocity));
+      _mm_storeu_ps(v + i, _mm_sub_ps(velocity, force));
+    }
+#endif
+    for (; i < count; i++) {
+      const float force = mAnchorK * (p[i] - rest[i]) +
+                          mNeighbourK * (degree[i] * p[i] - sum[i]) +
+                          mDamping * v[i];
+      v[i] -= force;
+    }
+  }
+
+  void updatePositions(size_t begin, size_t end) {
+    for (int c = 0; c < 3; c++) {
+      float *p = mPosition[c].data();
+      const float *v = mVelocity[c].data();
+      size_t i = begin;
+#ifdef AL_SPRINGSOLVER_SSE
+      for (; i + 4 <= end; i += 4) {
+        _mm_storeu_ps(p + i,
+                      _mm_add_ps(_mm_loadu_ps(p + i), _mm_loadu_ps(v + i)));
+      }
+#endif
+      for (; i < end; i++) {
+        p[i] += v[i];
+      }
+    }
+    if (mOut) {
+      for (size_t i = begin; i < end; i++) {
+        mOut[i] = position(i);
+      }
+    }
+  }
+
+  std::vector<uint32_t> mOffsets;
+  std::vector<uint32_t> mNeighbours;
+  std::vector<float> mDegree;
+  std::vector<float> mRest[3];
+  std::vector<float> mPosition[3];
+  std::vector<float> mVelocity[3];
+
+  float mAnchorK{0.0f};
+  float mNeighbourK{0.0f};
+  float mDamping{0.0f};
+  Vec3f *mOut{nullptr};
+
+  Phase mPhase{Phase::VELOCITY};
+  std::atomic<size_t> mNextBlock{0};
+  std::vector<std::thread> mThreads;
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  std::condition_variable mDone;
+  uint64_t mGeneration{0};
+  size_t mFinished{0};
+  bool mQuit{false};
+};
+
+} // namespace al
+
+#endif // AL_SPRINGSOLVER_HPP
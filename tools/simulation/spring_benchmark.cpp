@@ -0,0 +1,182 @@
+// Measures the cost of a blob simulation step at every mesh size listed in
+// cookbook/blob/main.cpp, from 162 to 655362 vertices.
+//
+// The meshes are icospheres subdivided here, with the same neighbour lists as
+// the .ico files. Each size is stepped with the original per-vertex loops over
+// vector<vector<int>> neighbours, and with SpringSolver on one thread and on
+// all hardware threads. The time per step is reported against the 16.7 ms of
+// a 60 fps frame, and the solver's positions are compared with the original
+// loops after the run.
+//
+// Usage: spring_benchmark [steps] [threads]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "al/math/al_Vec.hpp"
+
+#include "al_SpringSolver.hpp"
+
+using namespace al;
+
+static const float kSK = 0.06f;
+static const float kNK = 0.1f;
+static const float kD = 0.08f;
+
+struct Icosphere {
+  std::vector<Vec3f> vertices;
+  std::vector<std::vector<int>> neighbours;
+};
+
+// Subdivide an icosahedron until it has at least count vertices
+Icosphere makeIcosphere(size_t count) {
+  const float t = (1.0f + std::sqrt(5.0f)) / 2.0f;
+  std::vector<Vec3f> v = {{-1, t, 0}, {1, t, 0},  {-1, -t, 0}, {1, -t, 0},
+                          {0, -1, t}, {0, 1, t},  {0, -1, -t}, {0, 1, -t},
+                          {t, 0, -1}, {t, 0, 1},  {-t, 0, -1}, {-t, 0, 1}};
+  std::vector<int> faces = {0, 11, 5,  0, 5,  1, 0, 1, 7, 0, 7,  10, 0, 10, 11,
+                            1, 5,  9,  5, 11, 4, 11, 10, 2, 10, 7, 6, 7,  1, 8,
+                            3, 9,  4,  3, 4,  2, 3, 2, 6, 3, 6,  8,  3, 8,  9,
+                            4, 9,  5,  2, 4,  11, 6, 2, 10, 8, 6, 7, 9, 8, 1};
+  auto normalize = [](Vec3f p) {
+    float m = std::sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+    return Vec3f(p.x / m, p.y / m, p.z / m);
+  };
+  for (auto &p : v) {
+    p = normalize(p);
+  }
+  while (v.size() < count) {
+    std::map<std::pair<int, int>, int> midpoints;
+    auto midpoint = [&](int a, int b) {
+      auto key = std::make_pair(std::min(a, b), std::max(a, b));
+      auto found = midpoints.find(key);
+      if (found != midpoints.end()) {
+        return found->second;
+      }
+      v.push_back(normalize(Vec3f((v[a].x + v[b].x) / 2, (v[a].y + v[b].y) / 2,
+                                  (v[a].z + v[b].z) / 2)));
+      midpoints[key] = int(v.size()) - 1;
+      return int(v.size()) - 1;
+    };
+    std::vector<int> subdivided;
+    for (size_t f = 0; f < faces.size(); f += 3) {
+      int a = faces[f], b = faces[f + 1], c = faces[f + 2];
+      int ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+      subdivided.insert(subdivided.end(),
+                        {a, ab, ca, b, bc, ab, c, ca, bc, ab, bc, ca});
+    }
+    faces.swap(subdivided);
+  }
+  std::vector<std::set<int>> adjacent(v.size());
+  for (size_t f = 0; f < faces.size(); f += 3) {
+    for (int k = 0; k < 3; k++) {
+      adjacent[faces[f + k]].insert(faces[f + (k + 1) % 3]);
+      adjacent[faces[f + (k + 1) % 3]].insert(faces[f + k]);
+    }
+  }
+  Icosphere sphere;
+  sphere.vertices = v;
+  for (auto &list : adjacent) {
+    sphere.neighbours.emplace_back(list.begin(), list.end());
+  }
+  return sphere;
+}
+
+// The loops of Blob::onAnimate before SpringSolver
+void originalStep(std::vector<Vec3f> &p, std::vector<Vec3f> &velocity,
+                  const std::vector<Vec3f> &original,
+                  const std::vector<std::vector<int>> &nn) {
+  const size_t n = p.size();
+  for (size_t i = 0; i < n; i++) {
+    Vec3f &v = p[i];
+    Vec3f force = (v - original[i]) * -kSK;
+    for (size_t k = 0; k < nn[i].size(); k++) {
+      Vec3f &neighbour = p[nn[i][k]];
+      force += (v - neighbour) * -kNK;
+    }
+    force -= velocity[i] * kD;
+    velocity[i] += force;
+  }
+  for (size_t i = 0; i < n; i++) {
+    p[i] += velocity[i];
+  }
+}
+
+// Seconds per step of f over steps steps
+template <class F> double timeSteps(int steps, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < steps; i++) {
+    f();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double>(elapsed).count() / steps;
+}
+
+int main(int argc, char *argv[]) {
+  const int steps = argc > 1 ? std::atoi(argv[1]) : 100;
+  const unsigned int threads = argc > 2 ? unsigned(std::atoi(argv[2])) : 0;
+  const size_t sizes[] = {162, 642, 2562, 10242, 40962, 163842, 655362};
+
+  SpringSolver parallel;
+  parallel.setThreads(threads);
+  std::printf("%d steps per case, %u threads\n", steps, parallel.threads());
+  std::printf("%8s %12s %12s %12s %9s %10s\n", "N", "original ms",
+              "1 thread ms", "threads ms", "speedup", "max error");
+
+  for (size_t n : sizes) {
+    Icosphere sphere = makeIcosphere(n);
+    const size_t count = sphere.vertices.size();
+
+    // Start from a poke of every vertex, so that all springs are stretched
+    std::vector<Vec3f> start(sphere.vertices);
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> distribution(-0.1f, 0.1f);
+    for (auto &p : start) {
+      p += Vec3f(distribution(generator), distribution(generator),
+                 distribution(generator));
+    }
+
+    std::vector<Vec3f> p(start);
+    std::vector<Vec3f> velocity(count, Vec3f(0, 0, 0));
+    double original = timeSteps(steps, [&]() {
+      originalStep(p, velocity, sphere.vertices, sphere.neighbours);
+    });
+
+    SpringSolver serial;
+    serial.setTopology(sphere.neighbours);
+    serial.setRest(sphere.vertices.data(), count);
+    std::vector<Vec3f> out(count);
+    for (size_t i = 0; i < count; i++) {
+      serial.displace(i, start[i] - sphere.vertices[i]);
+    }
+    double single =
+        timeSteps(steps, [&]() { serial.step(kSK, kNK, kD, out.data()); });
+
+    parallel.setTopology(sphere.neighbours);
+    parallel.setRest(sphere.vertices.data(), count);
+    for (size_t i = 0; i < count; i++) {
+      parallel.displace(i, start[i] - sphere.vertices[i]);
+    }
+    double threaded =
+        timeSteps(steps, [&]() { parallel.step(kSK, kNK, kD, out.data()); });
+
+    float error = 0.0f;
+    for (size_t i = 0; i < count; i++) {
+      Vec3f d = out[i] - p[i];
+      error = std::max(error, std::fabs(d.x));
+      error = std::max(error, std::max(std::fabs(d.y), std::fabs(d.z)));
+    }
+    std::printf("%8zu %12.3f %12.3f %12.3f %8.1fx %10.2g%s\n", count,
+                original * 1e3, single * 1e3, threaded * 1e3,
+                original / threaded, error,
+                threaded > 1.0 / 60.0 ? "  (slower than 60 fps)" : "");
+  }
+  return 0;
+}
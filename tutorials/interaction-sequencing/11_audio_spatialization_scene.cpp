@@ -10,11 +10,16 @@
 #include "al/scene/al_SynthSequencer.hpp"
 #include "al/sound/al_Ambisonics.hpp"
 #include "al/sound/al_Dbap.hpp"
+#include "al/sound/al_Lbap.hpp"
 #include "al/sound/al_StereoPanner.hpp"
 #include "al/sound/al_Vbap.hpp"
 #include "al/ui/al_Parameter.hpp"
 #include "al/ui/al_PresetSequencer.hpp"
 
+#include "al_AmbisonicBus.hpp"
+#include "al_AudibilityCuller.hpp"
+#include "al_SpatialMixKernel.hpp"
+
 //#include "al/util/sound/al_OutputMaster.hpp"
 
 using namespace al;
@@ -28,14 +33,24 @@ using namespace al;
  */
 
 // Choose the spatializer type here:
-
-#define SpatializerType StereoPanner
+// BatchedSpatializer mixes all agents at once with a SIMD kernel instead of
+// one voice at a time, which scales much better with many agents and
+// speakers. The plain spatializers are listed below it.
+
+#define SpatializerType BatchedSpatializer<StereoPanner>
+//#define SpatializerType BatchedSpatializer<Vbap>
+//#define SpatializerType BatchedSpatializer<Dbap>
+//#define SpatializerType BatchedSpatializer<Lbap>
+//#define SpatializerType StereoPanner
 //#define SpatializerType Vbap
 //#define SpatializerType Dbap
 //#define SpatializerType AmbisonicsSpatializer
+// 3rd order Ambisonics with a single decode per block for all agents
+//#define SpatializerType AmbisonicBusSpatializer
 
-//
-class MyAgent : public PositionedVoice {
+// Agents are CullableVoices, so agents that have faded out or are far away
+// are not synthesized or spatialized.
+class MyAgent : public CullableVoice {
 public:
   MyAgent() {
     mEnvelope.lengths(5.0f, 5.0f);
@@ -45,10 +60,12 @@ public:
   }
 
   void onProcess(AudioIOData &io) override {
-    while (io()) {
-      mModulatorValue = mModulator();
-      io.out(0) +=
-          mEnvelope() * mSource() * mModulatorValue * 0.05; // compute sample
+    if (renderBlock(io)) {
+      while (io()) {
+        mModulatorValue = mModulator();
+        io.out(0) +=
+            mEnvelope() * mSource() * mModulatorValue * 0.05; // compute sample
+      }
     }
 
     if (mEnvelope.done()) {
@@ -56,6 +73,15 @@ public:
     }
   }
 
+  float levelEstimate() override { return mEnvelope.value() * 0.05f; }
+
+  void onSkip(AudioIOData &io) override {
+    for (unsigned int i = 0; i < io.framesPerBuffer(); i++) {
+      mModulatorValue = mModulator();
+      mEnvelope();
+    }
+  }
+
   void onProcess(Graphics &g) override {
     // Get shared Mesh
     Mesh *sharedMesh = static_cast<Mesh *>(userData());
@@ -106,6 +132,8 @@ struct MyApp : public App {
   rnd::Random<> randomGenerator; // Random number generator
 
   DynamicScene scene;
+  AudibilityCuller culler;
+
   virtual void onInit() override {
     // Configure spatializer for the scene
     auto speakers = StereoSpeakerLayout();
@@ -122,6 +150,10 @@ struct MyApp : public App {
 
     // Prepare the scene buffers according to audioIO buffers
     scene.prepare(audioIO());
+
+    // Agents have no reduced control rate, so with the decimation level at
+    // the cull level they are either rendered in full or culled
+    culler.setThresholds(-80.0f, -80.0f);
   }
 
   virtual void onCreate() override {
@@ -143,6 +175,8 @@ struct MyApp : public App {
     ImGui::Begin("Info");
     ImGui::Text("Press space to create agent. Navigate scene with keyboard.");
     ImGui::Text("%i Active Agents", count);
+    auto stats = culler.stats();
+    ImGui::Text("Audible: %i  Culled: %i", stats.audible, stats.culled);
     voices = scene.getActiveVoices();
     count = 0;
     while (voices) {
@@ -183,6 +217,8 @@ struct MyApp : public App {
   virtual void onSound(AudioIOData &io) override {
     // The spatializer must be "prepared" and "finalized" on every block.
     // We do it here once, independently of the number of voices.
+    // Agents that can't be heard are marked before rendering.
+    culler.update(scene);
     scene.render(io);
   }
 
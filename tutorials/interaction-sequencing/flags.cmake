@@ -0,0 +1,2 @@
+# Shared audio helpers (batched spatial mixing kernel)
+set(app_include_dirs ../../tools/audio)
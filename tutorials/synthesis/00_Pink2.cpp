@@ -236,7 +236,6 @@ public:
 // We make an app.
 class MyApp : public App {
 public:
-  SoundFileStreaming player;
     std::vector<float> buffer;
     bool loop = true;
 
@@ -24,6 +24,8 @@
 #include "al/math/al_Random.hpp"
 #include "al/sound/al_SoundFile.hpp"
 
+#include "al_SampleCache.hpp"
+
 #include "randomnessHelper.h" 
 #include <stdlib.h>     //To use to generate random numbers
 #include <time.h>       
@@ -35,7 +37,9 @@ using namespace std;
 //From Aviv's Demo:
 class Vocals : public SynthVoice {
     public:
-    SoundFilePlayerTS player;
+    // Cursor into the process wide sample cache. All Vocals voices share one
+    // decoded copy of the file.
+    CachedSamplePlayer player;
 
     vector<float> soundfile_buffer;
 
@@ -64,7 +68,7 @@ class Vocals : public SynthVoice {
 
     void onProcess(AudioIOData& io) override {
         int frames = (int)io.framesPerBuffer();
-        int channels = player.soundFile.channels;
+        int channels = player.channels();
         int bufferLength = frames * channels;
         if ((int)soundfile_buffer.size() < bufferLength) {
         soundfile_buffer.resize(bufferLength);
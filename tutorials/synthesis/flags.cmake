@@ -0,0 +1,2 @@
+# Shared audio file helpers (sample cache, file readers)
+set(app_include_dirs ../../tools/audio)